@@ -0,0 +1,416 @@
+/*
+ * file:        age-x6.c
+ * description: file system aging and workload generator for CS 5600
+ *              hw3. Drives the in-process fs_ops (homework.o on top of
+ *              image.o) with a random but reproducible mix of file
+ *              creates, appends, deletes and reads, and reports
+ *              throughput and per-op latency percentiles.
+ *
+ * usage: age-x6 [options] file.img
+ *     -seed N          random seed (default 1)
+ *     -ops N           number of operations (default 10000)
+ *     -dirs N          directories to spread files over (default 8)
+ *     -fanout N        subdirectories per directory (default 4)
+ *     -size DIST       size of new files (default exp:8k)
+ *     -append DIST     size of appends (default exp:2k)
+ *     -mix C:A:D[:R]   relative weights of create, append, delete and
+ *                      read (default 4:3:2:1)
+ *     -io N            bytes per write/read call (default 4k)
+ *     -icache KB       inode cache size (default 1024)
+ *     -delalloc KB     data buffered for delayed allocation (default
+ *                      512, 0 = allocate as data is written)
+ *     -wbuf KB         write-behind buffer per file (default 64, 0 = none)
+ *     -window KB       reservation window for appends (default 256,
+ *                      0 = none)
+ *     -csv             print results as CSV
+ *
+ * DIST is one of  N  (fixed),  uniform:MIN:MAX,  exp:MEAN  or
+ * lognormal:MEDIAN:SIGMA; sizes accept K and M suffixes.
+ *
+ * Files and directories already in the image are picked up at start,
+ * so an image can be aged with one run and measured with the next.
+ */
+#define FUSE_USE_VERSION 27
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fuse.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "fs5600.h"
+#include "blkdev.h"
+#include "stats.h"
+
+extern struct fuse_operations fs_ops;
+extern int fs_icache_kb;
+extern int fs_delalloc_kb;
+extern int fs_wbuf_kb;
+extern int fs_window_kb;
+extern char *fs_snap_image;
+struct blkdev *disk;
+
+/* xorshift64* - our own generator, so that a seed gives the same
+ * workload whatever the C library.
+ */
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double rng_unit(void)            /* [0,1) */
+{
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* handle K/M, like mkfs-x6
+ */
+static long parseint(char *s, char **end)
+{
+    long n = strtol(s, &s, 0);
+    if (tolower(*s) == 'k')
+        n *= 1024, s++;
+    else if (tolower(*s) == 'm')
+        n *= 1024 * 1024, s++;
+    if (end)
+        *end = s;
+    return n;
+}
+
+struct dist {
+    enum {FIXED, UNIFORM, EXP, LOGNORMAL} type;
+    double a, b;
+};
+
+static int parse_dist(char *s, struct dist *d)
+{
+    char *p;
+    if (!strncmp(s, "uniform:", 8)) {
+        d->type = UNIFORM;
+        d->a = parseint(s + 8, &p);
+        if (*p != ':')
+            return -1;
+        d->b = parseint(p + 1, &p);
+    } else if (!strncmp(s, "exp:", 4)) {
+        d->type = EXP;
+        d->a = parseint(s + 4, &p);
+    } else if (!strncmp(s, "lognormal:", 10)) {
+        d->type = LOGNORMAL;
+        d->a = parseint(s + 10, &p);
+        if (*p != ':')
+            return -1;
+        d->b = strtod(p + 1, &p);
+    } else {
+        d->type = FIXED;
+        d->a = parseint(s, &p);
+    }
+    return *p == 0 ? 0 : -1;
+}
+
+static long sample(struct dist *d)
+{
+    double v = d->a;
+    switch (d->type) {
+    case FIXED:
+        break;
+    case UNIFORM:
+        v = d->a + rng_unit() * (d->b - d->a + 1);
+        break;
+    case EXP:
+        v = -d->a * log(1 - rng_unit());
+        break;
+    case LOGNORMAL: {
+        double z = sqrt(-2 * log(1 - rng_unit())) * cos(2 * M_PI * rng_unit());
+        v = d->a * exp(d->b * z);
+        break;
+    }
+    }
+    return v < 0 ? 0 : (long)v;
+}
+
+/* what we know about the image - directories and live files
+ */
+struct dir { char path[128]; int full; };
+struct file { char path[128]; long size; };
+
+struct dir *dirs;
+int n_dirs, max_dirs;
+struct file *files;
+int n_files, max_files;
+int next_name;
+
+static void add_dir(const char *path)
+{
+    if (n_dirs == max_dirs) {
+        max_dirs = max_dirs ? max_dirs * 2 : 64;
+        dirs = realloc(dirs, max_dirs * sizeof(*dirs));
+    }
+    snprintf(dirs[n_dirs].path, sizeof(dirs[n_dirs].path), "%s", path);
+    dirs[n_dirs++].full = 0;
+}
+
+static void add_file(const char *path, long size)
+{
+    if (n_files == max_files) {
+        max_files = max_files ? max_files * 2 : 1024;
+        files = realloc(files, max_files * sizeof(*files));
+    }
+    snprintf(files[n_files].path, sizeof(files[n_files].path), "%s", path);
+    files[n_files++].size = size;
+}
+
+static char *scan_path;
+
+static int scan_filler(void *buf, const char *name, const struct stat *sb,
+                       off_t off)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", scan_path, name);
+    if (S_ISDIR(sb->st_mode))
+        add_dir(path);
+    else
+        add_file(path, sb->st_size);
+    int n;
+    if (sscanf(name, "f%d", &n) == 1 && n >= next_name)
+        next_name = n + 1;
+    return 0;
+}
+
+/* breadth-first scan of the existing tree; the root is dirs[0] with
+ * an empty path, so that children come out as "/name".
+ */
+static void scan_tree(void)
+{
+    int i;
+    add_dir("");
+    for (i = 0; i < n_dirs; i++) {
+        scan_path = dirs[i].path;
+        fs_ops.readdir(i == 0 ? "/" : dirs[i].path, NULL, scan_filler, 0, NULL);
+    }
+}
+
+/* the operations. Each returns the number of bytes moved, or <0.
+ */
+char *data;
+int io_size;
+
+static long write_data(const char *path, long offset, long len)
+{
+    long done = 0;
+    while (done < len) {
+        int n = len - done < io_size ? len - done : io_size;
+        int val = fs_ops.write(path, data + (offset + done) % io_size, n,
+                               offset + done, NULL);
+        if (val < 0)
+            return val;
+        done += val;
+        if (val < n)
+            return -ENOSPC;
+    }
+    return done;
+}
+
+static long do_create(long size)
+{
+    char path[256];
+    int i, d;
+
+    for (i = 0; i < n_dirs; i++) {      /* random dir with room left */
+        d = rng() % n_dirs;
+        if (!dirs[d].full)
+            break;
+    }
+    if (i == n_dirs)
+        return -ENOSPC;
+    snprintf(path, sizeof(path), "%s/f%d", dirs[d].path, next_name++);
+    int val = fs_ops.mknod(path, 0644 | S_IFREG, 0);
+    if (val == -ENOSPC)
+        dirs[d].full = 1;
+    if (val < 0)
+        return val;
+    add_file(path, 0);
+    long n = write_data(path, 0, size);
+    if (n > 0)
+        files[n_files-1].size = n;
+    return n;
+}
+
+static long do_append(struct file *f, long len)
+{
+    long n = write_data(f->path, f->size, len);
+    if (n > 0)
+        f->size += n;
+    return n;
+}
+
+static long do_delete(int i)
+{
+    int val = fs_ops.unlink(files[i].path);
+    char *p = strrchr(files[i].path, '/');
+    int d;
+    for (d = 0; d < n_dirs; d++)        /* directory has room again */
+        if (!strncmp(dirs[d].path, files[i].path, p - files[i].path) &&
+            dirs[d].path[p - files[i].path] == 0)
+            dirs[d].full = 0;
+    files[i] = files[--n_files];
+    return val;
+}
+
+static long do_read(struct file *f)
+{
+    long offset = 0;
+    int n;
+    while ((n = fs_ops.read(f->path, data, io_size, offset, NULL)) > 0)
+        offset += n;
+    return n < 0 ? n : offset;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: age-x6 [-seed N] [-ops N] [-dirs N] [-fanout N]"
+            " [-size DIST] [-append DIST]\n              [-mix C:A:D[:R]]"
+            " [-io N] [-icache KB]\n              [-delalloc KB]"
+            " [-wbuf KB] [-window KB] [-csv] file.img\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long seed = 1, n_ops = 10000;
+    int want_dirs = 8, fanout = 4, csv = 0;
+    int mix[4] = {4, 3, 2, 1};
+    struct dist size_dist = {EXP, 8192}, append_dist = {EXP, 2048};
+    long i;
+
+    io_size = 4096;
+    for (argc--, argv++; argc > 1; argc -= 2, argv += 2) {
+        if (!strcmp(argv[0], "-seed"))
+            seed = strtol(argv[1], NULL, 0);
+        else if (!strcmp(argv[0], "-ops"))
+            n_ops = parseint(argv[1], NULL);
+        else if (!strcmp(argv[0], "-dirs"))
+            want_dirs = atoi(argv[1]);
+        else if (!strcmp(argv[0], "-fanout"))
+            fanout = atoi(argv[1]);
+        else if (!strcmp(argv[0], "-io"))
+            io_size = parseint(argv[1], NULL);
+        else if (!strcmp(argv[0], "-icache"))
+            fs_icache_kb = atoi(argv[1]);
+        else if (!strcmp(argv[0], "-delalloc"))
+            fs_delalloc_kb = atoi(argv[1]);
+        else if (!strcmp(argv[0], "-wbuf"))
+            fs_wbuf_kb = atoi(argv[1]);
+        else if (!strcmp(argv[0], "-window"))
+            fs_window_kb = atoi(argv[1]);
+        else if (!strcmp(argv[0], "-size")) {
+            if (parse_dist(argv[1], &size_dist) < 0)
+                usage();
+        } else if (!strcmp(argv[0], "-append")) {
+            if (parse_dist(argv[1], &append_dist) < 0)
+                usage();
+        } else if (!strcmp(argv[0], "-mix")) {
+            mix[3] = 0;
+            if (sscanf(argv[1], "%d:%d:%d:%d", &mix[0], &mix[1], &mix[2],
+                       &mix[3]) < 3)
+                usage();
+        } else if (!strcmp(argv[0], "-csv")) {
+            csv = 1;
+            argc++, argv--;
+        } else
+            usage();
+    }
+    if (argc != 1 || io_size <= 0 || fanout < 1 ||
+        mix[0] + mix[1] + mix[2] + mix[3] <= 0)
+        usage();
+
+    if ((disk = image_create(argv[0])) == NULL)
+        exit(1);
+    fs_snap_image = argv[0];    /* keep its snapshots up to date */
+    fs_ops.init(NULL);
+    rng_state = seed * 2654435761ULL + 1;
+    data = malloc(2 * io_size);
+    for (i = 0; i < 2 * io_size; i++)
+        data[i] = rng();
+
+    scan_tree();
+
+    /* top up the directory tree: directory k lives in (k-1)/fanout
+     */
+    struct lat_stats st[5];
+    lat_init(&st[0], "create");
+    lat_init(&st[1], "append");
+    lat_init(&st[2], "delete");
+    lat_init(&st[3], "read");
+    lat_init(&st[4], "mkdir");
+    while (n_dirs < want_dirs) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/d%d", dirs[(n_dirs-1) / fanout].path,
+                 n_dirs);
+        uint64_t t = now_ns();
+        int val = fs_ops.mkdir(path, 0755);
+        lat_add(&st[4], now_ns() - t, 0);
+        if (val < 0) {
+            st[4].errors++;
+            break;
+        }
+        add_dir(path);
+    }
+
+    uint64_t start = now_ns();
+    for (i = 0; i < n_ops; i++) {
+        int w = rng() % (mix[0] + mix[1] + mix[2] + mix[3]);
+        int op = w < mix[0] ? 0 : w < mix[0] + mix[1] ? 1 :
+            w < mix[0] + mix[1] + mix[2] ? 2 : 3;
+        if (n_files == 0)
+            op = 0;
+        int f = n_files ? rng() % n_files : 0;
+        long len = op == 0 ? sample(&size_dist) :
+            op == 1 ? sample(&append_dist) : 0;
+
+        uint64_t t = now_ns();
+        long val = op == 0 ? do_create(len) : op == 1 ? do_append(&files[f], len) :
+            op == 2 ? do_delete(f) : do_read(&files[f]);
+        uint64_t dt = now_ns() - t;
+
+        if (val < 0)
+            st[op].errors++;
+        lat_add(&st[op], dt, val > 0 ? val : 0);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    long total_bytes = 0, total_ops = 0;
+    for (i = 0; i < 4; i++) {
+        total_bytes += st[i].bytes;
+        total_ops += st[i].n;
+    }
+    if (csv) {
+        lat_print_header(stdout, "seed");
+        char s[32];
+        sprintf(s, "%ld", seed);
+        for (i = 0; i < 5; i++)
+            if (st[i].n)
+                lat_print_csv(stdout, &st[i], s, 0);
+    } else {
+        printf("%ld ops in %.3f s: %.1f ops/s, %.3f MB/s; "
+               "%d files, %d directories live\n", total_ops, elapsed / 1e9,
+               total_ops / (elapsed / 1e9), total_bytes / 1e6 / (elapsed / 1e9),
+               n_files, n_dirs);
+        for (i = 0; i < 5; i++)
+            if (st[i].n)
+                lat_print(stdout, &st[i], 0);
+    }
+    fs_ops.destroy(NULL);
+    return 0;
+}
@@ -0,0 +1,375 @@
+/*
+ * file:        bench-x6.c
+ * description: microbenchmarks for the CS 5600 hw3 file system. Times
+ *              each fs_ops entry point in-process (homework.o on top of
+ *              image.o), then the raw blkdev_ops of the image backend,
+ *              and prints one CSV line per case with latency
+ *              percentiles, so runs can be diffed across commits.
+ *
+ * usage: bench-x6 [-n iterations] [-nosched] file.img
+ *     -nosched - don't stack the I/O scheduler on the image, so writes
+ *                go straight through (for comparison)
+ *
+ * The image should be freshly made with mkfs-x6 (see 'make bench') -
+ * the file system cases build their own directory trees and files in
+ * it, and the raw device cases overwrite its data area.
+ */
+#define FUSE_USE_VERSION 27
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fuse.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fs5600.h"
+#include "blkdev.h"
+#include "stats.h"
+
+extern struct fuse_operations fs_ops;
+extern int fs_sched;
+extern uint64_t fs_freemap_ns;
+struct blkdev *disk;
+struct blkdev *raw_disk;        /* the image, under any scheduler */
+
+int iters = 200;
+char *buf;
+
+/* file offsets where each level of the block tree starts, which
+ * depend on the block size of the image (set from statfs in main)
+ */
+#define DIRECT_START 0L
+long INDIR1_START, INDIR2_START;
+
+static uint64_t seed = 88172645463325252ULL;
+
+static uint64_t rng(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static void report(struct lat_stats *ls, const char *param)
+{
+    lat_print_csv(stdout, ls, param, 0);
+    lat_free(ls);
+}
+
+static void check(int val, const char *what)
+{
+    if (val < 0) {
+        fprintf(stderr, "bench-x6: %s: %s\n", what, strerror(-val));
+        exit(1);
+    }
+}
+
+/* write 'len' bytes of a file in 64K calls
+ */
+static void fill_file(const char *path, long len)
+{
+    long off;
+    check(fs_ops.mknod(path, 0644 | S_IFREG, 0), path);
+    for (off = 0; off < len; off += 65536) {
+        int n = len - off < 65536 ? len - off : 65536;
+        check(fs_ops.write(path, buf, n, off, NULL), path);
+    }
+}
+
+/* getattr on a file at the bottom of a chain of N directories
+ */
+static void bench_getattr(void)
+{
+    char path[256] = "/ga";
+    struct stat sb;
+    int depth, i;
+
+    check(fs_ops.mkdir(path, 0755), path);
+    for (depth = 1; depth <= 8; depth++) {
+        char file[300], param[32];
+        struct lat_stats ls;
+
+        sprintf(file, "%s/f", path);
+        check(fs_ops.mknod(file, 0644 | S_IFREG, 0), file);
+        lat_init(&ls, "getattr");
+        for (i = 0; i < iters; i++) {
+            uint64_t t = now_ns();
+            int val = fs_ops.getattr(file, &sb);
+            lat_add(&ls, now_ns() - t, 0);
+            if (val < 0)
+                ls.errors++;
+        }
+        sprintf(param, "depth=%d", depth + 1);
+        report(&ls, param);
+        sprintf(path + strlen(path), "/d%d", depth);
+        check(fs_ops.mkdir(path, 0755), path);
+    }
+}
+
+/* mknod into a directory already holding K entries; each new file is
+ * removed again (untimed) so the fill level stays at K.
+ */
+static void bench_mknod(void)
+{
+    int fills[] = {0, 8, 16, 24, 31};
+    int k = 0, f, i;
+    char path[64], param[32];
+
+    check(fs_ops.mkdir("/mk", 0755), "/mk");
+    for (f = 0; f < sizeof(fills)/sizeof(fills[0]); f++) {
+        struct lat_stats ls;
+        for (; k < fills[f]; k++) {
+            sprintf(path, "/mk/fill%d", k);
+            check(fs_ops.mknod(path, 0644 | S_IFREG, 0), path);
+        }
+        lat_init(&ls, "mknod");
+        for (i = 0; i < iters; i++) {
+            sprintf(path, "/mk/new%d", i);
+            uint64_t t = now_ns();
+            int val = fs_ops.mknod(path, 0644 | S_IFREG, 0);
+            lat_add(&ls, now_ns() - t, 0);
+            if (val < 0)
+                ls.errors++;
+            else
+                fs_ops.unlink(path);
+        }
+        sprintf(param, "fill=%d", fills[f]);
+        report(&ls, param);
+    }
+}
+
+/* read and (over)write 'blksiz' bytes at offsets cycling through the
+ * direct, single-indirect and double-indirect parts of one file.
+ */
+static void bench_rw(void)
+{
+    int sizes[] = {512, 1000, 4096, 16384, 65536};
+    struct { const char *name; long start, len; } ranges[] = {
+        {"direct", DIRECT_START, INDIR1_START - DIRECT_START},
+        {"indir1", INDIR1_START, INDIR2_START - INDIR1_START},
+        {"indir2", INDIR2_START, 4L * 1024 * 1024},
+    };
+    const char *path = "/rw";
+    int s, r, i, op;
+
+    fill_file(path, INDIR2_START + ranges[2].len + 65536);
+    for (op = 0; op < 2; op++)
+        for (r = 0; r < 3; r++)
+            for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+                struct lat_stats ls;
+                char param[64];
+                long span = ranges[r].len > sizes[s] ?
+                    ranges[r].len - sizes[s] : 1;
+
+                lat_init(&ls, op ? "write" : "read");
+                for (i = 0; i < iters; i++) {
+                    long off = ranges[r].start + ((long)i * sizes[s]) % span;
+                    uint64_t t = now_ns();
+                    int val = op ?
+                        fs_ops.write(path, buf, sizes[s], off, NULL) :
+                        fs_ops.read(path, buf, sizes[s], off, NULL);
+                    lat_add(&ls, now_ns() - t, val > 0 ? val : 0);
+                    if (val != sizes[s])
+                        ls.errors++;
+                }
+                sprintf(param, "%s/%d", ranges[r].name, sizes[s]);
+                report(&ls, param);
+            }
+    check(fs_ops.unlink(path), path);
+}
+
+/* unlink of files that reach into each level of the block tree
+ */
+static void bench_unlink(void)
+{
+    long sizes[] = {4096, 64 * 1024, 1024 * 1024, 8 * 1024 * 1024};
+    int s, i, n = iters < 20 ? iters : 20;
+
+    for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+        struct lat_stats ls;
+        char param[32];
+        lat_init(&ls, "unlink");
+        for (i = 0; i < n; i++) {
+            fill_file("/big", sizes[s]);
+            uint64_t t = now_ns();
+            int val = fs_ops.unlink("/big");
+            lat_add(&ls, now_ns() - t, 0);
+            if (val < 0)
+                ls.errors++;
+        }
+        sprintf(param, "size=%ld", sizes[s]);
+        report(&ls, param);
+    }
+}
+
+/* N threads each rewriting 4K of its own file and fsyncing it; the
+ * fsync rate shows how well concurrent fsyncs share a device sync.
+ */
+struct fsync_arg {
+    int id;
+    struct lat_stats ls;
+};
+
+static void *fsync_worker(void *arg)
+{
+    struct fsync_arg *a = arg;
+    char path[32];
+    int i;
+
+    sprintf(path, "/fsync%d", a->id);
+    for (i = 0; i < iters; i++) {
+        if (fs_ops.write(path, buf, 4096, (i % 16) * 4096L, NULL) != 4096)
+            a->ls.errors++;
+        uint64_t t = now_ns();
+        int val = fs_ops.fsync(path, 1, NULL);
+        lat_add(&a->ls, now_ns() - t, 0);
+        if (val < 0)
+            a->ls.errors++;
+    }
+    return NULL;
+}
+
+static void bench_fsync(void)
+{
+    int threads[] = {1, 2, 4, 8}, t, i;
+    char path[32], param[32];
+
+    for (i = 0; i < 8; i++) {
+        sprintf(path, "/fsync%d", i);
+        check(fs_ops.mknod(path, 0644 | S_IFREG, 0), path);
+    }
+    for (t = 0; t < sizeof(threads)/sizeof(threads[0]); t++) {
+        int n = threads[t];
+        struct fsync_arg *a = calloc(n, sizeof(*a));
+        pthread_t *tid = calloc(n, sizeof(*tid));
+        struct lat_stats ls;
+
+        for (i = 0; i < n; i++) {
+            a[i].id = i;
+            lat_init(&a[i].ls, "fsync");
+        }
+        uint64_t t0 = now_ns();
+        for (i = 0; i < n; i++)
+            pthread_create(&tid[i], NULL, fsync_worker, &a[i]);
+        for (i = 0; i < n; i++)
+            pthread_join(tid[i], NULL);
+        uint64_t elapsed = now_ns() - t0;
+
+        lat_init(&ls, "fsync");
+        for (i = 0; i < n; i++) {
+            lat_merge(&ls, &a[i].ls);
+            lat_free(&a[i].ls);
+        }
+        sprintf(param, "threads=%d", n);
+        lat_print_csv(stdout, &ls, param, elapsed);
+        lat_free(&ls);
+        free(a);
+        free(tid);
+    }
+}
+
+/* mounting the image again, up to the end of the first operation
+ * (getattr of the root): after a clean unmount, and after an unclean
+ * one (no destroy), which rebuilds the bitmap from the inodes; and the
+ * part of fs_init that builds the free space index.
+ */
+static void bench_mount(void)
+{
+    struct lat_stats ls, fm;
+    struct stat sb;
+    int clean, i;
+
+    lat_init(&fm, "freemap");
+    for (clean = 1; clean >= 0; clean--) {
+        lat_init(&ls, "mount");
+        for (i = 0; i < iters; i++) {
+            if (clean)
+                fs_ops.destroy(NULL);
+            uint64_t t = now_ns();
+            fs_ops.init(NULL);
+            fs_ops.getattr("/", &sb);
+            lat_add(&ls, now_ns() - t, 0);
+            lat_add(&fm, fs_freemap_ns, 0);
+        }
+        report(&ls, clean ? "clean" : "unclean");
+    }
+    report(&fm, "");
+}
+
+/* the raw backend: sequential and random reads and writes of 1, 8
+ * and 64 blocks, kept clear of the superblock and metadata.
+ */
+static void bench_blkdev(void)
+{
+    int counts[] = {1, 8, 64};
+    int64_t nblks = raw_disk->ops->num_blocks(raw_disk);
+    int64_t base = nblks / 2, span = nblks - base;
+    int c, op, rnd, i;
+
+    for (op = 0; op < 2; op++)
+        for (rnd = 0; rnd < 2; rnd++)
+            for (c = 0; c < 3; c++) {
+                struct lat_stats ls;
+                char param[32];
+                int n = counts[c];
+                int64_t pos = 0;
+                lat_init(&ls, op ? "blk_write" : "blk_read");
+                for (i = 0; i < iters * 5; i++) {
+                    int64_t blk = base + (rnd ? rng() % (span - n) : pos);
+                    pos = (pos + n) % (span - n);
+                    uint64_t t = now_ns();
+                    if (op)
+                        raw_disk->ops->write(raw_disk, blk, n, buf);
+                    else
+                        raw_disk->ops->read(raw_disk, blk, n, buf);
+                    lat_add(&ls, now_ns() - t, (uint64_t)n * BLOCK_SIZE);
+                }
+                sprintf(param, "%s/%d", rnd ? "rand" : "seq", n);
+                report(&ls, param);
+            }
+}
+
+int main(int argc, char **argv)
+{
+    for (argc--, argv++; argc > 1; argc--, argv++) {
+        if (!strcmp(argv[0], "-n") && argc > 2) {
+            iters = atoi(argv[1]);
+            argc--, argv++;
+        } else if (!strcmp(argv[0], "-nosched"))
+            fs_sched = 0;
+        else
+            break;
+    }
+    if (argc != 1 || iters < 1) {
+        fprintf(stderr, "usage: bench-x6 [-n iterations] [-nosched] file.img\n");
+        exit(1);
+    }
+    if ((raw_disk = disk = image_create(argv[0])) == NULL)
+        exit(1);
+    buf = malloc(65536);
+    memset(buf, 'x', 65536);
+    fs_ops.init(NULL);
+
+    struct statvfs sv;
+    fs_ops.statfs("/", &sv);
+    INDIR1_START = (long)N_DIRECT * sv.f_bsize;
+    INDIR2_START = INDIR1_START + (long)PTRS_PER_BLK(sv.f_bsize) * sv.f_bsize;
+
+    lat_print_header(stdout, "param");
+    bench_getattr();
+    bench_mknod();
+    bench_rw();
+    bench_unlink();
+    bench_fsync();
+    bench_mount();
+    bench_blkdev();
+    fs_ops.destroy(NULL);
+    return 0;
+}
@@ -7,6 +7,8 @@
 #ifndef __BLKDEV_H__
 #define __BLKDEV_H__
 
+#include <stdint.h>
+
 #define BLOCK_SIZE 1024
 
 struct blkdev {
@@ -14,10 +16,35 @@ struct blkdev {
     void *private;
 };
 
+/* block numbers are 64-bit, so devices can be larger than 2G blocks;
+ * a single transfer is still limited to an 'int' count of blocks.
+ */
 struct blkdev_ops {
-    int  (*num_blocks)(struct blkdev *dev);
-    void (*read)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
-    void (*write)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
+    int64_t (*num_blocks)(struct blkdev *dev);
+    void (*read)(struct blkdev *dev, int64_t first_blk, int num_blks, void *buf);
+    void (*write)(struct blkdev *dev, int64_t first_blk, int num_blks, void *buf);
+
+    /* optional: rewrite block 0, the superblock, which 'write' refuses
+     * to touch so that a stray write can't destroy it
+     */
+    void (*write_super)(struct blkdev *dev, void *buf);
+
+    /* optional (NULL if the device doesn't queue writes): 'flush'
+     * issues everything queued, and 'barrier' makes all writes queued
+     * so far reach the device before any queued after it.
+     */
+    void (*flush)(struct blkdev *dev);
+    void (*barrier)(struct blkdev *dev);
+
+    /* optional: returns once everything written so far is durable -
+     * 0, or -EIO if the device couldn't make it so
+     */
+    int (*sync)(struct blkdev *dev);
+
+    /* optional: the contents of these blocks are no longer needed; the
+     * device may release the space, after which they read as zeros
+     */
+    void (*discard)(struct blkdev *dev, int64_t first_blk, int num_blks);
 };
 
 extern struct blkdev *image_create(char *path);
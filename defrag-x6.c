@@ -0,0 +1,492 @@
+/*
+ * file:        defrag-x6.c
+ * description: offline defragmenter for CS 5600 / 7600 hw3 images.
+ *
+ * Files are visited in directory order (breadth-first from the root,
+ * entries in slot order). Each file whose data isn't already one
+ * contiguous run is copied into a free run of the block map, with its
+ * indirect blocks first and its data blocks after them in logical
+ * order; the run is searched for starting just past the previous file,
+ * so files from the same directory end up next to each other.
+ *
+ * Each move is made crash-safe with an intent record in <image>.defrag:
+ *   1. copy data and build the new indirect blocks in the (free) run
+ *   2. write the intent record (old and new inode) and fsync it
+ *   3. mark the run allocated, sync
+ *   4. write the new inode, sync     <- commit point
+ *   5. free the old blocks, sync, and remove the intent record
+ * If the tool is interrupted, the next run finds the intent record and
+ * either finishes step 5 (inode already switched) or releases the run
+ * (inode not switched), then carries on - files that are already
+ * contiguous are skipped, so restarting simply resumes the work.
+ *
+ * usage: defrag-x6 [-n] file.img
+ *     -n  - only report the current fragmentation
+ * Striped sets (see stripe.h) aren't handled.
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fuse.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "fs5600.h"
+#include "layout.h"
+#include "snap.h"
+
+char *disk;
+size_t disk_len;
+struct fs5600_super *sb;
+uint32_t bs;                    /* block size */
+uint32_t isz;                   /* inode size */
+fd_set *block_map;
+struct fs5600_inode *inodes;
+uint32_t data_start;
+uint32_t n_inodes;
+char *state_path;
+
+#define DEFRAG_MAGIC 0x64667261
+
+/* intent record for the move in progress
+ */
+struct intent {
+    uint32_t magic;
+    uint32_t inum;
+    uint32_t run_start;
+    uint32_t run_len;
+    struct fs5600_inode old, new;
+};
+
+static void *blk_ptr(uint32_t blk)
+{
+    return disk + (size_t)blk * bs;
+}
+
+/* flush a range of the mapping to the image before going on
+ */
+static void sync_range(void *p, size_t len)
+{
+    size_t pg = sysconf(_SC_PAGESIZE);
+    uintptr_t a = (uintptr_t)p & ~(pg - 1);
+    if (msync((void*)a, (uintptr_t)p + len - a, MS_SYNC) < 0)
+        perror("msync"), exit(1);
+}
+
+static void sync_bitmap(void)
+{
+    sync_range(block_map, (size_t)sb->block_map_sz * bs);
+}
+
+static void sync_inode(uint32_t inum)
+{
+    sync_range(FS5600_INODE(inodes, isz, inum), sizeof(struct fs5600_inode));
+}
+
+static void check_ptr(uint32_t inum, uint32_t blk)
+{
+    if (blk < data_start || blk >= sb->num_blocks) {
+        fprintf(stderr, "inode %u: bad block %u - run read-img first\n",
+                inum, blk);
+        exit(1);
+    }
+}
+
+static void add_indir(uint32_t **ind, long *max, long *n, uint32_t blk)
+{
+    if (*n == *max) {
+        *max = *max ? *max * 2 : 256;
+        *ind = realloc(*ind, *max * sizeof(uint32_t));
+    }
+    (*ind)[(*n)++] = blk;
+}
+
+/* an indirect block 'levels' deep and the indirect blocks under it,
+ * each block before its children
+ */
+static void tree_indirs(uint32_t blk, int levels, uint32_t **ind, long *max,
+                        long *n)
+{
+    int i;
+    add_indir(ind, max, n, blk);
+    if (levels > 1) {
+        uint32_t *ptrs = blk_ptr(blk);
+        for (i = 0; i < PTRS_PER_BLK(bs); i++)
+            if (ptrs[i])
+                tree_indirs(ptrs[i], levels - 1, ind, max, n);
+    }
+}
+
+/* indirect blocks of a file, in the order they are placed in a run
+ */
+static long file_indirs(struct fs5600_inode *in, uint32_t **ind, long *max)
+{
+    uint32_t roots[] = {in->indir_1, in->indir_2, in->indir_3};
+    long n = 0;
+    int i;
+    for (i = 0; i < 3; i++)
+        if (roots[i])
+            tree_indirs(roots[i], i + 1, ind, max, &n);
+    return n;
+}
+
+/* Directory-order list of regular files.
+ */
+uint32_t *files;
+int n_files;
+
+static void walk_tree(void)
+{
+    uint32_t *dirs = malloc(n_inodes * sizeof(uint32_t));
+    int head = 0, tail = 0, i;
+
+    files = malloc(n_inodes * sizeof(uint32_t));
+    dirs[tail++] = sb->root_inode;
+    while (head != tail) {
+        struct fs5600_inode *in = FS5600_INODE(inodes, isz, dirs[head++]);
+        check_ptr(dirs[head-1], in->direct[0]);
+        struct fs5600_dirent *de = blk_ptr(in->direct[0]);
+        for (i = 0; i < DIRENTS_PER_BLK(bs); i++) {
+            if (!de[i].valid)
+                continue;
+            if (de[i].inode < 1 || de[i].inode >= n_inodes ||
+                tail == n_inodes || n_files == n_inodes) {
+                fprintf(stderr, "bad directory %u - run read-img first\n",
+                        dirs[head-1]);
+                exit(1);
+            }
+            if (de[i].isDir)
+                dirs[tail++] = de[i].inode;
+            else
+                files[n_files++] = de[i].inode;
+        }
+    }
+    free(dirs);
+}
+
+uint32_t *blks;                 /* scratch lists for one file */
+uint32_t *indirs;
+long max_blks, max_indirs;
+
+static void measure(struct layout_stats *ls)
+{
+    long i, n;
+    layout_init(ls, 0);
+    for (i = 0; i < n_files; i++) {
+        uint32_t inum = files[i];
+        n = layout_file_blocks(disk, bs, FS5600_INODE(inodes, isz, inum),
+                               &blks, &max_blks);
+        layout_add_file(ls, inum, 1 + sb->inode_map_sz + sb->block_map_sz +
+                        inum / INODES_PER_BLK(bs, isz), blks, n);
+    }
+    layout_free_space(ls, sb, blk_ptr, data_start, sb->num_blocks);
+}
+
+static int is_contiguous(uint32_t *b, long n)
+{
+    long i;
+    for (i = 1; i < n; i++)
+        if (b[i] != b[i-1] + 1)
+            return 0;
+    return 1;
+}
+
+/* first free run of 'len' blocks at or after 'goal', wrapping around
+ * to the start of the data area. Returns 0 if there is none.
+ */
+static uint32_t find_run(uint32_t goal, uint32_t len)
+{
+    uint32_t i, start = 0, run = 0;
+    int pass;
+
+    if (goal < data_start || goal >= sb->num_blocks)
+        goal = data_start;
+    for (pass = 0; pass < 2; pass++) {
+        uint32_t lo = pass ? data_start : goal;
+        uint32_t hi = pass ? goal + len : sb->num_blocks;
+        if (hi > sb->num_blocks)
+            hi = sb->num_blocks;
+        for (run = 0, i = lo; i < hi; i++) {
+            if (FD_ISSET(i, block_map)) {
+                run = 0;
+                continue;
+            }
+            if (run++ == 0)
+                start = i;
+            if (run == len)
+                return start;
+        }
+    }
+    return 0;
+}
+
+static void set_run(uint32_t start, uint32_t len, int alloc)
+{
+    uint32_t i;
+    for (i = start; i < start + len; i++) {
+        if (alloc)
+            FD_SET(i, block_map);
+        else
+            FD_CLR(i, block_map);
+    }
+}
+
+static void write_intent(struct intent *it)
+{
+    int fd = open(state_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || write(fd, it, sizeof(*it)) != sizeof(*it) || fsync(fd) < 0)
+        perror(state_path), exit(1);
+    close(fd);
+}
+
+static void clear_intent(void)
+{
+    if (unlink(state_path) < 0 && errno != ENOENT)
+        perror(state_path), exit(1);
+}
+
+/* free the blocks of 'old' that lie outside the new run
+ */
+static void free_old(struct intent *it)
+{
+    long i, n = layout_file_blocks(disk, bs, &it->old, &blks, &max_blks);
+    long m = file_indirs(&it->old, &indirs, &max_indirs);
+    for (i = 0; i < n + m; i++) {
+        uint32_t b = i < n ? blks[i] : indirs[i - n];
+        if (b < it->run_start || b >= it->run_start + it->run_len)
+            FD_CLR(b, block_map);
+    }
+    sync_bitmap();
+}
+
+/* finish or undo a move interrupted by a crash
+ */
+static void recover(void)
+{
+    struct intent it;
+    int fd = open(state_path, O_RDONLY);
+    if (fd < 0)
+        return;
+    int n = read(fd, &it, sizeof(it));
+    close(fd);
+    if (n != sizeof(it) || it.magic != DEFRAG_MAGIC || it.inum >= n_inodes) {
+        /* the intent record never made it to disk, so nothing
+         * after step 2 happened either */
+        clear_intent();
+        return;
+    }
+
+    if (!memcmp(FS5600_INODE(inodes, isz, it.inum), &it.new, sizeof(it.new))) {
+        printf("recovery: finishing move of inode %u\n", it.inum);
+        set_run(it.run_start, it.run_len, 1);
+        sync_bitmap();
+        free_old(&it);
+    } else {
+        printf("recovery: rolling back move of inode %u\n", it.inum);
+        set_run(it.run_start, it.run_len, 0);
+        sync_bitmap();
+    }
+    clear_intent();
+}
+
+/* build the copy of an indirect tree 'levels' deep, taking blocks for
+ * it from '*next_ind' in file_indirs() order and pointing it at the
+ * data blocks from 'data + *k' on, in logical order
+ */
+static uint32_t copy_indir(uint32_t old_blk, int levels, uint32_t *next_ind,
+                           uint32_t data, long *k)
+{
+    uint32_t *old = blk_ptr(old_blk);
+    uint32_t blk = (*next_ind)++;
+    uint32_t *new = blk_ptr(blk);
+    int i;
+
+    for (i = 0; i < PTRS_PER_BLK(bs); i++) {
+        if (old[i] == 0)
+            new[i] = 0;
+        else if (levels > 1)
+            new[i] = copy_indir(old[i], levels - 1, next_ind, data, k);
+        else
+            new[i] = data + (*k)++;
+    }
+    return blk;
+}
+
+/* move one file into the run at 'start'
+ */
+static void move_file(uint32_t inum, uint32_t start, long n, long m)
+{
+    struct fs5600_inode *in = FS5600_INODE(inodes, isz, inum);
+    struct intent it = {.magic = DEFRAG_MAGIC, .inum = inum,
+                        .run_start = start, .run_len = n + m,
+                        .old = *in, .new = *in};
+    uint32_t data = start + m, next_ind = start;
+    uint32_t *old_roots[] = {&in->indir_1, &in->indir_2, &in->indir_3};
+    uint32_t *new_roots[] = {&it.new.indir_1, &it.new.indir_2, &it.new.indir_3};
+    long i, k = 0;
+
+    /* step 1 - data, then indirect blocks pointing at it. 'blks'
+     * holds the old data blocks in logical order, which is the order
+     * the pointers are rewritten in below.
+     */
+    for (i = 0; i < n; i++)
+        memcpy(blk_ptr(data + i), blk_ptr(blks[i]), bs);
+
+    for (i = 0; i < N_DIRECT; i++)
+        if (in->direct[i])
+            it.new.direct[i] = data + k++;
+    for (i = 0; i < 3; i++)
+        if (*old_roots[i])
+            *new_roots[i] = copy_indir(*old_roots[i], i + 1, &next_ind, data, &k);
+    sync_range(blk_ptr(start), (size_t)(n + m) * bs);
+
+    write_intent(&it);                          /* step 2 */
+    set_run(start, n + m, 1);                   /* step 3 */
+    sync_bitmap();
+    *in = it.new;                               /* step 4 */
+    sync_inode(inum);
+    free_old(&it);                              /* step 5 */
+    clear_intent();
+}
+
+int main(int argc, char **argv)
+{
+    int i, plan_only = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "-n")) {
+        plan_only = 1;
+        argv++, argc--;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: defrag-x6 [-n] file.img\n");
+        exit(1);
+    }
+
+    /* it works on the one image file, mapped */
+    if (strchr(argv[1], ',') != NULL) {
+        fprintf(stderr, "%s: can't defragment a striped set\n", argv[1]);
+        exit(1);
+    }
+
+    /* blocks moved behind the snapshots' back would change them too */
+    char **snaps;
+    if (!plan_only && snap_list(argv[1], &snaps) > 0) {
+        fprintf(stderr, "%s has snapshots - delete them first (snap-x6)\n",
+                argv[1]);
+        exit(1);
+    }
+
+    int fd = open(argv[1], plan_only ? O_RDONLY : O_RDWR);
+    if (fd < 0)
+        perror("can't open"), exit(1);
+    struct stat _sb;
+    if (fstat(fd, &_sb) < 0)
+        perror("fstat"), exit(1);
+    disk_len = _sb.st_size;
+    if (disk_len < FS_BLOCK_SIZE)
+        fprintf(stderr, "%s: too small for a superblock\n", argv[1]), exit(1);
+    disk = mmap(NULL, disk_len, PROT_READ | (plan_only ? 0 : PROT_WRITE),
+                MAP_SHARED, fd, 0);
+    if (disk == MAP_FAILED)
+        perror("mmap"), exit(1);
+
+    sb = (void*)disk;
+    bs = FS5600_BLOCK_SIZE(sb);
+    isz = FS5600_INODE_SIZE(sb);
+    data_start = FS5600_DATA_START(sb);
+    n_inodes = sb->inode_region_sz * INODES_PER_BLK(bs, isz);
+    if (sb->magic != FS5600_MAGIC || !FS5600_VALID_BLOCK_SIZE(bs) ||
+        data_start > sb->num_blocks ||
+        (size_t)sb->num_blocks * bs > disk_len ||
+        (sb->features & ~FS5600_FEATURES)) {
+        fprintf(stderr, "%s: bad superblock\n", argv[1]);
+        exit(1);
+    }
+    block_map = blk_ptr(1 + sb->inode_map_sz);
+    inodes = blk_ptr(1 + sb->inode_map_sz + sb->block_map_sz);
+
+    /* the blocks in the journal would overwrite our changes on replay */
+    if ((sb->features & FS5600_FEAT_JOURNAL) &&
+        layout_journal_pending(sb, blk_ptr) != 0) {
+        fprintf(stderr, "%s: journal needs recovery - mount the image "
+                "first\n", argv[1]);
+        exit(1);
+    }
+
+    /* the log (lfs.c) puts blocks where it likes, whatever their
+     * numbers are
+     */
+    if (sb->features & FS5600_FEAT_LOG) {
+        fprintf(stderr, "%s: a log-structured image can't be "
+                "defragmented\n", argv[1]);
+        exit(1);
+    }
+
+    /* moving a shared block would leave its other files pointing at
+     * the old copy, which is freed
+     */
+    if ((sb->features & FS5600_FEAT_DEDUP) && !plan_only) {
+        fprintf(stderr, "%s: can't move the shared blocks of a dedup "
+                "image\n", argv[1]);
+        exit(1);
+    }
+
+    state_path = malloc(strlen(argv[1]) + 8);
+    sprintf(state_path, "%s.defrag", argv[1]);
+    if (!plan_only)
+        recover();
+
+    walk_tree();
+
+    struct layout_stats before, after;
+    measure(&before);
+    printf("before:\n");
+    layout_print(stdout, &before);
+    if (plan_only)
+        return 0;
+
+    long moved = 0, moved_blks = 0, skipped = 0;
+    uint32_t goal = data_start;
+    for (i = 0; i < n_files; i++) {
+        uint32_t inum = files[i];
+        struct fs5600_inode *in = FS5600_INODE(inodes, isz, inum);
+        long n = layout_file_blocks(disk, bs, in, &blks, &max_blks);
+        long m = file_indirs(in, &indirs, &max_indirs);
+        long j;
+
+        for (j = 0; j < n; j++)
+            check_ptr(inum, blks[j]);
+        for (j = 0; j < m; j++)
+            check_ptr(inum, indirs[j]);
+        if (n == 0)
+            continue;
+        if (is_contiguous(blks, n)) {
+            goal = blks[n-1] + 1;
+            continue;
+        }
+        uint32_t start = find_run(goal, n + m);
+        if (start == 0) {
+            skipped++;
+            continue;
+        }
+        move_file(inum, start, n, m);
+        goal = start + n + m;
+        moved++;
+        moved_blks += n + m;
+    }
+
+    measure(&after);
+    printf("\nafter:\n");
+    layout_print(stdout, &after);
+    printf("\nmoved %ld files (%ld blocks), %ld skipped for lack of a "
+           "free run; score %.2f%% -> %.2f%%\n", moved, moved_blks, skipped,
+           layout_score(&before), layout_score(&after));
+
+    munmap(disk, disk_len);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * file:        freemap.c
+ * description: summary index over an allocation bitmap for CS 5600
+ *              hw3 - see freemap.h
+ */
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "freemap.h"
+
+#define BIT(i) (1ULL << ((i) & 63))
+
+/* the free bits of bitmap word 'w' */
+static uint64_t free_bits(struct freemap *fm, int64_t w)
+{
+    uint64_t bits = ~fm->map[w];
+    if (w == (fm->nbits - 1) >> 6 && (fm->nbits & 63))
+        bits &= BIT(fm->nbits) - 1;
+    return bits;
+}
+
+/* word 'w' of level 'l', where level -1 is the free bits of the bitmap
+ */
+static uint64_t get(struct freemap *fm, int l, int64_t w)
+{
+    return l < 0 ? free_bits(fm, w) : fm->lvl[l][w];
+}
+
+static int64_t words(struct freemap *fm, int l)
+{
+    return l < 0 ? (fm->nbits + 63) >> 6 : fm->nwords[l];
+}
+
+void freemap_init(struct freemap *fm, void *map, int64_t nbits)
+{
+    int l;
+
+    for (l = 0; l < fm->levels; l++)
+        free(fm->lvl[l]);
+    fm->map = map;
+    fm->nbits = nbits;
+
+    /* each summary word is built from 64 words below it in one
+     * branch-free pass, which the compiler can vectorize
+     */
+    int64_t below = words(fm, -1), i, j;
+    for (l = 0; l == 0 || fm->nwords[l - 1] > 1; l++) {
+        int64_t n = (below + 63) >> 6;
+        fm->nwords[l] = n ? n : 1;
+        fm->lvl[l] = calloc(fm->nwords[l], sizeof(uint64_t));
+        uint64_t *src = l ? fm->lvl[l - 1] : fm->map, *dst = fm->lvl[l];
+        uint64_t full = l ? 0 : ~0ULL;
+        for (i = 0; i < below >> 6; i++) {
+            uint64_t s = 0;
+            for (j = 0; j < 64; j++)
+                s |= (uint64_t)(src[i * 64 + j] != full) << j;
+            dst[i] = s;
+        }
+        for (j = 0; j < (below & 63); j++)
+            dst[i] |= (uint64_t)(src[i * 64 + j] != full) << j;
+        if (l == 0 && below && !free_bits(fm, below - 1))
+            dst[(below - 1) >> 6] &= ~BIT(below - 1);
+        below = n;
+    }
+    fm->levels = l;
+}
+
+void freemap_update(struct freemap *fm, int64_t first, int64_t n)
+{
+    int64_t lo, hi, w;
+    int l;
+
+    if (first + n > fm->nbits)
+        n = fm->nbits - first;
+    if (n <= 0)
+        return;
+    lo = first >> 6, hi = (first + n - 1) >> 6;
+    for (l = 0; l < fm->levels; l++, lo >>= 6, hi >>= 6) {
+        for (w = lo; w <= hi; w++) {
+            if (get(fm, l - 1, w))
+                fm->lvl[l][w >> 6] |= BIT(w);
+            else
+                fm->lvl[l][w >> 6] &= ~BIT(w);
+        }
+    }
+}
+
+void freemap_set(struct freemap *fm, int64_t bit)
+{
+    int64_t w = bit >> 6;
+    int l;
+
+    fm->map[w] |= BIT(bit);
+    if (free_bits(fm, w))
+        return;
+    for (l = 0; l < fm->levels; l++, w >>= 6) {
+        fm->lvl[l][w >> 6] &= ~BIT(w);
+        if (fm->lvl[l][w >> 6])
+            break;
+    }
+}
+
+void freemap_clear(struct freemap *fm, int64_t bit)
+{
+    int64_t w = bit >> 6;
+    int l;
+
+    fm->map[w] &= ~BIT(bit);
+    for (l = 0; l < fm->levels; l++, w >>= 6) {
+        uint64_t old = fm->lvl[l][w >> 6];
+        fm->lvl[l][w >> 6] |= BIT(w);
+        if (old)
+            break;              /* the levels above knew already */
+    }
+}
+
+int64_t freemap_next(struct freemap *fm, int64_t from)
+{
+    int64_t pos = from < 0 ? 0 : from;
+    int l = -1;
+
+    if (pos >= fm->nbits)
+        return -1;
+    for (;;) {
+        int64_t w = pos >> 6;
+        if (w >= words(fm, l))
+            return -1;
+        uint64_t bits = get(fm, l, w) & (~0ULL << (pos & 63));
+        if (bits) {
+            pos = (w << 6) + __builtin_ctzll(bits);
+            break;
+        }
+        if (l == fm->levels - 1)
+            return -1;
+        pos = w + 1;            /* on to the next word, a level up */
+        l++;
+    }
+    while (l-- > -1)
+        pos = (pos << 6) + __builtin_ctzll(get(fm, l, pos));
+    return pos;
+}
+
+/* the first bit in use in [pos, limit), or 'limit' */
+static int64_t next_used(struct freemap *fm, int64_t pos, int64_t limit)
+{
+    if (limit > fm->nbits)
+        limit = fm->nbits;
+    while (pos < limit) {
+        uint64_t used = fm->map[pos >> 6] >> (pos & 63);
+        if (used) {
+            pos += __builtin_ctzll(used);
+            return pos < limit ? pos : limit;
+        }
+        pos = (pos | 63) + 1;
+    }
+    return limit;
+}
+
+int64_t freemap_run(struct freemap *fm, int64_t from, int64_t n)
+{
+    int64_t start = freemap_next(fm, from);
+
+    while (start >= 0) {
+        int64_t end = next_used(fm, start, start + n);
+        if (end - start >= n)
+            return start;
+        start = freemap_next(fm, end);
+    }
+    return -1;
+}
@@ -0,0 +1,53 @@
+/*
+ * file:        freemap.h
+ * description: summary index over an allocation bitmap for CS 5600
+ *              hw3, so that free blocks are found without scanning
+ *              the bitmap.
+ *
+ * The bitmap (1 = in use) is taken as 64-bit words. Level 0 of the
+ * index has a bit per bitmap word, set if the word has a free bit;
+ * each level above has a bit per word of the one below, set if that
+ * word is non-zero, up to a level of one word. A search goes up from
+ * its starting point until it finds a set bit and then straight down,
+ * so it reads a word or two per level - O(log64 n).
+ */
+#ifndef __FREEMAP_H__
+#define __FREEMAP_H__
+
+#include <stdint.h>
+
+#define FREEMAP_LEVELS 6        /* enough for 2^36 bits */
+
+struct freemap {
+    uint64_t *map;              /* the bitmap, not owned */
+    int64_t   nbits;
+    int       levels;
+    int64_t   nwords[FREEMAP_LEVELS];
+    uint64_t *lvl[FREEMAP_LEVELS];
+};
+
+/* build the index for 'nbits' bits at 'map', freeing any old one
+ * 'fm' holds. Bits past 'nbits' in the last word count as in use.
+ */
+void freemap_init(struct freemap *fm, void *map, int64_t nbits);
+
+/* bring the index up to date after bits [first, first+n) of the
+ * bitmap were changed behind its back (e.g. read in from disk)
+ */
+void freemap_update(struct freemap *fm, int64_t first, int64_t n);
+
+/* set (mark in use) or clear (mark free) a bit of the bitmap
+ */
+void freemap_set(struct freemap *fm, int64_t bit);
+void freemap_clear(struct freemap *fm, int64_t bit);
+
+/* the first free bit at or after 'from', or -1 if there is none
+ */
+int64_t freemap_next(struct freemap *fm, int64_t from);
+
+/* the start of the first run of 'n' free bits at or after 'from', or
+ * -1 if there is none
+ */
+int64_t freemap_run(struct freemap *fm, int64_t from, int64_t n);
+
+#endif
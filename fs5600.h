@@ -8,9 +8,33 @@
 #ifndef __CS5600FS_H__
 #define __CS5600FS_H__
 
+/* Block size is chosen at mkfs time and recorded in the superblock.
+ * FS_BLOCK_SIZE is the default (and what images made before the field
+ * existed use) as well as the size of the superblock itself. The
+ * number of dirents per directory, pointers per indirect block and
+ * inodes per block are all derived from the block size.
+ */
 #define FS_BLOCK_SIZE 1024
+#define FS5600_MIN_BLOCK_SIZE 1024
+#define FS5600_MAX_BLOCK_SIZE 65536
 #define FS5600_MAGIC 0x37363030
 
+/* Feature flags, in fs5600_super.features. Images made before the
+ * field existed have zeros there, i.e. no optional features.
+ */
+#define FS5600_FEAT_LARGE_FILE 0x00000001 /* size_hi, indir_3 in inodes */
+#define FS5600_FEAT_JOURNAL    0x00000002 /* metadata journal (journal.c) */
+#define FS5600_FEAT_COMPRESS   0x00000004 /* new files are compressed */
+#define FS5600_FEAT_DEDUP      0x00000008 /* shared data blocks, refcounts */
+#define FS5600_FEAT_INLINE     0x00000010 /* small files in large inodes */
+#define FS5600_FEAT_LOG        0x00000020 /* log-structured (lfs.c) */
+#define FS5600_FEATURES        (FS5600_FEAT_LARGE_FILE | \
+                                FS5600_FEAT_JOURNAL |    \
+                                FS5600_FEAT_COMPRESS |   \
+                                FS5600_FEAT_DEDUP |      \
+                                FS5600_FEAT_INLINE |     \
+                                FS5600_FEAT_LOG)       /* all known flags */
+
 /* Entry in a directory
  */
 struct fs5600_dirent {
@@ -29,11 +53,105 @@ struct fs5600_super {
     uint32_t block_map_sz;       /* in blocks */
     uint32_t num_blocks;         /* total, including SB, bitmaps, inodes */
     uint32_t root_inode;        /* always inode 1 */
+    uint32_t features;           /* FS5600_FEAT_* */
+    uint32_t block_size;         /* bytes, a power of 2; 0 = FS_BLOCK_SIZE */
+    uint32_t journal_start;      /* FEAT_JOURNAL only, else zero */
+    uint32_t journal_sz;         /* in blocks, before the data */
+    uint32_t dedup_sz;           /* FEAT_DEDUP table, right after the inodes */
+    uint32_t inode_size;         /* FEAT_INLINE only: bytes, a power of 2 */
+    uint32_t state;              /* FS5600_STATE_* */
+    uint32_t seg_sz;             /* FEAT_LOG only: blocks per segment */
+    uint32_t n_segs;             /* FEAT_LOG only: segments after block 0 */
+
+    /* pad out to an entire (1K) block */
+    char pad[FS_BLOCK_SIZE - 15 * sizeof(uint32_t)];
+};
+
+/* set while the file system is mounted, and cleared when it is
+ * unmounted cleanly; if it is set at mount the bitmaps may not match
+ * the inodes, and are rebuilt from them.
+ */
+#define FS5600_STATE_DIRTY 0x00000001
+
+#define FS5600_BLOCK_SIZE(sb) ((sb)->block_size ? (sb)->block_size : FS_BLOCK_SIZE)
+#define FS5600_VALID_BLOCK_SIZE(bs) ((bs) >= FS5600_MIN_BLOCK_SIZE && \
+                                     (bs) <= FS5600_MAX_BLOCK_SIZE && \
+                                     ((bs) & ((bs) - 1)) == 0)
+
+/* first block of the dedup table, and the first block that may hold
+ * directories, indirect blocks or data
+ */
+#define FS5600_DEDUP_START(sb) (1 + (sb)->inode_map_sz + (sb)->block_map_sz + \
+                                (sb)->inode_region_sz)
+#define FS5600_DATA_START(sb) (FS5600_DEDUP_START(sb) + (sb)->dedup_sz + \
+                               (sb)->journal_sz)
 
-    /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 6 * sizeof(uint32_t)]; 
+/* Deduplication (FEAT_DEDUP): the table has an entry for every block.
+ * For a data block written with dedup on, 'refs' counts the file block
+ * pointers to it and 'fp' is a fingerprint of its contents, so that
+ * files with the same data can share it; 'refs' is 0 for any other
+ * block, which has a single owner.
+ */
+struct fs5600_dedup {
+    uint32_t refs;
+    uint32_t fp;
 };
 
+#define DEDUP_PER_BLK(bs) ((bs) / sizeof(struct fs5600_dedup))
+
+/* Metadata journal: the first block of the region holds the journal
+ * header, the rest is a log of transactions. Each transaction is one
+ * or more descriptor blocks, each followed by the 'n' blocks it
+ * describes; a transaction only counts if all of its descriptors are
+ * present with matching checksums. Replay starts at block 'start' of
+ * the region with sequence number 'seq', and continues with seq+1
+ * right after it until a transaction is missing.
+ */
+#define FS5600_JSUPER_MAGIC 0x4A353630
+#define FS5600_JDESC_MAGIC  0x4A443630
+
+struct fs5600_jsuper {
+    uint32_t magic;
+    uint32_t seq;               /* first transaction to replay */
+    uint32_t start;             /* where it is, relative to journal_start */
+};
+
+struct fs5600_jdesc {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t n;                 /* blocks logged after this one */
+    uint32_t more;              /* another descriptor follows */
+    uint32_t csum;              /* of this block (with csum 0) + the n blocks */
+    uint32_t blknum[];          /* home locations of the logged blocks */
+};
+
+#define JDESC_MAX(bs) (((bs) - sizeof(struct fs5600_jdesc)) / sizeof(uint32_t))
+
+/* Log-structured layout (FEAT_LOG): 'num_blocks' and all the block
+ * numbers in the file system are logical. Block 0 holds the superblock
+ * as usual; the rest of the image is 'n_segs' segments of 'seg_sz'
+ * blocks, and every other block written goes to the end of the log, in
+ * a chunk of a summary block followed by the data blocks it lists. A
+ * logical block with FS5600_LSUM_TRIM set was discarded, and has no
+ * data block. A segment is read from its first block for as long as
+ * there are summaries with increasing 'seq' and a good magic number;
+ * the newest copy of each logical block, by 'seq', is the one that
+ * counts, and blocks never written read as zeros.
+ */
+#define FS5600_LSUM_MAGIC 0x4C533630
+#define FS5600_LSUM_TRIM  0x80000000
+
+struct fs5600_lsum {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t n;                 /* entries in blknum[] */
+    uint32_t csum;              /* of this block (with csum 0) + the data */
+    uint32_t blknum[];          /* logical blocks, in the order written */
+};
+
+#define LSUM_MAX(bs) (((bs) - sizeof(struct fs5600_lsum)) / sizeof(uint32_t))
+#define FS5600_SEG_START(sb, s) (1 + (int64_t)(s) * (sb)->seg_sz)
+
 #define N_DIRECT 6
 struct fs5600_inode {
     uint16_t uid;
@@ -41,14 +159,51 @@ struct fs5600_inode {
     uint32_t mode;
     uint32_t ctime;
     uint32_t mtime;
-     int32_t size;
+     int32_t size;              /* low 32 bits, with FEAT_LARGE_FILE */
     uint32_t direct[N_DIRECT];
     uint32_t indir_1;
     uint32_t indir_2;
-    uint32_t pad[3];            /* 64 bytes per inode */
+    uint32_t size_hi;           /* FEAT_LARGE_FILE only, else zero */
+    uint32_t indir_3;           /* FEAT_LARGE_FILE only, else zero */
+    uint32_t flags;             /* FS5600_INODE_*; 64 bytes per inode */
 };
 
-enum {INODES_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs5600_inode)};
+/* file size in bytes, for either inode variant */
+#define FS5600_SIZE(in) ((int64_t)(in)->size_hi << 32 | (uint32_t)(in)->size)
+
+/* With FEAT_INLINE, inodes are 'inode_size' bytes (more than the 64 of
+ * struct fs5600_inode), and a regular file with FS5600_INODE_INLINE
+ * set keeps its data in the rest of its inode instead of in blocks;
+ * it is moved out to blocks when it outgrows that.
+ */
+#define FS5600_INODE_INLINE 0x00000002
+
+#define FS5600_INODE_SIZE(sb) ((sb)->inode_size ? (sb)->inode_size : \
+                               sizeof(struct fs5600_inode))
+#define FS5600_VALID_INODE_SIZE(is, bs) ((is) >= sizeof(struct fs5600_inode) && \
+                                         (is) <= (bs) && ((is) & ((is) - 1)) == 0)
+
+/* inode 'inum' of the table at 'base', with 'is'-byte inodes */
+#define FS5600_INODE(base, is, inum) \
+    ((struct fs5600_inode *)((char *)(base) + (size_t)(inum) * (is)))
+#define FS5600_INLINE_DATA(in) ((char *)(in) + sizeof(struct fs5600_inode))
+#define FS5600_INLINE_MAX(is) ((is) - sizeof(struct fs5600_inode))
+
+/* Compressed files (FS5600_INODE_COMPRESSED, only with FEAT_COMPRESS)
+ * are stored in clusters of FS5600_CLUSTER_BLKS logical blocks. A
+ * cluster that compresses into fewer blocks than it covers holds a
+ * 32-bit length and then the compressed bytes (lz.c) in its first
+ * blocks, and has holes in the rest; any other cluster is stored as is.
+ * A cluster covers all of its blocks, except the last one of the file,
+ * which stops at the end of the file.
+ */
+#define FS5600_INODE_COMPRESSED 0x00000001
+
+#define FS5600_CLUSTER_BLKS(bs) ((bs) <= 16384 ? 16 : 262144 / (bs))
+
+#define INODES_PER_BLK(bs, is) ((bs) / (is))
+#define DIRENTS_PER_BLK(bs) ((bs) / sizeof(struct fs5600_dirent))
+#define PTRS_PER_BLK(bs)    ((bs) / sizeof(uint32_t))
 
 #endif
 
@@ -19,15 +19,24 @@
 #include <errno.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "fs5600.h"
 #include "blkdev.h"
+#include "sched.h"
+#include "journal.h"
+#include "lfs.h"
+#include "snap.h"
+#include "lz.h"
+#include "freemap.h"
 
 /*
  * disk access - the global variable 'disk' points to a blkdev
  *
  * structure which has been initialized to access the image file.
- * NOTE - blkdev access is in terms of 1024-byte blocks
+ * NOTE - blkdev access is in terms of 1024-byte blocks; file system
+ * blocks may be larger, so go through blk_read/blk_write below.
  */
 
 extern struct blkdev *disk;
@@ -42,14 +51,465 @@ fd_set *inode_map;              /* = malloc(sb.inode_map_size * FS_BLOCK_SIZE);
 fd_set *block_map;
 int inode_map_sz;
 int block_map_sz;
-int num_of_blocks;
-struct fs5600_inode *inode_region;	/* inodes in memory */
+int64_t num_of_blocks;
+int64_t num_of_inodes;          /* in the table - the map may cover more */
+int64_t data_start;             /* first block after the metadata */
+
+/* block_map is changed only through block_fm, the summary index that
+ * finds free blocks without scanning it (freemap.c); it is rebuilt
+ * from the bitmap at startup, taking fs_freemap_ns.
+ */
+static struct freemap block_fm;
+uint64_t fs_freemap_ns;
+int features;                   /* FS5600_FEAT_* from the superblock */
+int64_t max_file_sz;            /* depends on the inode variant */
+int inode_size;                 /* bytes; 64 unless FS5600_FEAT_INLINE */
+int inline_max;                 /* file data that fits in an inode */
+static struct fs5600_inode *inode_get(int inum);
+#define INODE(inum) inode_get(inum)
 void update_bitmap(void);
 
-// some constants
-int file_in_inode_sz = N_DIRECT * BLOCK_SIZE;
-int file_1st_level_sz = BLOCK_SIZE / sizeof(int) * BLOCK_SIZE;
-int file_2nd_level_sz = (BLOCK_SIZE / sizeof(int)) * (BLOCK_SIZE / sizeof(int)) * BLOCK_SIZE;
+/* geometry, derived from the block size in the superblock */
+int fs_block_size;              /* bytes */
+int blk_shift;                  /* log2(fs_block_size) */
+int blk_sectors;                /* blkdev blocks per file system block */
+int dirents_per_blk;
+int inodes_per_blk;
+int ptrs_per_blk;
+int ptr_shift;                  /* log2(ptrs_per_blk) */
+int cluster_blks;               /* blocks per compressed cluster */
+int cluster_sz;                 /* bytes */
+
+static void blk_read(int64_t blknum, int n, void *buf) {
+    disk->ops->read(disk, blknum * blk_sectors, n * blk_sectors, buf);
+}
+
+static void blk_write(int64_t blknum, int n, void *buf) {
+    disk->ops->write(disk, blknum * blk_sectors, n * blk_sectors, buf);
+}
+
+/* writes are queued by the I/O scheduler (sched.c) until the end of
+ * each operation; blk_barrier() keeps the writes before it ahead of
+ * those after it, where the order on disk matters.
+ */
+int fs_sched = 1;               /* 0 = write straight to the image */
+
+static void blk_barrier(void) {
+    if (disk->ops->barrier)
+        disk->ops->barrier(disk);
+}
+
+static void blk_flush(void) {
+    if (disk->ops->flush)
+        disk->ops->flush(disk);
+}
+
+/* the image itself, under the scheduler and journal, for fsync - or
+ * with FS5600_FEAT_LOG the log (lfs.c), which has to write out the
+ * blocks it holds
+ */
+static struct blkdev *raw_disk;
+
+/* With fs_snap_image set (to the image's path), the device under the
+ * scheduler is the live device of snap.c, which keeps the snapshots of
+ * the image - or, with fs_snap_name set as well, that snapshot, which
+ * is mounted read-only.
+ */
+char *fs_snap_image;
+char *fs_snap_name;
+static struct blkdev *snap_disk;
+static int readonly;
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* With FS5600_FEAT_JOURNAL, 'disk' is the journal (journal.c) and
+ * metadata - bitmaps, inodes, directories and indirect blocks - goes
+ * through meta_write into its running transaction; data is written in
+ * place with blk_write.
+ */
+static struct blkdev *jnl;
+
+static void meta_write(int64_t blknum, int n, void *buf) {
+    if (jnl)
+        journal_write(jnl, blknum * blk_sectors, n * blk_sectors, buf);
+    else
+        blk_write(blknum, n, buf);
+}
+
+/* After a clean unmount the bitmaps are read a block at a time, the
+ * first time a bit in the block is needed, so that mounting doesn't
+ * wait for all of them; imap_loaded and bmap_loaded say which blocks
+ * are in memory (NULL = all of them). Bits are changed through
+ * imap_set() and friends, which read the block in first and note it
+ * for update_bitmap() to write - the blocks from lo to hi of each.
+ */
+static char *imap_loaded, *bmap_loaded;
+static int64_t imap_lo, imap_hi, bmap_lo, bmap_hi;
+
+/* read in the block of a bitmap holding 'bit' if it isn't yet, and
+ * return 1 if it wasn't
+ */
+static int map_need(fd_set *map, char *loaded, int64_t start, int64_t bit) {
+    int64_t i = bit / (fs_block_size * 8);
+    if (loaded == NULL || loaded[i]) {
+        return 0;
+    }
+    blk_read(start + i, 1, (char *)map + i * fs_block_size);
+    loaded[i] = 1;
+    return 1;
+}
+
+static void map_dirty(int64_t *lo, int64_t *hi, int64_t bit) {
+    int64_t i = bit / (fs_block_size * 8);
+    if (*lo == *hi) {
+        *lo = i, *hi = i + 1;
+    } else if (i < *lo) {
+        *lo = i;
+    } else if (i >= *hi) {
+        *hi = i + 1;
+    }
+}
+
+static int imap_need(int64_t inum) {
+    return map_need(inode_map, imap_loaded, 1, inum);
+}
+
+/* free blocks in the part of the block bitmap read so far; kept up to
+ * date by bmap_set/bmap_clear, and used to hold space for delayed
+ * allocation (see free_at_least)
+ */
+static int64_t n_free_known;
+
+static int64_t count_free(int64_t first, int64_t n) {
+    uint64_t *w = (uint64_t *)block_map;
+    int64_t i = first, end = first + n, n_used = 0;
+    if (end > num_of_blocks) {
+        end = num_of_blocks;
+    }
+    if (end <= first) {
+        return 0;
+    }
+    for (; i < end && (i & 63); i++) {
+        n_used += FD_ISSET(i, block_map) != 0;
+    }
+    for (; i + 64 <= end; i += 64) {
+        n_used += __builtin_popcountll(w[i / 64]);
+    }
+    for (; i < end; i++) {
+        n_used += FD_ISSET(i, block_map) != 0;
+    }
+    return end - first - n_used;
+}
+
+static int bmap_need(int64_t blknum) {
+    if (!map_need(block_map, bmap_loaded, 1 + inode_map_sz, blknum)) {
+        return 0;
+    }
+    int64_t bits = fs_block_size * 8;
+    freemap_update(&block_fm, blknum / bits * bits, bits);
+    n_free_known += count_free(blknum / bits * bits, bits);
+    return 1;
+}
+
+/* are at least 'n' blocks free? Bitmap blocks not read yet are read
+ * until enough free ones have been seen, or there are none left.
+ */
+static int free_at_least(int64_t n) {
+    int64_t i = 0;
+    while (n_free_known < n && bmap_loaded != NULL) {
+        for (; i < block_map_sz && bmap_loaded[i]; i++)
+            ;
+        if (i >= block_map_sz) {
+            break;
+        }
+        bmap_need(i * fs_block_size * 8);
+    }
+    return n_free_known >= n;
+}
+
+static void imap_set(int64_t inum) {
+    imap_need(inum);
+    FD_SET(inum, inode_map);
+    map_dirty(&imap_lo, &imap_hi, inum);
+}
+
+static void imap_clear(int64_t inum) {
+    imap_need(inum);
+    FD_CLR(inum, inode_map);
+    map_dirty(&imap_lo, &imap_hi, inum);
+}
+
+static void bmap_set(int64_t blknum) {
+    bmap_need(blknum);
+    n_free_known -= !FD_ISSET(blknum, block_map);
+    freemap_set(&block_fm, blknum);
+    map_dirty(&bmap_lo, &bmap_hi, blknum);
+}
+
+static void bmap_clear(int64_t blknum) {
+    bmap_need(blknum);
+    n_free_known += FD_ISSET(blknum, block_map) != 0;
+    freemap_clear(&block_fm, blknum);
+    map_dirty(&bmap_lo, &bmap_hi, blknum);
+}
+
+/* a free block that a snapshot still has a copy of in place (one the
+ * snapshot had in use) is copied out before it is written - see snap.c
+ * - so those are only given out when there are no others
+ */
+static int snap_held(int64_t blknum) {
+    return snap_disk != NULL && snap_shared(snap_disk, blknum);
+}
+
+/* the first free block at or after 'from', or -1. The index counts
+ * bitmap blocks not read yet as free, so a block found in one is
+ * looked for again once it is read.
+ */
+static int64_t next_free_block(int64_t from) {
+    int64_t blknum, held = -1;
+    while ((blknum = freemap_next(&block_fm, from)) >= 0) {
+        if (bmap_need(blknum)) {
+            from = blknum;
+        } else if (snap_held(blknum)) {
+            held = held < 0 ? blknum : held;
+            from = blknum + 1;
+        } else {
+            break;
+        }
+    }
+    return blknum >= 0 ? blknum : held;
+}
+
+/* the first run of 'n' free blocks (n at most a bitmap block's worth),
+ * or -1
+ */
+static int64_t free_run(int64_t n) {
+    int64_t blknum, from = 0, held = -1, i;
+    while ((blknum = freemap_run(&block_fm, from, n)) >= 0) {
+        if (bmap_need(blknum) | bmap_need(blknum + n - 1)) {
+            from = blknum;
+            continue;
+        }
+        for (i = 0; i < n && !snap_held(blknum + i); i++)
+            ;
+        if (i == n) {
+            break;
+        }
+        held = held < 0 ? blknum : held;
+        from = blknum + i + 1;
+    }
+    return blknum >= 0 ? blknum : held;
+}
+
+/* The inode table is read a block at a time as inodes are needed, into
+ * a cache of at most fs_icache_kb KB, so that memory follows the files
+ * in use rather than the size of the image. Cached blocks are found
+ * through a hash table and replaced least recently used first.
+ *
+ * INODE(inum) returns a pointer into the cache and pins the inode's
+ * table block until icache_put_all() at the end of the operation (in
+ * the LOCKED_OP wrappers), so the pointers an operation holds stay
+ * good; if every block is pinned, the cache goes over its cap until
+ * then. update_inode() writes the whole table block back at once, as
+ * the order of writes to disk depends on it, so blocks are always
+ * clean when they are replaced.
+ */
+int fs_icache_kb = 1024;
+
+struct itab_blk {
+    int64_t  num;               /* block of the inode table */
+    int      pinned;
+    struct itab_blk *hnext;     /* hash chain */
+    struct itab_blk *prev, *next;       /* LRU list, unpinned only */
+    char    *data;
+};
+static struct itab_blk **icache_hash;
+static int icache_mask;
+static int icache_n, icache_max;        /* blocks cached, and the cap */
+static struct itab_blk icache_lru = {.prev = &icache_lru,
+                                     .next = &icache_lru};
+static struct itab_blk **icache_pins;
+static int n_pins, max_pins;
+
+static void lru_unlink(struct itab_blk *b) {
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+}
+
+static void lru_append(struct itab_blk *b) {
+    b->prev = icache_lru.prev;
+    b->next = &icache_lru;
+    b->prev->next = b;
+    icache_lru.prev = b;
+}
+
+static struct itab_blk **icache_slot(int64_t num) {
+    struct itab_blk **p = &icache_hash[num & icache_mask];
+    while (*p != NULL && (*p)->num != num) {
+        p = &(*p)->hnext;
+    }
+    return p;
+}
+
+/* table block 'num', read in if need be, and pinned */
+static struct itab_blk *icache_get(int64_t num) {
+    struct itab_blk *b = *icache_slot(num);
+
+    if (b == NULL) {
+        if (icache_n >= icache_max && icache_lru.next != &icache_lru) {
+            b = icache_lru.next;
+            lru_unlink(b);
+            *icache_slot(b->num) = b->hnext;
+        } else {
+            b = malloc(sizeof(*b));
+            b->data = malloc(fs_block_size);
+            icache_n++;
+        }
+        b->num = num;
+        b->hnext = NULL;
+        *icache_slot(num) = b;
+        blk_read(1 + inode_map_sz + block_map_sz + num, 1, b->data);
+    } else if (!b->pinned) {
+        lru_unlink(b);
+    }
+    if (!b->pinned) {
+        b->pinned = 1;
+        if (n_pins == max_pins) {
+            max_pins = max_pins ? 2 * max_pins : 16;
+            icache_pins = realloc(icache_pins,
+                                  max_pins * sizeof(*icache_pins));
+        }
+        icache_pins[n_pins++] = b;
+    }
+    return b;
+}
+
+static struct fs5600_inode *inode_get(int inum) {
+    struct itab_blk *b = icache_get(inum / inodes_per_blk);
+    return FS5600_INODE(b->data, inode_size, inum % inodes_per_blk);
+}
+
+/* unpin the blocks the operation used, most recently used last */
+static void icache_put_all(void) {
+    int i;
+    for (i = 0; i < n_pins; i++) {
+        icache_pins[i]->pinned = 0;
+        lru_append(icache_pins[i]);
+    }
+    n_pins = 0;
+}
+
+/* empty the cache, and size it for the block size */
+static void icache_init(void) {
+    int i;
+    struct itab_blk *b, *next;
+
+    for (i = 0; icache_hash != NULL && i <= icache_mask; i++) {
+        for (b = icache_hash[i]; b != NULL; b = next) {
+            next = b->hnext;
+            free(b->data);
+            free(b);
+        }
+    }
+    icache_n = n_pins = 0;
+    icache_lru.prev = icache_lru.next = &icache_lru;
+    icache_max = (int64_t)fs_icache_kb * 1024 / fs_block_size;
+    if (icache_max < 4) {
+        icache_max = 4;
+    }
+    for (icache_mask = 63; icache_mask < icache_max; ) {
+        icache_mask = icache_mask * 2 + 1;
+    }
+    free(icache_hash);
+    icache_hash = calloc(icache_mask + 1, sizeof(*icache_hash));
+}
+
+/* a block freed in the running transaction can't be given to another
+ * file (and overwritten in place) until the free is committed, or a
+ * crash could leave the old file pointing at the new data. Called at
+ * the start of the operations that allocate blocks.
+ */
+static int blocks_freed;
+
+static void commit_frees(void) {
+    if (jnl && blocks_freed)
+        journal_commit(jnl);
+    blocks_freed = 0;
+}
+
+/* blocks freed by the current operation. Once the bitmap is written,
+ * discard_freed() passes them to the device in runs of consecutive
+ * blocks, so that the image file gives the space back.
+ */
+static uint32_t *freed;
+static long n_freed, max_freed;
+
+static void free_block(uint32_t blknum) {
+    bmap_clear(blknum);
+    if (n_freed == max_freed) {
+        max_freed = max_freed ? 2 * max_freed : 1024;
+        freed = realloc(freed, max_freed * sizeof(*freed));
+    }
+    freed[n_freed++] = blknum;
+    blocks_freed = 1;
+}
+
+static void blk_discard(int64_t blknum, int64_t n) {
+    disk->ops->discard(disk, blknum * blk_sectors, n * blk_sectors);
+}
+
+static int cmp_blknum(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void discard_freed(void) {
+    long i, j;
+    if (disk->ops->discard && n_freed > 0) {
+        qsort(freed, n_freed, sizeof(*freed), cmp_blknum);
+        for (i = 0; i < n_freed; i = j) {
+            for (j = i + 1; j < n_freed && freed[j] == freed[j-1] + 1; j++)
+                ;
+            blk_discard(freed[i], j - i);
+        }
+    }
+    n_freed = 0;
+}
+
+/* The directory scans are written once as inline functions of the
+ * block size and expanded for 1K and 4K blocks, so that in the common
+ * cases the compiler sees a constant loop bound; other sizes use the
+ * generic expansion.
+ */
+#define BS_SPECIALIZE(f, ...)                                          \
+    (fs_block_size == 1024 ? f(1024, __VA_ARGS__) :                    \
+     fs_block_size == 4096 ? f(4096, __VA_ARGS__) :                    \
+     f(fs_block_size, __VA_ARGS__))
+
+/* index of the valid entry 'name', or -1 */
+static inline __attribute__((always_inline))
+int _dir_find(int bs, struct fs5600_dirent *de, const char *name) {
+    int i;
+    for (i = 0; i < DIRENTS_PER_BLK(bs); i++) {
+        if (de[i].valid && strcmp(de[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+#define dir_find(de, name) BS_SPECIALIZE(_dir_find, de, name)
+
+/* index of the first free entry, or -1 */
+static inline __attribute__((always_inline))
+int _dir_free_slot(int bs, struct fs5600_dirent *de) {
+    int i;
+    for (i = 0; i < DIRENTS_PER_BLK(bs); i++) {
+        if (!de[i].valid) {
+            return i;
+        }
+    }
+    return -1;
+}
+#define dir_free_slot(de) BS_SPECIALIZE(_dir_free_slot, de)
 
 
 /* init - this is called once by the FUSE framework at startup. Ignore
@@ -58,32 +518,213 @@ int file_2nd_level_sz = (BLOCK_SIZE / sizeof(int)) * (BLOCK_SIZE / sizeof(int))
  *   - read superblock
  *   - allocate memory, read bitmaps and inodes
  */
+static struct indir_cache {
+    uint32_t blknum;            /* 0 = empty */
+    uint32_t *ptrs;
+} indir_cache[3];
+
+/* Compressed files (FS5600_INODE_COMPRESSED) are read and written a
+ * cluster at a time. The last few clusters used are kept decompressed
+ * in memory, so that a sequential read decompresses each one once, and
+ * a write updates the cached copy and writes the whole cluster again.
+ */
+#define N_CLUSTERS 4
+#define MAX_CLUSTER_BLKS 16     /* largest FS5600_CLUSTER_BLKS */
+
+static struct cluster {
+    int      inum;              /* 0 = empty */
+    int64_t  num;
+    uint64_t used;              /* for LRU replacement */
+    char    *data;              /* cluster_sz bytes, zero past EOF */
+} clusters[N_CLUSTERS];
+static uint64_t cluster_clock;
+static char *cluster_buf;       /* a cluster as stored on disk */
+
+/* With FS5600_FEAT_DEDUP the dedup table (reference counts and
+ * fingerprints, see fs5600.h) is kept in memory like the bitmaps, and
+ * written out with them; dedup_lo..dedup_hi are the table blocks
+ * changed since. It is indexed by fingerprint with a hash table of
+ * chains through dedup_next, built at startup.
+ */
+static struct fs5600_dedup *dedup_tab;  /* NULL = no dedup */
+static int64_t dedup_start;
+static int64_t dedup_lo, dedup_hi;
+static uint32_t *dedup_head;    /* dedup_mask+1 chains, 0 = end */
+static uint32_t *dedup_next;    /* per block */
+static uint32_t dedup_mask;
+
+/* the superblock as on disk; its FS5600_STATE_DIRTY is set from the
+ * end of fs_init to the end of fs_destroy
+ */
+static struct fs5600_super super;
+
+static int write_super(void) {
+    if (raw_disk->ops->write_super == NULL)
+        return 0;
+    raw_disk->ops->write_super(raw_disk, &super);
+    return raw_disk->ops->sync ? raw_disk->ops->sync(raw_disk) : 0;
+}
+
+static int64_t scan_blocks(int64_t n_inodes);
+static void da_reset(void);
+static void wb_reset(void);
+static void win_reset(void);
+
 void* fs_init(struct fuse_conn_info *conn)
 {
     struct fs5600_super sb;
+    int i;
     /* here 1 stands for block size, here is 1024 bytes */
     disk->ops->read(disk, 0, 1, &sb);
+    if (!FS5600_VALID_BLOCK_SIZE(FS5600_BLOCK_SIZE(&sb))) {
+        fprintf(stderr, "bad file system block size %u\n", sb.block_size);
+        exit(1);
+    }
+    if (sb.features & ~FS5600_FEATURES) {
+        fprintf(stderr, "unsupported file system features 0x%x\n",
+                sb.features & ~FS5600_FEATURES);
+        exit(1);
+    }
+    features = sb.features;
+    static int stacked;
+    if (!stacked) {
+        if (features & FS5600_FEAT_LOG) {
+            if ((disk = lfs_create(disk, &sb)) == NULL)
+                exit(1);
+        }
+        if (fs_snap_image) {
+            if ((disk = snap_create(disk, &sb, fs_snap_image,
+                                    fs_snap_name)) == NULL)
+                exit(1);
+            snap_disk = disk;
+            readonly = fs_snap_name != NULL;
+        }
+        raw_disk = disk;
+        if (fs_sched)
+            disk = sched_create(disk);
+        if (features & FS5600_FEAT_JOURNAL) {
+            if ((jnl = journal_create(disk, &sb)) == NULL)
+                exit(1);
+            disk = jnl;
+        }
+        stacked = 1;
+    }
+
+    fs_block_size = FS5600_BLOCK_SIZE(&sb);
+    for (blk_shift = 0; (1 << blk_shift) < fs_block_size; blk_shift++)
+        ;
+    blk_sectors = fs_block_size / BLOCK_SIZE;
+    dirents_per_blk = DIRENTS_PER_BLK(fs_block_size);
+    inode_size = FS5600_INODE_SIZE(&sb);
+    if (!FS5600_VALID_INODE_SIZE(inode_size, fs_block_size)) {
+        fprintf(stderr, "bad inode size %u\n", sb.inode_size);
+        exit(1);
+    }
+    inodes_per_blk = INODES_PER_BLK(fs_block_size, inode_size);
+    inline_max = (features & FS5600_FEAT_INLINE) ?
+        FS5600_INLINE_MAX(inode_size) : 0;
+    ptrs_per_blk = PTRS_PER_BLK(fs_block_size);
+    ptr_shift = blk_shift - 2;
+    for (i = 0; i < 3; i++) {
+        indir_cache[i].ptrs = realloc(indir_cache[i].ptrs, fs_block_size);
+    }
+    cluster_blks = FS5600_CLUSTER_BLKS(fs_block_size);
+    cluster_sz = cluster_blks * fs_block_size;
+    cluster_buf = realloc(cluster_buf, cluster_sz);
+    for (i = 0; i < N_CLUSTERS; i++) {
+        clusters[i].inum = 0;
+        clusters[i].data = realloc(clusters[i].data, cluster_sz);
+    }
+
+    /* without FEAT_LARGE_FILE the size is an int32_t and there's no
+     * triple indirect block
+     */
+    int64_t p = ptrs_per_blk, nblks = N_DIRECT + p + p * p;
+    if (features & FS5600_FEAT_LARGE_FILE)
+        max_file_sz = (nblks + p * p * p) * fs_block_size;
+    else if ((max_file_sz = nblks * fs_block_size) > INT32_MAX)
+        max_file_sz = INT32_MAX;
 
     /* your code here */
-    /* read bitmaps */
-    inode_map = malloc(sb.inode_map_sz * FS_BLOCK_SIZE);
-    disk->ops->read(disk, 1, sb.inode_map_sz, inode_map);
+    /* bitmaps: after a clean unmount they are read as they are needed,
+     * otherwise in full, to be checked against the inodes below
+     */
+    int clean = !(sb.state & FS5600_STATE_DIRTY);
+    free(inode_map);
+    free(block_map);
+    free(imap_loaded);
+    free(bmap_loaded);
+    inode_map = calloc(sb.inode_map_sz, fs_block_size);
+    block_map = calloc(sb.block_map_sz, fs_block_size);
+    imap_loaded = bmap_loaded = NULL;
+    if (clean) {
+        imap_loaded = calloc(sb.inode_map_sz, 1);
+        bmap_loaded = calloc(sb.block_map_sz, 1);
+        n_free_known = 0;
+    } else {
+        blk_read(1, sb.inode_map_sz, inode_map);
+        blk_read(sb.inode_map_sz + 1, sb.block_map_sz, block_map);
+    }
+    imap_lo = imap_hi = bmap_lo = bmap_hi = 0;
     inode_map_sz = sb.inode_map_sz;
+    num_of_inodes = (int64_t)sb.inode_region_sz * inodes_per_blk;
     // printf("%d\n", inode_map_sz);
-
-    block_map = malloc(sb.block_map_sz * FS_BLOCK_SIZE);
-    disk->ops->read(disk, sb.inode_map_sz + 1, sb.block_map_sz, block_map);
     block_map_sz = sb.block_map_sz;
+    num_of_blocks = sb.num_blocks;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    freemap_init(&block_fm, block_map, num_of_blocks);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fs_freemap_ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+        (t1.tv_nsec - t0.tv_nsec);
 
     // printf("%d\n", block_map_sz);
-    /* read inodes */
-    inode_region = malloc(sb.inode_region_sz * FS_BLOCK_SIZE);
-    int inode_region_pos = 1 + sb.inode_map_sz + sb.block_map_sz;
-    disk->ops->read(disk, inode_region_pos, sb.inode_region_sz, inode_region);
-    // printf("%d\n", sb.inode_region_sz);
-    num_of_blocks = sb.num_blocks;
+    /* inodes are read as they are needed */
+    icache_init();
+    da_reset();
+    wb_reset();
+    win_reset();
+    data_start = FS5600_DATA_START(&sb);
     // printf("%d\n", num_of_blocks);
 
+    free(dedup_tab);
+    dedup_tab = NULL;
+    if (features & FS5600_FEAT_DEDUP) {
+        int64_t b;
+        dedup_start = FS5600_DEDUP_START(&sb);
+        dedup_tab = malloc((size_t)sb.dedup_sz * fs_block_size);
+        blk_read(dedup_start, sb.dedup_sz, dedup_tab);
+        dedup_lo = dedup_hi = 0;
+        for (dedup_mask = 1023; dedup_mask < num_of_blocks; )
+            dedup_mask = dedup_mask * 2 + 1;
+        dedup_head = realloc(dedup_head, (dedup_mask + 1) * sizeof(uint32_t));
+        memset(dedup_head, 0, (dedup_mask + 1) * sizeof(uint32_t));
+        dedup_next = realloc(dedup_next, num_of_blocks * sizeof(uint32_t));
+        for (b = data_start; b < num_of_blocks; b++) {
+            if (dedup_tab[b].refs > 0) {
+                uint32_t *head = &dedup_head[dedup_tab[b].fp & dedup_mask];
+                dedup_next[b] = *head;
+                *head = b;
+            }
+        }
+    }
+
+    int64_t n = clean ? 0 :
+        scan_blocks(num_of_inodes);
+    if (n > 0) {
+        fprintf(stderr, "file system was not unmounted cleanly: "
+                "%lld blocks reclaimed\n", (long long)n);
+    }
+    if (!clean) {
+        n_free_known = count_free(0, num_of_blocks);
+    }
+    super = sb;
+    if (!readonly) {
+        super.state |= FS5600_STATE_DIRTY;
+        write_super();
+    }
+
     return NULL;
 }
 
@@ -118,7 +759,7 @@ static int translate(const char *path) {
     int inode_num = 1;
     struct fs5600_inode *father_inode;
     struct fs5600_dirent *dir;
-    dir = malloc(FS_BLOCK_SIZE);
+    dir = malloc(fs_block_size);
 
     struct fs5600_dirent dummy_dir = {
 	.valid = 1,
@@ -146,22 +787,16 @@ static int translate(const char *path) {
             }
             break;
 	    }
-	    father_inode = &inode_region[inode_num];
+	    father_inode = INODE(inode_num);
 	    int block_pos = father_inode->direct[0];
-	    disk->ops->read(disk, block_pos, 1, dir);
-	    int i;
-	    int found = 0;
-	    for (i = 0; i < 32; i++) {
-            if (strcmp(dir[i].name, token) == 0 && dir[i].valid == 1) {
-                found = 1;
-                inode_num = dir[i].inode;
-                current_dir = &dir[i];
-            }
-	    }
-	    if (found == 0) {
+	    blk_read(block_pos, 1, dir);
+	    int i = dir_find(dir, token);
+	    if (i < 0) {
             error = -ENOENT;
             break;
 	    }
+	    inode_num = dir[i].inode;
+	    current_dir = &dir[i];
         token = strtok(NULL, delim);
     }
 
@@ -195,14 +830,23 @@ int trancate_path (const char *path, char **trancated_path) {
     return 0;
 }
 
-static void set_attr(struct fs5600_inode inode, struct stat *sb) {
+static int64_t file_size(int inum);
+static void da_drop(int inum);
+static void da_room(int64_t n);
+static void wb_drop(int inum);
+static int wb_sync(int inum);
+static void wb_read(int inum, char *buf, size_t len, off_t offset);
+static void win_drop(int inum);
+
+static void set_attr(struct fs5600_inode inode, int64_t size,
+                     struct stat *sb) {
     /* set every other bit to zero */
     memset(sb, 0, sizeof(struct stat));
     sb->st_mode = inode.mode;
     sb->st_uid = inode.uid;
     sb->st_gid = inode.gid;
-    sb->st_size = inode.size;
-    sb->st_blocks = (inode.size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    sb->st_size = size;
+    sb->st_blocks = (sb->st_size + fs_block_size - 1) / fs_block_size;
     sb->st_nlink = 1;
     sb->st_atime = inode.mtime;
     sb->st_ctime = inode.ctime;
@@ -220,14 +864,13 @@ static void set_attr(struct fs5600_inode inode, struct stat *sb) {
  */
 static int fs_getattr(const char *path, struct stat *sb)
 {
-    fs_init(NULL);
     int inum = translate(path);
     if (inum == -ENOENT || inum == -ENOTDIR) {
     	return inum;
     }
 
-    struct fs5600_inode inode = inode_region[inum];
-    set_attr(inode, sb);
+    struct fs5600_inode inode = *INODE(inum);
+    set_attr(inode, file_size(inum), sb);
     /* what should I return if succeeded?
      success (0) */
     return 0;
@@ -237,13 +880,13 @@ static int fs_getattr(const char *path, struct stat *sb)
 int inode_is_dir(int father_inum, int inum) {
     struct fs5600_inode *inode;
     struct fs5600_dirent *dir;
-    dir = malloc(FS_BLOCK_SIZE);
+    dir = malloc(fs_block_size);
 
-    inode = &inode_region[father_inum];
+    inode = INODE(father_inum);
     int block_pos = inode->direct[0];
-    disk->ops->read(disk, block_pos, 1, dir);
+    blk_read(block_pos, 1, dir);
     int i;
-    for (i = 0; i < 32; i++) {
+    for (i = 0; i < dirents_per_blk; i++) {
 	if (dir[i].valid == 0) {
 	    continue;
 	}
@@ -287,29 +930,29 @@ static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
 
     struct fs5600_inode *inode;
     struct fs5600_dirent *dir;
-    inode = &inode_region[inum];
+    inode = INODE(inum);
     // check is dir
     if(!S_ISDIR(inode->mode)) {
         return -ENOTDIR;
     }
 
-    dir = malloc(FS_BLOCK_SIZE);
+    dir = malloc(fs_block_size);
     int block_pos = inode->direct[0];
-    disk->ops->read(disk, block_pos, 1, dir);
+    blk_read(block_pos, 1, dir);
     int curr_inum;
     struct fs5600_inode curr_inode;
 
     struct stat sb;
 
     int i;
-    for (i = 0; i < 32; i++) {
+    for (i = 0; i < dirents_per_blk; i++) {
     	if (dir[i].valid == 0) {
     	    continue;
     	}
 
     	curr_inum = dir[i].inode;
-        curr_inode = inode_region[curr_inum];
-    	set_attr(curr_inode, &sb);
+        curr_inode = *INODE(curr_inum);
+    	set_attr(curr_inode, file_size(curr_inum), &sb);
     	filler(ptr, dir[i].name, &sb, 0);
     }
     free(dir);
@@ -332,7 +975,8 @@ void update_inode(int inum);
 *          "/a/b" must exist, and "/a/b/c" must not.
 *
 * If a file or directory of this name already exists, return -EEXIST.
-* If this would result in >32 entries in a directory, return -ENOSPC
+* If this would result in more entries in a directory than fit in a
+* block (32 with 1K blocks), return -ENOSPC
 * if !S_ISREG(mode) [i.e. 'mode' specifies a device special
 * file or other non-file object] then return -EINVAL
 */
@@ -356,8 +1000,8 @@ static int fs_mknod(const char *path, mode_t mode, dev_t dev)
     if (inum > 0) {
         return -EEXIST;
     }
-    // check entries in father dir not excceed 32
-    struct fs5600_inode *father_inode = &inode_region[dir_inum];
+    // check entries in father dir not excceed dirents_per_blk
+    struct fs5600_inode *father_inode = INODE(dir_inum);
     int free_dirent_num = find_free_dirent_num(father_inode);
     if(free_dirent_num < 0) {
         return -ENOSPC;
@@ -373,16 +1017,20 @@ static int fs_mknod(const char *path, mode_t mode, dev_t dev)
             .ctime = time_raw_format,
             .mtime = time_raw_format,
             .size = 0,
+            .flags = ((features & FS5600_FEAT_COMPRESS) ?
+                      FS5600_INODE_COMPRESSED : 0) |
+                ((features & FS5600_FEAT_INLINE) ? FS5600_INODE_INLINE : 0),
     };
     int free_inum = find_free_inode_map_bit();
     if (free_inum < 0) {
         return -ENOSPC;
     }
-    FD_SET(free_inum, inode_map);
+    imap_set(free_inum);
     update_bitmap();
 
     // write father_inode to the allocated pos in father_inode region
-    memcpy(&inode_region[free_inum], &new_inode, sizeof(struct fs5600_inode));
+    memset(INODE(free_inum), 0, inode_size);
+    memcpy(INODE(free_inum), &new_inode, sizeof(struct fs5600_inode));
     update_inode(free_inum);
 
 
@@ -400,18 +1048,20 @@ static int fs_mknod(const char *path, mode_t mode, dev_t dev)
     strncpy(new_dirent.name, tmp_name, strlen(tmp_name));
     new_dirent.name[strlen(tmp_name)] = '\0';
 
-    struct fs5600_dirent *dir_blk = (struct fs5600_dirent *)calloc(BLOCK_SIZE / sizeof(int), sizeof(int));
-    disk->ops->read(disk, (father_inode->direct)[0], 1, dir_blk);
+    // the new inode has to be on disk before the entry pointing to it
+    blk_barrier();
+    struct fs5600_dirent *dir_blk = (struct fs5600_dirent *)calloc(1, fs_block_size);
+    blk_read((father_inode->direct)[0], 1, dir_blk);
     memcpy(&dir_blk[free_dirent_num], &new_dirent, sizeof(struct fs5600_dirent));
-    disk->ops->write(disk, father_inode->direct[0], 1, dir_blk);
+    meta_write(father_inode->direct[0], 1, dir_blk);
     free(dir_blk);
     free(_path);
     return 0;
 }
 
 void update_inode(int inum) {
-    int offset = 1 + inode_map_sz + block_map_sz + (inum / 16);
-    disk->ops->write(disk, offset, 1, &inode_region[inum - (inum % 16)]);
+    struct itab_blk *b = icache_get(inum / inodes_per_blk);
+    meta_write(1 + inode_map_sz + block_map_sz + b->num, 1, b->data);
 }
 
 static void strip(char *path) {
@@ -432,9 +1082,9 @@ static char *get_name(char *path) {
 }
 
 int find_free_inode_map_bit() {// find a free inode_region
-    int inode_capacity = inode_map_sz * FS_BLOCK_SIZE * 8;
     int i;
-    for (i = 2; i < inode_capacity; i++) {
+    for (i = 2; i < num_of_inodes; i++) {
+        imap_need(i);
         if (!FD_ISSET(i, inode_map)) {
             return i;
         }
@@ -443,32 +1093,28 @@ int find_free_inode_map_bit() {// find a free inode_region
 }
 
 int find_free_dirent_num(struct fs5600_inode *inode) {
-    struct fs5600_dirent *dir = (struct fs5600_dirent *)malloc(BLOCK_SIZE);
-    disk->ops->read(disk, (inode->direct)[0], 1, dir);
+    struct fs5600_dirent *dir = (struct fs5600_dirent *)malloc(fs_block_size);
+    blk_read((inode->direct)[0], 1, dir);
 
-    int free_dirent_num = -1;
-    int i;
-    for (i = 0; i < 32; i++) {
-        if (!dir[i].valid) {
-            free_dirent_num = i;
-            break;
-        }
-    }
+    int free_dirent_num = dir_free_slot(dir);
     free(dir);
     return free_dirent_num;
 }
 
-int find_free_block_number();
+int64_t find_free_block_number(int64_t goal);
 /* mkdir - create a directory with the given mode.
  * Errors - path resolution, EEXIST
  * Conditions for EEXIST are the same as for create.
- * If this would result in >32 entries in a directory, return -ENOSPC
+ * If this would result in more entries than fit in a directory block,
+ * return -ENOSPC
  *
  * Note that you may want to combine the logic of fs_mknod and
  * fs_mkdir.
  */
 static int fs_mkdir(const char *path, mode_t mode)
 {
+    commit_frees();
+    da_room(1);
     mode = mode | S_IFDIR;
     if (!S_ISDIR(mode)) {
         return -EINVAL;
@@ -490,8 +1136,8 @@ static int fs_mkdir(const char *path, mode_t mode)
     if (inum > 0) {
         return -EEXIST;
     }
-    // check entries in father dir not excceed 32
-    struct fs5600_inode *father_inode = &inode_region[dir_inum];
+    // check entries in father dir not excceed dirents_per_blk
+    struct fs5600_inode *father_inode = INODE(dir_inum);
     int free_dirent_num = find_free_dirent_num(father_inode);
     if(free_dirent_num < 0) {
         return -ENOSPC;
@@ -513,22 +1159,26 @@ static int fs_mkdir(const char *path, mode_t mode)
             .size = 0,
             .direct = {0, 0, 0, 0, 0, 0},
     };
-    int free_blk_num = find_free_block_number();
-    FD_SET(free_blk_num, block_map);
-    update_bitmap();
-    new_inode.direct[0] = free_blk_num;
-    int *clear_block = (int *)calloc(BLOCK_SIZE, sizeof(int));
-    disk->ops->write(disk, new_inode.direct[0], 1, clear_block);
+    // the inode first, so that there's no block to give back without one
     int free_inum = find_free_inode_map_bit();
     if (free_inum < 0) {
-        free(clear_block);
         return -ENOSPC;
     }
-    FD_SET(free_inum, inode_map);
+    int64_t free_blk_num = find_free_block_number(0);
+    if (free_blk_num < 0) {
+        return -ENOSPC;
+    }
+    bmap_set(free_blk_num);
+    update_bitmap();
+    new_inode.direct[0] = free_blk_num;
+    int *clear_block = (int *)calloc(1, fs_block_size);
+    meta_write(new_inode.direct[0], 1, clear_block);
+    imap_set(free_inum);
     update_bitmap();
 
     // write father_inode to the allocated pos in father_inode region
-    memcpy(&inode_region[free_inum], &new_inode, sizeof(struct fs5600_inode));
+    memset(INODE(free_inum), 0, inode_size);
+    memcpy(INODE(free_inum), &new_inode, sizeof(struct fs5600_inode));
     update_inode(free_inum);
 
 
@@ -545,10 +1195,12 @@ static int fs_mkdir(const char *path, mode_t mode)
     assert(strlen(tmp_name) < 28);
     memcpy(new_dirent.name, tmp_name, strlen(tmp_name));
 
-    struct fs5600_dirent *dir_blk = (struct fs5600_dirent *)malloc(BLOCK_SIZE);
-    disk->ops->read(disk, (father_inode->direct)[0], 1, dir_blk);
+    // the new inode has to be on disk before the entry pointing to it
+    blk_barrier();
+    struct fs5600_dirent *dir_blk = (struct fs5600_dirent *)malloc(fs_block_size);
+    blk_read((father_inode->direct)[0], 1, dir_blk);
     memcpy(&dir_blk[free_dirent_num], &new_dirent, sizeof(struct fs5600_dirent));
-    disk->ops->write(disk, father_inode->direct[0], 1, dir_blk);
+    meta_write(father_inode->direct[0], 1, dir_blk);
 
     free(clear_block);
     free(dir_blk);
@@ -556,9 +1208,11 @@ static int fs_mkdir(const char *path, mode_t mode)
     return 0;
 }
 
-void truncate_2nd_level(int h1t_root_blk_num);
-
-void truncate_3rd_level(int h2t_root_blk_num);
+static void truncate_tree(uint32_t blknum, int levels);
+static void indir_cache_clear(void);
+static void cluster_forget(int inum);
+static void put_block(uint32_t blknum);
+static void truncate_inode(int inum);
 
 /* truncate - truncate file to exactly 'len' bytes
  * Errors - path resolution, ENOENT, EISDIR, EINVAL
@@ -577,71 +1231,74 @@ static int fs_truncate(const char *path, off_t len)
     if (inum == -ENOENT || inum == -ENOTDIR) {
         return inum;
     }
-    struct fs5600_inode *inode = &inode_region[inum];
+    struct fs5600_inode *inode = INODE(inum);
     if  (S_ISDIR(inode->mode)) {
         return -EISDIR;
     }
+    truncate_inode(inum);
+    return 0;
+}
+
+/* free all the blocks of a file and set its size to 0
+ */
+static void truncate_inode(int inum)
+{
+    struct fs5600_inode *inode = INODE(inum);
+    wb_drop(inum);
+    da_drop(inum);
+    win_drop(inum);
 
     // clear the block bit map of this inode
-    int temp_blk_num;
     int i;
     for (i = 0; i < N_DIRECT; i++) {
-        temp_blk_num = inode->direct[i];
-        inode->direct[i] = 0;
-        if (temp_blk_num != 0) {
-            FD_CLR(temp_blk_num, block_map);
-            update_bitmap();
-        } else {
-            break;
+        if (inode->direct[i] != 0) {
+            put_block(inode->direct[i]);
+            inode->direct[i] = 0;
         }
     }
-    if (inode->size > N_DIRECT * BLOCK_SIZE) {
-        truncate_2nd_level(inode->indir_1);
+    uint32_t *roots[] = {&inode->indir_1, &inode->indir_2, &inode->indir_3};
+    for (i = 0; i < 3; i++) {
+        if (*roots[i] != 0) {
+            truncate_tree(*roots[i], i + 1);
+            *roots[i] = 0;
+        }
     }
-
-    if (inode->size > (BLOCK_SIZE / 4) * BLOCK_SIZE + N_DIRECT * BLOCK_SIZE) {
-        truncate_3rd_level(inode->indir_2);
+    indir_cache_clear();
+    cluster_forget(inum);
+    if (inode->flags & FS5600_INODE_INLINE) {
+        memset(FS5600_INLINE_DATA(inode), 0, inline_max);
     }
 
-    // set the size of inode as 0
-    inode_region[inum].size = 0;
-    inode_region[inum].indir_1 = 0;
-    inode_region[inum].indir_2 = 0;
+    // set the size of inode as 0, and only then free the blocks, so
+    // they are never in use by two files on disk
+    inode->size = 0;
+    inode->size_hi = 0;
     update_inode(inum);
-    return 0;
-}
-
-
-void truncate_2nd_level(int h1t_root_blk_num) {
-    int h1t_blk[256];
-    disk->ops->read(disk, h1t_root_blk_num, 1, h1t_blk);
-    int i;
-    for (i = 0; i < 256; ++i) {
-        int temp_blk_num = h1t_blk[i];
-        if (temp_blk_num != 0) {
-            FD_CLR(temp_blk_num, block_map);
-        } else {
-            break;
-        }
-    }
-    FD_CLR(h1t_root_blk_num, block_map);
+    blk_barrier();
     update_bitmap();
+    discard_freed();
 }
 
-void truncate_3rd_level(int h2t_root_blk_num) {
-    sleep(0.1);
-    int h2t_blk[256];
-    disk->ops->read(disk, h2t_root_blk_num, 1, h2t_blk);
+/* free the block tree under an indirect block, 'levels' levels deep
+ * (1 = pointers to data blocks), and the block itself. The caller
+ * writes out the bitmap.
+ */
+static void truncate_tree(uint32_t blknum, int levels) {
+    uint32_t *ptrs = malloc(fs_block_size);
+    blk_read(blknum, 1, ptrs);
     int i;
-    for (i = 0; i < 256; ++i) {
-        int temp_blk_num = h2t_blk[i];
-        if (temp_blk_num == 0) {
-            break;
+    for (i = 0; i < ptrs_per_blk; ++i) {
+        if (ptrs[i] == 0) {
+            continue;
+        }
+        if (levels > 1) {
+            truncate_tree(ptrs[i], levels - 1);
+        } else {
+            put_block(ptrs[i]);
         }
-        truncate_2nd_level(h2t_blk[i]);
     }
-    FD_CLR(h2t_root_blk_num, block_map);
-    update_bitmap();
+    free(ptrs);
+    free_block(blknum);
 }
 
 /* unlink - delete a file
@@ -654,50 +1311,40 @@ static int fs_unlink(const char *path)
     if (inum == -ENOENT || inum == -ENOTDIR) {
         return inum;
     }
-    struct fs5600_inode *inode = &inode_region[inum];
+    struct fs5600_inode *inode = INODE(inum);
     if  (S_ISDIR(inode->mode)) {
         return -EISDIR;
     }
 
-    // truncate all the data
-    int truncate_result = fs_truncate(path, 0);
-    if (truncate_result != 0) {
-        return truncate_result;
-    }
-
     char *father_path;
     trancate_path(path, &father_path);
     int father_inum = translate(father_path);
     free(father_path);
-    struct fs5600_inode *father_inode = &inode_region[father_inum];
-
-
-    // remove inode, i.e. clear inode_map corresponding bit
-    FD_CLR(inum, inode_map);
-    update_bitmap();
+    struct fs5600_inode *father_inode = INODE(father_inum);
 
     // remove entry from father dir
     char *_path = strdup(path);
     char *name = get_name(_path);
 
-    struct fs5600_dirent *father_dir = malloc(FS_BLOCK_SIZE);
-    disk->ops->read(disk, father_inode->direct[0], 1, father_dir);
-    int found = 0;
-    int i;
-    for (i = 0; i < 32; ++i) {
-        if (strcmp(father_dir[i].name, name) == 0) {
-            if (father_dir[i].valid == 1 ) {
-                father_dir[i].valid = 0;
-                found = 1;
-            }
-        }
-    }
-    disk->ops->write(disk, father_inode->direct[0], 1, father_dir);
-    if (!found) {
+    struct fs5600_dirent *father_dir = malloc(fs_block_size);
+    blk_read(father_inode->direct[0], 1, father_dir);
+    int i = dir_find(father_dir, name);
+    if (i < 0) {
+        free(father_dir);
+        free(_path);
         return -ENOENT;
     }
+    father_dir[i].valid = 0;
+    meta_write(father_inode->direct[0], 1, father_dir);
     free(father_dir);
     free(_path);
+
+    // with the entry gone, truncate all the data and remove the inode,
+    // i.e. clear inode_map corresponding bit
+    blk_barrier();
+    truncate_inode(inum);
+    imap_clear(inum);
+    update_bitmap();
     return 0;
 }
 
@@ -713,7 +1360,7 @@ static int fs_rmdir(const char *path)
     if (inum == -ENOENT || inum == -ENOTDIR) {
         return inum;
     }
-    struct fs5600_inode *inode = &inode_region[inum];
+    struct fs5600_inode *inode = INODE(inum);
     if  (S_ISREG(inode->mode)) {
         return -ENOTDIR;
     }
@@ -727,11 +1374,11 @@ static int fs_rmdir(const char *path)
     }
 
     // check dir is empty
-    struct fs5600_dirent *dirent = malloc(FS_BLOCK_SIZE);
-    disk->ops->read(disk, inode->direct[0], 1, dirent);
+    struct fs5600_dirent *dirent = malloc(fs_block_size);
+    blk_read(inode->direct[0], 1, dirent);
     int empty = 1;
     int i;
-    for (i = 0; i < 32; ++i) {
+    for (i = 0; i < dirents_per_blk; ++i) {
         if (dirent[i].valid) {
             empty = 0;
             break;
@@ -742,34 +1389,29 @@ static int fs_rmdir(const char *path)
         return -ENOTEMPTY;
     }
 
-    // block map remove the block of this dir
-    FD_SET(inode->direct[0], inode_map);
-    update_bitmap();
-
-    // inode map remove this dir
-    FD_SET(inum, inode_map);
-    update_bitmap();
-
-    // then unlink this dir
+    // unlink this dir
     char *_path = strdup(path);
     strip(_path);
     char *name = get_name(_path);
     int father_inum = translate(father_path);
     free(father_path);
-    struct fs5600_inode *father_inode = &inode_region[father_inum];
-    struct fs5600_dirent *father_dirent = malloc(FS_BLOCK_SIZE);
-    disk->ops->read(disk, father_inode->direct[0], 1, father_dirent);
-    for (i = 0; i < 32; ++i) {
-        if (strcmp(father_dirent[i].name, name) == 0) {
-            if (father_dirent[i].valid == 1 ) {
-                father_dirent[i].valid = 0;
-            }
-        }
-    }
-    disk->ops->write(disk, father_inode->direct[0], 1, father_dirent);
-
+    struct fs5600_inode *father_inode = INODE(father_inum);
+    struct fs5600_dirent *father_dirent = malloc(fs_block_size);
+    blk_read(father_inode->direct[0], 1, father_dirent);
+    if ((i = dir_find(father_dirent, name)) >= 0) {
+        father_dirent[i].valid = 0;
+        meta_write(father_inode->direct[0], 1, father_dirent);
+    }
+    free(father_dirent);
     free(_path);
-    return -0;
+
+    // then free its block and inode
+    blk_barrier();
+    free_block(inode->direct[0]);
+    imap_clear(inum);
+    update_bitmap();
+    discard_freed();
+    return 0;
 }
 
 /* rename - rename a file or directory
@@ -826,20 +1468,19 @@ static int fs_rename(const char *src_path, const char *dst_path)
    	/*load dirent block to memory to search src file name*/
    	struct fs5600_inode *father_inode;
     struct fs5600_dirent *dir;
-    dir = malloc(FS_BLOCK_SIZE);
+    dir = malloc(fs_block_size);
 
-    father_inode = &inode_region[father_inum];
+    father_inode = INODE(father_inum);
     int block_pos = father_inode->direct[0];
-    disk->ops->read(disk, block_pos, 1, dir);
-    int i;
-    /*traverse the drient block to find the dirent with the same name*/
-    for (i = 0;i < 32; i++) {
-    	if (dir[i].valid == 1 && strcmp(dir[i].name, src_name) == 0) {
+    blk_read(block_pos, 1, dir);
+    /*find the dirent with the same name*/
+    int i = dir_find(dir, src_name);
+    if (i >= 0) {
     		strncpy(dir[i].name, dst_name, strlen(dst_name));
     		dir[i].name[strlen(dst_name)] = '\0';
-    		disk->ops->write(disk, block_pos, 1, dir);
-    	}
+    		meta_write(block_pos, 1, dir);
     }
+    free(dir);
     free(_src_path);
     free(_dst_path);
    	free(src_father_path);
@@ -859,7 +1500,7 @@ static int fs_chmod(const char *path, mode_t mode)
     	return inum;
     }
     struct fs5600_inode *inode;
-    inode = &inode_region[inum];
+    inode = INODE(inum);
     inode->mode = mode;
     update_inode(inum);
     return 0;
@@ -878,177 +1519,1538 @@ int fs_utime(const char *path, struct utimbuf *ut)
     	return inum;
     }
     struct fs5600_inode *inode;
-    inode = &inode_region[inum];
+    inode = INODE(inum);
     inode->mtime = ut->modtime;
     update_inode(inum);
     return 0;
 }
 
 
-/*
- * given block number, offset, length and return buffer, load corresponding data into buffer
+/* Block trees: N_DIRECT blocks are mapped by the inode itself, then
+ * come single, double and (with FS5600_FEAT_LARGE_FILE) triple
+ * indirect trees of ptrs_per_blk pointers per block.
  *
+ * The indirect block last read at each depth is kept in memory, so a
+ * sequential read or write fetches each indirect block once rather
+ * than once per data block.
  */
-static int fs_read_block(int blknum, int offset, int len, char *buf);
+static uint32_t *read_indir(int depth, uint32_t blknum) {
+    if (indir_cache[depth].blknum != blknum) {
+        blk_read(blknum, 1, indir_cache[depth].ptrs);
+        indir_cache[depth].blknum = blknum;
+    }
+    return indir_cache[depth].ptrs;
+}
 
-// return the read in length
-static int fs_read_1st_level(const struct fs5600_inode *inode, off_t offset, size_t len, char *buf);
-// return the read in length
-static int fs_read_2nd_level(size_t root_blk, int offset, int len, char *buf);
-static int fs_read_3rd_level(size_t root_blk, int offset, int len, char *buf);
+static void indir_cache_clear(void) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        indir_cache[i].blknum = 0;
+    }
+}
 
-/* read - read data from an open file.
- * should return exactly the number of bytes requested, except:
- *   - if offset >= file len, return 0
- *   - if offset+len > file len, return bytes from offset to EOF
- *   - on error, return <0
- * Errors - path resolution, ENOENT, EISDIR
+/* allocate a (zeroed) block, the first free one at or after 'goal' if
+ * there is one, and mark it in the block map
  */
-static int fs_read(const char *path, char *buf, size_t len, off_t offset,
-                   struct fuse_file_info *fi)
-{
-    /*first get the inode
-    check it is valid
-    check it is file*/
-
-    int tmp_offset = offset;
-    int inum = translate(path);
-    if (inum == -ENOENT || inum == -ENOTDIR) {
-        return inum;
+static int64_t alloc_block_at(int64_t goal) {
+    int64_t blknum = find_free_block_number(goal);
+    if (blknum >= 0) {
+        bmap_set(blknum);
+        update_bitmap();
     }
-    const struct fs5600_inode *inode = &inode_region[inum];
-    if(!S_ISREG(inode->mode)) {
-        return -EISDIR;
-    }
-    int size = inode->size;
-    if (tmp_offset >= size) {
-        return 0;
+    return blknum;
+}
+
+static int64_t alloc_block(void) {
+    return alloc_block_at(0);
+}
+
+/* write out what holds a block pointer: the inode if 'where' is 0,
+ * otherwise the indirect block cached at depth where-1
+ */
+static void put_slot(int inum, int where) {
+    if (where == 0) {
+        update_inode(inum);
+    } else {
+        meta_write(indir_cache[where-1].blknum, 1, indir_cache[where-1].ptrs);
+    }
+}
+
+/* find the pointer to block 'lblk' of a file, in the inode or in the
+ * indirect block cache: '*slotp' is set to it and '*where' to what
+ * holds it (see put_slot). If 'alloc' is set, missing indirect blocks
+ * on the way are allocated; otherwise '*slotp' is NULL if there are
+ * none.
+ * Errors - ENOSPC, EFBIG (past the largest file size)
+ */
+static int bmap_slot(int inum, int64_t lblk, int alloc, uint32_t **slotp,
+                     int *where) {
+    struct fs5600_inode *inode = INODE(inum);
+    int64_t p = ptrs_per_blk;
+    uint32_t *slot;
+    int levels, depth;
+
+    if (lblk < N_DIRECT) {
+        slot = &inode->direct[lblk], levels = 0;
+    } else if ((lblk -= N_DIRECT) < p) {
+        slot = &inode->indir_1, levels = 1;
+    } else if ((lblk -= p) < p * p) {
+        slot = &inode->indir_2, levels = 2;
+    } else if ((lblk -= p * p) < p * p * p &&
+               (features & FS5600_FEAT_LARGE_FILE)) {
+        slot = &inode->indir_3, levels = 3;
+    } else {
+        return -EFBIG;
+    }
+
+    *where = 0;
+    for (depth = 0; depth < levels; depth++) {
+        if (*slot == 0) {
+            if (!alloc) {
+                *slotp = NULL;
+                return 0;
+            }
+            int64_t blknum = alloc_block();
+            if (blknum < 0) {
+                return blknum;
+            }
+            *slot = blknum;
+            put_slot(inum, *where);
+        }
+        uint32_t *ptrs = read_indir(depth, *slot);
+        slot = &ptrs[(lblk >> (ptr_shift * (levels - depth - 1))) & (p - 1)];
+        *where = depth + 1;
+    }
+    *slotp = slot;
+    return 0;
+}
+
+/* map block 'lblk' of a file to a disk block. If 'alloc' is set, any
+ * missing data or indirect blocks on the way are allocated; otherwise
+ * a missing block (hole) maps to 0.
+ * Errors - ENOSPC, EFBIG (past the largest file size)
+ */
+static int64_t fs_bmap(int inum, int64_t lblk, int alloc) {
+    uint32_t *slot;
+    int where;
+    int val = bmap_slot(inum, lblk, alloc, &slot, &where);
+
+    if (val < 0 || slot == NULL) {
+        return val;
+    }
+    if (*slot == 0 && alloc) {
+        int64_t blknum = alloc_block();
+        if (blknum < 0) {
+            return blknum;
+        }
+        *slot = blknum;
+        put_slot(inum, where);
+    }
+    return *slot;
+}
+
+/* point block 'lblk' of a file at 'blknum'. What holds the pointer is
+ * written out unless 'more' says block 'lblk'+1 is set next and its
+ * pointer is in the same place, so that a run of blocks writes each
+ * pointer block (or the inode) once.
+ * Errors - ENOSPC, EFBIG
+ */
+static int set_ptr(int inum, int64_t lblk, uint32_t blknum, int more) {
+    uint32_t *slot;
+    int where, val = bmap_slot(inum, lblk, 1, &slot, &where);
+    if (val < 0) {
+        return val;
+    }
+    *slot = blknum;
+    int64_t next = lblk + 1;
+    if (!more || (where == 0 ? next >= N_DIRECT :
+                  (next - N_DIRECT) % ptrs_per_blk == 0)) {
+        put_slot(inum, where);
+    }
+    return 0;
+}
+
+/* the blocks a compressed file's old clusters were in, which can be
+ * freed once the file points at the new ones
+ */
+static uint32_t *retired;
+static long n_retired, max_retired;
+
+static void retire_block(uint32_t blknum) {
+    if (n_retired == max_retired) {
+        max_retired = max_retired ? 2 * max_retired : 64;
+        retired = realloc(retired, max_retired * sizeof(*retired));
+    }
+    retired[n_retired++] = blknum;
+}
+
+/* drop the retired blocks, once nothing points at them */
+static void free_retired(void) {
+    long i;
+    if (n_retired > 0) {
+        blk_barrier();
+        for (i = 0; i < n_retired; i++) {
+            put_block(retired[i]);
+        }
+        n_retired = 0;
+        update_bitmap();
+        discard_freed();
+    }
+}
+
+/* number of blocks cluster 'c' covers in a file of 'size' bytes */
+static int cluster_need(int64_t size, int64_t c) {
+    int64_t n = ((size + fs_block_size - 1) >> blk_shift) - c * cluster_blks;
+    return n < 0 ? 0 : n > cluster_blks ? cluster_blks : n;
+}
+
+/* read cluster 'c' of a file into 'data'
+ * Errors - EIO (corrupt compressed cluster)
+ */
+static int cluster_load(int inum, int64_t c, char *data) {
+    struct fs5600_inode *inode = INODE(inum);
+    int need = cluster_need(FS5600_SIZE(inode), c), n = 0, i;
+    int64_t blks[MAX_CLUSTER_BLKS];
+
+    memset(data, 0, cluster_sz);
+    for (i = 0; i < need; i++) {
+        blks[i] = fs_bmap(inum, c * cluster_blks + i, 0);
+        if (blks[i] > 0) {
+            n++;
+        }
+    }
+    if (n == need) {            /* stored as is */
+        for (i = 0; i < need; i++) {
+            blk_read(blks[i], 1, data + i * fs_block_size);
+        }
+        return 0;
+    }
+
+    uint32_t clen;
+    for (i = 0; i < n; i++) {
+        if (blks[i] <= 0) {
+            return -EIO;
+        }
+        blk_read(blks[i], 1, cluster_buf + i * fs_block_size);
+    }
+    memcpy(&clen, cluster_buf, sizeof(clen));
+    if (clen > n * fs_block_size - sizeof(clen) ||
+        lz_decompress(cluster_buf + sizeof(clen), clen, data, cluster_sz) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/* the cached copy of cluster 'c' of a file, read in if need be.
+ * Returns NULL if it is corrupt.
+ */
+static struct cluster *cluster_get(int inum, int64_t c) {
+    struct cluster *cl = &clusters[0];
+    int i;
+
+    for (i = 0; i < N_CLUSTERS; i++) {
+        if (clusters[i].inum == inum && clusters[i].num == c) {
+            cl = &clusters[i];
+            cl->used = ++cluster_clock;
+            return cl;
+        }
+        if (clusters[i].used < cl->used) {
+            cl = &clusters[i];
+        }
+    }
+    cl->inum = 0;
+    if (cluster_load(inum, c, cl->data) < 0) {
+        return NULL;
+    }
+    cl->inum = inum;
+    cl->num = c;
+    cl->used = ++cluster_clock;
+    return cl;
+}
+
+static void cluster_forget(int inum) {
+    int i;
+    for (i = 0; i < N_CLUSTERS; i++) {
+        if (clusters[i].inum == inum) {
+            clusters[i].inum = 0;
+        }
+    }
+}
+
+/* write cluster 'c' of a file, holding 'data', compressed if that
+ * saves a block. It goes into newly allocated blocks, and then the
+ * file is pointed at them and given its new size 'size' in one go, so
+ * a crash leaves either the old cluster or the new one. The blocks it
+ * was in before are retired.
+ * Errors - ENOSPC
+ */
+static int cluster_store(int inum, int64_t c, char *data, int64_t size) {
+    struct fs5600_inode *inode = INODE(inum);
+    int need = cluster_need(size, c), k = need, i, where;
+    int64_t extent = size - c * cluster_sz, blks[MAX_CLUSTER_BLKS];
+    char *src = data;
+    uint32_t *slot, clen;
+
+    if (extent > cluster_sz) {
+        extent = cluster_sz;
+    }
+    if (need > 1) {
+        clen = lz_compress(data, extent, cluster_buf + sizeof(clen),
+                           (need - 1) * fs_block_size - sizeof(clen));
+        if (clen > 0) {
+            memcpy(cluster_buf, &clen, sizeof(clen));
+            k = (clen + sizeof(clen) + fs_block_size - 1) >> blk_shift;
+            memset(cluster_buf + sizeof(clen) + clen, 0,
+                   k * fs_block_size - sizeof(clen) - clen);
+            src = cluster_buf;
+        }
+    }
+
+    /* make sure the indirect blocks are there, so that nothing can
+     * fail once the file starts pointing at the new blocks
+     */
+    for (i = 0; i < k; i++) {
+        int val = bmap_slot(inum, c * cluster_blks + i, 1, &slot, &where);
+        if (val < 0) {
+            return val;
+        }
+    }
+    int64_t goal = k > 1 ? free_run(k) : 0;
+    for (i = 0; i < k; i++) {
+        if ((blks[i] = alloc_block_at(goal < 0 ? 0 : goal)) < 0) {
+            int val = blks[i];
+            while (--i >= 0) {
+                bmap_clear(blks[i]);
+            }
+            update_bitmap();
+            return val;
+        }
+        blk_write(blks[i], 1, src + i * fs_block_size);
+    }
+
+    blk_barrier();
+    for (i = 0; i < need; i++) {
+        bmap_slot(inum, c * cluster_blks + i, i < k, &slot, &where);
+        if (slot == NULL || *slot == (i < k ? blks[i] : 0)) {
+            continue;
+        }
+        if (*slot != 0) {
+            retire_block(*slot);
+        }
+        *slot = i < k ? blks[i] : 0;
+        put_slot(inum, where);
+    }
+    inode->size = (uint32_t)size;
+    inode->size_hi = size >> 32;
+    update_inode(inum);
+    return 0;
+}
+
+/* read and write for compressed files, a cluster at a time; the
+ * offset and length have been checked against the file size
+ */
+static int read_compressed(int inum, char *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        int64_t pos = offset + done;
+        int off = pos % cluster_sz, n = cluster_sz - off;
+        if (n > len - done) {
+            n = len - done;
+        }
+        struct cluster *cl = cluster_get(inum, pos / cluster_sz);
+        if (cl == NULL) {
+            return done ? done : -EIO;
+        }
+        memcpy(buf + done, cl->data + off, n);
+        done += n;
+    }
+    return done;
+}
+
+static int write_compressed(int inum, const char *buf, size_t len,
+                            off_t offset) {
+    int64_t size = FS5600_SIZE(INODE(inum));
+    size_t done = 0;
+    int val = 0;
+
+    while (done < len) {
+        int64_t pos = offset + done;
+        int off = pos % cluster_sz, n = cluster_sz - off;
+        if (n > len - done) {
+            n = len - done;
+        }
+        struct cluster *cl = cluster_get(inum, pos / cluster_sz);
+        if (cl == NULL) {
+            val = -EIO;
+            break;
+        }
+        memcpy(cl->data + off, buf + done, n);
+        if (pos + n > size) {
+            size = pos + n;
+        }
+        if ((val = cluster_store(inum, pos / cluster_sz, cl->data, size)) < 0) {
+            cl->inum = 0;       /* no longer what is on disk */
+            break;
+        }
+        done += n;
+    }
+    free_retired();
+    return done ? done : val;
+}
+
+/* Deduplication. Every data block written with FS5600_FEAT_DEDUP gets
+ * a reference count and a fingerprint in the dedup table; a block with
+ * the same data as one already on disk is not written, but shares it.
+ * Shared blocks are never written in place - a write to one goes to a
+ * new block (copy on write).
+ */
+static void dedup_set(uint32_t blknum, uint32_t refs, uint32_t fp) {
+    struct fs5600_dedup *d = &dedup_tab[blknum];
+    int64_t t = blknum / DEDUP_PER_BLK(fs_block_size);
+    uint32_t *p;
+
+    fp = refs ? fp : 0;
+    if (d->refs > 0 && (refs == 0 || fp != d->fp)) {
+        for (p = &dedup_head[d->fp & dedup_mask]; *p != blknum;
+             p = &dedup_next[*p])
+            ;
+        *p = dedup_next[blknum];
+    }
+    if (refs > 0 && (d->refs == 0 || fp != d->fp)) {
+        dedup_next[blknum] = dedup_head[fp & dedup_mask];
+        dedup_head[fp & dedup_mask] = blknum;
+    }
+    d->refs = refs;
+    d->fp = fp;
+    if (dedup_lo == dedup_hi) {
+        dedup_lo = t, dedup_hi = t + 1;
+    } else if (t < dedup_lo) {
+        dedup_lo = t;
+    } else if (t >= dedup_hi) {
+        dedup_hi = t + 1;
+    }
+}
+
+/* drop a file's reference to data block 'blknum', freeing it with the
+ * last one
+ */
+static void put_block(uint32_t blknum) {
+    if (dedup_tab && dedup_tab[blknum].refs > 0) {
+        dedup_set(blknum, dedup_tab[blknum].refs - 1, dedup_tab[blknum].fp);
+        if (dedup_tab[blknum].refs > 0) {
+            return;
+        }
+    }
+    free_block(blknum);
+}
+
+static uint32_t block_fp(const void *buf) {
+    const uint64_t *p = buf;
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    int i;
+    for (i = 0; i < fs_block_size / 8; i++) {
+        h = (h ^ p[i]) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+    }
+    return h ^ (h >> 32);
+}
+
+/* a block already holding 'data' (with fingerprint 'fp'), or 0 */
+static int64_t dedup_find(uint32_t fp, const char *data) {
+    uint32_t blknum;
+    char *tmp = NULL;
+
+    for (blknum = dedup_head[fp & dedup_mask]; blknum != 0;
+         blknum = dedup_next[blknum]) {
+        if (dedup_tab[blknum].fp != fp) {
+            continue;
+        }
+        if (tmp == NULL) {
+            tmp = malloc(fs_block_size);
+        }
+        blk_read(blknum, 1, tmp);
+        if (!memcmp(tmp, data, fs_block_size)) {
+            break;
+        }
+    }
+    free(tmp);
+    return blknum;
+}
+
+/* write block 'lblk' of a file, holding 'data', with dedup on. 'old' is
+ * the block it is in now (0 if none). If another block holds the same
+ * data the file is pointed at that one; otherwise the data goes in
+ * place if 'old' isn't shared, or into a new block. A block the file
+ * no longer points at is retired. Returns the block the data is in.
+ * Errors - ENOSPC, EFBIG
+ */
+static int64_t dedup_write(int inum, int64_t lblk, int64_t old, char *data) {
+    uint32_t fp = block_fp(data), *slot;
+    int64_t blknum = dedup_find(fp, data);
+    int where, val;
+
+    if (blknum != 0 && blknum == old) {
+        return old;             /* no change */
+    }
+    if (blknum == 0 && old != 0 && dedup_tab[old].refs <= 1) {
+        blk_write(old, 1, data);
+        dedup_set(old, 1, fp);
+        return old;
+    }
+
+    if ((val = bmap_slot(inum, lblk, 1, &slot, &where)) < 0) {
+        return val;
+    }
+    if (blknum == 0) {
+        if ((blknum = alloc_block()) < 0) {
+            return blknum;
+        }
+        blk_write(blknum, 1, data);
+        dedup_set(blknum, 1, fp);
+    } else {
+        dedup_set(blknum, dedup_tab[blknum].refs + 1, fp);
+    }
+    // the reference is counted before the pointer to it is written
+    update_bitmap();
+    *slot = blknum;
+    put_slot(inum, where);
+    if (old != 0) {
+        retire_block(old);
+    }
+    return blknum;
+}
+
+/* Delayed allocation: data written to blocks a file doesn't have on
+ * disk yet is kept in memory against the inode, and the file's size
+ * with it, instead of being given blocks as each write arrives. Blocks
+ * are allocated at write-back - when the buffered data is DA_SECS old,
+ * over fs_delalloc_kb KB, needed for space, or at fsync and unmount -
+ * a whole file at a time, in runs as long as its buffered ranges, so
+ * that files written side by side don't split each other up. A file
+ * deleted or truncated before then never touches the block bitmap.
+ *
+ * Space for the buffered blocks, and for the indirect blocks they may
+ * need, is held back from other allocations (see da_held), so that
+ * write-back can't run out of it. Blocks already on disk are written
+ * in place as before, and dedup and compressed files don't buffer.
+ */
+int fs_delalloc_kb = 512;       /* 0 = allocate as data is written */
+#define DA_SECS 5
+#define DA_HASH 1024
+
+struct da_blk {
+    int inum;
+    int64_t lblk;
+    struct da_blk *hnext;       /* hash chain */
+    struct da_blk *next;        /* the file's other blocks */
+    char data[];
+};
+
+struct da_file {
+    int inum;
+    int64_t size;               /* the file's size, with buffered data */
+    int64_t n;                  /* blocks buffered */
+    struct da_blk *blks;
+    struct da_file *hnext;      /* hash chain */
+    struct da_file *next;       /* all files with buffered data */
+};
+
+static struct da_blk *da_bhash[DA_HASH];
+static struct da_file *da_fhash[DA_HASH];
+static struct da_file *da_files;
+static int64_t da_n;            /* blocks buffered in all files */
+static int da_nfiles;
+static time_t da_t0;            /* when the oldest buffered data came */
+static int da_busy;             /* in write-back, allocating held space */
+
+static unsigned da_hash(int inum, int64_t lblk) {
+    return ((uint32_t)inum * 2654435761u ^ (uint32_t)lblk * 40503u) &
+        (DA_HASH - 1);
+}
+
+static struct da_file *da_file(int inum) {
+    struct da_file *f = da_fhash[da_hash(inum, 0)];
+    while (f != NULL && f->inum != inum) {
+        f = f->hnext;
+    }
+    return f;
+}
+
+static struct da_blk *da_blk(int inum, int64_t lblk) {
+    struct da_blk *b = da_bhash[da_hash(inum, lblk)];
+    while (b != NULL && (b->inum != inum || b->lblk != lblk)) {
+        b = b->hnext;
+    }
+    return b;
+}
+
+/* blocks to hold back for 'n' buffered blocks in 'files' files: the
+ * data, a pointer block per ptrs_per_blk-1 of it (rounded up for each
+ * file), and the indirect blocks above those
+ */
+static int64_t da_held_for(int64_t n, int files) {
+    return n + n / (ptrs_per_blk - 1) + 4 * files;
+}
+
+static int64_t wb_held(void);
+
+/* all the space held back, for delayed allocation and write-behind */
+static int64_t da_held(void) {
+    return da_held_for(da_n, da_nfiles) + wb_held();
+}
+
+static int64_t wb_end(int inum);
+static void win_open(int inum, int64_t lblk);
+static void win_close_all(int except);
+
+/* the size of a file, counting data buffered for it */
+static int64_t file_size(int inum) {
+    struct da_file *f = da_file(inum);
+    int64_t size = f ? f->size : FS5600_SIZE(INODE(inum));
+    int64_t end = wb_end(inum);
+    return end > size ? end : size;
+}
+
+/* take a file's record out of the tables and free it */
+static void da_free(struct da_file *f) {
+    struct da_file **fp;
+    struct da_blk **bp, *b;
+
+    for (fp = &da_fhash[da_hash(f->inum, 0)]; *fp != f; fp = &(*fp)->hnext)
+        ;
+    *fp = f->hnext;
+    for (fp = &da_files; *fp != f; fp = &(*fp)->next)
+        ;
+    *fp = f->next;
+    while ((b = f->blks) != NULL) {
+        for (bp = &da_bhash[da_hash(b->inum, b->lblk)]; *bp != b;
+             bp = &(*bp)->hnext)
+            ;
+        *bp = b->hnext;
+        f->blks = b->next;
+        free(b);
+    }
+    da_n -= f->n;
+    da_nfiles--;
+    free(f);
+}
+
+/* forget the data buffered for a file, which is being truncated or
+ * deleted
+ */
+static void da_drop(int inum) {
+    struct da_file *f = da_file(inum);
+    if (f != NULL) {
+        da_free(f);
+    }
+}
+
+/* forget everything buffered, at mount: after a remount without an
+ * unmount it is lost, as in a crash
+ */
+static void da_reset(void) {
+    while (da_files != NULL) {
+        da_free(da_files);
+    }
+}
+
+/* are the 'n' blocks from 'blknum' all free? */
+static int run_is_free(int64_t blknum, int64_t n) {
+    int64_t i;
+    if (blknum < data_start || blknum + n > num_of_blocks) {
+        return 0;
+    }
+    for (i = blknum; i < blknum + n; i++) {
+        bmap_need(i);
+        if (FD_ISSET(i, block_map) || snap_held(i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* find free blocks for up to '*n' blocks of data: all of them at
+ * 'goal' (the block after the file's previous one) if they fit there,
+ * otherwise the longest run there is up to '*n' (halving it until one
+ * is found). '*n' is set to how many were found.
+ * Errors - ENOSPC
+ */
+static int64_t da_find_run(int64_t goal, int64_t *n) {
+    int64_t blknum;
+    if (*n > fs_block_size * 8) {
+        *n = fs_block_size * 8;
+    }
+    for (; *n > 1; *n = (*n + 1) / 2) {
+        if (goal > 0 && run_is_free(goal, *n)) {
+            return goal;
+        }
+        if ((blknum = free_run(*n)) >= 0) {
+            return blknum;
+        }
+    }
+    if ((blknum = next_free_block(goal)) < 0 && goal > 0) {
+        blknum = next_free_block(0);
+    }
+    return blknum < 0 ? -ENOSPC : blknum;
+}
+
+static int cmp_da_blk(const void *a, const void *b) {
+    int64_t x = (*(struct da_blk *const *)a)->lblk;
+    int64_t y = (*(struct da_blk *const *)b)->lblk;
+    return x < y ? -1 : x > y;
+}
+
+/* give a file's buffered blocks their place on disk: allocate runs for
+ * them and write the data, then (after a barrier) point the file at
+ * them, then set its size. If space runs out anyway, the file ends
+ * before the first block that didn't get one.
+ */
+static void da_writeback(struct da_file *f) {
+    struct fs5600_inode *inode = INODE(f->inum);
+    struct da_blk **v = malloc(f->n * sizeof(*v)), *b;
+    uint32_t *phys = malloc(f->n * sizeof(*phys));
+    int64_t i, j, k, n, blknum, size = f->size, done;
+    int inum = f->inum, append;
+    char *buf = NULL;
+
+    for (i = 0, b = f->blks; b != NULL; b = b->next) {
+        v[i++] = b;
+    }
+    qsort(v, f->n, sizeof(*v), cmp_da_blk);
+
+    /* allocate and write a run at a time */
+    da_busy = 1;
+    for (done = 0; done < f->n; done += n) {
+        for (n = 1; done + n < f->n && v[done+n]->lblk == v[done]->lblk + n;
+             n++)
+            ;
+        int64_t goal = done > 0 && v[done-1]->lblk == v[done]->lblk - 1 ?
+            phys[done-1] + 1 : 0;
+        if (goal == 0 && v[done]->lblk > 0) {
+            goal = fs_bmap(f->inum, v[done]->lblk - 1, 0);
+            goal = goal > 0 ? goal + 1 : 0;
+        }
+        if ((blknum = da_find_run(goal, &n)) < 0) {
+            break;
+        }
+        buf = realloc(buf, n * fs_block_size);
+        for (k = 0; k < n; k++) {
+            bmap_set(blknum + k);
+            phys[done+k] = blknum + k;
+            memcpy(buf + k * fs_block_size, v[done+k]->data, fs_block_size);
+        }
+        blk_write(blknum, n, buf);
+    }
+    update_bitmap();
+    blk_barrier();
+
+    for (i = 0; i < done; i++) {
+        int more = i + 1 < done && v[i+1]->lblk == v[i]->lblk + 1;
+        if (set_ptr(f->inum, v[i]->lblk, phys[i], more) < 0) {
+            break;
+        }
+    }
+    if (i < f->n) {
+        fprintf(stderr, "inode %d: out of space for delayed data\n", f->inum);
+        if (size > v[i]->lblk * fs_block_size) {
+            size = v[i]->lblk * fs_block_size;
+        }
+        for (j = i; j < done; j++) {
+            bmap_clear(phys[j]);
+        }
+        update_bitmap();
+    }
+    da_busy = 0;
+
+    blk_barrier();
+    inode->size = (uint32_t)size;
+    inode->size_hi = size >> 32;
+    update_inode(f->inum);
+
+    /* a file appended to since its last write-back gets a window */
+    append = i == f->n && v[0]->lblk > 0;
+    n = v[f->n-1]->lblk + 1;
+    da_free(f);
+    if (append) {
+        win_open(inum, n);
+    }
+    free(buf);
+    free(phys);
+    free(v);
+}
+
+/* write back the data buffered for one file, or for all of them if
+ * 'inum' is 0
+ */
+static void da_sync(int inum) {
+    struct da_file *f;
+    if (da_files == NULL) {
+        return;
+    }
+    commit_frees();
+    if (inum != 0) {
+        if ((f = da_file(inum)) != NULL) {
+            da_writeback(f);
+        }
+    } else {
+        while (da_files != NULL) {
+            da_writeback(da_files);
+        }
+    }
+}
+
+/* before an operation that allocates up to 'n' blocks: if there is
+ * less free than that besides the space held for buffered data, free
+ * what is left of the reservation windows, and then write the buffered
+ * data back
+ */
+static void da_room(int64_t n) {
+    if (!free_at_least(da_held() + n)) {
+        win_close_all(0);
+        commit_frees();
+        if (!free_at_least(da_held() + n)) {
+            da_sync(0);
+        }
+    }
+}
+
+/* at the end of an operation: write everything back once the oldest
+ * buffered data is DA_SECS old
+ */
+static void da_age(void) {
+    if (da_files != NULL && time(NULL) - da_t0 >= DA_SECS) {
+        da_sync(0);
+    }
+}
+
+/* buffer block 'lblk' of a file, which has none on disk yet, as zeros;
+ * first writing everything back if the buffer is full or the space
+ * for it is taken. NULL if there's no room even then, if that gave the
+ * file a block there after all, or if delayed allocation is off.
+ */
+static struct da_blk *da_add(int inum, int64_t lblk) {
+    struct da_file *f = da_file(inum);
+    if (fs_delalloc_kb == 0) {
+        return NULL;
+    }
+    if (!free_at_least(da_held_for(da_n + 1, da_nfiles + (f == NULL)) +
+                       wb_held())) {
+        win_close_all(inum);
+        commit_frees();
+    }
+    if ((da_n + 1) * fs_block_size > fs_delalloc_kb * 1024LL ||
+        !free_at_least(da_held_for(da_n + 1, da_nfiles + (f == NULL)) +
+                       wb_held())) {
+        da_sync(0);
+        // the write-back may have given the file a window over 'lblk'
+        if (!free_at_least(da_held_for(1, 1) + wb_held()) ||
+            fs_bmap(inum, lblk, 0) != 0) {
+            return NULL;
+        }
+        f = NULL;
+    }
+    if (f == NULL) {
+        unsigned h = da_hash(inum, 0);
+        f = calloc(1, sizeof(*f));
+        f->inum = inum;
+        f->size = FS5600_SIZE(INODE(inum));
+        f->hnext = da_fhash[h], da_fhash[h] = f;
+        f->next = da_files, da_files = f;
+        if (da_nfiles++ == 0) {
+            da_t0 = time(NULL);
+        }
+    }
+    struct da_blk *b = calloc(1, sizeof(*b) + fs_block_size);
+    unsigned h = da_hash(inum, lblk);
+    b->inum = inum;
+    b->lblk = lblk;
+    b->hnext = da_bhash[h], da_bhash[h] = b;
+    b->next = f->blks, f->blks = b;
+    f->n++;
+    da_n++;
+    return b;
+}
+
+/* Preallocation: a file can be given blocks past its end, which are
+ * not part of its data until writes (or fallocate) move the end over
+ * them, so they need no zeroing. Writes into them go in place.
+ *
+ * Reservation windows: a file appended to across allocations - a
+ * direct one, or a write-back after an earlier one - is given the free
+ * blocks right after its last one, as many as it has (from 8 up to
+ * fs_window_kb KB), so that its next appends land next to the last
+ * ones whatever is written meanwhile. Once they are used up the next
+ * allocation opens a new window next to them. What is left of a window
+ * is freed at close (flush), at unmount, when another file needs the
+ * slot, or when space runs short. After a crash the blocks just stay
+ * past the end of the file.
+ */
+int fs_window_kb = 256;         /* 0 = no windows */
+#define N_WINDOWS 16
+
+static struct window {
+    int      inum;              /* 0 = empty */
+    uint64_t used;              /* for LRU replacement */
+} windows[N_WINDOWS];
+static uint64_t window_clock;
+
+/* give a file blocks for 'lblk' to 'lblk'+'n'-1, which it doesn't
+ * have, in runs as long as possible starting at block 'goal' (if 0,
+ * next to its block 'lblk'-1), zeroed if 'zero' is set. The caller has
+ * checked there is room. Returns the number given, which is less than
+ * 'n' if space ran out after all.
+ */
+static int64_t prealloc(int inum, int64_t lblk, int64_t n, int64_t goal,
+                        int zero) {
+    uint32_t *phys = malloc(n * sizeof(*phys));
+    int64_t i, k, done, blknum;
+    char *zeros = NULL;
+
+    if (goal == 0 && lblk > 0 && (goal = fs_bmap(inum, lblk - 1, 0)) > 0) {
+        goal++;
+    }
+    da_busy = 1;
+    for (done = 0; done < n; done += k) {
+        k = n - done;
+        if ((blknum = da_find_run(goal, &k)) < 0) {
+            break;
+        }
+        for (i = 0; i < k; i++) {
+            bmap_set(blknum + i);
+            phys[done+i] = blknum + i;
+        }
+        for (i = 0; zero && i < k; i += 64) {
+            if (zeros == NULL) {
+                zeros = calloc(64, fs_block_size);
+            }
+            blk_write(blknum + i, k - i < 64 ? k - i : 64, zeros);
+        }
+        goal = blknum + k;
+    }
+    update_bitmap();
+    blk_barrier();
+    for (i = 0; i < done; i++) {
+        if (set_ptr(inum, lblk + i, phys[i], i + 1 < done) < 0) {
+            break;
+        }
+    }
+    for (k = i; k < done; k++) {
+        bmap_clear(phys[k]);
+    }
+    update_bitmap();
+    da_busy = 0;
+    free(zeros);
+    free(phys);
+    return i;
+}
+
+/* clear the pointers to file blocks 'lblk' on in a tree 'levels'
+ * levels deep (see truncate_tree; 0 = a data block) under '*slot',
+ * which starts at file block 'base', freeing the blocks, and indirect
+ * blocks left with nothing in them. Returns 1 if anything changed.
+ */
+static int trim_tree(uint32_t *slot, int levels, int64_t base, int64_t lblk) {
+    int64_t span = 1;
+    int i, changed = 0;
+
+    for (i = 0; i < levels; i++) {
+        span *= ptrs_per_blk;
+    }
+    if (*slot == 0 || base + span <= lblk) {
+        return 0;
+    }
+    if (base >= lblk) {
+        if (levels > 0) {
+            truncate_tree(*slot, levels);
+        } else {
+            put_block(*slot);
+        }
+        *slot = 0;
+        return 1;
+    }
+    uint32_t *ptrs = malloc(fs_block_size);
+    blk_read(*slot, 1, ptrs);
+    span /= ptrs_per_blk;
+    for (i = 0; i < ptrs_per_blk; i++) {
+        changed |= trim_tree(&ptrs[i], levels - 1, base + i * span, lblk);
+    }
+    if (changed) {
+        meta_write(*slot, 1, ptrs);
+    }
+    free(ptrs);
+    return changed;
+}
+
+/* free the blocks a file has past its end (counting buffered data) -
+ * the pointers first, then the bitmap
+ */
+static void free_past_end(int inum) {
+    struct fs5600_inode *inode = INODE(inum);
+    struct da_file *f = da_file(inum);
+    int64_t size = FS5600_SIZE(inode), lblk, p = ptrs_per_blk;
+    int i, changed = 0;
+
+    if (f != NULL && f->size > size) {
+        size = f->size;
+    }
+    lblk = (size + fs_block_size - 1) >> blk_shift;
+    for (i = 0; i < N_DIRECT; i++) {
+        changed |= trim_tree(&inode->direct[i], 0, i, lblk);
+    }
+    changed |= trim_tree(&inode->indir_1, 1, N_DIRECT, lblk);
+    changed |= trim_tree(&inode->indir_2, 2, N_DIRECT + p, lblk);
+    changed |= trim_tree(&inode->indir_3, 3, N_DIRECT + p + p * p, lblk);
+    if (!changed) {
+        return;
+    }
+    indir_cache_clear();
+    update_inode(inum);
+    blk_barrier();
+    update_bitmap();
+    discard_freed();
+}
+
+static struct window *win_find(int inum) {
+    int i;
+    for (i = 0; i < N_WINDOWS; i++) {
+        if (windows[i].inum == inum) {
+            return &windows[i];
+        }
+    }
+    return NULL;
+}
+
+/* free what is left of a window */
+static void win_close(struct window *w) {
+    int inum = w->inum;
+    w->inum = 0;
+    free_past_end(inum);
+}
+
+/* close every window but the file 'except's */
+static void win_close_all(int except) {
+    int i;
+    for (i = 0; i < N_WINDOWS; i++) {
+        if (windows[i].inum != 0 && windows[i].inum != except) {
+            win_close(&windows[i]);
+        }
     }
-    if (tmp_offset + len > size) {
-        len = size - tmp_offset;
+}
+
+/* forget a file's window, leaving its blocks to the file */
+static void win_drop(int inum) {
+    struct window *w = win_find(inum);
+    if (w != NULL) {
+        w->inum = 0;
+    }
+}
+
+static void win_reset(void) {
+    memset(windows, 0, sizeof(windows));
+}
+
+/* a file has just been given block 'lblk'-1, at its end: reserve the
+ * free blocks after that one for it - or after the indirect blocks
+ * that a write-back puts just past the data
+ */
+static void win_open(int inum, int64_t lblk) {
+    int64_t want = lblk, max = (int64_t)fs_window_kb * 1024 >> blk_shift;
+    int64_t goal, n;
+    struct window *w = win_find(inum);
+    int i;
+
+    if (fs_window_kb == 0 || dedup_tab != NULL || da_file(inum) != NULL ||
+        (goal = fs_bmap(inum, lblk - 1, 0)) <= 0 ||
+        fs_bmap(inum, lblk, 0) != 0) {
+        return;
+    }
+    want = want < 8 ? 8 : (want > max ? max : want);
+    if (!free_at_least(da_held() + 2 * want)) {
+        return;
+    }
+    for (i = 0, goal++; i < 8 && !run_is_free(goal, 1); i++, goal++)
+        ;
+    for (n = 0; n < want && run_is_free(goal + n, 1); n++)
+        ;
+    if (n == 0) {
+        return;
+    }
+    if (w == NULL) {
+        for (w = &windows[0], i = 1; i < N_WINDOWS && w->inum != 0; i++) {
+            if (windows[i].inum == 0 || windows[i].used < w->used) {
+                w = &windows[i];
+            }
+        }
+        if (w->inum != 0) {
+            win_close(w);
+            commit_frees();
+        }
+        w->inum = inum;
+    }
+    w->used = ++window_clock;
+    prealloc(inum, lblk, n, goal, 0);
+}
+
+/*
+ * given block number, offset, length and return buffer, load corresponding data into buffer
+ *
+ */
+static int fs_read_block(int64_t blknum, int offset, int len, char *buf);
+static int read_data(int inum, char *buf, size_t len, off_t offset);
+
+/* read - read data from an open file.
+ * should return exactly the number of bytes requested, except:
+ *   - if offset >= file len, return 0
+ *   - if offset+len > file len, return bytes from offset to EOF
+ *   - on error, return <0
+ * Errors - path resolution, ENOENT, EISDIR
+ */
+static int fs_read(const char *path, char *buf, size_t len, off_t offset,
+                   struct fuse_file_info *fi)
+{
+    /*first get the inode
+    check it is valid
+    check it is file*/
+
+    int inum = translate(path);
+    if (inum == -ENOENT || inum == -ENOTDIR) {
+        return inum;
+    }
+    const struct fs5600_inode *inode = INODE(inum);
+    if(!S_ISREG(inode->mode)) {
+        return -EISDIR;
+    }
+    int64_t size = file_size(inum);
+    if (offset >= size) {
+        return 0;
+    }
+    if (offset + len > size) {
+        len = size - offset;
+    }
+
+    // what is stored, then what the write-behind buffer holds over it
+    struct da_file *f = da_file(inum);
+    int64_t stored = f ? f->size : FS5600_SIZE(inode);
+    size_t n = offset >= stored ? 0 :
+        offset + len > stored ? stored - offset : len;
+    int val = n > 0 ? read_data(inum, buf, n, offset) : 0;
+    if (val < 0) {
+        return val;
+    }
+    memset(buf + n, 0, len - n);
+    wb_read(inum, buf, len, offset);
+    return len;
+}
+
+/* read data from a file's blocks, or the data buffered for blocks it
+ * doesn't have yet (see da_add), or its inode; the offset and length
+ * are within what is stored
+ */
+static int read_data(int inum, char *buf, size_t len, off_t offset)
+{
+    const struct fs5600_inode *inode = INODE(inum);
+    if (inode->flags & FS5600_INODE_INLINE) {
+        memcpy(buf, FS5600_INLINE_DATA(inode) + offset, len);
+        return len;
+    }
+    if (inode->flags & FS5600_INODE_COMPRESSED) {
+        return read_compressed(inum, buf, len, offset);
+    }
+
+    int buffered = da_file(inum) != NULL;
+    size_t done = 0;
+    while (done < len) {
+        int in_blk_offset = (offset + done) & (fs_block_size - 1);
+        int in_blk_len = fs_block_size - in_blk_offset;
+        if (in_blk_len > len - done) {
+            in_blk_len = len - done;
+        }
+        int64_t lblk = (offset + done) >> blk_shift, blknum;
+        struct da_blk *b = buffered ? da_blk(inum, lblk) : NULL;
+        if (b != NULL) {
+            memcpy(buf + done, b->data + in_blk_offset, in_blk_len);
+        } else if ((blknum = fs_bmap(inum, lblk, 0)) > 0) {
+            fs_read_block(blknum, in_blk_offset, in_blk_len, buf + done);
+        } else {
+            memset(buf + done, 0, in_blk_len);   /* hole */
+        }
+        done += in_blk_len;
+    }
+    return done;
+}
+
+static int fs_read_block(int64_t blknum, int offset, int len, char *buf) {
+    assert(blknum > 0);
+    char *blk = (char*) malloc(fs_block_size);
+
+
+    blk_read(blknum, 1, blk);
+    char *blk_ptr = blk;
+    blk_ptr += offset;
+    memcpy(buf, blk_ptr, len);
+    free(blk);
+    return 0;
+}
+
+/* write data to a file's blocks, allocating them as needed, or into
+ * memory for blocks that don't exist yet (see da_add); the offset and
+ * length have been checked against the file size
+ */
+static int write_blocks(int inum, const char *buf, size_t len, off_t offset)
+{
+    struct fs5600_inode *inode = INODE(inum);
+    int64_t size = FS5600_SIZE(inode);
+    char *blk = (char*) malloc(fs_block_size);
+    size_t done = 0;
+    int64_t blknum = 0;
+    struct da_file *f;
+    while (done < len) {
+        int in_blk_offset = (offset + done) & (fs_block_size - 1);
+        int in_blk_len = fs_block_size - in_blk_offset;
+        if (in_blk_len > len - done) {
+            in_blk_len = len - done;
+        }
+        int64_t lblk = (offset + done) >> blk_shift;
+        blknum = fs_bmap(inum, lblk, 0);
+        if (blknum == 0 && dedup_tab == NULL) {
+            struct da_blk *b = da_blk(inum, lblk);
+            if (b == NULL && offset + done > size && da_file(inum) == NULL) {
+                // cover what went into the window first: making room
+                // in da_add can close it
+                blk_barrier();
+                size = offset + done;
+                inode->size = (uint32_t)size;
+                inode->size_hi = size >> 32;
+                update_inode(inum);
+            }
+            if (b != NULL || (b = da_add(inum, lblk)) != NULL) {
+                memcpy(b->data + in_blk_offset, buf + done, in_blk_len);
+                done += in_blk_len;
+                f = da_file(inum);
+                if (offset + done > f->size) {
+                    f->size = offset + done;
+                }
+                continue;
+            }
+            if ((blknum = fs_bmap(inum, lblk, 1)) > 0 && offset > 0) {
+                win_open(inum, lblk + 1);
+            }
+        }
+        if (blknum < 0) {
+            break;
+        }
+        // whole blocks that follow each other on disk go out in one
+        // write, straight from 'buf'
+        if (dedup_tab == NULL && in_blk_offset == 0) {
+            int n = 1;
+            while ((n + 1) * (size_t)fs_block_size <= len - done &&
+                   fs_bmap(inum, lblk + n, 0) == blknum + n) {
+                n++;
+            }
+            if (n > 1) {
+                blk_write(blknum, n, (char *)buf + done);
+                done += n * fs_block_size;
+                continue;
+            }
+        }
+        // whole blocks are simply overwritten, partial ones merged -
+        // except past the end, where a block may be preallocated but
+        // never written
+        if (in_blk_len < fs_block_size) {
+            if (blknum > 0 && lblk << blk_shift < size) {
+                blk_read(blknum, 1, blk);
+            } else {
+                memset(blk, 0, fs_block_size);
+            }
+        }
+        memcpy(blk + in_blk_offset, buf + done, in_blk_len);
+        if (dedup_tab) {
+            if ((blknum = dedup_write(inum, lblk, blknum, blk)) < 0) {
+                break;
+            }
+        } else {
+            blk_write(blknum, 1, blk);
+        }
+        done += in_blk_len;
     }
-    int tmp_len = len;
-    if (tmp_offset < file_in_inode_sz) {
-        int read_len = fs_read_1st_level(inode, tmp_offset, tmp_len, buf);
-        tmp_offset += read_len;
-        tmp_len -= read_len;
-        buf += read_len;
+    free(blk);
+
+    /* update inode size, after the data it covers */
+    if ((f = da_file(inum)) != NULL) {
+        /* set at write-back */
+    } else if (offset + done > size) {
+        blk_barrier();
+        size = offset + done;
+        inode->size = (uint32_t)size;
+        inode->size_hi = size >> 32;
+        update_inode(inum);
     }
-    if (tmp_offset >= file_in_inode_sz &&
-        tmp_offset < file_in_inode_sz + file_1st_level_sz) {
-        int read_len = fs_read_2nd_level(inode->indir_1, tmp_offset, tmp_len, buf);
-        tmp_offset += read_len;
-        tmp_len -= read_len;
-        buf += read_len;
+    free_retired();
+    if (done == 0 && blknum < 0) {
+        return blknum;
     }
-    if (tmp_offset >= file_in_inode_sz + file_1st_level_sz &&
-        tmp_offset <= file_in_inode_sz + file_1st_level_sz + file_2nd_level_sz) {
-        int read_len = fs_read_3rd_level(inode->indir_2, tmp_offset, tmp_len, buf);
-        tmp_offset += read_len;
-        tmp_len -= read_len;
-        buf += read_len;
+    return done;
+}
+
+/* move the data of an inline file (FS5600_INODE_INLINE) out to blocks,
+ * once it no longer fits in the inode
+ */
+static int uninline(int inum)
+{
+    struct fs5600_inode *inode = INODE(inum);
+    int size = FS5600_SIZE(inode), val = 0;
+    char *data = malloc(inline_max);
+
+    memcpy(data, FS5600_INLINE_DATA(inode), size);
+    memset(FS5600_INLINE_DATA(inode), 0, inline_max);
+    inode->flags &= ~FS5600_INODE_INLINE;
+    inode->size = 0;
+    if (size > 0 && !(inode->flags & FS5600_INODE_COMPRESSED)) {
+        update_inode(inum);     /* the data may wait in memory */
+    }
+    if (size > 0) {
+        val = (inode->flags & FS5600_INODE_COMPRESSED) ?
+            write_compressed(inum, data, size, 0) :
+            write_blocks(inum, data, size, 0);
+    } else {
+        update_inode(inum);
     }
-    return tmp_offset - offset;
+    free(data);
+    return val < size ? (val < 0 ? val : -ENOSPC) : 0;
 }
-/*
-*
-*/
-static int fs_read_1st_level(const struct fs5600_inode *inode, off_t offset, size_t len, char *buf) {
-    int read_length = 0;
-    int block_direct = offset / BLOCK_SIZE;
-    int temp_len = len;
-    int in_blk_len;
-    int in_blk_offset = offset % BLOCK_SIZE;
-    for (; block_direct < N_DIRECT && temp_len > 0; in_blk_offset = 0, block_direct++) {
-        if (temp_len + in_blk_offset > BLOCK_SIZE) {
-            in_blk_len = BLOCK_SIZE - in_blk_offset;
-            temp_len -= in_blk_len;
-        } else {
-            in_blk_len = temp_len;
-            temp_len = 0;
+
+/* write data to a file of any kind; the offset and length have been
+ * checked against the file size
+ */
+static int write_data(int inum, const char *buf, size_t len, off_t offset)
+{
+    struct fs5600_inode *inode = INODE(inum);
+    if (inode->flags & FS5600_INODE_INLINE) {
+        if (offset + len <= inline_max) {
+            memcpy(FS5600_INLINE_DATA(inode) + offset, buf, len);
+            if (offset + len > FS5600_SIZE(inode)) {
+                inode->size = offset + len;
+            }
+            update_inode(inum);
+            return len;
         }
-        if (inode->direct[block_direct] == 0) {
-            break;
+        int val = uninline(inum);
+        if (val < 0) {
+            return val;
         }
-        fs_read_block(inode->direct[block_direct], in_blk_offset, in_blk_len, buf);
-        buf += in_blk_len;
-        read_length += in_blk_len;
     }
-    return read_length;
+    if (inode->flags & FS5600_INODE_COMPRESSED) {
+        return write_compressed(inum, buf, len, offset);
+    }
+    return write_blocks(inum, buf, len, offset);
 }
 
-static int fs_read_2nd_level(size_t root_blk, int offset, int len, char *buf){
-    int read_length = 0;
-    int h1t_offset = offset - file_in_inode_sz; // height 1 tree offset
-    int block_direct = h1t_offset / BLOCK_SIZE;
-    int temp_len = len;
-    int in_blk_len;
-    int in_blk_offset = h1t_offset % BLOCK_SIZE;
-    int h1t_blk[256];
-    disk->ops->read(disk, root_blk, 1, h1t_blk);
-
-    for (; block_direct < 256 && temp_len > 0; in_blk_offset = 0, block_direct++) {
-        if (temp_len + in_blk_offset > BLOCK_SIZE) {
-            in_blk_len = BLOCK_SIZE - in_blk_offset;
-            temp_len -= in_blk_len;
-        } else {
-            in_blk_len = temp_len;
-            temp_len = 0;
-        }
-        if (h1t_blk[block_direct] == 0) {
-            break;
+/* Write-behind: small writes that follow each other in a file are
+ * gathered in a buffer of fs_wbuf_kb KB for the file, so that an
+ * application writing 1000 bytes at a time (like 'put') costs one
+ * write of whole blocks per buffer, and one size update, rather than
+ * a read-modify-write of two blocks each time. A full buffer writes
+ * out its whole blocks and keeps the partial one at the end.
+ *
+ * The buffer is written out in full when a write to the file doesn't
+ * follow on, at close (flush), fsync and unmount, when another file
+ * needs the slot, and once it is DA_SECS old; the file's size counts
+ * it until then, and reads are served from it. Truncating or deleting
+ * the file drops it.
+ *
+ * Like delayed allocation, a buffer holds back the space its data will
+ * need (see wb_held), so that writing it out later can't fail for lack
+ * of space after the write was acknowledged; a write there isn't room
+ * to hold space for is done straight away instead.
+ */
+int fs_wbuf_kb = 64;            /* 0 = no write-behind */
+#define N_WBUFS 8
+
+static struct wbuf {
+    int      inum;              /* 0 = empty */
+    int64_t  off;               /* file offset of data[0] */
+    size_t   len;
+    time_t   t0;                /* when the data started collecting */
+    uint64_t used;              /* for LRU replacement */
+    int      flushing;          /* being written out, with its space */
+    char    *data;              /* fs_wbuf_kb KB */
+} wbufs[N_WBUFS];
+static uint64_t wbuf_clock;
+
+static struct wbuf *wb_find(int inum) {
+    int i;
+    for (i = 0; i < N_WBUFS; i++) {
+        if (wbufs[i].inum == inum) {
+            return &wbufs[i];
         }
-        fs_read_block(h1t_blk[block_direct], in_blk_offset, in_blk_len, buf);
-        buf += in_blk_len;
-        read_length += in_blk_len;
     }
-    return read_length;
+    return NULL;
 }
 
-static int fs_read_3rd_level(size_t root_blk, int offset, int len, char *buf){
-    int read_length = 0;
-    int h2t_offset = offset - file_1st_level_sz - file_in_inode_sz;// height 2 tree offset
-    int block_direct = h2t_offset / file_1st_level_sz;
-    int temp_len = len;
-    int in_blk_len;
-    int in_blk_offset = h2t_offset % file_1st_level_sz;
+/* the end of a file's buffered data, or 0 */
+static int64_t wb_end(int inum) {
+    struct wbuf *w = wb_find(inum);
+    return w ? w->off + w->len : 0;
+}
 
+/* blocks held back for the buffered data, counted as for delayed
+ * allocation: every block a buffer touches, whether the file has it
+ * yet or not. A buffer being written out uses its share.
+ */
+static int64_t wb_held(void) {
+    int64_t n = 0;
+    int i, files = 0;
+    for (i = 0; i < N_WBUFS; i++) {
+        struct wbuf *w = &wbufs[i];
+        if (w->inum != 0 && w->len > 0 && !w->flushing) {
+            n += ((w->off + w->len - 1) >> blk_shift) - (w->off >> blk_shift) + 1;
+            files++;
+        }
+    }
+    return files ? da_held_for(n, files) : 0;
+}
 
-    int h2t_blk[256];
-    disk->ops->read(disk, root_blk, 1, h2t_blk);
+/* copy what a file's buffer holds of offset..offset+len-1 into 'buf' */
+static void wb_read(int inum, char *buf, size_t len, off_t offset) {
+    struct wbuf *w = wb_find(inum);
+    if (w == NULL || w->off >= offset + (off_t)len ||
+        w->off + (off_t)w->len <= offset) {
+        return;
+    }
+    int64_t lo = w->off > offset ? w->off : offset;
+    int64_t hi = w->off + w->len < offset + len ? w->off + w->len : offset + len;
+    memcpy(buf + (lo - offset), w->data + (lo - w->off), hi - lo);
+}
 
-    for (; block_direct < 256 && temp_len > 0; in_blk_offset = 0, block_direct++) {
-        if (temp_len + in_blk_offset > file_1st_level_sz) {
-            in_blk_len = file_1st_level_sz - in_blk_offset;
-            temp_len -= in_blk_len;
-        } else {
-            in_blk_len = temp_len;
-            temp_len = 0;
+/* write out a buffer's data - only its whole blocks, if 'whole' is
+ * set - and empty the slot if nothing is left.
+ * Errors - ENOSPC, EFBIG
+ */
+static int wb_flush(struct wbuf *w, int whole) {
+    int64_t n = w->len;
+    int val = 0;
+    if (whole &&
+        (n = ((w->off + w->len) & ~(int64_t)(fs_block_size - 1)) - w->off) <= 0) {
+        n = w->len;
+    }
+    if (n > 0) {
+        commit_frees();
+        w->flushing = 1;
+        val = write_data(w->inum, w->data, n, w->off);
+        w->flushing = 0;
+        if (val >= 0 && val < n) {
+            val = -ENOSPC;
         }
-        fs_read_2nd_level(h2t_blk[block_direct], in_blk_offset + file_in_inode_sz, in_blk_len, buf);
-        buf += in_blk_len;
-        read_length += in_blk_len;
+        memmove(w->data, w->data + n, w->len - n);
+        w->off += n;
+        w->len -= n;
+        w->t0 = time(NULL);
+    }
+    if (w->len == 0 || val < 0) {
+        w->inum = 0;
     }
-    return read_length;
+    return val < 0 ? val : 0;
 }
 
-static int fs_read_block(int blknum, int offset, int len, char *buf) {
-    assert(blknum > 0);
-    char *blk = (char*) malloc(BLOCK_SIZE);
+/* write out a file's buffer, if it has one */
+static int wb_sync(int inum) {
+    struct wbuf *w = wb_find(inum);
+    return w ? wb_flush(w, 0) : 0;
+}
 
+static void wb_sync_all(void) {
+    int i;
+    for (i = 0; i < N_WBUFS; i++) {
+        if (wbufs[i].inum != 0 && wb_flush(&wbufs[i], 0) < 0) {
+            fprintf(stderr, "inode %d: buffered data lost\n", wbufs[i].inum);
+        }
+    }
+}
 
-    disk->ops->read(disk, blknum, 1, blk);
-    char *blk_ptr = blk;
-    blk_ptr += offset;
-    memcpy(buf, blk_ptr, len);
-    free(blk);
-    return 0;
+/* at the end of an operation: write out buffers DA_SECS old */
+static void wb_age(void) {
+    int i;
+    time_t now = time(NULL);
+    for (i = 0; i < N_WBUFS; i++) {
+        if (wbufs[i].inum != 0 && now - wbufs[i].t0 >= DA_SECS &&
+            wb_flush(&wbufs[i], 0) < 0) {
+            fprintf(stderr, "inode %d: buffered data lost\n", wbufs[i].inum);
+        }
+    }
 }
-static int fs_write_1st_level(int inode, off_t offset, size_t len, const char *buf);
-static int fs_write_2nd_level(size_t root_blk, int offset, int len, const char *buf);
-static int fs_write_3rd_level(size_t root_blk, int offset, int len, const char *buf);
 
+static void wb_drop(int inum) {
+    struct wbuf *w = wb_find(inum);
+    if (w != NULL) {
+        w->inum = 0;
+    }
+}
+
+static void wb_reset(void) {
+    int i;
+    for (i = 0; i < N_WBUFS; i++) {
+        wbufs[i].inum = 0;
+        free(wbufs[i].data);
+        wbufs[i].data = NULL;
+    }
+}
 
+/* buffer a write to a file, which follows on from its buffer if it
+ * has one, in a slot taken from the least recently used file if need
+ * be. Returns the length or an error from writing out a buffer - or,
+ * with no room to hold space for it, from writing it out straight
+ * away.
+ */
+static int wb_write(int inum, const char *buf, size_t len, off_t offset) {
+    size_t max = fs_wbuf_kb * 1024, done = 0;
+    struct wbuf *w = wb_find(inum);
+    int64_t need = da_held_for(((offset + (int64_t)len - 1) >> blk_shift) -
+                               (offset >> blk_shift) + 1, 1);
+    int i, val;
+
+    if (!free_at_least(da_held() + need)) {
+        da_room(need);
+        if (!free_at_least(da_held() + need)) {
+            if ((val = wb_sync(inum)) < 0) {
+                return val;
+            }
+            return write_data(inum, buf, len, offset);
+        }
+    }
+    if (w == NULL) {
+        for (w = &wbufs[0], i = 1; i < N_WBUFS && w->inum != 0; i++) {
+            if (wbufs[i].inum == 0 || wbufs[i].used < w->used) {
+                w = &wbufs[i];
+            }
+        }
+        if (w->inum != 0 && (val = wb_flush(w, 0)) < 0) {
+            return val;
+        }
+        if (w->data == NULL) {
+            w->data = malloc(max);
+        }
+        w->inum = inum;
+        w->off = offset;
+        w->len = 0;
+        w->t0 = time(NULL);
+    }
+    w->used = ++wbuf_clock;
+    while (done < len) {
+        size_t n = len - done < max - w->len ? len - done : max - w->len;
+        memcpy(w->data + w->len, buf + done, n);
+        w->len += n;
+        done += n;
+        if (w->len == max && (val = wb_flush(w, 1)) < 0) {
+            return val;
+        }
+        if (w->inum == 0) {     /* flushed to nothing */
+            w->inum = inum;
+            w->off = offset + done;
+            w->len = 0;
+        }
+    }
+    return len;
+}
 
 /* write - write data to a file
  * It should return exactly the number of bytes requested, except on
@@ -1057,233 +3059,442 @@ static int fs_write_3rd_level(size_t root_blk, int offset, int len, const char *
  *  return EINVAL if 'offset' is greater than current file length.
  *  (POSIX semantics support the creation of files with "holes" in them,
  *   but we don't)
+ *  return EFBIG if 'offset' is at or past the largest file size.
  */
 static int fs_write(const char *path, const char *buf, size_t len,
                     off_t offset, struct fuse_file_info *fi)
 {
-    int inum;
-    if (!(inum = translate(path))) { // here checked path resolution
+    commit_frees();
+    da_room((len >> blk_shift) + 4);
+    int inum = translate(path);
+    if (inum < 0) { // here checked path resolution
         return inum;
     }
-    struct fs5600_inode *inode = &inode_region[inum];
-    if (offset > inode->size) {// check tmp_offset is no larger than file size
+    struct fs5600_inode *inode = INODE(inum);
+    if (S_ISDIR(inode->mode)) {
+        return -EISDIR;
+    }
+    int64_t size = file_size(inum);
+    if (offset > size) {// check offset is no larger than file size
         return -EINVAL;
     }
-
-    int tmp_offset = offset;
-    int tmp_len = len;
-
-    if (tmp_offset < file_in_inode_sz) {
-        int written_len = fs_write_1st_level(inum, tmp_offset, tmp_len, buf);
-        tmp_offset += written_len;
-        tmp_len -= written_len;
-        buf += written_len;
+    if (offset >= max_file_sz) {
+        return -EFBIG;
+    }
+    if (offset + len > max_file_sz) {
+        len = max_file_sz - offset;
+    }
+    // a write that doesn't follow on from the buffer pushes it out;
+    // big ones aren't buffered
+    if (wb_end(inum) != offset) {
+        int val = wb_sync(inum);
+        if (val < 0) {
+            return val;
+        }
+    }
+    if (fs_wbuf_kb > 0 && (len < fs_wbuf_kb * 1024 || wb_find(inum))) {
+        return wb_write(inum, buf, len, offset);
     }
-    if (tmp_offset >= file_in_inode_sz &&
-            tmp_offset < file_in_inode_sz + file_1st_level_sz) {
+    return write_data(inum, buf, len, offset);
+}
 
-        if (inode->indir_1 == 0) {// if indir_1 not set, set it
-            // find a free block
-            int blk_num = find_free_block_number();
-            if (blk_num < 0) {
-                return tmp_offset - offset;
+/* fallocate - give a file blocks up to 'offset'+'len' (files here
+ * have no holes, so only the part past its last block is new), in runs
+ * as long as possible next to that block. With FALLOC_FL_KEEP_SIZE they
+ * stay past the end of the file, unwritten, until writes reach them;
+ * without, they are zeroed, along with any the file already had past
+ * its end, and the file grows to cover them.
+ * Errors - ENOENT, ENOTDIR, EISDIR, EINVAL, EFBIG, ENOSPC, EOPNOTSUPP
+ * (other modes, and dedup images or compressed files, where blocks
+ * are only given to data)
+ */
+static int fs_fallocate(const char *path, int mode, off_t offset, off_t len,
+                        struct fuse_file_info *fi)
+{
+    commit_frees();
+    int inum = translate(path);
+    if (inum < 0) {
+        return inum;
+    }
+    struct fs5600_inode *inode = INODE(inum);
+    if (S_ISDIR(inode->mode)) {
+        return -EISDIR;
+    }
+    if ((mode & ~FALLOC_FL_KEEP_SIZE) != 0 || dedup_tab != NULL ||
+        (inode->flags & FS5600_INODE_COMPRESSED)) {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+    if (offset + len > max_file_sz) {
+        return -EFBIG;
+    }
+    int keep = mode & FALLOC_FL_KEEP_SIZE;
+    int64_t end = offset + len, size, lblk, last, n;
+    int val = wb_sync(inum);
+    if (val < 0) {
+        return val;
+    }
+    da_sync(inum);
+    if (inode->flags & FS5600_INODE_INLINE) {
+        if (end <= inline_max) {
+            if (!keep && end > FS5600_SIZE(inode)) {
+                inode->size = end;
+                update_inode(inum);
             }
-            /*change the inode*/
-            inode->indir_1 = blk_num;
-            update_inode(inum);
-            /*set the block bitmap*/
-            FD_SET(blk_num, block_map);
-            update_bitmap();
+            return 0;
         }
-        int written_len = fs_write_2nd_level(inode->indir_1, tmp_offset, tmp_len, buf);
-        tmp_offset += written_len;
-        tmp_len -= written_len;
-        buf += written_len;
-    }
-    if (tmp_offset >= file_in_inode_sz + file_1st_level_sz &&
-            tmp_offset <= file_in_inode_sz + file_1st_level_sz + file_2nd_level_sz) {
-        if (inode->indir_2 == 0) { // if indir_2 not set, set it
-            // find a free block
-            int blk_num = find_free_block_number();
-            if (blk_num < 0) {
-                return tmp_offset - offset;
-            }
-            /*change the inode*/
-            inode->indir_2 = blk_num;
-            update_inode(inum);
-            /*set the block bitmap*/
-            FD_SET(blk_num, block_map);
-            update_bitmap();
+        if ((val = uninline(inum)) < 0) {
+            return val;
+        }
+        da_sync(inum);
+    }
+    struct window *w = win_find(inum);
+    if (w != NULL) {
+        win_close(w);
+    }
+    commit_frees();
+
+    // blocks already past the end were never written
+    char *zeros = calloc(1, fs_block_size);
+    size = FS5600_SIZE(inode);
+    last = (end + fs_block_size - 1) >> blk_shift;
+    for (lblk = (size + fs_block_size - 1) >> blk_shift; lblk < last; lblk++) {
+        int64_t blknum = fs_bmap(inum, lblk, 0);
+        if (blknum <= 0) {
+            break;
+        }
+        if (!keep) {
+            blk_write(blknum, 1, zeros);
+        }
+    }
+    free(zeros);
+    if ((n = last - lblk) > 0) {
+        da_room(da_held_for(n, 1));
+        if (!free_at_least(da_held() + da_held_for(n, 1))) {
+            return -ENOSPC;
+        }
+        if (prealloc(inum, lblk, n, 0, !keep) < n) {
+            return -ENOSPC;
         }
-        int written_len = fs_write_3rd_level(inode->indir_2, tmp_offset, tmp_len, buf);
-        tmp_offset += written_len;
-        tmp_len -= written_len;
-        buf += written_len;
     }
-    /* update inode size */
-    if (tmp_offset > inode->size) {
-        inode->size = tmp_offset;
+    if (!keep && end > size) {
+        blk_barrier();
+        inode->size = (uint32_t)end;
+        inode->size_hi = end >> 32;
         update_inode(inum);
     }
-    // printf("written length: %d\n", (int)(tmp_offset - offset));
-    return tmp_offset - offset;
+    return 0;
 }
 
-static int fs_write_1st_level(int inum, off_t offset, size_t len, const char *buf) {
-    int written_length = 0;
-    struct fs5600_inode *inode = &inode_region[inum];
-    int block_direct = offset / BLOCK_SIZE;
-    int temp_len = len;
-    int in_blk_len;
-    int in_blk_offset = offset % BLOCK_SIZE;
-
-    for (; block_direct < N_DIRECT && temp_len > 0; in_blk_offset = 0, block_direct++) {
-        if (temp_len + in_blk_offset > BLOCK_SIZE) {
-            in_blk_len = BLOCK_SIZE - in_blk_offset;
-            temp_len -= in_blk_len;
-        } else {
-            in_blk_len = temp_len;
-            temp_len = 0;
-        }
-        // if there is already allocated
-        if (inode->direct[block_direct] == 0) {
-            // find a free block
-            int blk_num = find_free_block_number();
-            if (blk_num < 0) {
-                return written_length;
-            }
-
-            // change the inode
-            inode->direct[block_direct] = blk_num;
-            update_inode(inum);
-
-            // set the block bitmap
-            FD_SET(blk_num, block_map);
-            update_bitmap();
+/* Copying within the image (copy_file_range). Whole blocks of a file
+ * go over a run at a time, read and written in one transfer of up to
+ * COPY_KB without passing through the caller; or, with dedup - which
+ * is the reflink mode: blocks have reference counts, and a write to a
+ * shared one goes to a new block (see dedup_write) - they just get
+ * another reference, so that a copy of any size writes only pointers.
+ * Partial blocks, and files whose blocks don't line up, go through
+ * fs_read and fs_write.
+ */
+#define COPY_KB 1024
+
+static int64_t copy_bytes(const char *path_in, off_t offset_in,
+                          const char *path_out, off_t offset_out,
+                          int64_t len) {
+    char *buf = malloc(COPY_KB * 1024);
+    int64_t done = 0;
+    int n = 0, val = 0;
+
+    while (done < len) {
+        n = len - done < COPY_KB * 1024 ? len - done : COPY_KB * 1024;
+        if ((n = fs_read(path_in, buf, n, offset_in + done, NULL)) <= 0 ||
+            (val = fs_write(path_out, buf, n, offset_out + done, NULL)) < 0) {
+            break;
+        }
+        done += val;
+        if (val < n) {
+            break;
         }
-        // write data to the found or given block
-        char *blk = (char*) malloc(BLOCK_SIZE);
-        disk->ops->read(disk, inode->direct[block_direct], 1, blk);
-        memcpy(blk + in_blk_offset, buf, in_blk_len);
-        disk->ops->write(disk, inode->direct[block_direct], 1, blk);
-        free(blk);
-        buf += in_blk_len;
-        written_length += in_blk_len;
     }
-
-    return written_length;
+    free(buf);
+    return done > 0 ? done : (n < 0 ? n : (val < 0 ? val : 0));
 }
 
-static int fs_write_2nd_level(size_t root_blk, int offset, int len, const char *buf){
-    int written_length = 0;
-    int h1t_offset = offset - file_in_inode_sz; // height 1 tree offset
-    int block_direct = h1t_offset / BLOCK_SIZE;
-    int temp_len = len;
-    int in_blk_len;
-    int in_blk_offset = h1t_offset % BLOCK_SIZE;
-
-
-    int h1t_blk[256];
-    disk->ops->read(disk, root_blk, 1, h1t_blk);
+/* copy 'n' blocks of file 'in' from 'lin' on to file 'out' from 'lout'
+ * on; neither has data buffered. Returns the number copied, fewer if a
+ * block of 'in' is missing.
+ * Errors - ENOSPC
+ */
+static int64_t copy_blocks(int in, int64_t lin, int out, int64_t lout,
+                           int64_t n) {
+    int64_t chunk = (int64_t)COPY_KB * 1024 >> blk_shift;
+    int64_t i, j, k, m, done;
+    uint32_t *src = malloc(chunk * sizeof(*src));
+    uint32_t *dst = malloc(chunk * sizeof(*dst));
+    char *buf = NULL;
+    int val = 0;
+
+    // without dedup 'out' needs blocks of its own, in as few runs as
+    // possible: past the ones it has (it has no holes)
+    for (m = 0; dedup_tab == NULL && m < n && fs_bmap(out, lout + m, 0) > 0;
+         m++)
+        ;
+    if (dedup_tab == NULL && m < n) {
+        da_room(da_held_for(n - m, 1));
+        for (m = 0; m < n && fs_bmap(out, lout + m, 0) > 0; m++)
+            ;
+        if (m < n && (!free_at_least(da_held() + da_held_for(n - m, 1)) ||
+                      prealloc(out, lout + m, n - m, 0, 0) < n - m)) {
+            val = -ENOSPC;
+            n = m;
+        }
+    }
+    if (dedup_tab == NULL) {
+        buf = malloc(chunk * fs_block_size);
+    }
 
-    for (; block_direct < 256 && temp_len > 0; in_blk_offset = 0, block_direct++) {
-        if (temp_len + in_blk_offset > BLOCK_SIZE) {
-            in_blk_len = BLOCK_SIZE - in_blk_offset;
-            temp_len -= in_blk_len;
-        } else {
-            in_blk_len = temp_len;
-            temp_len = 0;
-        }
-        if (h1t_blk[block_direct] == 0) { // if h1t_blk block direct is not used, allocate a block
-            /*find a free block*/
-            int blk_num = find_free_block_number();
-            if (blk_num < 0) {
-                return written_length;
+    for (done = 0; done < n; done += k) {
+        k = n - done < chunk ? n - done : chunk;
+        for (i = 0; i < k; i++) {
+            src[i] = fs_bmap(in, lin + done + i, 0);
+            dst[i] = fs_bmap(out, lout + done + i, 0);
+            if (src[i] == 0) {
+                k = i, n = done + i;
+            }
+        }
+        if (dedup_tab == NULL) {
+            for (i = 0; i < k; i = j) {
+                for (j = i + 1; j < k && src[j] == src[j-1] + 1 &&
+                         dst[j] == dst[j-1] + 1; j++)
+                    ;
+                blk_read(src[i], j - i, buf);
+                blk_write(dst[i], j - i, buf);
+            }
+            continue;
+        }
+        // the references are counted before the pointers are written
+        for (i = 0; i < k; i++) {
+            if (src[i] != dst[i]) {
+                dedup_set(src[i], dedup_tab[src[i]].refs + 1,
+                          dedup_tab[src[i]].fp);
+            }
+        }
+        update_bitmap();
+        for (i = 0; i < k; i++) {
+            if ((val = set_ptr(out, lout + done + i, src[i], i + 1 < k)) < 0) {
+                break;
+            }
+            if (dst[i] != 0 && dst[i] != src[i]) {
+                retire_block(dst[i]);
+            }
+        }
+        if (i < k) {
+            for (j = i; j < k; j++) {
+                if (src[j] != dst[j]) {
+                    dedup_set(src[j], dedup_tab[src[j]].refs - 1,
+                              dedup_tab[src[j]].fp);
+                }
             }
-            /*change the h1t block and write back*/
-            h1t_blk[block_direct] = blk_num;
-            disk->ops->write(disk, root_blk, 1, h1t_blk);
-            /*set the block bitmap*/
-            FD_SET(blk_num, block_map);
             update_bitmap();
+            done += i;
+            break;
         }
-        char *blk = (char*) malloc(BLOCK_SIZE);
-        disk->ops->read(disk, h1t_blk[block_direct], 1, blk);
-        memcpy(blk + in_blk_offset, buf, in_blk_len);
-
-        disk->ops->write(disk, h1t_blk[block_direct], 1, blk);
-        free(blk);
-        buf += in_blk_len;
-        written_length += in_blk_len;
     }
-
-    return written_length;
+    free_retired();
+    free(buf);
+    free(dst);
+    free(src);
+    return done > 0 || val >= 0 ? done : val;
 }
 
-static int fs_write_3rd_level(size_t root_blk, int offset, int len, const char *buf) {
-    int written_length = 0;
-    int h2t_offset = offset - file_in_inode_sz - file_1st_level_sz;// height 2 tree offset
-    int block_direct = h2t_offset / file_1st_level_sz;
-    int temp_len = len;
-    int in_blk_len;
-    int in_blk_offset = h2t_offset % file_1st_level_sz;
-
-    int h2t_blk[256];
-    disk->ops->read(disk, root_blk, 1, h2t_blk);
-
-    for (; block_direct < 256 && temp_len > 0; in_blk_offset = 0, block_direct++) {
-        if (temp_len + in_blk_offset > file_1st_level_sz) {
-            in_blk_len = file_1st_level_sz - in_blk_offset;
-            temp_len -= in_blk_len;
-        } else {
-            in_blk_len = temp_len;
-            temp_len = 0;
-        }
-        // if h2t_blk block direct is not used, allocate a block
-        if (h2t_blk[block_direct] == 0) {
-            // find a free block
-            int blk_num = find_free_block_number();
-            if (blk_num < 0) {
-                return written_length;
-            }
+/* copy_file_range - copy 'len' bytes at 'offset_in' in one file to
+ * 'offset_out' in another, or elsewhere in the same one, and return
+ * the number copied: fewer at the end of the source or if space runs
+ * out part way.
+ * Errors - path resolution, EISDIR, EINVAL (flags, overlapping ranges,
+ * or 'offset_out' past the end of the file), EFBIG, ENOSPC
+ */
+static int64_t copy_range(const char *path_in, off_t offset_in,
+                          const char *path_out, off_t offset_out,
+                          int64_t len, int flags)
+{
+    commit_frees();
+    int in = translate(path_in), out = translate(path_out);
+    if (in < 0) {
+        return in;
+    }
+    if (out < 0) {
+        return out;
+    }
+    struct fs5600_inode *ip = INODE(in), *op = INODE(out);
+    if (S_ISDIR(ip->mode) || S_ISDIR(op->mode)) {
+        return -EISDIR;
+    }
+    if (flags != 0 || offset_in < 0 || offset_out < 0 || len < 0) {
+        return -EINVAL;
+    }
+    int64_t size_in = file_size(in), head = len, done, n, val;
+    if (offset_in >= size_in) {
+        return 0;
+    }
+    if (len > size_in - offset_in) {
+        len = size_in - offset_in;
+    }
+    if (offset_out > file_size(out) ||
+        (in == out && offset_in < offset_out + len &&
+         offset_out < offset_in + len)) {
+        return -EINVAL;
+    }
+    if (offset_out >= max_file_sz) {
+        return -EFBIG;
+    }
+    if (offset_out + len > max_file_sz) {
+        len = max_file_sz - offset_out;
+    }
 
-            // change the h2t block and write back
-            h2t_blk[block_direct] = blk_num;
-            disk->ops->write(disk, root_blk, 1, h2t_blk);
+    // up to the first whole block, if the blocks line up
+    if (((offset_in ^ offset_out) & (fs_block_size - 1)) == 0 &&
+        !((ip->flags | op->flags) & FS5600_INODE_COMPRESSED) &&
+        !(ip->flags & FS5600_INODE_INLINE) &&
+        (!(op->flags & FS5600_INODE_INLINE) || offset_out + len > inline_max)) {
+        head = -offset_in & (fs_block_size - 1);
+        head = head < len ? head : len;
+    }
+    done = copy_bytes(path_in, offset_in, path_out, offset_out, head);
+    if (done < head) {
+        return done;
+    }
 
-            // set the block bitmap
-            FD_SET(blk_num, block_map);
-            update_bitmap();
+    if ((n = (len - done) >> blk_shift) > 0) {
+        if ((val = wb_sync(in)) < 0 || (val = wb_sync(out)) < 0) {
+            return done ? done : val;
         }
-        int written_length_next_level = fs_write_2nd_level(h2t_blk[block_direct], in_blk_offset + N_DIRECT * BLOCK_SIZE, in_blk_len, buf);
-        if(written_length_next_level == 0) {
-            break;
+        da_sync(in);
+        if ((op->flags & FS5600_INODE_INLINE) && (val = uninline(out)) < 0) {
+            return done ? done : val;
+        }
+        da_sync(out);
+        val = copy_blocks(in, (offset_in + done) >> blk_shift,
+                          out, (offset_out + done) >> blk_shift, n);
+        if (val < 0) {
+            return done ? done : val;
+        }
+        int64_t end = offset_out + done + (val << blk_shift);
+        if (end > FS5600_SIZE(op)) {
+            blk_barrier();
+            op->size = (uint32_t)end;
+            op->size_hi = end >> 32;
+            update_inode(out);
+        }
+        done += val << blk_shift;
+        if (val < n) {
+            return done;
         }
-        buf += written_length_next_level;
-        written_length += written_length_next_level;
     }
 
-    return written_length;
+    val = copy_bytes(path_in, offset_in + done, path_out, offset_out + done,
+                     len - done);
+    return val < 0 ? (done ? done : val) : done + val;
 }
 
 void update_bitmap() {
-    disk->ops->write(disk, 1, inode_map_sz, inode_map);
-    disk->ops->write(disk, 1 + inode_map_sz, block_map_sz, block_map);
+    if (imap_hi > imap_lo) {
+        meta_write(1 + imap_lo, imap_hi - imap_lo,
+                   (char *)inode_map + imap_lo * fs_block_size);
+        imap_lo = imap_hi = 0;
+    }
+    if (bmap_hi > bmap_lo) {
+        meta_write(1 + inode_map_sz + bmap_lo, bmap_hi - bmap_lo,
+                   (char *)block_map + bmap_lo * fs_block_size);
+        bmap_lo = bmap_hi = 0;
+    }
+    if (dedup_hi > dedup_lo) {
+        meta_write(dedup_start + dedup_lo, dedup_hi - dedup_lo,
+                   (char *)dedup_tab + dedup_lo * fs_block_size);
+        dedup_lo = dedup_hi = 0;
+    }
 }
 
 
-int find_free_block_number() {
+/* After an unclean shutdown blocks can be marked in use that no file
+ * points to - allocated by a write that stopped before the file was
+ * pointed at them, or freed by one that stopped before the bitmap was
+ * written - so the block bitmap, and the dedup reference counts, are
+ * rebuilt from the inodes. Returns the number of blocks reclaimed.
+ */
+static void scan_refs(uint32_t *refs, uint32_t blknum, int levels) {
     int i;
-    for (i = 0; i < block_map_sz * BLOCK_SIZE * 8 && i < num_of_blocks; i++) {
-        if (!FD_ISSET(i, block_map)) {
-            int *clear_blk = calloc(1, BLOCK_SIZE);
-            disk->ops->write(disk, i, 1, clear_blk);
-            free(clear_blk);
-            return i;
+    if (blknum < data_start || blknum >= num_of_blocks ||
+        refs[blknum]++ > 0 || levels == 0) {
+        return;
+    }
+    uint32_t *ptrs = malloc(fs_block_size);
+    blk_read(blknum, 1, ptrs);
+    for (i = 0; i < ptrs_per_blk; i++) {
+        if (ptrs[i] != 0) {
+            scan_refs(refs, ptrs[i], levels - 1);
         }
     }
+    free(ptrs);
+}
 
-    return -ENOSPC;
+static int64_t scan_blocks(int64_t n_inodes) {
+    uint32_t *refs = calloc(num_of_blocks, sizeof(uint32_t));
+    int64_t inum, b, n = 0;
+    int i;
+
+    for (inum = 1; inum < n_inodes; inum++) {
+        if (!FD_ISSET(inum, inode_map)) {
+            continue;
+        }
+        struct fs5600_inode *inode = INODE(inum);
+        for (i = 0; i < N_DIRECT; i++) {
+            if (inode->direct[i] != 0) {
+                scan_refs(refs, inode->direct[i], 0);
+            }
+        }
+        uint32_t roots[] = {inode->indir_1, inode->indir_2, inode->indir_3};
+        for (i = 0; i < 3; i++) {
+            if (roots[i] != 0) {
+                scan_refs(refs, roots[i], i + 1);
+            }
+        }
+        icache_put_all();
+    }
+    for (b = data_start; b < num_of_blocks; b++) {
+        if (dedup_tab && dedup_tab[b].refs > 0 &&
+            dedup_tab[b].refs != refs[b]) {
+            dedup_set(b, refs[b], dedup_tab[b].fp);
+        }
+        if (FD_ISSET(b, block_map) && refs[b] == 0) {
+            bmap_clear(b);
+            n++;
+        } else if (!FD_ISSET(b, block_map) && refs[b] > 0) {
+            bmap_set(b);
+        }
+    }
+    free(refs);
+    update_bitmap();
+    blk_flush();
+    return n;
+}
+
+int64_t find_free_block_number(int64_t goal) {
+    if (!da_busy && !free_at_least(da_held() + 1)) {
+        return -ENOSPC;         /* held for delayed allocation */
+    }
+    int64_t i = next_free_block(goal);
+    if (i < 0 && goal > 0) {
+        i = next_free_block(0);
+    }
+    if (i < 0) {
+        return -ENOSPC;
+    }
+    int *clear_blk = calloc(1, fs_block_size);
+    blk_write(i, 1, clear_blk);
+    free(clear_blk);
+    return i;
 }
 
 /* statfs - get file system statistics
@@ -1298,7 +3509,7 @@ static int fs_statfs(const char *path, struct statvfs *st)
      * You could calculate bfree dynamically by scanning the block
      * allocation map.
      */
-    st->f_bsize = FS_BLOCK_SIZE;
+    st->f_bsize = fs_block_size;
     st->f_blocks = 0;
     st->f_bfree = 0;
     st->f_bavail = 0;
@@ -1307,23 +3518,249 @@ static int fs_statfs(const char *path, struct statvfs *st)
     return 0;
 }
 
+/* flush - called on every close(). The file's write-behind buffer is
+ * written out, so that a write error shows up at close at the latest,
+ * and what is left of its reservation window is freed.
+ * The journal's running transaction and data waiting for delayed
+ * allocation are also held between operations, but close doesn't have
+ * to write them; the wrapper below pushes out anything queued.
+ */
+static int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int inum = translate(path);
+    if (inum < 0) {
+        return inum;
+    }
+    int val = wb_sync(inum);
+    struct window *w = win_find(inum);
+    if (w != NULL) {
+        win_close(w);
+    }
+    return val;
+}
+
+/* fsync - make the file's data and metadata durable. Its buffered data
+ * is written out and given blocks, the running journal transaction is
+ * committed and every queued write issued here, under the file system
+ * lock; the wrapper then waits for the device sync without it, so
+ * that concurrent fsyncs share one fdatasync (see image_sync).
+ * 'datasync' makes no difference, as the metadata that locates the
+ * data has to be durable too.
+ */
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int inum = translate(path);
+    if (inum < 0) {
+        return inum;
+    }
+    int val = wb_sync(inum);
+    if (val < 0) {
+        return val;
+    }
+    da_sync(inum);
+    if (jnl) {
+        journal_commit(jnl);
+    }
+    return 0;
+}
+
+/* quiesce - buffered data is written back, reservation windows are
+ * freed, everything in the journal is committed and written home, so
+ * the image is consistent without it, and then synced and marked clean.
+ * Errors - EIO if the device can't sync, leaving it marked dirty
+ */
+static int quiesce(void)
+{
+    int val = 0;
+
+    wb_sync_all();
+    da_sync(0);
+    win_close_all(0);
+    icache_put_all();
+    if (jnl) {
+        journal_commit(jnl);
+        val = journal_checkpoint(jnl);
+    }
+    if (disk->ops->sync) {
+        if (disk->ops->sync(disk) < 0)
+            val = -EIO;
+    } else
+        blk_flush();
+    if (val < 0) {
+        return val;
+    }
+    super.state &= ~FS5600_STATE_DIRTY;
+    return write_super();
+}
+
+/* destroy - called once at unmount; a read-only mount has nothing to
+ * write.
+ */
+static void fs_destroy(void *private_data)
+{
+    pthread_mutex_lock(&fs_lock);
+    if (!readonly && quiesce() < 0)
+        fprintf(stderr, "unmount: the image couldn't be synced, so it "
+                "is left marked dirty\n");
+    pthread_mutex_unlock(&fs_lock);
+}
+
+/* fs_snapshot - take snapshot 'name' of the mounted file system (see
+ * snap.c). Everything is written out first, so that the image holds a
+ * clean file system for the snapshot to keep; that and a copy of the
+ * block bitmap are all it costs up front. Not part of fs_ops; the
+ * 'snapshot' command calls it.
+ */
+int fs_snapshot(const char *name)
+{
+    int64_t i;
+    int val;
+
+    pthread_mutex_lock(&fs_lock);
+    if (readonly)
+        val = -EROFS;
+    else if (snap_disk == NULL)
+        val = -EOPNOTSUPP;
+    else if ((val = quiesce()) == 0) {
+        for (i = 0; i < num_of_blocks; i += fs_block_size * 8) {
+            bmap_need(i);
+        }
+        val = snap_take(snap_disk, name, block_map);
+        super.state |= FS5600_STATE_DIRTY;
+        write_super();
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return val;
+}
+
+/* fs_trim - discard every free block in the data area, for space freed
+ * before the image supported discard (or by other tools). Not part of
+ * fs_ops; the 'fstrim' command calls it. Returns the number of blocks
+ * discarded.
+ */
+int64_t fs_trim(void)
+{
+    int64_t i, j, n = 0;
+
+    pthread_mutex_lock(&fs_lock);
+    if (!readonly && disk->ops->discard) {
+        for (i = 0; i < num_of_blocks; i += fs_block_size * 8) {
+            bmap_need(i);
+        }
+        for (i = data_start; i < num_of_blocks; i = j) {
+            for (j = i; j < num_of_blocks && !FD_ISSET(j, block_map); j++)
+                ;
+            if (j > i) {
+                blk_discard(i, j - i);
+                n += j - i;
+            } else
+                j++;
+        }
+        if (jnl)
+            journal_commit(jnl);
+        blk_flush();
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return n;
+}
+
+/* fs_copy_file_range - see copy_range. Not part of fs_ops, as FUSE 2
+ * has no copy_file_range; the 'clone' and 'copy' commands call it.
+ */
+int64_t fs_copy_file_range(const char *path_in, off_t offset_in,
+                           const char *path_out, off_t offset_out,
+                           int64_t len, int flags)
+{
+    pthread_mutex_lock(&fs_lock);
+    int64_t val = readonly ? -EROFS :
+        copy_range(path_in, offset_in, path_out, offset_out, len, flags);
+    wb_age();
+    da_age();
+    icache_put_all();
+    blk_flush();
+    pthread_mutex_unlock(&fs_lock);
+    return val;
+}
+
+/* The file system isn't re-entrant, so each operation runs under
+ * fs_lock, and then unpins the inode table blocks it used. Each one
+ * that writes ends by writing back buffered data once it is old
+ * enough, and flushing the scheduler's queue, so that it is on disk
+ * (in sorted, merged order) when it returns. Those are refused on a
+ * read-only mount, except for flush (2), which changes nothing itself.
+ */
+#define LOCKED_OP(op, flush, proto, args)       \
+    static int locked_##op proto {              \
+        pthread_mutex_lock(&fs_lock);           \
+        int val = (flush == 1 && readonly) ?    \
+            -EROFS : fs_##op args;              \
+        if (flush) {                            \
+            wb_age();                           \
+            da_age();                           \
+        }                                       \
+        icache_put_all();                       \
+        if (flush)                              \
+            blk_flush();                        \
+        pthread_mutex_unlock(&fs_lock);         \
+        return val;                             \
+    }
+
+LOCKED_OP(getattr, 0, (const char *path, struct stat *sb), (path, sb))
+LOCKED_OP(readdir, 0, (const char *path, void *ptr, fuse_fill_dir_t filler,
+                       off_t offset, struct fuse_file_info *fi),
+          (path, ptr, filler, offset, fi))
+LOCKED_OP(mknod, 1, (const char *path, mode_t mode, dev_t dev), (path, mode, dev))
+LOCKED_OP(mkdir, 1, (const char *path, mode_t mode), (path, mode))
+LOCKED_OP(unlink, 1, (const char *path), (path))
+LOCKED_OP(rmdir, 1, (const char *path), (path))
+LOCKED_OP(rename, 1, (const char *src, const char *dst), (src, dst))
+LOCKED_OP(chmod, 1, (const char *path, mode_t mode), (path, mode))
+LOCKED_OP(utime, 1, (const char *path, struct utimbuf *ut), (path, ut))
+LOCKED_OP(truncate, 1, (const char *path, off_t len), (path, len))
+LOCKED_OP(read, 0, (const char *path, char *buf, size_t len, off_t offset,
+                    struct fuse_file_info *fi), (path, buf, len, offset, fi))
+LOCKED_OP(write, 1, (const char *path, const char *buf, size_t len,
+                     off_t offset, struct fuse_file_info *fi),
+          (path, buf, len, offset, fi))
+LOCKED_OP(statfs, 0, (const char *path, struct statvfs *st), (path, st))
+LOCKED_OP(flush, 2, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED_OP(fallocate, 1, (const char *path, int mode, off_t offset, off_t len,
+                         struct fuse_file_info *fi),
+          (path, mode, offset, len, fi))
+
+static int locked_fsync(const char *path, int datasync,
+                        struct fuse_file_info *fi)
+{
+    pthread_mutex_lock(&fs_lock);
+    int val = fs_fsync(path, datasync, fi);
+    icache_put_all();
+    blk_flush();
+    pthread_mutex_unlock(&fs_lock);
+    if (val == 0 && raw_disk->ops->sync && raw_disk->ops->sync(raw_disk) < 0)
+        val = -EIO;
+    return val;
+}
+
 /* operations vector. Please don't rename it, as the skeleton code in
  * misc.c assumes it is named 'fs_ops'.
  */
 struct fuse_operations fs_ops = {
     .init = fs_init,
-    .getattr = fs_getattr,
-    .readdir = fs_readdir,
-    .mknod = fs_mknod,
-    .mkdir = fs_mkdir,
-    .unlink = fs_unlink,
-    .rmdir = fs_rmdir,
-    .rename = fs_rename,
-    .chmod = fs_chmod,
-    .utime = fs_utime,
-    .truncate = fs_truncate,
-    .read = fs_read,
-    .write = fs_write,
-    .statfs = fs_statfs,
+    .destroy = fs_destroy,
+    .getattr = locked_getattr,
+    .readdir = locked_readdir,
+    .mknod = locked_mknod,
+    .mkdir = locked_mkdir,
+    .unlink = locked_unlink,
+    .rmdir = locked_rmdir,
+    .rename = locked_rename,
+    .chmod = locked_chmod,
+    .utime = locked_utime,
+    .truncate = locked_truncate,
+    .read = locked_read,
+    .write = locked_write,
+    .statfs = locked_statfs,
+    .flush = locked_flush,
+    .fallocate = locked_fallocate,
+    .fsync = locked_fsync,
 };
-
@@ -6,6 +6,7 @@
  */
 
 #define _XOPEN_SOURCE 500
+#define _GNU_SOURCE             /* fallocate */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,49 +18,141 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "blkdev.h"
+#include "stripe.h"
 
 struct image_dev {
-    char *path;
-    int   fd;
-    int   nblks;
+    char   *path;
+    int     fd;
+    int64_t nblks;
+
+    /* fdatasync coalescing, see image_sync */
+    pthread_mutex_t sync_lock;
+    pthread_cond_t  sync_cv;
+    uint64_t sync_started, sync_done;
+    uint64_t sync_failed;       /* the last one that failed, or 0 */
+    int      sync_busy;
+    int      no_discard;        /* file system can't punch holes */
 };
 
 /* The blkdev operations - num_blocks, read, write
  */
-static int image_num_blocks(struct blkdev *dev)
+static int64_t image_num_blocks(struct blkdev *dev)
 {
     struct image_dev *im = dev->private;
     return im->nblks;
 }
 
-static void image_read(struct blkdev *dev, int offset, int len, void *buf)
+/* byte offsets and lengths are computed in off_t / size_t, so that
+ * images over 2GB work; pread and pwrite may transfer less than asked
+ * for on large requests, hence the loops.
+ */
+static void image_read(struct blkdev *dev, int64_t offset, int len, void *buf)
 {
     struct image_dev *im = dev->private;
-    assert(offset >= 0 && offset+len <= im->nblks);
-    int result = pread(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
-
-    if (result < 0) {           /* shouldn't happen */
-        fprintf(stderr, "read error on %s: %s\n", im->path, strerror(errno));
-        assert(0);
+    assert(offset >= 0 && len >= 0 && offset+len <= im->nblks);
+    size_t bytes = (size_t)len * BLOCK_SIZE, done = 0;
+    off_t pos = (off_t)offset * BLOCK_SIZE;
+
+    while (done < bytes) {
+        ssize_t result = pread(im->fd, (char*)buf + done, bytes - done,
+                               pos + done);
+        if (result < 0) {       /* shouldn't happen */
+            fprintf(stderr, "read error on %s: %s\n", im->path, strerror(errno));
+            assert(0);
+        }
+        if (result == 0) {      /* shouldn't happen */
+            fprintf(stderr, "short read on %s: %s\n", im->path, strerror(errno));
+            assert(0);
+        }
+        done += result;
     }
-    if (result != len*BLOCK_SIZE) { /* shouldn't happen */
-        fprintf(stderr, "short read on %s: %s\n", im->path, strerror(errno));
-        assert(0);
+}
+
+static void write_blocks(struct image_dev *im, int64_t offset, int len,
+                         void *buf)
+{
+    size_t bytes = (size_t)len * BLOCK_SIZE, done = 0;
+    off_t pos = (off_t)offset * BLOCK_SIZE;
+
+    while (done < bytes) {
+        ssize_t result = pwrite(im->fd, (char*)buf + done, bytes - done,
+                                pos + done);
+        if (result <= 0) {      /* shouldn't happen */
+            fprintf(stderr, "write error on %s: %s\n", im->path, strerror(errno));
+            assert(0);
+        }
+        done += result;
     }
 }
 
-static void image_write(struct blkdev * dev, int offset, int len, void *buf)
+static void image_write(struct blkdev * dev, int64_t offset, int len, void *buf)
 {
     struct image_dev *im = dev->private;
     assert(offset != 0);        /* over-writing the superblock is an error */
-    assert(offset >= 0 && offset+len <= im->nblks);
+    assert(offset >= 0 && len >= 0 && offset+len <= im->nblks);
+    write_blocks(im, offset, len, buf);
+}
 
-    int result = pwrite(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
-    if (result != len*BLOCK_SIZE) { /* shouldn't happen */
-        fprintf(stderr, "write error on %s: %s\n", im->path, strerror(errno));
-        assert(0);
+/* the one way to write block 0 - see blkdev.h */
+static void image_write_super(struct blkdev *dev, void *buf)
+{
+    write_blocks(dev->private, 0, 1, buf);
+}
+
+/* A sync already in progress may have started before the caller's
+ * writes, so each caller waits for the one after it to finish; the
+ * callers that arrive while one fdatasync runs are all covered by the
+ * single next one. Each of them is told if it failed - or if any since
+ * did, which is as much as the host promises about those writes.
+ */
+static int image_sync(struct blkdev *dev)
+{
+    struct image_dev *im = dev->private;
+
+    pthread_mutex_lock(&im->sync_lock);
+    uint64_t want = im->sync_started + 1;
+    while (im->sync_done < want) {
+        if (im->sync_busy) {
+            pthread_cond_wait(&im->sync_cv, &im->sync_lock);
+            continue;
+        }
+        uint64_t me = ++im->sync_started;
+        im->sync_busy = 1;
+        pthread_mutex_unlock(&im->sync_lock);
+        int failed = fdatasync(im->fd) < 0;
+        if (failed)
+            fprintf(stderr, "sync error on %s: %s\n", im->path, strerror(errno));
+        pthread_mutex_lock(&im->sync_lock);
+        if (failed)
+            im->sync_failed = me;
+        im->sync_done = me;
+        im->sync_busy = 0;
+        pthread_cond_broadcast(&im->sync_cv);
+    }
+    int val = im->sync_failed >= want ? -EIO : 0;
+    pthread_mutex_unlock(&im->sync_lock);
+    return val;
+}
+
+/* punch a hole in the image file, so that the blocks no longer take up
+ * space on the host and read back as zeros without any I/O
+ */
+static void image_discard(struct blkdev *dev, int64_t first, int n)
+{
+    struct image_dev *im = dev->private;
+    assert(first > 0 && n >= 0 && first+n <= im->nblks);
+
+    if (im->no_discard || n == 0)
+        return;
+    if (fallocate(im->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)first * BLOCK_SIZE, (off_t)n * BLOCK_SIZE) < 0) {
+        if (errno != EOPNOTSUPP)
+            fprintf(stderr, "discard error on %s: %s\n", im->path,
+                    strerror(errno));
+        im->no_discard = 1;
     }
 }
 
@@ -67,12 +160,19 @@ struct blkdev_ops image_ops = {
     .num_blocks = image_num_blocks,
     .read = image_read,
     .write = image_write,
+    .write_super = image_write_super,
+    .sync = image_sync,
+    .discard = image_discard,
 };
 
-/* create an image blkdev reading from a specified image file.
+/* create an image blkdev reading from a specified image file - or,
+ * given several separated by commas, the striped set of them (stripe.c)
  */
 struct blkdev *image_create(char *path)
 {
+    if (strchr(path, ',') != NULL)
+        return stripe_create(path);
+
     struct blkdev *dev = malloc(sizeof(*dev));
     struct image_dev *im = malloc(sizeof(*im));
 
@@ -99,6 +199,11 @@ struct blkdev *image_create(char *path)
                 path, BLOCK_SIZE);
 
     im->nblks = sb.st_size / BLOCK_SIZE;
+    pthread_mutex_init(&im->sync_lock, NULL);
+    pthread_cond_init(&im->sync_cv, NULL);
+    im->sync_started = im->sync_done = im->sync_failed = 0;
+    im->sync_busy = 0;
+    im->no_discard = 0;
     dev->private = im;
     dev->ops = &image_ops;
 
@@ -0,0 +1,514 @@
+/*
+ * file:        journal.c
+ * description: metadata write-ahead journal for CS 5600 hw3.
+ *
+ * Every metadata block written since the last commit is kept in memory
+ * ('running'). A commit appends them to the circular log as one record
+ * - descriptor blocks listing home locations, each followed by the
+ * blocks it describes - and the checksums in the descriptors make the
+ * record count only if all of it reached the disk. Records are
+ * appended from the start of the log; committed blocks stay in memory
+ * ('committed') until a checkpoint writes them all to their home
+ * locations and empties the log, which happens only when the next
+ * record doesn't fit or the file system is unmounted. A block changed
+ * again after a commit
+ * gets a separate running copy, so a checkpoint never writes anything
+ * that isn't in the log yet.
+ *
+ * Commits are grouped: the flush at the end of each operation only
+ * commits once the running transaction holds a quarter of the log or is
+ * JNL_COMMIT_SECS old. Data blocks are written in place as before, so
+ * they always reach the disk ahead of the metadata that points to them.
+ * Discards wait for the commit of the transaction that freed the
+ * blocks, so a crash can't leave a file pointing at a discarded block.
+ *
+ * A checkpoint syncs the device three times: so that the records are
+ * on disk before their blocks start to overwrite the home locations,
+ * so that the blocks are home before the header empties the log, and
+ * so that the header is on disk before new records reuse the log. A
+ * barrier only orders the writes in sched.c; it takes a sync to make
+ * them survive a power failure. A sync that fails doesn't stop the
+ * checkpoint, but it returns -EIO, so that the file system isn't marked
+ * clean on the strength of it.
+ *
+ * For testing, JNL_KILL_AT=partial, home or header in the environment
+ * kills the process with SIGKILL during the first checkpoint, after
+ * the first block is written home, after all of them are, or after
+ * the header is.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+#define JNL_COMMIT_SECS 5       /* longest a transaction stays open */
+
+struct jnl_ent {
+    int64_t blk;                /* file system block */
+    char   *committed;          /* in the log, not yet home; or NULL */
+    char   *running;            /* changed since the last commit; or NULL */
+};
+
+struct jnl_dev {
+    struct blkdev  *lower;
+    int             bs;         /* file system block size */
+    int             sect;       /* device blocks per file system block */
+    int64_t         start;      /* first block of the journal region */
+    uint32_t        size;       /* its length, header included */
+    uint32_t        seq;        /* of the next transaction */
+    uint32_t        head;       /* where the next record goes */
+    int             live;       /* records in the log */
+    struct jnl_ent *ents;
+    int             n_ents, max_ents;
+    int            *hash;       /* index+1 into 'ents', 0 = empty */
+    int             hash_sz;    /* power of 2 */
+    int            *run;        /* entries with a running copy */
+    int             n_run;
+    time_t          run_t0;     /* when the running transaction began */
+    char           *buf;        /* one block */
+    struct { int64_t first; int n; } *disc;    /* waiting for the commit */
+    int             n_disc, max_disc;
+};
+
+static uint32_t csum(uint32_t h, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    while (len--)
+        h = (h ^ *p++) * 16777619;
+    return h;
+}
+#define CSUM_INIT 2166136261u
+
+static time_t now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* device-level I/O in file system blocks */
+static void lower_read(struct jnl_dev *j, int64_t blk, void *buf)
+{
+    j->lower->ops->read(j->lower, blk * j->sect, j->sect, buf);
+}
+
+static void lower_write(struct jnl_dev *j, int64_t blk, void *buf)
+{
+    j->lower->ops->write(j->lower, blk * j->sect, j->sect, buf);
+}
+
+static void lower_barrier(struct jnl_dev *j)
+{
+    if (j->lower->ops->barrier)
+        j->lower->ops->barrier(j->lower);
+}
+
+/* everything written so far, on the disk; 0 or -EIO */
+static int lower_sync(struct jnl_dev *j)
+{
+    if (j->lower->ops->flush)
+        j->lower->ops->flush(j->lower);
+    return j->lower->ops->sync ? j->lower->ops->sync(j->lower) : 0;
+}
+
+static char *kill_at;           /* JNL_KILL_AT */
+
+static void kill_point(struct jnl_dev *j, const char *step)
+{
+    if (kill_at != NULL && !strcmp(kill_at, step)) {
+        if (j->lower->ops->flush)
+            j->lower->ops->flush(j->lower);
+        kill(getpid(), SIGKILL);
+    }
+}
+
+static int *hash_slot(struct jnl_dev *j, int64_t blk)
+{
+    unsigned h = (unsigned)(blk * 0x9E3779B1u) & (j->hash_sz - 1);
+    while (j->hash[h] && j->ents[j->hash[h] - 1].blk != blk)
+        h = (h + 1) & (j->hash_sz - 1);
+    return &j->hash[h];
+}
+
+static void rehash(struct jnl_dev *j)
+{
+    int i;
+    while (j->hash_sz < 2 * j->max_ents)
+        j->hash_sz *= 2;
+    j->hash = realloc(j->hash, j->hash_sz * sizeof(int));
+    memset(j->hash, 0, j->hash_sz * sizeof(int));
+    for (i = 0; i < j->n_ents; i++)
+        *hash_slot(j, j->ents[i].blk) = i + 1;
+}
+
+static struct jnl_ent *lookup(struct jnl_dev *j, int64_t blk)
+{
+    int idx = j->n_ents ? *hash_slot(j, blk) : 0;
+    return idx ? &j->ents[idx - 1] : NULL;
+}
+
+/* write a record - descriptors and the blocks of entries run[0..n-1] -
+ * at log position 'pos'. Returns its length in blocks.
+ */
+static uint32_t write_record(struct jnl_dev *j, uint32_t pos, int *run, int n)
+{
+    struct fs5600_jdesc *d = (void*)j->buf;
+    int max = JDESC_MAX(j->bs), i, k;
+    uint32_t len = 0;
+
+    for (i = 0; i < n; i += k) {
+        k = n - i < max ? n - i : max;
+        memset(j->buf, 0, j->bs);
+        *d = (struct fs5600_jdesc){.magic = FS5600_JDESC_MAGIC, .seq = j->seq,
+                                   .n = k, .more = (i + k < n)};
+        int m;
+        for (m = 0; m < k; m++)
+            d->blknum[m] = j->ents[run[i + m]].blk;
+        uint32_t h = csum(CSUM_INIT, j->buf, j->bs);
+        for (m = 0; m < k; m++)
+            h = csum(h, j->ents[run[i + m]].running, j->bs);
+        d->csum = h;
+
+        lower_write(j, j->start + pos + len++, j->buf);
+        for (m = 0; m < k; m++)
+            lower_write(j, j->start + pos + len++, j->ents[run[i + m]].running);
+    }
+    return len;
+}
+
+static void write_header(struct jnl_dev *j)
+{
+    memset(j->buf, 0, j->bs);
+    *(struct fs5600_jsuper *)j->buf = (struct fs5600_jsuper){
+        .magic = FS5600_JSUPER_MAGIC, .seq = j->seq, .start = 1};
+    lower_write(j, j->start, j->buf);
+}
+
+int journal_checkpoint(struct blkdev *dev)
+{
+    struct jnl_dev *j = dev->private;
+    int i, n = 0, val;
+
+    if (j->live == 0)
+        return 0;
+    val = lower_sync(j);
+    for (i = 0; i < j->n_ents; i++)
+        if (j->ents[i].committed) {
+            lower_write(j, j->ents[i].blk, j->ents[i].committed);
+            kill_point(j, "partial");
+        }
+
+    /* the log may only be reused once the blocks are home, and the
+     * header has to say so before anything overwrites the old records
+     */
+    if (lower_sync(j) < 0)
+        val = -EIO;
+    kill_point(j, "home");
+    write_header(j);
+    if (lower_sync(j) < 0)
+        val = -EIO;
+    kill_point(j, "header");
+
+    for (i = 0; i < j->n_ents; i++) {
+        struct jnl_ent *e = &j->ents[i];
+        free(e->committed);
+        e->committed = NULL;
+        if (e->running)
+            j->ents[n++] = *e;
+    }
+    j->n_ents = n;
+    for (i = 0; i < n; i++)
+        j->run[i] = i;
+    rehash(j);
+    j->head = 1;
+    j->live = 0;
+    return val;
+}
+
+static void issue_discards(struct jnl_dev *j)
+{
+    int i;
+    for (i = 0; i < j->n_disc; i++)
+        j->lower->ops->discard(j->lower, j->disc[i].first, j->disc[i].n);
+    j->n_disc = 0;
+}
+
+void journal_commit(struct blkdev *dev)
+{
+    struct jnl_dev *j = dev->private;
+    int max = JDESC_MAX(j->bs), i;
+
+    if (j->n_run == 0) {
+        issue_discards(j);
+        return;
+    }
+    uint32_t len = j->n_run + (j->n_run + max - 1) / max;
+    if (j->head + len > j->size)
+        journal_checkpoint(dev);
+
+    int logged = (j->head + len <= j->size);
+    if (logged) {
+        write_record(j, j->head, j->run, j->n_run);
+        lower_barrier(j);
+        j->head += len;
+        j->live++;
+        j->seq++;
+    } else {
+        /* bigger than the whole log - the best we can do is write it
+         * home, unprotected, after everything committed so far
+         */
+        lower_barrier(j);
+        for (i = 0; i < j->n_run; i++) {
+            struct jnl_ent *e = &j->ents[j->run[i]];
+            lower_write(j, e->blk, e->running);
+        }
+        lower_barrier(j);
+    }
+
+    for (i = 0; i < j->n_run; i++) {
+        struct jnl_ent *e = &j->ents[j->run[i]];
+        if (logged) {
+            free(e->committed);
+            e->committed = e->running;
+        } else
+            free(e->running);
+        e->running = NULL;
+    }
+    j->n_run = 0;
+    issue_discards(j);
+}
+
+void journal_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct jnl_dev *j = dev->private;
+    int i;
+
+    assert(first % j->sect == 0 && n % j->sect == 0);
+    for (i = 0; i < n / j->sect; i++) {
+        int64_t blk = first / j->sect + i;
+        struct jnl_ent *e = lookup(j, blk);
+
+        if (e == NULL) {
+            if (j->n_ents == j->max_ents) {
+                j->max_ents = j->max_ents ? 2 * j->max_ents : 256;
+                j->ents = realloc(j->ents, j->max_ents * sizeof(*j->ents));
+                j->run = realloc(j->run, j->max_ents * sizeof(int));
+                rehash(j);
+            }
+            e = &j->ents[j->n_ents++];
+            *e = (struct jnl_ent){.blk = blk};
+            *hash_slot(j, blk) = j->n_ents;
+        }
+        if (e->running == NULL) {
+            e->running = malloc(j->bs);
+            if (j->n_run == 0)
+                j->run_t0 = now_secs();
+            j->run[j->n_run++] = e - j->ents;
+        }
+        memcpy(e->running, (char*)buf + (size_t)i * j->bs, j->bs);
+    }
+}
+
+static int64_t jnl_num_blocks(struct blkdev *dev)
+{
+    struct jnl_dev *j = dev->private;
+    return j->lower->ops->num_blocks(j->lower);
+}
+
+static void jnl_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct jnl_dev *j = dev->private;
+    int64_t blk;
+
+    j->lower->ops->read(j->lower, first, n, buf);
+    if (j->n_ents == 0)
+        return;
+    for (blk = first / j->sect; blk * j->sect < first + n; blk++) {
+        struct jnl_ent *e = lookup(j, blk);
+        if (e == NULL)
+            continue;
+        char *src = e->running ? e->running : e->committed;
+        int64_t lo = blk * j->sect > first ? blk * j->sect : first;
+        int64_t hi = (blk + 1) * j->sect < first + n ?
+            (blk + 1) * j->sect : first + n;
+        memcpy((char*)buf + (lo - first) * BLOCK_SIZE,
+               src + (lo - blk * j->sect) * BLOCK_SIZE,
+               (hi - lo) * BLOCK_SIZE);
+    }
+}
+
+/* a plain (data) write to a block that is still in the journal - a
+ * metadata block freed and reused for data - would later be overwritten
+ * by the checkpoint or by replay, so get the journal out of the way
+ * first. This is rare: blocks freed in the running transaction aren't
+ * reused until it commits.
+ */
+static void jnl_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct jnl_dev *j = dev->private;
+    int64_t blk;
+
+    for (blk = first / j->sect; j->n_ents && blk * j->sect < first + n; blk++)
+        if (lookup(j, blk)) {
+            journal_commit(dev);
+            journal_checkpoint(dev);
+            break;
+        }
+    j->lower->ops->write(j->lower, first, n, buf);
+}
+
+static void jnl_discard(struct blkdev *dev, int64_t first, int n)
+{
+    struct jnl_dev *j = dev->private;
+
+    if (j->lower->ops->discard == NULL)
+        return;
+    if (j->n_disc == j->max_disc) {
+        j->max_disc = j->max_disc ? 2 * j->max_disc : 64;
+        j->disc = realloc(j->disc, j->max_disc * sizeof(*j->disc));
+    }
+    j->disc[j->n_disc].first = first;
+    j->disc[j->n_disc++].n = n;
+}
+
+static void jnl_flush(struct blkdev *dev)
+{
+    struct jnl_dev *j = dev->private;
+
+    if (j->n_run == 0 || j->n_run >= (j->size - 1) / 4 ||
+        now_secs() - j->run_t0 >= JNL_COMMIT_SECS)
+        journal_commit(dev);
+    if (j->lower->ops->flush)
+        j->lower->ops->flush(j->lower);
+}
+
+static void jnl_barrier(struct blkdev *dev)
+{
+    struct jnl_dev *j = dev->private;
+    lower_barrier(j);
+}
+
+static int jnl_sync(struct blkdev *dev)
+{
+    struct jnl_dev *j = dev->private;
+    journal_commit(dev);
+    return lower_sync(j);
+}
+
+struct blkdev_ops jnl_ops = {
+    .num_blocks = jnl_num_blocks,
+    .read = jnl_read,
+    .write = jnl_write,
+    .flush = jnl_flush,
+    .barrier = jnl_barrier,
+    .sync = jnl_sync,
+    .discard = jnl_discard,
+};
+
+/* read the record at 'pos' if it is transaction 'seq' and complete:
+ * returns its length, with the home locations and contents in
+ * '*blks' / '*data' ('*n' blocks), or 0.
+ */
+static uint32_t read_record(struct jnl_dev *j, uint32_t pos, uint32_t seq,
+                            uint32_t **blks, char **data, int *n)
+{
+    struct fs5600_jdesc *d = (void*)j->buf;
+    uint32_t len = 0;
+    int more = 1, max = 0;
+
+    *n = 0;
+    while (more) {
+        if (pos + len >= j->size)
+            return 0;
+        lower_read(j, j->start + pos + len, j->buf);
+        if (d->magic != FS5600_JDESC_MAGIC || d->seq != seq ||
+            d->n > JDESC_MAX(j->bs) || pos + len + 1 + d->n > j->size)
+            return 0;
+        uint32_t k = d->n, want = d->csum, i;
+        more = d->more;
+        if (*n + k > max) {
+            max = *n + k;
+            *blks = realloc(*blks, max * sizeof(uint32_t));
+            *data = realloc(*data, (size_t)max * j->bs);
+        }
+        memcpy(*blks + *n, d->blknum, k * sizeof(uint32_t));
+        d->csum = 0;
+        uint32_t h = csum(CSUM_INIT, j->buf, j->bs);
+        for (i = 0; i < k; i++) {
+            char *p = *data + (size_t)(*n + i) * j->bs;
+            lower_read(j, j->start + pos + len + 1 + i, p);
+            h = csum(h, p, j->bs);
+        }
+        if (h != want)
+            return 0;
+        *n += k;
+        len += 1 + k;
+    }
+    return len;
+}
+
+static void replay(struct jnl_dev *j, struct fs5600_jsuper *js)
+{
+    uint32_t pos = js->start, seq = js->seq, len, *blks = NULL;
+    char *data = NULL;
+    int n, i, count = 0;
+
+    while ((len = read_record(j, pos, seq, &blks, &data, &n)) > 0) {
+        for (i = 0; i < n; i++)
+            lower_write(j, blks[i], data + (size_t)i * j->bs);
+        pos += len;
+        seq++;
+        count++;
+    }
+    free(blks);
+    free(data);
+
+    j->seq = seq;
+    if (count > 0) {
+        lower_sync(j);
+        write_header(j);
+        lower_sync(j);
+        fprintf(stderr, "journal: replayed %d transaction%s\n", count,
+                count == 1 ? "" : "s");
+    }
+}
+
+struct blkdev *journal_create(struct blkdev *lower, struct fs5600_super *sb)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct jnl_dev *j = calloc(1, sizeof(*j));
+
+    assert(dev != NULL && j != NULL);
+    j->lower = lower;
+    j->bs = FS5600_BLOCK_SIZE(sb);
+    j->sect = j->bs / BLOCK_SIZE;
+    j->start = sb->journal_start;
+    j->size = sb->journal_sz;
+    j->head = 1;
+    j->buf = malloc(j->bs);
+    j->hash_sz = 16;
+    j->hash = calloc(j->hash_sz, sizeof(int));
+    kill_at = getenv("JNL_KILL_AT");
+
+    lower_read(j, j->start, j->buf);
+    struct fs5600_jsuper js = *(struct fs5600_jsuper *)j->buf;
+    if (js.magic != FS5600_JSUPER_MAGIC || js.start < 1 || js.start >= j->size) {
+        fprintf(stderr, "bad journal header\n");
+        free(j->buf);
+        free(j->hash);
+        free(j);
+        free(dev);
+        return NULL;
+    }
+    replay(j, &js);
+
+    dev->private = j;
+    dev->ops = &jnl_ops;
+    return dev;
+}
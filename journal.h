@@ -0,0 +1,40 @@
+/*
+ * file:        journal.h
+ * description: metadata write-ahead journal for CS 5600 hw3 - a blkdev
+ *              stacked on top of another one, which collects metadata
+ *              block updates into transactions, appends them to the
+ *              journal region (group commit) and writes them to their
+ *              home locations later (checkpoint).
+ */
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include "blkdev.h"
+#include "fs5600.h"
+
+/* Replays any committed transactions in the journal described by
+ * 'sb', then returns a device that reads through to 'lower' (seeing
+ * journaled blocks) and passes plain writes straight down. Returns
+ * NULL if the journal header is bad.
+ *
+ * The device's flush commits the running transaction once it is big or
+ * old enough, then flushes 'lower'; its sync commits it right away and
+ * then syncs 'lower'.
+ */
+struct blkdev *journal_create(struct blkdev *lower, struct fs5600_super *sb);
+
+/* add whole file system blocks of metadata to the running transaction
+ * (addresses and length in device blocks, like blkdev_ops.write)
+ */
+void journal_write(struct blkdev *dev, int64_t first_blk, int num_blks,
+                   void *buf);
+
+/* commit the running transaction to the log now */
+void journal_commit(struct blkdev *dev);
+
+/* write every committed block home and empty the log; -EIO if the
+ * device couldn't sync them
+ */
+int journal_checkpoint(struct blkdev *dev);
+
+#endif
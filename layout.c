@@ -0,0 +1,282 @@
+/*
+ * file:        layout.c
+ * description: fragmentation and layout scoring for CS 5600 hw3 images.
+ *
+ * A file's layout is measured over its data blocks in logical order:
+ * each maximal run of physically consecutive blocks is an extent, and
+ * the gap between the end of one run and the start of the next is the
+ * seek distance a sequential reader pays. Free space is measured the
+ * same way over the block map.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+
+static void *blk_ptr(char *disk, int bs, uint32_t blk)
+{
+    return disk + (size_t)blk * bs;
+}
+
+static void add_blk(uint32_t **blks, long *max, long *n, uint32_t blk)
+{
+    if (*n == *max) {
+        *max = *max ? *max * 2 : 1024;
+        *blks = realloc(*blks, *max * sizeof(uint32_t));
+    }
+    (*blks)[(*n)++] = blk;
+}
+
+/* an indirect block 'levels' deep (1 = pointers to data blocks)
+ */
+static void add_indir(char *disk, int bs, uint32_t blk, int levels,
+                      uint32_t **blks, long *max, long *n)
+{
+    uint32_t *ptrs = blk_ptr(disk, bs, blk);
+    int i;
+    for (i = 0; i < PTRS_PER_BLK(bs); i++) {
+        if (!ptrs[i])
+            continue;
+        if (levels > 1)
+            add_indir(disk, bs, ptrs[i], levels - 1, blks, max, n);
+        else
+            add_blk(blks, max, n, ptrs[i]);
+    }
+}
+
+int layout_journal_pending(struct fs5600_super *sb,
+                           void *(*blk_ptr)(uint32_t))
+{
+    struct fs5600_jsuper *js = blk_ptr(sb->journal_start);
+
+    if (js->magic != FS5600_JSUPER_MAGIC || js->start < 1 ||
+        js->start >= sb->journal_sz)
+        return -1;
+    struct fs5600_jdesc *d = blk_ptr(sb->journal_start + js->start);
+    return d->magic == FS5600_JDESC_MAGIC && d->seq == js->seq;
+}
+
+long layout_file_blocks(char *disk, int bs, struct fs5600_inode *in,
+                        uint32_t **blks, long *max)
+{
+    uint32_t roots[] = {in->indir_1, in->indir_2, in->indir_3};
+    long n = 0;
+    int i;
+
+    for (i = 0; i < N_DIRECT; i++)
+        if (in->direct[i])
+            add_blk(blks, max, &n, in->direct[i]);
+    for (i = 0; i < 3; i++)
+        if (roots[i])
+            add_indir(disk, bs, roots[i], i + 1, blks, max, &n);
+    return n;
+}
+
+static int bucket(long len)
+{
+    int b = 0;
+    while (len > 1 && b < LAYOUT_BUCKETS - 1)
+        len >>= 1, b++;
+    return b;
+}
+
+void layout_init(struct layout_stats *st, int top_n)
+{
+    memset(st, 0, sizeof(*st));
+    st->top_n = top_n;
+    if (top_n > 0)
+        st->worst = calloc(top_n, sizeof(*st->worst));
+}
+
+/* more fragmented = more extents, then longer seeks
+ */
+static int worse(struct layout_file *a, struct layout_file *b)
+{
+    if (a->extents != b->extents)
+        return a->extents > b->extents;
+    return a->seek > b->seek;
+}
+
+static void add_worst(struct layout_stats *st, struct layout_file *f)
+{
+    int i;
+    if (st->top_n == 0 || f->extents <= 1)
+        return;
+    if (st->n_worst == st->top_n && !worse(f, &st->worst[st->n_worst - 1]))
+        return;
+    if (st->n_worst < st->top_n)
+        st->n_worst++;
+    for (i = st->n_worst - 1; i > 0 && worse(f, &st->worst[i-1]); i--)
+        st->worst[i] = st->worst[i-1];
+    st->worst[i] = *f;
+}
+
+void layout_add_file(struct layout_stats *st, uint32_t inum, uint32_t ino_blk,
+                     uint32_t *blks, long n)
+{
+    struct layout_file f = {.inum = inum, .blocks = n};
+    long i, run = 1;
+
+    st->files++;
+    if (n == 0)
+        return;
+    f.ino_dist = blks[0] > ino_blk ? blks[0] - ino_blk : ino_blk - blks[0];
+    f.extents = 1;
+    for (i = 1; i < n; i++) {
+        if (blks[i] == blks[i-1] + 1) {
+            run++;
+            continue;
+        }
+        st->run_hist[bucket(run)]++;
+        run = 1;
+        f.extents++;
+        f.seek += blks[i] > blks[i-1] ? blks[i] - blks[i-1] - 1
+                                      : blks[i-1] - blks[i] + 1;
+    }
+    st->run_hist[bucket(run)]++;
+
+    st->blocks += n;
+    st->extents += f.extents;
+    st->seeks += n - 1;
+    st->seek += f.seek;
+    st->ino_dist += f.ino_dist;
+    add_worst(st, &f);
+}
+
+void layout_merge(struct layout_stats *dst, struct layout_stats *src)
+{
+    int i;
+    dst->files += src->files;
+    dst->blocks += src->blocks;
+    dst->extents += src->extents;
+    dst->seeks += src->seeks;
+    dst->seek += src->seek;
+    dst->ino_dist += src->ino_dist;
+    dst->free_blocks += src->free_blocks;
+    dst->free_runs += src->free_runs;
+    if (src->free_max > dst->free_max)
+        dst->free_max = src->free_max;
+    for (i = 0; i < LAYOUT_BUCKETS; i++) {
+        dst->run_hist[i] += src->run_hist[i];
+        dst->free_hist[i] += src->free_hist[i];
+    }
+    for (i = 0; i < src->n_worst; i++)
+        add_worst(dst, &src->worst[i]);
+}
+
+void layout_free_space(struct layout_stats *st, struct fs5600_super *sb,
+                       void *(*blk_ptr)(uint32_t), uint32_t lo, uint32_t hi)
+{
+    uint32_t i, bits = 8 * FS5600_BLOCK_SIZE(sb);
+    uint32_t map_start = 1 + sb->inode_map_sz;
+    fd_set *map = NULL;
+    long run = 0;
+
+    for (i = lo; i <= hi; i++) {
+        if (i < hi && (i == lo || i % bits == 0))
+            map = blk_ptr(map_start + i / bits);
+        if (i < hi && !FD_ISSET(i % bits, map)) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            st->free_blocks += run;
+            st->free_runs++;
+            st->free_hist[bucket(run)]++;
+            if (run > st->free_max)
+                st->free_max = run;
+        }
+        run = 0;
+    }
+}
+
+double layout_score(struct layout_stats *st)
+{
+    if (st->seeks == 0)
+        return 0;
+    /* every file contributes one unavoidable first extent
+     */
+    long with_data = st->blocks - st->seeks;
+    return 100.0 * (st->extents - with_data) / st->seeks;
+}
+
+static void print_hist(FILE *fp, const char *title, long *hist)
+{
+    int i, last = 0;
+    for (i = 0; i < LAYOUT_BUCKETS; i++)
+        if (hist[i])
+            last = i;
+    fprintf(fp, "%s\n", title);
+    for (i = 0; i <= last; i++)
+        fprintf(fp, "  %8ld-%-8ld %ld\n", 1L << i, (2L << i) - 1, hist[i]);
+}
+
+void layout_print(FILE *fp, struct layout_stats *st)
+{
+    int i;
+    long with_data = st->blocks - st->seeks;
+
+    fprintf(fp, "layout: %ld files, %ld data blocks, %ld extents\n",
+            st->files, st->blocks, st->extents);
+    fprintf(fp, "  fragmentation score:     %.2f%%\n", layout_score(st));
+    fprintf(fp, "  extents per file:        %.2f\n",
+            with_data ? (double)st->extents / with_data : 0);
+    fprintf(fp, "  avg seek distance:       %.2f blocks\n",
+            st->seeks ? (double)st->seek / st->seeks : 0);
+    fprintf(fp, "  avg inode-to-data:       %.2f blocks\n",
+            with_data ? (double)st->ino_dist / with_data : 0);
+    print_hist(fp, "contiguous run lengths (blocks: runs)", st->run_hist);
+
+    fprintf(fp, "free space: %ld blocks in %ld runs, largest %ld\n",
+            st->free_blocks, st->free_runs, st->free_max);
+    fprintf(fp, "  free fragmentation:      %.2f%%\n", st->free_blocks ?
+            100.0 * (1 - (double)st->free_max / st->free_blocks) : 0);
+    print_hist(fp, "free run lengths (blocks: runs)", st->free_hist);
+
+    if (st->n_worst > 0) {
+        fprintf(fp, "most fragmented files:\n"
+                "     inode   blocks  extents     seek  ino-dist\n");
+        for (i = 0; i < st->n_worst; i++)
+            fprintf(fp, "  %8u %8u %8u %8llu %9u\n", st->worst[i].inum,
+                    st->worst[i].blocks, st->worst[i].extents,
+                    (unsigned long long)st->worst[i].seek,
+                    st->worst[i].ino_dist);
+    }
+}
+
+static void print_hist_json(FILE *fp, long *hist)
+{
+    int i, last = 0;
+    for (i = 0; i < LAYOUT_BUCKETS; i++)
+        if (hist[i])
+            last = i;
+    fprintf(fp, "[");
+    for (i = 0; i <= last; i++)
+        fprintf(fp, "%s%ld", i ? ", " : "", hist[i]);
+    fprintf(fp, "]");
+}
+
+void layout_print_json(FILE *fp, struct layout_stats *st)
+{
+    int i;
+    long with_data = st->blocks - st->seeks;
+
+    fprintf(fp, "{\"files\": %ld, \"blocks\": %ld, \"extents\": %ld,"
+            " \"score\": %.3f,\n  \"avg_seek\": %.3f, \"avg_inode_dist\": %.3f,"
+            "\n  \"run_hist\": ", st->files, st->blocks, st->extents,
+            layout_score(st), st->seeks ? (double)st->seek / st->seeks : 0,
+            with_data ? (double)st->ino_dist / with_data : 0);
+    print_hist_json(fp, st->run_hist);
+    fprintf(fp, ",\n  \"free_blocks\": %ld, \"free_runs\": %ld,"
+            " \"free_max\": %ld, \"free_hist\": ",
+            st->free_blocks, st->free_runs, st->free_max);
+    print_hist_json(fp, st->free_hist);
+    fprintf(fp, ",\n  \"worst\": [");
+    for (i = 0; i < st->n_worst; i++)
+        fprintf(fp, "%s\n    {\"inode\": %u, \"blocks\": %u, \"extents\": %u,"
+                " \"seek\": %llu, \"inode_dist\": %u}", i ? "," : "",
+                st->worst[i].inum, st->worst[i].blocks, st->worst[i].extents,
+                (unsigned long long)st->worst[i].seek, st->worst[i].ino_dist);
+    fprintf(fp, "]}");
+}
@@ -0,0 +1,73 @@
+/*
+ * file:        layout.h
+ * description: fragmentation and layout scoring for CS 5600 hw3 images,
+ *              shared by read-img --layout and defrag-x6
+ */
+#ifndef __LAYOUT_H__
+#define __LAYOUT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "fs5600.h"
+
+/* histogram buckets are powers of two: 1, 2-3, 4-7, 8-15, ...
+ */
+#define LAYOUT_BUCKETS 24
+
+struct layout_file {
+    uint32_t inum;
+    uint32_t blocks;            /* data blocks */
+    uint32_t extents;           /* contiguous runs of data blocks */
+    uint64_t seek;              /* sum of gaps between logical neighbours */
+    uint32_t ino_dist;          /* inode table block -> first data block */
+};
+
+struct layout_stats {
+    long files, blocks, extents;
+    long seeks;                 /* block-to-block transitions */
+    uint64_t seek;              /* total seek distance, in blocks */
+    uint64_t ino_dist;          /* total inode-to-data distance */
+    long run_hist[LAYOUT_BUCKETS];
+    long free_blocks, free_runs, free_max;
+    long free_hist[LAYOUT_BUCKETS];
+    int top_n, n_worst;
+    struct layout_file *worst;  /* most fragmented first */
+};
+
+/* fill '*blks' with the data blocks of a file in logical order, reading
+ * indirect blocks from the image mapped at 'disk', with 'bs'-byte
+ * blocks. The array ('*max' entries) is grown with realloc as needed.
+ * Returns the count.
+ */
+long layout_file_blocks(char *disk, int bs, struct fs5600_inode *in,
+                        uint32_t **blks, long *max);
+
+/* state of the metadata journal (FS5600_FEAT_JOURNAL) of the file
+ * system 'sb', whose block N is at blk_ptr(N): 0 if empty, 1 if it
+ * holds transactions that haven't been replayed, -1 if its header is
+ * bad. Only the first descriptor is looked at, not the checksums.
+ */
+int layout_journal_pending(struct fs5600_super *sb,
+                           void *(*blk_ptr)(uint32_t));
+
+void layout_init(struct layout_stats *st, int top_n);
+void layout_add_file(struct layout_stats *st, uint32_t inum, uint32_t ino_blk,
+                     uint32_t *blks, long n);
+void layout_merge(struct layout_stats *dst, struct layout_stats *src);
+/* free runs among blocks lo..hi-1, from the block map of 'sb' (read
+ * with blk_ptr, as above)
+ */
+void layout_free_space(struct layout_stats *st, struct fs5600_super *sb,
+                       void *(*blk_ptr)(uint32_t), uint32_t lo, uint32_t hi);
+
+/* percentage of logical block transitions that aren't physically
+ * contiguous - 0 is a perfectly laid out volume.
+ */
+double layout_score(struct layout_stats *st);
+
+void layout_print(FILE *fp, struct layout_stats *st);
+void layout_print_json(FILE *fp, struct layout_stats *st);
+
+#endif
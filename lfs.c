@@ -0,0 +1,635 @@
+/*
+ * file:        lfs.c
+ * description: log-structured layout for CS 5600 hw3.
+ *
+ * The image after the superblock is a row of segments (see fs5600.h).
+ * Blocks written - data, directories, inodes and bitmaps alike - are
+ * collected into a chunk in memory, and each chunk goes to the end of
+ * the log as a single sequential write: a summary block listing the
+ * logical block numbers, followed by the blocks. 'map' then points
+ * each logical block at its newest copy, so a block rewritten in place
+ * by the file system simply moves; this map (at block rather than
+ * inode granularity) is what locates the inode table blocks, too. It
+ * is kept in memory only, and rebuilt at startup from the summaries:
+ * one read per chunk, and the data of the newest segment's chunks,
+ * which is the only place a chunk can be half written.
+ *
+ * A segment whose blocks have all been superseded is free again once
+ * the chunk that superseded the last of them is on disk; its first
+ * block is zeroed, so that its old chunks can't come back at the next
+ * startup. The cleaner frees the rest: it copies the live blocks of a
+ * victim segment to the end of the log and frees the victim, picking
+ * the segment with the best (1 - u) * age / (1 + u), where u is the
+ * fraction of the segment still live and age is how many chunks ago it
+ * was last written - cold, mostly empty segments first. A thread does
+ * this in the background, started by the first write, whenever fewer
+ * than 'bg_low' segments are free; if writes catch up with it they
+ * clean in the foreground, and LFS_RESERVE segments are kept for the
+ * cleaner itself. mkfs-x6 sizes the file system at 80% of the log, so
+ * there is always a victim worth cleaning.
+ *
+ * The log keeps writes in order by itself - a chunk is found at
+ * startup whole or not at all, and the ones before it with it - so
+ * there is no 'barrier' op. That holds for a process crash, where the
+ * writes already made all reach the image; for a power failure the
+ * only writes that matter out of order are those freeing a segment,
+ * so each pass that frees some syncs the device first, putting the
+ * copies of its live blocks on disk before their originals are lost.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "lfs.h"
+
+#define LFS_COMMIT_SECS 5       /* longest a chunk stays in memory */
+#define LFS_RESERVE     2       /* free segments only the cleaner uses */
+#define LFS_CLEAN_SECS  1       /* how often the cleaner thread looks */
+
+struct lfs_dev {
+    struct blkdev  *lower;
+    int             bs;         /* file system block size */
+    int             sect;       /* device blocks per file system block */
+    int64_t         nblks;      /* logical file system blocks */
+    uint32_t        seg_sz;
+    int64_t         n_segs;
+    uint32_t       *map;        /* logical -> physical block, 0 = none */
+    uint32_t       *rmap;       /* physical block - 1 -> logical */
+    uint32_t       *live;       /* per segment: blocks 'map' points into */
+    uint32_t       *stamp;      /* per segment: seq of its newest chunk */
+    char           *is_free;    /* per segment */
+    int64_t        *free_segs;  /* stack, lowest segment on top */
+    int64_t         n_free;
+    int64_t         bg_low;     /* the cleaner thread keeps this many free */
+    int             dead;       /* a segment may have no live blocks left */
+    int64_t         cur;        /* segment being filled, or -1 */
+    uint32_t        off;        /* next block in it */
+    uint32_t        seq;        /* of the next chunk */
+
+    /* the chunk being collected: entry i is logical block ent[i], with
+     * FS5600_LSUM_TRIM if it was discarded, else with its data in slot
+     * i of 'data'. A block has at most one entry per chunk.
+     */
+    uint32_t       *ent;
+    char           *data;
+    int             n_ent, n_data, max_ent;
+    int            *hash;       /* index+1 into 'ent', 0 = empty */
+    int             hash_sz;    /* power of 2 */
+    time_t          t0;         /* when the chunk was started */
+    char           *buf;        /* a chunk as written */
+    char           *segbuf;     /* the segment being cleaned */
+    char           *zero;       /* one block of zeros */
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cv;         /* wakes the cleaner thread */
+    int             started;    /* the cleaner thread */
+};
+
+static uint32_t csum(uint32_t h, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    while (len--)
+        h = (h ^ *p++) * 16777619;
+    return h;
+}
+#define CSUM_INIT 2166136261u
+
+static time_t now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* device-level I/O in file system blocks */
+static void lower_read(struct lfs_dev *l, int64_t blk, int n, void *buf)
+{
+    l->lower->ops->read(l->lower, blk * l->sect, n * l->sect, buf);
+}
+
+static void lower_write(struct lfs_dev *l, int64_t blk, int n, void *buf)
+{
+    l->lower->ops->write(l->lower, blk * l->sect, n * l->sect, buf);
+}
+
+static int64_t seg_start(struct lfs_dev *l, int64_t seg)
+{
+    return 1 + seg * l->seg_sz;
+}
+
+static int64_t seg_of(struct lfs_dev *l, uint32_t phys)
+{
+    return (phys - 1) / l->seg_sz;
+}
+
+static int *hash_slot(struct lfs_dev *l, uint32_t blk)
+{
+    unsigned h = (blk * 0x9E3779B1u) & (l->hash_sz - 1);
+    while (l->hash[h] && (l->ent[l->hash[h] - 1] & ~FS5600_LSUM_TRIM) != blk)
+        h = (h + 1) & (l->hash_sz - 1);
+    return &l->hash[h];
+}
+
+/* the entry for 'blk' in the chunk being collected, or -1 */
+static int pending(struct lfs_dev *l, uint32_t blk)
+{
+    return l->n_ent ? *hash_slot(l, blk) - 1 : -1;
+}
+
+/* data blocks the chunk being collected has room for */
+static uint32_t room(struct lfs_dev *l)
+{
+    return (l->cur < 0 ? l->seg_sz : l->seg_sz - l->off) - 1;
+}
+
+static void free_segment(struct lfs_dev *l, int64_t seg)
+{
+    lower_write(l, seg_start(l, seg), 1, l->zero);
+    if (l->lower->ops->discard)
+        l->lower->ops->discard(l->lower, (seg_start(l, seg) + 1) * l->sect,
+                               (l->seg_sz - 1) * l->sect);
+    l->is_free[seg] = 1;
+    l->free_segs[l->n_free++] = seg;
+}
+
+/* free the segments with nothing live in them, once the chunks that
+ * superseded their blocks are on disk - not at all if they can't be
+ * made so
+ */
+static void reclaim(struct lfs_dev *l)
+{
+    int64_t s;
+    int synced = 0;
+
+    for (s = 0; s < l->n_segs; s++)
+        if (!l->is_free[s] && s != l->cur && l->live[s] == 0) {
+            if (!synced++ && l->lower->ops->sync &&
+                l->lower->ops->sync(l->lower) < 0)
+                return;
+            free_segment(l, s);
+        }
+    l->dead = 0;
+}
+
+static void take_segment(struct lfs_dev *l)
+{
+    if (l->n_free == 0) {
+        fprintf(stderr, "lfs: no free segments\n");
+        abort();
+    }
+    l->cur = l->free_segs[--l->n_free];
+    l->is_free[l->cur] = 0;
+    l->off = 0;
+    if (l->n_free < l->bg_low)
+        pthread_cond_signal(&l->cv);
+}
+
+static void drop(struct lfs_dev *l, uint32_t phys)
+{
+    int64_t s = seg_of(l, phys);
+    if (--l->live[s] == 0 && s != l->cur)
+        l->dead = 1;
+}
+
+/* append the chunk being collected to the log, and point the map at
+ * its blocks
+ */
+static void commit(struct lfs_dev *l)
+{
+    struct fs5600_lsum *sum = (void*)l->buf;
+    int i, d = 0;
+
+    if (l->n_ent == 0)
+        return;
+    if (l->cur < 0)
+        take_segment(l);
+    assert(l->n_data <= room(l));
+
+    memset(l->buf, 0, l->bs);
+    *sum = (struct fs5600_lsum){.magic = FS5600_LSUM_MAGIC, .seq = l->seq,
+                                .n = l->n_ent};
+    for (i = 0; i < l->n_ent; i++) {
+        sum->blknum[i] = l->ent[i];
+        if (!(l->ent[i] & FS5600_LSUM_TRIM))
+            memcpy(l->buf + (size_t)++d * l->bs,
+                   l->data + (size_t)i * l->bs, l->bs);
+    }
+    sum->csum = csum(CSUM_INIT, l->buf, (size_t)(1 + d) * l->bs);
+    int64_t base = seg_start(l, l->cur) + l->off;
+    lower_write(l, base, 1 + d, l->buf);
+
+    for (i = d = 0; i < l->n_ent; i++) {
+        uint32_t blk = l->ent[i] & ~FS5600_LSUM_TRIM;
+        if (l->map[blk])
+            drop(l, l->map[blk]);
+        if (l->ent[i] & FS5600_LSUM_TRIM)
+            l->map[blk] = 0;
+        else {
+            uint32_t phys = base + 1 + d++;
+            l->map[blk] = phys;
+            l->rmap[phys - 1] = blk;
+            l->live[l->cur]++;
+        }
+    }
+    l->stamp[l->cur] = l->seq++;
+    l->off += 1 + d;
+    l->n_ent = l->n_data = 0;
+    memset(l->hash, 0, l->hash_sz * sizeof(int));
+
+    /* no room for another summary and a block - on to the next one */
+    if (l->seg_sz - l->off < 2) {
+        if (l->live[l->cur] == 0)
+            l->dead = 1;
+        l->cur = -1;
+    }
+    if (l->dead)
+        reclaim(l);
+}
+
+/* add a block ('data' = NULL for a discard) to the chunk being
+ * collected, writing the chunk out first if it is full
+ */
+static void append(struct lfs_dev *l, uint32_t blk, const void *data)
+{
+    int fresh = 0;
+
+    for (;;) {
+        int *h = hash_slot(l, blk), i = *h - 1;
+        int is_data = (i >= 0 && !(l->ent[i] & FS5600_LSUM_TRIM));
+
+        if (data == NULL) {
+            if (i < 0 && l->map[blk] == 0)
+                return;         /* nothing to discard */
+            if (i >= 0) {
+                l->ent[i] = blk | FS5600_LSUM_TRIM;
+                l->n_data -= is_data;
+                return;
+            }
+            if (l->n_ent < l->max_ent) {
+                l->ent[l->n_ent++] = blk | FS5600_LSUM_TRIM;
+                *h = l->n_ent;
+                fresh = 1;
+                break;
+            }
+        } else if (is_data || l->n_data < room(l)) {
+            if (i < 0 && l->n_ent < l->max_ent) {
+                i = l->n_ent++;
+                *h = l->n_ent;
+                fresh = 1;
+            }
+            if (i >= 0) {
+                l->n_data += !is_data;
+                l->ent[i] = blk;
+                memcpy(l->data + (size_t)i * l->bs, data, l->bs);
+                break;
+            }
+        }
+        commit(l);
+    }
+    if (fresh && l->n_ent == 1)
+        l->t0 = now_secs();
+}
+
+/* copy the live blocks of the best victim to the end of the log, and
+ * free it. Returns 0 if no segment would gain anything.
+ */
+static int clean_one(struct lfs_dev *l)
+{
+    int64_t s, victim = -1;
+    double best = 0;
+    uint32_t i;
+
+    for (s = 0; s < l->n_segs; s++) {
+        uint32_t n = l->live[s];
+        if (l->is_free[s] || s == l->cur ||
+            n + (n + l->max_ent - 1) / l->max_ent >= l->seg_sz)
+            continue;
+        double u = (double)n / l->seg_sz;
+        double age = l->seq - l->stamp[s];
+        double score = (1 - u) * (age + 1) / (1 + u);
+        if (victim < 0 || score > best) {
+            victim = s;
+            best = score;
+        }
+    }
+    if (victim < 0)
+        return 0;
+
+    /* blocks with a newer copy in the chunk being collected are dead
+     * once it is written, so only the others are copied
+     */
+    int64_t base = seg_start(l, victim);
+    lower_read(l, base, l->seg_sz, l->segbuf);
+    for (i = 0; i < l->seg_sz; i++) {
+        uint32_t blk = l->rmap[base + i - 1];
+        if (blk && l->map[blk] == base + i && pending(l, blk) < 0)
+            append(l, blk, l->segbuf + (size_t)i * l->bs);
+    }
+    commit(l);
+    assert(l->live[victim] == 0 && l->is_free[victim]);
+    return 1;
+}
+
+/* writes clean in the foreground when the cleaner thread can't keep up,
+ * leaving the last LFS_RESERVE free segments to the cleaning
+ */
+static void make_room(struct lfs_dev *l)
+{
+    while (l->n_free <= LFS_RESERVE && clean_one(l))
+        ;
+}
+
+static void *cleaner_thread(void *arg)
+{
+    struct lfs_dev *l = arg;
+
+    pthread_mutex_lock(&l->lock);
+    for (;;) {
+        if (l->n_free >= l->bg_low || !clean_one(l)) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += LFS_CLEAN_SECS;
+            pthread_cond_timedwait(&l->cv, &l->lock, &ts);
+            continue;
+        }
+        /* let the file system in between segments */
+        pthread_mutex_unlock(&l->lock);
+        pthread_mutex_lock(&l->lock);
+    }
+    return NULL;
+}
+
+static int64_t lfs_num_blocks(struct blkdev *dev)
+{
+    struct lfs_dev *l = dev->private;
+    return l->nblks * l->sect;
+}
+
+/* runs of blocks that are consecutive in the log are read with a
+ * single read
+ */
+static void lfs_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct lfs_dev *l = dev->private;
+    char *p = buf;
+
+    /* block 0 isn't in the log, and the superblock is read on its own */
+    if (first < l->sect) {
+        int k = n < l->sect - first ? n : l->sect - first;
+        l->lower->ops->read(l->lower, first, k, p);
+        first += k;
+        n -= k;
+        p += (size_t)k * BLOCK_SIZE;
+    }
+    assert(first % l->sect == 0 && n % l->sect == 0 && first + n <=
+           l->nblks * l->sect);
+
+    int64_t blk = first / l->sect, end = (first + n) / l->sect;
+    pthread_mutex_lock(&l->lock);
+    while (blk < end) {
+        int i = pending(l, blk), k = 1;
+        uint32_t phys = l->map[blk];
+        if (i >= 0 && (l->ent[i] & FS5600_LSUM_TRIM))
+            memset(p, 0, l->bs);
+        else if (i >= 0)
+            memcpy(p, l->data + (size_t)i * l->bs, l->bs);
+        else if (phys == 0)
+            memset(p, 0, l->bs);
+        else {
+            while (blk + k < end && l->map[blk + k] == phys + k &&
+                   pending(l, blk + k) < 0)
+                k++;
+            lower_read(l, phys, k, p);
+        }
+        blk += k;
+        p += (size_t)k * l->bs;
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+static void lfs_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct lfs_dev *l = dev->private;
+    int i;
+
+    assert(first % l->sect == 0 && n % l->sect == 0);
+    assert(first > 0 && first + n <= l->nblks * l->sect);
+    pthread_mutex_lock(&l->lock);
+    if (!l->started) {
+        pthread_t t;
+        pthread_create(&t, NULL, cleaner_thread, l);
+        pthread_detach(t);
+        l->started = 1;
+    }
+    for (i = 0; i < n / l->sect; i++) {
+        make_room(l);
+        append(l, first / l->sect + i, (char*)buf + (size_t)i * l->bs);
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+static void lfs_write_super(struct blkdev *dev, void *buf)
+{
+    struct lfs_dev *l = dev->private;
+    l->lower->ops->write_super(l->lower, buf);
+}
+
+static void lfs_flush(struct blkdev *dev)
+{
+    struct lfs_dev *l = dev->private;
+
+    pthread_mutex_lock(&l->lock);
+    if (l->n_ent && now_secs() - l->t0 >= LFS_COMMIT_SECS)
+        commit(l);
+    pthread_mutex_unlock(&l->lock);
+    if (l->lower->ops->flush)
+        l->lower->ops->flush(l->lower);
+}
+
+static int lfs_sync(struct blkdev *dev)
+{
+    struct lfs_dev *l = dev->private;
+
+    pthread_mutex_lock(&l->lock);
+    commit(l);
+    pthread_mutex_unlock(&l->lock);
+    if (l->lower->ops->flush)
+        l->lower->ops->flush(l->lower);
+    return l->lower->ops->sync ? l->lower->ops->sync(l->lower) : 0;
+}
+
+/* a discarded block is unmapped, which the summary records so that it
+ * stays that way after a restart
+ */
+static void lfs_discard(struct blkdev *dev, int64_t first, int n)
+{
+    struct lfs_dev *l = dev->private;
+    int i;
+
+    assert(first % l->sect == 0 && n % l->sect == 0 && first > 0);
+    pthread_mutex_lock(&l->lock);
+    for (i = 0; i < n / l->sect; i++) {
+        make_room(l);
+        append(l, first / l->sect + i, NULL);
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+struct blkdev_ops lfs_ops = {
+    .num_blocks = lfs_num_blocks,
+    .read = lfs_read,
+    .write = lfs_write,
+    .write_super = lfs_write_super,
+    .flush = lfs_flush,
+    .sync = lfs_sync,
+    .discard = lfs_discard,
+};
+
+int64_t lfs_where(struct blkdev *dev, int64_t blk)
+{
+    struct lfs_dev *l = dev->private;
+
+    assert(l->n_ent == 0);
+    if (blk == 0)
+        return 0;
+    return l->map[blk] ? (int64_t)l->map[blk] : -1;
+}
+
+/* read the chunk at block 'pos' of segment 'seg' into 'buf', if it is
+ * newer than 'after' and looks complete - with 'verify', if its data
+ * matches the checksum. Returns its length in blocks, or 0.
+ */
+static uint32_t read_chunk(struct lfs_dev *l, int64_t seg, uint32_t pos,
+                           uint32_t after, int verify)
+{
+    struct fs5600_lsum *sum = (void*)l->buf;
+    uint32_t i, d = 0;
+
+    lower_read(l, seg_start(l, seg) + pos, 1, l->buf);
+    if (sum->magic != FS5600_LSUM_MAGIC || sum->seq <= after ||
+        sum->n > LSUM_MAX(l->bs))
+        return 0;
+    for (i = 0; i < sum->n; i++)
+        d += !(sum->blknum[i] & FS5600_LSUM_TRIM);
+    if (pos + 1 + d > l->seg_sz)
+        return 0;
+    if (verify) {
+        uint32_t want = sum->csum;
+        lower_read(l, seg_start(l, seg) + pos + 1, d, l->buf + l->bs);
+        sum->csum = 0;
+        if (csum(CSUM_INIT, l->buf, (size_t)(1 + d) * l->bs) != want)
+            return 0;
+    }
+    return 1 + d;
+}
+
+/* rebuild the map from the chunks of every segment, the newest copy of
+ * each block (by seq) winning. Segments are filled one at a time, so
+ * the one whose first chunk is newest holds the last chunks written.
+ */
+static void recover(struct lfs_dev *l)
+{
+    struct fs5600_lsum *sum = (void*)l->buf;
+    uint32_t *mseq = calloc(l->nblks, sizeof(uint32_t)), top = 0, i;
+    int64_t s, newest = -1;
+
+    assert(mseq != NULL);
+    for (s = 0; s < l->n_segs; s++)
+        if (read_chunk(l, s, 0, top, 0) > 0) {
+            top = sum->seq;
+            newest = s;
+        }
+
+    l->seq = 1;
+    for (s = 0; s < l->n_segs; s++) {
+        uint32_t pos = 0, after = 0, len;
+        while (pos < l->seg_sz &&
+               (len = read_chunk(l, s, pos, after, s == newest)) > 0) {
+            int64_t phys = seg_start(l, s) + pos + 1;
+            for (i = 0; i < sum->n; i++) {
+                uint32_t blk = sum->blknum[i] & ~FS5600_LSUM_TRIM;
+                int trim = (sum->blknum[i] & FS5600_LSUM_TRIM) != 0;
+                if (blk > 0 && blk < l->nblks && sum->seq > mseq[blk]) {
+                    mseq[blk] = sum->seq;
+                    l->map[blk] = trim ? 0 : phys;
+                }
+                phys += !trim;
+            }
+            after = l->stamp[s] = sum->seq;
+            if (sum->seq >= l->seq)
+                l->seq = sum->seq + 1;
+            pos += len;
+        }
+        if (s == newest && l->seg_sz - pos >= 2) {
+            l->cur = s;
+            l->off = pos;
+        }
+    }
+    free(mseq);
+
+    for (i = 1; i < l->nblks; i++)
+        if (l->map[i]) {
+            l->rmap[l->map[i] - 1] = i;
+            l->live[seg_of(l, l->map[i])]++;
+        }
+    for (s = l->n_segs - 1; s >= 0; s--)
+        if (s != l->cur && l->live[s] == 0) {
+            l->is_free[s] = 1;
+            l->free_segs[l->n_free++] = s;
+        }
+}
+
+struct blkdev *lfs_create(struct blkdev *lower, struct fs5600_super *sb)
+{
+    int bs = FS5600_BLOCK_SIZE(sb), sect = bs / BLOCK_SIZE;
+
+    if (sb->seg_sz < 4 || sb->n_segs < 2 * LFS_RESERVE + 2 ||
+        sb->num_blocks >= FS5600_LSUM_TRIM ||
+        (1 + (int64_t)sb->n_segs * sb->seg_sz) * sect >
+        lower->ops->num_blocks(lower)) {
+        fprintf(stderr, "bad log geometry\n");
+        return NULL;
+    }
+
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct lfs_dev *l = calloc(1, sizeof(*l));
+    assert(dev != NULL && l != NULL);
+    l->lower = lower;
+    l->bs = bs;
+    l->sect = sect;
+    l->nblks = sb->num_blocks;
+    l->seg_sz = sb->seg_sz;
+    l->n_segs = sb->n_segs;
+    l->map = calloc(l->nblks, sizeof(uint32_t));
+    l->rmap = calloc((size_t)l->n_segs * l->seg_sz, sizeof(uint32_t));
+    l->live = calloc(l->n_segs, sizeof(uint32_t));
+    l->stamp = calloc(l->n_segs, sizeof(uint32_t));
+    l->is_free = calloc(l->n_segs, 1);
+    l->free_segs = calloc(l->n_segs, sizeof(int64_t));
+    l->bg_low = l->n_segs / 8 > LFS_RESERVE + 2 ? l->n_segs / 8 :
+        LFS_RESERVE + 2;
+    l->cur = -1;
+    l->max_ent = LSUM_MAX(bs) < l->seg_sz - 1 ? LSUM_MAX(bs) : l->seg_sz - 1;
+    l->ent = calloc(l->max_ent, sizeof(uint32_t));
+    l->data = malloc((size_t)l->max_ent * bs);
+    for (l->hash_sz = 16; l->hash_sz < 2 * l->max_ent; l->hash_sz *= 2)
+        ;
+    l->hash = calloc(l->hash_sz, sizeof(int));
+    l->buf = malloc((size_t)l->seg_sz * bs);
+    l->segbuf = malloc((size_t)l->seg_sz * bs);
+    l->zero = calloc(1, bs);
+    assert(l->map && l->rmap && l->live && l->stamp && l->is_free &&
+           l->free_segs && l->ent && l->data && l->hash && l->buf &&
+           l->segbuf && l->zero);
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->cv, NULL);
+
+    recover(l);
+
+    dev->private = l;
+    dev->ops = &lfs_ops;
+    return dev;
+}
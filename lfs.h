@@ -0,0 +1,35 @@
+/*
+ * file:        lfs.h
+ * description: log-structured layout for CS 5600 hw3 - a blkdev stacked
+ *              on top of another one, which appends every block written
+ *              to the end of a log of segments and keeps a map from the
+ *              file system's (logical) block numbers to where in the
+ *              log their newest copies are, with a segment cleaner
+ *              making room for the log to go on.
+ */
+#ifndef __LFS_H__
+#define __LFS_H__
+
+#include "blkdev.h"
+#include "fs5600.h"
+
+/* Reads the segment summaries of the FS5600_FEAT_LOG image on 'lower'
+ * described by 'sb' to rebuild the block map, and returns a device of
+ * sb->num_blocks (logical) file system blocks; NULL if the geometry in
+ * 'sb' doesn't fit 'lower'. Nothing is written until the device is.
+ *
+ * Writes are collected into a chunk in memory, which is appended to
+ * the log when it is full, at a 'flush' once it is old enough, or at a
+ * 'sync'. Block 0 (the superblock) isn't part of the log: it is read
+ * from block 0 of 'lower' and written with 'write_super'.
+ */
+struct blkdev *lfs_create(struct blkdev *lower, struct fs5600_super *sb);
+
+/* where on 'lower' the newest copy of file system block 'blk' is, in
+ * file system blocks; -1 if it hasn't been written (or has been
+ * discarded) since mkfs, so that it reads as zeros. For tools that
+ * read the image themselves - nothing may have been written to 'dev'.
+ */
+int64_t lfs_where(struct blkdev *dev, int64_t blk);
+
+#endif
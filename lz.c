@@ -0,0 +1,149 @@
+/*
+ * file:        lz.c
+ * description: fast LZ77 block codec for compressed files in CS 5600
+ *              hw3, in the LZ4 block format.
+ *
+ * Each sequence is a token byte (literal count in the high nibble,
+ * match length - 4 in the low one; 15 means more length bytes follow,
+ * each adding up to 255), the literals, and a 2-byte little-endian
+ * match offset. The last sequence is literals only. The compressor
+ * finds matches with a single hash table of 4-byte prefixes, which
+ * is quick and does well on text and logs; as the format requires, the
+ * last 5 bytes are always literals and no match starts in the last 12.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_BITS  12
+#define MIN_MATCH  4
+#define MAX_OFFSET 65535
+#define MF_LIMIT   12           /* no match starts in the last 12 bytes */
+#define LAST_LITS  5            /* ... or covers the last 5 */
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t *put_len(uint8_t *op, int n)
+{
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+/* append a sequence - 'lits' literals from 'lit', then (unless mlen is
+ * 0) a match of 'mlen' bytes 'off' back - or return NULL if it
+ * won't fit before 'oend'
+ */
+static uint8_t *put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                        int lits, int off, int mlen)
+{
+    if (oend - op < 1 + lits + lits / 255 + 1 + 2 + mlen / 255 + 1)
+        return NULL;
+    uint8_t *token = op++;
+    *token = (lits < 15 ? lits : 15) << 4;
+    if (lits >= 15)
+        op = put_len(op, lits - 15);
+    memcpy(op, lit, lits);
+    op += lits;
+    if (mlen) {
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        mlen -= MIN_MATCH;
+        *token |= mlen < 15 ? mlen : 15;
+        if (mlen >= 15)
+            op = put_len(op, mlen - 15);
+    }
+    return op;
+}
+
+int lz_compress(const void *src, int len, void *dst, int cap)
+{
+    const uint8_t *in = src, *ip = in, *anchor = in, *end = in + len;
+    uint8_t *op = dst, *oend = op + cap;
+    uint32_t table[1 << HASH_BITS];
+
+    if (len > MF_LIMIT) {
+        const uint8_t *mflimit = end - MF_LIMIT, *mlimit = end - LAST_LITS;
+        memset(table, 0, sizeof(table));
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            int h = hash(seq);
+            const uint8_t *ref = in + table[h];
+            table[h] = ip - in;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+            while (ip > anchor && ref > in && ip[-1] == ref[-1])
+                ip--, ref--;
+            const uint8_t *p = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+            while (p < mlimit && *p == *r)
+                p++, r++;
+            op = put_seq(op, oend, anchor, ip - anchor, ip - ref, p - ip);
+            if (op == NULL)
+                return 0;
+            anchor = ip = p;
+        }
+    }
+    op = put_seq(op, oend, anchor, end - anchor, 0, 0);
+    return op ? op - (uint8_t *)dst : 0;
+}
+
+/* read the rest of a length that didn't fit in its nibble */
+static int get_len(const uint8_t **ip, const uint8_t *iend, int *n)
+{
+    int b;
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const void *src, int clen, void *dst, int cap)
+{
+    const uint8_t *ip = src, *iend = ip + clen;
+    uint8_t *op = dst, *oend = op + cap;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int lits = token >> 4, mlen = token & 15;
+        if (lits == 15 && get_len(&ip, iend, &lits) < 0)
+            return -1;
+        if (lits > iend - ip || lits > oend - op)
+            return -1;
+        memcpy(op, ip, lits);
+        op += lits;
+        ip += lits;
+        if (ip == iend)
+            break;              /* the last sequence has no match */
+
+        if (iend - ip < 2)
+            return -1;
+        int off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (mlen == 15 && get_len(&ip, iend, &mlen) < 0)
+            return -1;
+        mlen += MIN_MATCH;
+        if (off == 0 || off > op - (uint8_t *)dst || mlen > oend - op)
+            return -1;
+        const uint8_t *m = op - off;
+        while (mlen--)
+            *op++ = *m++;       /* may overlap, so byte by byte */
+    }
+    return op - (uint8_t *)dst;
+}
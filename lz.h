@@ -0,0 +1,21 @@
+/*
+ * file:        lz.h
+ * description: fast LZ77 block codec for compressed files in CS 5600
+ *              hw3 (the LZ4 block format: byte-aligned sequences of
+ *              literals and 64K-window matches, no entropy coding)
+ */
+#ifndef __LZ_H__
+#define __LZ_H__
+
+/* compress 'len' bytes from 'src' into at most 'cap' bytes at 'dst'.
+ * Returns the compressed length, or 0 if it doesn't fit.
+ */
+int lz_compress(const void *src, int len, void *dst, int cap);
+
+/* decompress 'clen' bytes from 'src' into at most 'cap' bytes at
+ * 'dst'. Returns the decompressed length, or -1 if the input is
+ * corrupt or doesn't fit.
+ */
+int lz_decompress(const void *src, int clen, void *dst, int cap);
+
+#endif
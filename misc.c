@@ -19,8 +19,10 @@
 #include <stddef.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <linux/falloc.h>
 #include <fuse.h>
 #include "blkdev.h"
+#include "trace.h"
 
 #include "fs5600.h"		/* only for BLOCK_SIZE */
 
@@ -30,24 +32,40 @@
  * structure.  
  */
 extern struct fuse_operations fs_ops;
+extern int64_t fs_trim(void);
+extern int64_t fs_copy_file_range(const char *path_in, off_t offset_in,
+                                  const char *path_out, off_t offset_out,
+                                  int64_t len, int flags);
+extern int fs_snapshot(const char *name);
+extern char *fs_snap_image, *fs_snap_name;
 
 struct blkdev *disk;
 struct data {
     char *image_name;
     int   cmd_mode;
+    char *trace_file;
+    char *snapshot;
 } _data;
 
 /*
  * See comments in /usr/include/fuse/fuse_opts.h for details of 
  * FUSE argument processing.
  * 
- *  usage: ./homework -image disk.img [-part #] directory
- *              disk.img  - name of the image file to mount
+ *  usage: ./homework -image disk.img [-trace file] [-snapshot name]
+ *                   [-part #] directory
+ *              disk.img  - name of the image file to mount, or of
+ *                          several, separated by commas, for a striped
+ *                          set made with mkfs-x6 (see stripe.h)
+ *              file      - record every fs_ops call to this trace file
+ *                          (see trace.h, and replay-x6 to play it back)
+ *              name      - mount this snapshot of the image, read-only
  *              directory - directory to mount it on
  */
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
     {"-cmdline", offsetof(struct data, cmd_mode), 1},
+    {"-trace %s", offsetof(struct data, trace_file), 0},
+    {"-snapshot %s", offsetof(struct data, snapshot), 0},
 
     FUSE_OPT_END
 };
@@ -121,9 +139,7 @@ int do_pwd(char *argv[])
     return 0;
 }
 
-#define DIRENTS_PER_BLOCK (FS_BLOCK_SIZE / sizeof(struct fs5600_dirent))
-
-char lsbuf[DIRENTS_PER_BLOCK][64];
+char lsbuf[DIRENTS_PER_BLK(FS5600_MAX_BLOCK_SIZE)][64];
 int  lsi;
 
 void init_ls(void)
@@ -167,7 +183,8 @@ static int dashl_filler(void *buf, const char *name, const struct stat *sb, off_
 {
     char mode[16];
     sprintf(lsbuf[lsi++], "%s %s %lld %lld\n",
-	   name, strmode(mode, sb->st_mode), sb->st_size, sb->st_blocks);
+	   name, strmode(mode, sb->st_mode), (long long)sb->st_size,
+	   (long long)sb->st_blocks);
     return 0;
 }
 
@@ -242,7 +259,8 @@ int do_put(char *argv[])
 {
     char *outside = argv[0], *inside = argv[1];
     char path[128];
-    int len, fd, offset = 0, val;
+    int len, fd, val;
+    off_t offset = 0;
 
     if ((fd = open(outside, O_RDONLY, 0)) < 0)
 	return fd;
@@ -259,6 +277,8 @@ int do_put(char *argv[])
 	offset += len;
     }
     close(fd);
+    if (val >= 0)
+	val = fs_ops.flush(path, NULL);    /* as close() would */
     return (val >= 0) ? 0 : val;
 }
 
@@ -272,7 +292,8 @@ int do_get(char *argv[])
 {
     char *inside = argv[0], *outside = argv[1];
     char path[128];
-    int len, fd, offset = 0;
+    int len, fd;
+    off_t offset = 0;
 
     if ((fd = open(outside, O_WRONLY|O_CREAT|O_TRUNC, 0777)) < 0)
 	return fd;
@@ -301,7 +322,8 @@ int do_show(char *argv[])
 {
     char *file = argv[0];
     char path[128];
-    int len, offset = 0;
+    int len;
+    off_t offset = 0;
 
     sprintf(path, "%s/%s", cwd, file);
     fix_path(path);
@@ -313,6 +335,74 @@ int do_show(char *argv[])
     return (len >= 0) ? 0 : len;
 }
 
+static int _falloc(char *argv[], int mode)
+{
+    char path[128];
+    if (snprintf(path, sizeof(path), "%s/%s", cwd, argv[0]) >= sizeof(path))
+	return -ENAMETOOLONG;
+    fix_path(path);
+    return fs_ops.fallocate(path, mode, strtoll(argv[1], NULL, 0),
+			    strtoll(argv[2], NULL, 0), NULL);
+}
+
+int do_falloc(char *argv[])
+{
+    return _falloc(argv, 0);
+}
+
+int do_falloc_k(char *argv[])
+{
+    return _falloc(argv, FALLOC_FL_KEEP_SIZE);
+}
+
+int do_clone(char *argv[])
+{
+    char src[128], dst[128];
+    struct stat sb;
+    int64_t val = 0;
+    off_t offset = 0;
+
+    if (snprintf(src, sizeof(src), "%s/%s", cwd, argv[0]) >= sizeof(src) ||
+	snprintf(dst, sizeof(dst), "%s/%s", cwd, argv[1]) >= sizeof(dst))
+	return -ENAMETOOLONG;
+    fix_path(src);
+    fix_path(dst);
+    if ((val = fs_ops.getattr(src, &sb)) != 0)
+	return val;
+    if ((val = fs_ops.mknod(dst, sb.st_mode, 0)) != 0)
+	return val;
+    while (offset < sb.st_size &&
+	   (val = fs_copy_file_range(src, offset, dst, offset,
+				     sb.st_size - offset, 0)) > 0)
+	offset += val;
+    if (val >= 0)
+	val = fs_ops.flush(dst, NULL);
+    return (val >= 0) ? 0 : val;
+}
+
+int do_copy(char *argv[])
+{
+    char src[128], dst[128];
+    int64_t val;
+
+    if (snprintf(src, sizeof(src), "%s/%s", cwd, argv[0]) >= sizeof(src) ||
+	snprintf(dst, sizeof(dst), "%s/%s", cwd, argv[2]) >= sizeof(dst))
+	return -ENAMETOOLONG;
+    fix_path(src);
+    fix_path(dst);
+    val = fs_copy_file_range(src, strtoll(argv[1], NULL, 0), dst,
+			     strtoll(argv[3], NULL, 0),
+			     strtoll(argv[4], NULL, 0), 0);
+    if (val >= 0)
+	printf("copied %lld bytes\n", (long long)val);
+    return (val >= 0) ? 0 : val;
+}
+
+int do_snapshot(char *argv[])
+{
+    return fs_snapshot(argv[0]);
+}
+
 int do_statfs(char *argv[])
 {
     struct statvfs st;
@@ -323,6 +413,12 @@ int do_statfs(char *argv[])
     return retval;
 }
 
+int do_fstrim(char *argv[])
+{
+    printf("trimmed %lld blocks\n", (long long)fs_trim());
+    return 0;
+}
+
 void _blksiz(int size)
 {
     blksiz = size;
@@ -360,7 +456,13 @@ struct {
     {"get", 2, do_get, "get <inside> <outside> - retrieve a file from file system to local directory"},
     {"get", 1, do_get1, "get <name> - ditto, but keep the same name"},
     {"show", 1, do_show, "show <file> - retrieve and print a file"},
+    {"falloc", 3, do_falloc, "falloc <file> <offset> <len> - allocate (zeroed) space"},
+    {"falloc-k", 3, do_falloc_k, "falloc-k <file> <offset> <len> - ditto, but keep the size"},
+    {"clone", 2, do_clone, "clone <file> <newfile> - copy a file, sharing its blocks with dedup"},
+    {"copy", 5, do_copy, "copy <file> <offset> <file2> <offset2> <len> - copy part of a file"},
+    {"snapshot", 1, do_snapshot, "snapshot <name> - take a snapshot of the file system"},
     {"statfs", 0, do_statfs, "statfs - print file system info"},
+    {"fstrim", 0, do_fstrim, "fstrim - discard all free blocks"},
     {"blksiz", 1, do_blksiz, "blksiz - set read/write block size"},
     {0, 0, 0}
 };
@@ -445,15 +547,28 @@ int main(int argc, char **argv)
         printf("cannot open image file '%s': %s\n", file, strerror(errno));
         exit(1);
     }
+    fs_snap_image = file;
+    if ((fs_snap_name = _data.snapshot) != NULL)
+        fuse_opt_add_arg(&args, "-oro");
+
+    if (_data.trace_file && trace_start(_data.trace_file, &fs_ops) < 0) {
+        printf("cannot open trace file '%s': %s\n", _data.trace_file,
+               strerror(errno));
+        exit(1);
+    }
 
     if (_data.cmd_mode) {
         fs_ops.init(NULL);
         _blksiz(1000);
         cmdloop();
+        fs_ops.destroy(NULL);
+        trace_stop();
         return 0;
     }
 
-    return fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    int retval = fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    trace_stop();
+    return retval;
 }
 
 
@@ -12,94 +12,262 @@
 #include <errno.h>
 #include <ctype.h>
 #include <assert.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "fs5600.h"
+#include "lfs.h"
+#include "snap.h"
+#include "stripe.h"
 
-char *disk;
-
-/* handle K/M
+/* handle K/M/G/T
  */
-int parseint(char *s)
+int64_t parseint(char *s)
 {
-    int n = strtol(s, &s, 0);
-    if (tolower(*s) == 'k')
-        return n * 1024;
-    if (tolower(*s) == 'm')
-        return n * 1024 * 1024;
+    int64_t n = strtoll(s, &s, 0);
+    switch (tolower(*s)) {
+    case 't': n *= 1024;  /* fall through */
+    case 'g': n *= 1024;  /* fall through */
+    case 'm': n *= 1024;  /* fall through */
+    case 'k': n *= 1024;
+    }
     return n;
 }
 
 #define DIV_ROUND_UP(n, m) ((n) + (m) - 1) / (m)
 
-/* usage: mkfs-x6 [-size #] file.img
- * If file doesn't exist, create with size '#' (K and M suffixes allowed)
+int bs = FS_BLOCK_SIZE;         /* block size */
+struct blkdev *log_dev;         /* with -log, blocks after 0 go here */
+struct blkdev *stripe_dev;      /* a striped set, instead of 'fd' */
+
+static void write_blk(int fd, int64_t blk, void *buf)
+{
+    int sect = bs / BLOCK_SIZE;
+
+    if (log_dev && blk != 0) {
+        log_dev->ops->write(log_dev, blk * sect, sect, buf);
+        return;
+    }
+    if (stripe_dev && blk == 0) {  /* the rest of block 0 is zeros */
+        stripe_dev->ops->write_super(stripe_dev, buf);
+        return;
+    }
+    if (stripe_dev) {
+        stripe_dev->ops->write(stripe_dev, blk * sect, sect, buf);
+        return;
+    }
+    if (pwrite(fd, buf, bs, (off_t)blk * bs) != bs) {
+        perror("mkfs-x6: write");
+        exit(1);
+    }
+}
+
+/* write the 'nblks' blocks of a bitmap starting at block 'base', with
+ * the first 'nset' bits set. All-zero blocks aren't written - the
+ * image has just been truncated, so they read back as zeros without
+ * being allocated, which keeps mkfs of a multi-TB image quick.
+ */
+static void write_bitmap(int fd, int64_t base, int64_t nblks, int64_t nset)
+{
+    char *buf = malloc(bs);
+    int64_t i, bits = 8 * bs;
+    int j;
+
+    for (i = 0; i < nblks && i * bits < nset; i++) {
+        memset(buf, 0, bs);
+        for (j = 0; j < bits && i * bits + j < nset; j++)
+            FD_SET(j, (fd_set*)buf);
+        write_blk(fd, base + i, buf);
+    }
+    free(buf);
+}
+
+/* usage: mkfs-x6 [-size #] [-bs #] [-large] [-journal #] [-compress]
+ *                [-dedup] [-inline] [-log] [-stripe #]
+ *                file.img | a.img,b.img,...
+ * If file doesn't exist, create with size '#' (K, M, G and T suffixes
+ * allowed). -bs sets the block size (a power of 2 from 1K to 64K,
+ * default 1K). -large enables the inode variant with 64-bit sizes and
+ * triple indirect blocks (FS5600_FEAT_LARGE_FILE). -journal reserves a
+ * metadata journal of '#' blocks after the inode table
+ * (FS5600_FEAT_JOURNAL). -compress makes the file system compress the
+ * files created on it (FS5600_FEAT_COMPRESS). -dedup adds a table of
+ * block reference counts after the inodes, so that files can share
+ * identical blocks (FS5600_FEAT_DEDUP). -inline uses 256-byte inodes,
+ * which hold the data of files up to 192 bytes (FS5600_FEAT_INLINE).
+ * -log makes the image a log of 256K (or 16-block) segments (see
+ * lfs.c, FS5600_FEAT_LOG), with a file system of 80% of its size.
+ * Given several files separated by commas, creates a striped set of
+ * them (stripe.h) of about '#' in all, with a stripe unit of -stripe
+ * bytes (a multiple of the block size, default 64K).
  */
 int main(int argc, char **argv)
 {
-    int i, fd = -1, size = 0;
-    if (!strcmp(argv[1], "-size") && argc >= 3) {
-        size = parseint(argv[2]);
-        argv += 2;
-        argc -= 2;
+    int fd = -1, features = 0;
+    int64_t size = 0, n_jnl_blks = 0, unit = 65536;
+
+    for (argc--, argv++; argc > 1; argc--, argv++) {
+        if (!strcmp(argv[0], "-size") && argc > 2) {
+            size = parseint(argv[1]);
+            argc--, argv++;
+        } else if (!strcmp(argv[0], "-bs") && argc > 2) {
+            bs = parseint(argv[1]);
+            argc--, argv++;
+        } else if (!strcmp(argv[0], "-journal") && argc > 2) {
+            n_jnl_blks = parseint(argv[1]);
+            features |= FS5600_FEAT_JOURNAL;
+            argc--, argv++;
+        } else if (!strcmp(argv[0], "-stripe") && argc > 2) {
+            unit = parseint(argv[1]);
+            argc--, argv++;
+        } else if (!strcmp(argv[0], "-large"))
+            features |= FS5600_FEAT_LARGE_FILE;
+        else if (!strcmp(argv[0], "-compress"))
+            features |= FS5600_FEAT_COMPRESS;
+        else if (!strcmp(argv[0], "-dedup"))
+            features |= FS5600_FEAT_DEDUP;
+        else if (!strcmp(argv[0], "-inline"))
+            features |= FS5600_FEAT_INLINE;
+        else if (!strcmp(argv[0], "-log"))
+            features |= FS5600_FEAT_LOG;
+        else
+            break;
     }
 
-    if (argc == 2) {
-        fd = open(argv[1], O_WRONLY | O_CREAT, 0777);
+    /* the snapshots would be left pointing at blocks of another file
+     * system
+     */
+    char **snaps;
+    if (argc == 1 && snap_list(argv[0], &snaps) > 0) {
+        printf("%s has snapshots - delete them first (snap-x6)\n", argv[0]);
+        exit(1);
+    }
+    int striped = argc == 1 && strchr(argv[0], ',') != NULL;
+    if (striped && size > 0 && unit > 0 && unit % bs == 0 &&
+        FS5600_VALID_BLOCK_SIZE(bs)) {
+        int64_t val = stripe_format(argv[0], size, unit);
+        if (val < 0) {
+            printf("mkfs-x6: can't create %s: %s\n", argv[0],
+                   val == -EINVAL ? "too small for a stripe" :
+                   strerror(-val));
+            exit(1);
+        }
+        size = val;
+        if ((stripe_dev = image_create(argv[0])) == NULL)
+            exit(1);
+    } else if (argc == 1 && !striped) {
+        fd = open(argv[0], O_WRONLY | O_CREAT, 0777);
         if (fd >= 0 && size == 0) {
             struct stat sb;
             fstat(fd, &sb);
             size = sb.st_size;
         }
     }
-    if (fd < 0) {
-        printf("usage: mkfs-x6 [-size #] file.img\n");
+    if ((fd < 0 && stripe_dev == NULL) || !FS5600_VALID_BLOCK_SIZE(bs) ||
+        ((features & FS5600_FEAT_JOURNAL) && n_jnl_blks < 16)) {
+        printf("usage: mkfs-x6 [-size #] [-bs #] [-large] [-journal #] "
+               "[-compress] [-dedup] [-inline] [-log] [-stripe #] "
+               "file.img | a.img,b.img,...\n");
         exit(1);
     }
 
-    if (size % FS_BLOCK_SIZE != 0)
-        printf("WARNING: disk size not a multiple of block size: %d (0x%x)\n",
-               size, size);
-    int n_blks = size / FS_BLOCK_SIZE;
-    int n_map_blks = DIV_ROUND_UP(n_blks, 8*FS_BLOCK_SIZE);
-    int n_inos = n_blks / 4;
-    int n_ino_map_blks = DIV_ROUND_UP(n_inos, 8*FS_BLOCK_SIZE);
-    int n_ino_blks = DIV_ROUND_UP(n_inos*sizeof(struct fs5600_inode),
-                                  FS_BLOCK_SIZE);
-
-    disk = malloc(n_blks * FS_BLOCK_SIZE);
-    memset(disk, 0, n_blks * FS_BLOCK_SIZE);
+    if (size % bs != 0)
+        printf("WARNING: disk size not a multiple of block size: %lld (0x%llx)\n",
+               (long long)size, (long long)size);
+    int64_t n_blks = size / bs, n_phys = n_blks;
+    if (n_blks > UINT32_MAX) {
+        printf("mkfs-x6: at most %lld blocks supported\n", (long long)UINT32_MAX);
+        exit(1);
+    }
 
-    struct fs5600_super *sb = (void*)disk;
+    /* the file system is logical blocks in the log: 80% of it, less a
+     * segment being filled and two kept for the cleaner
+     */
+    int64_t seg_sz = 0, n_segs = 0;
+    if (features & FS5600_FEAT_LOG) {
+        seg_sz = 262144 / bs > 16 ? 262144 / bs : 16;
+        n_segs = (n_phys - 1) / seg_sz;
+        if (n_segs < 8) {
+            printf("mkfs-x6: too small for a log of %lld-block segments\n",
+                   (long long)seg_sz);
+            exit(1);
+        }
+        n_blks = (n_segs - 3) * seg_sz * 4 / 5;
+        if (n_blks >= FS5600_LSUM_TRIM)
+            n_blks = FS5600_LSUM_TRIM - 1;
+    }
+    int64_t n_map_blks = DIV_ROUND_UP(n_blks, 8*bs);
+    int64_t n_inos = n_blks / 4;
+    if (n_inos > (1 << 30))     /* 30-bit inode numbers in dirents */
+        n_inos = 1 << 30;
+    int64_t n_ino_map_blks = DIV_ROUND_UP(n_inos, 8*bs);
+    int inode_size = (features & FS5600_FEAT_INLINE) ? 256 :
+        sizeof(struct fs5600_inode);
+    int64_t n_ino_blks = DIV_ROUND_UP(n_inos*inode_size, bs);
 
-    int inode_map_base = 1;
-    fd_set *inode_map = (void*)(disk + inode_map_base*FS_BLOCK_SIZE);
+    int64_t inode_map_base = 1;
+    int64_t block_map_base = inode_map_base + n_ino_map_blks;
+    int64_t inode_base = block_map_base + n_map_blks;
+    int64_t dedup_base = inode_base + n_ino_blks;
+    int64_t n_dedup_blks = (features & FS5600_FEAT_DEDUP) ?
+        DIV_ROUND_UP(n_blks, DEDUP_PER_BLK(bs)) : 0;
+    int64_t jnl_base = dedup_base + n_dedup_blks;
+    int64_t rootdir_base = jnl_base + n_jnl_blks;
+    if (rootdir_base >= n_blks) {
+        printf("mkfs-x6: file system too small\n");
+        exit(1);
+    }
 
-    int block_map_base = inode_map_base + n_ino_map_blks;
-    fd_set *block_map = (void*)(disk + block_map_base*FS_BLOCK_SIZE);
-    
-    int inode_base = block_map_base + n_map_blks;
-    struct fs5600_inode *inodes = (void*)(disk + inode_base*FS_BLOCK_SIZE);
+    /* start from an all-zero (sparse) file of the right size - as
+     * stripe_format has left the members of a striped set
+     */
+    if (fd >= 0 && (ftruncate(fd, 0) < 0 || ftruncate(fd, n_phys * bs) < 0)) {
+        perror("mkfs-x6: truncate");
+        exit(1);
+    }
 
-    int rootdir_base = inode_base + n_ino_blks;
-    //struct fs5600_dirent *de = (void*)(disk + rootdir_base*FS_BLOCK_SIZE);
+    /* superblock, at the start of block 0 */
+    char *blk0 = calloc(1, bs);
+    *(struct fs5600_super *)blk0 =
+        (struct fs5600_super){.magic = FS5600_MAGIC,
+                              .inode_map_sz = n_ino_map_blks,
+                              .inode_region_sz = n_ino_blks,
+                              .block_map_sz = n_map_blks,
+                              .num_blocks = n_blks, .root_inode = 1,
+                              .features = features, .block_size = bs,
+                              .journal_start = n_jnl_blks ? jnl_base : 0,
+                              .journal_sz = n_jnl_blks,
+                              .dedup_sz = n_dedup_blks,
+                              .inode_size = (features & FS5600_FEAT_INLINE) ?
+                                            inode_size : 0,
+                              .seg_sz = seg_sz, .n_segs = n_segs};
+    write_blk(fd, 0, blk0);
+    if (features & FS5600_FEAT_LOG)
+        log_dev = lfs_create(stripe_dev ? stripe_dev : image_create(argv[0]),
+                             (void*)blk0);
 
-    /* superblock */
-    *sb = (struct fs5600_super){.magic = FS5600_MAGIC, .inode_map_sz = n_ino_map_blks,
-                                .inode_region_sz = n_ino_blks,
-                                .block_map_sz = n_map_blks,
-                                .num_blocks = n_blks, .root_inode = 1};
+    /* empty journal - replay starts with transaction 1 at block 1 */
+    if (n_jnl_blks) {
+        char *jblk = calloc(1, bs);
+        *(struct fs5600_jsuper *)jblk =
+            (struct fs5600_jsuper){.magic = FS5600_JSUPER_MAGIC,
+                                   .seq = 1, .start = 1};
+        write_blk(fd, jnl_base, jblk);
+        free(jblk);
+    }
 
     /* bitmaps */
-    FD_SET(0, inode_map);
-    FD_SET(1, inode_map);
-    for (i = 0; i <= rootdir_base; i++)
-        FD_SET(i, block_map);
+    write_bitmap(fd, inode_map_base, n_ino_map_blks, 2);
+    write_bitmap(fd, block_map_base, n_map_blks, rootdir_base + 1);
 
+    /* first block of inodes, holding the root directory (inode 1) */
+    char *inodes = calloc(1, bs);
     int t  = time(NULL);
-    inodes[1] = (struct fs5600_inode){.uid = 1001, .gid = 125, .mode = 0040777, 
-                                      .ctime = t, .mtime = t, .size = 1024,
+    *FS5600_INODE(inodes, inode_size, 1) = (struct fs5600_inode){.uid = 1001, .gid = 125, .mode = 0040777, 
+                                      .ctime = t, .mtime = t, .size = bs,
                                       .direct = {rootdir_base, 0, 0, 0, 0, 0},
                                       .indir_1 = 0, .indir_2 = 0};
+    write_blk(fd, inode_base, inodes);
 
     /* remember (from /usr/include/i386-linux-gnu/bits/stat.h)
      *    S_IFDIR = 0040000 - directory
@@ -109,14 +277,15 @@ int main(int argc, char **argv)
      *       1 - inode map
      *       2 - block map
      *       3,4,5,6 - inodes
-     *       7 - root directory (inode 1)
+     *       7 - root directory (inode 1) - empty, so left as zeros
+     * with -dedup and -journal, the dedup table (all zeros to start
+     * with) and then the journal go between the inodes and the root
+     * directory.
      */
-                      
-
-    assert(size == n_blks* FS_BLOCK_SIZE);
-    write(fd, disk, size);
-    close(fd);
+    if (log_dev)
+        log_dev->ops->sync(log_dev);
+    if (fd >= 0)
+        close(fd);
 
     return 0;
 }
-
@@ -17,28 +17,82 @@ char *disk;
 fd_set *inode_map;
 fd_set *block_map;
 void *next_ptr;
+int bs = FS_BLOCK_SIZE;
 
+static void *ptr;               /* next free block */
+
+static uint32_t alloc_blk(void)
+{
+    uint32_t blk = (ptr - (void*)disk) / bs;
+    ptr += bs;
+    return blk;
+}
+
+static void *blk_ptr(uint32_t blk)
+{
+    return disk + (size_t)blk * bs;
+}
+
+/* lay out a file of 'size' bytes filled with 'c': its indirect blocks
+ * first, then the data blocks contiguously in logical order.
+ */
+static void place_file(struct fs5600_inode *in, int size, char c)
+{
+    int n = (size + bs - 1) / bs, p = PTRS_PER_BLK(bs), i, j, k = 0;
+    uint32_t *ind1 = NULL, *ind2 = NULL;
+    uint32_t ind2_kids[p];
+
+    if (n > N_DIRECT)
+        ind1 = blk_ptr(in->indir_1 = alloc_blk());
+    if (n > N_DIRECT + p) {
+        ind2 = blk_ptr(in->indir_2 = alloc_blk());
+        for (i = 0; i * p < n - N_DIRECT - p; i++)
+            ind2[i] = ind2_kids[i] = alloc_blk();
+    }
+    char *data = ptr;
+    for (i = 0; i < N_DIRECT && k < n; i++, k++)
+        in->direct[i] = alloc_blk();
+    for (i = 0; i < p && k < n; i++, k++)
+        ind1[i] = alloc_blk();
+    for (i = 0; k < n; i++)
+        for (j = 0; j < p && k < n; j++, k++)
+            ((uint32_t *)blk_ptr(ind2_kids[i]))[j] = alloc_blk();
+    memset(data, c, size);
+}
+
+/* usage: mktest [-bs #] file.img
+ */
 int main(int argc, char **argv)
 {
     int i;
+
+    if (argc == 4 && !strcmp(argv[1], "-bs")) {
+        bs = atoi(argv[2]);
+        argv += 2, argc -= 2;
+    }
+    if (argc != 2 || !FS5600_VALID_BLOCK_SIZE(bs)) {
+        fprintf(stderr, "usage: mktest [-bs #] file.img\n");
+        exit(1);
+    }
     char *file = argv[1];
 
     int n_blks = 1024;
     int n_inos = 64;
-    int n_ino_blks = n_inos * sizeof(struct fs5600_inode) / FS_BLOCK_SIZE;
+    int n_ino_blks = (n_inos * sizeof(struct fs5600_inode) + bs - 1) / bs;
 
-    disk = malloc(n_blks * FS_BLOCK_SIZE);
-    memset(disk, 0, n_blks * FS_BLOCK_SIZE);
+    disk = malloc(n_blks * bs);
+    memset(disk, 0, n_blks * bs);
     
     struct fs5600_super *sb = (void*)disk;
-    void *ptr = disk + FS_BLOCK_SIZE;
+    ptr = disk + bs;
     
-    inode_map = ptr; ptr += FS_BLOCK_SIZE;
-    block_map = ptr; ptr += FS_BLOCK_SIZE;
+    inode_map = ptr; ptr += bs;
+    block_map = ptr; ptr += bs;
 
     *sb = (struct fs5600_super){.magic = FS5600_MAGIC, .inode_map_sz = 1,
                                 .inode_region_sz = n_ino_blks, .block_map_sz = 1,
-                                .num_blocks = n_blks, .root_inode = 1};
+                                .num_blocks = n_blks, .root_inode = 1,
+                                .block_size = bs};
     FD_SET(0, inode_map);
 
     /* remember (from /usr/include/i386-linux-gnu/bits/stat.h)
@@ -48,25 +102,25 @@ int main(int argc, char **argv)
     /* block 0 - superblock
      *       1 - inode map
      *       2 - block map
-     *       3,4,5,6 - inodes
+     *       3,4,5,6 - inodes (with 1K blocks)
      *       7 - root directory (inode 1)
      *      [8 - file]
      */
                       
-    struct fs5600_inode *inodes = ptr; ptr += 4*FS_BLOCK_SIZE;
+    struct fs5600_inode *inodes = ptr; ptr += n_ino_blks*bs;
 
     /* root directory
      */
     int inum = 1;
     int root_inum = inum++;
     FD_SET(root_inum, inode_map);
-    int root_blk = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    struct fs5600_dirent *root_de = ptr; ptr += FS_BLOCK_SIZE;
+    int root_blk = alloc_blk();
+    struct fs5600_dirent *root_de = blk_ptr(root_blk);
 
     int t = 0x50000000;
     inodes[root_inum] = (struct fs5600_inode){.uid = 1000, .gid = 1000, .mode = 0040777, 
                                               .ctime = t, .mtime = t,
-                                              .size = 1024,
+                                              .size = bs,
                                               .direct = {root_blk, 0, 0, 0, 0, 0},
                                               .indir_1 = 0, .indir_2 = 0};
 
@@ -79,15 +133,12 @@ int main(int argc, char **argv)
 
     root_de[1] = (struct fs5600_dirent){.valid = 1, .isDir = 0,
                                         .inode = f1_inode, .name = "file.A"};
-    int f1_blk = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    void *f1_ptr = ptr; ptr += FS_BLOCK_SIZE;
-    
-    memset(f1_ptr, 'A', 1000);
     inodes[f1_inode] = (struct fs5600_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
                                              .ctime = t+200, .mtime = t+200,
                                              .size = 1000,
-                                             .direct = {f1_blk, 0, 0, 0, 0, 0},
+                                             .direct = {0, 0, 0, 0, 0, 0},
                                              .indir_1 = 0, .indir_2 = 0};
+    place_file(&inodes[f1_inode], 1000, 'A');
     /* "/dir1/", directory, permission 755
      * note invalid directory entry for testing...
      */
@@ -96,8 +147,8 @@ int main(int argc, char **argv)
                                         .inode = f1_inode, .name = "dir1"};
     root_de[5] = (struct fs5600_dirent){.valid = 1, .isDir = 1,
                                         .inode = d1_inode, .name = "dir1"};
-    int d1_blk = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    struct fs5600_dirent *d1_de = ptr; ptr += FS_BLOCK_SIZE;
+    int d1_blk = alloc_blk();
+    struct fs5600_dirent *d1_de = blk_ptr(d1_blk);
     
     inodes[d1_inode] = (struct fs5600_inode){.uid = 1000, .gid = 1000, .mode = 0040755, 
                                              .ctime = t+400, .mtime = t+400,
@@ -105,22 +156,25 @@ int main(int argc, char **argv)
                                              .direct = {d1_blk, 0, 0, 0, 0, 0},
                                              .indir_1 = 0, .indir_2 = 0};
 
-    /* "/dir1/file.2", file, 2012 bytes
+    /* "/dir1/file.2", file, 2012 bytes, with its direct blocks in
+     * reverse order
      */
     int f2_inode = inum++;
-    int f2_blk1 = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    void *f2_ptr = ptr; ptr += FS_BLOCK_SIZE;
-    int f2_blk2 = (ptr - (void*)disk) / FS_BLOCK_SIZE; ptr += FS_BLOCK_SIZE;
-
     d1_de[3] = (struct fs5600_dirent){.valid = 1, .isDir = 0,
                                         .inode = f2_inode, .name = "file.2"};
 
-    memset(f2_ptr, '2', 2 * FS_BLOCK_SIZE);
     inodes[f2_inode] = (struct fs5600_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
                                              .ctime = t+200, .mtime = t+200,
                                              .size = 2012,
-                                             .direct = {f2_blk2, f2_blk1, 0, 0, 0, 0},
+                                             .direct = {0, 0, 0, 0, 0, 0},
                                              .indir_1 = 0, .indir_2 = 0};
+    place_file(&inodes[f2_inode], 2012, '2');
+    int f2_n = (2012 + bs - 1) / bs;
+    for (i = 0; i < f2_n / 2; i++) {
+        uint32_t tmp = inodes[f2_inode].direct[i];
+        inodes[f2_inode].direct[i] = inodes[f2_inode].direct[f2_n - 1 - i];
+        inodes[f2_inode].direct[f2_n - 1 - i] = tmp;
+    }
 
     /* "/dir1/file.0", zero-length file
      */
@@ -136,37 +190,19 @@ int main(int argc, char **argv)
     /* "/file.7", 7KB file
      */
     int f4_inode = inum++;
-    int f4_indirN = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    int *f4_indir = ptr; ptr += FS_BLOCK_SIZE;
-    int f4_blk0 = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    void *f4_data = ptr; ptr += 7*FS_BLOCK_SIZE;
-
     root_de[6] = (struct fs5600_dirent){.valid = 1, .isDir = 0,
                                         .inode = f4_inode, .name = "file.7"};
     inodes[f4_inode] = (struct fs5600_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
                                              .ctime = t+300, .mtime = t+300,
                                              .size = 6*1024 + 500,
                                              .direct = {0, 0, 0, 0, 0, 0},
-                                             .indir_1 = f4_indirN, .indir_2 = 0};
-    for (i = 0; i < 6; i++)
-        inodes[f4_inode].direct[i] = f4_blk0++;
-    f4_indir[0] = f4_blk0;
-    memset(f4_data, '4', 6*1024+500);
+                                             .indir_1 = 0, .indir_2 = 0};
+    place_file(&inodes[f4_inode], 6*1024 + 500, '4');
 
-    /* "/dir1/file.270", 270KB file
+    /* "/dir1/file.270", 270KB file - with 1K blocks that is 6 direct,
+     * 256 single indirect and 8 double indirect blocks
      */
-    
     int f5_inode = inum++;
-    int f5_indN1 = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    int *f5_indir1 = ptr; ptr += FS_BLOCK_SIZE;
-    int f5_indN2 = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    int *f5_indir2 = ptr; ptr += FS_BLOCK_SIZE;
-    int f5_indN2_0 = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    int *f5_indir2_0 = ptr; ptr += FS_BLOCK_SIZE;
-    
-    int f5_blk0 = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    void *f5_data = ptr; ptr += 270*FS_BLOCK_SIZE;
-
     d1_de[6] = (struct fs5600_dirent){.valid = 1, .isDir = 0,
                                       .inode = f5_inode, .name = "file.270"};
     inodes[f5_inode] = (struct fs5600_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
@@ -174,28 +210,15 @@ int main(int argc, char **argv)
                                              .size = 269*1024 + 721,
                                              .direct = {0, 0, 0, 0, 0, 0},
                                              .indir_1 = 0, .indir_2 = 0};
-    for (i = 0; i < 6; i++)
-        inodes[f5_inode].direct[i] = f5_blk0++;
-    inodes[f5_inode].indir_1 = f5_indN1;
-    for (i = 0; i < 256; i++)
-        f5_indir1[i] = f5_blk0++;
-
-    /* 270 - 6 - 256 = 8
-     */
-    inodes[f5_inode].indir_2 = f5_indN2;
-    f5_indir2[0] = f5_indN2_0;
-    for (i = 0; i < 8; i++)
-        f5_indir2_0[i] = f5_blk0++;
-    
-    memset(f5_data, 'K', 269*1024+721);
+    place_file(&inodes[f5_inode], 269*1024 + 721, 'K');
 
     for (i = 0; i < inum; i++)
         FD_SET(i, inode_map);
-    for (i = 0; i < (ptr - (void*)disk)/FS_BLOCK_SIZE; i++)
+    for (i = 0; i < (ptr - (void*)disk)/bs; i++)
         FD_SET(i, block_map);
 
     int fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0777);
-    write(fd, disk, n_blks * FS_BLOCK_SIZE);
+    write(fd, disk, n_blks * bs);
     close(fd);
 
     return 0;
@@ -1,157 +1,899 @@
 /*
  * file:        read-img.c
- * description: read and print summary of cs5600/cs7600 file system
- *              volume. 
+ * description: read and check a cs5600/cs7600 file system volume.
+ *
+ * The image is mmap'ed rather than read into memory, so the checker's
+ * footprint is the reference bitmaps plus the directory work queue,
+ * not the size of the volume. On a log-structured image each block is
+ * found through the block map lfs.c rebuilds from the segment
+ * summaries, and with -snapshot the blocks the snapshot saved are
+ * found in its (mapped) file instead. A striped set of images
+ * (several names separated by commas, see stripe.h) has each member
+ * mapped, and array blocks are found on them the way stripe.c does.
+ * The directory tree is walked by a pool of worker threads sharing a
+ * dynamic work queue; each worker verifies the inodes and indirect
+ * trees it pulls off the queue, and the bitmap cross-check is then
+ * split across the same number of threads.
+ *
+ * usage: read-img [-j threads] [-json] [-v] [--layout] [-snapshot name]
+ *                 file.img | a.img,b.img,...
+ *     -j N     - number of worker threads (default: one per CPU)
+ *     -json    - print a machine-readable summary (with timings) on stdout
+ *     -v       - list every directory and file as it is checked
+ *     --layout - also report fragmentation: extents and seek distance
+ *                per file, contiguous and free run length histograms,
+ *                inode-to-data distance, and the worst files
+ *     -snapshot NAME - check that snapshot of the image instead, with
+ *                its saved blocks read over a private mapping
+ *
+ * Either way the snapshots of the image (see snap.h) are checked
+ * against it, and the blocks each one still shares with it counted.
  */
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fuse.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "fs5600.h"
+#include "layout.h"
+#include "lfs.h"
+#include "snap.h"
+#include "stripe.h"
 
-int main(int argc, char **argv)
+/* the mapped image and the parameters we check everything against
+ */
+char *disk;
+char **members;                 /* striped set: the mapped members, */
+off_t *member_size;
+int n_members;                  /* 0 for a single image */
+int64_t stripe_unit;
+struct blkdev *log_dev;         /* FS5600_FEAT_LOG: where blocks are */
+struct snap_info snap;          /* -snapshot */
+char *snap_data;                /* its file, mapped */
+char *zero_blk;                 /* unwritten blocks of a log read as this */
+struct fs5600_super *sb;
+uint32_t bs;                    /* block size */
+uint32_t isz;                   /* inode size */
+uint32_t ptrs_per_blk, dirents_per_blk;
+uint32_t inode_map_start, block_map_start, inode_start, dedup_start;
+uint32_t n_inodes;              /* size of the inode table */
+uint32_t data_start;            /* first block after the inode table */
+
+/* reference bitmaps - bit N is set when block (inode) N is reached
+ * from the root. Set with atomic OR, since workers share them.
+ */
+uint8_t *blk_ref;
+uint8_t *ino_ref;
+
+/* FS5600_FEAT_DEDUP only: the number of file pointers found to each
+ * data block, to check its refcount in the dedup table against
+ */
+uint32_t *blk_cnt;
+
+/* returns the previous value of the bit, so that the caller can tell
+ * a second reference from the first one.
+ */
+static int test_and_set(uint8_t *map, uint32_t n)
 {
-    int i, fd = open(argv[1], O_RDONLY);
-    if (fd < 0)
-        perror("can't open"), exit(1);
-    struct stat _sb;
-    if (fstat(fd, &_sb) < 0)
-        perror("fstat"), exit(1);
-    int size = _sb.st_size;
-
-    void *disk = malloc(size);
-    if (read(fd, disk, size) != size)
-        perror("read"), exit(1);
-    fd_set *blkmap = calloc(size/8192, 1);
-    fd_set *imap = calloc(size/8192, 1);
-
-    struct fs5600_super *sb = (void*)disk;
-    printf("superblock: magic:  %08x\n"
-           "            imap:   %d blocks\n" 
-           "            bmap:   %d blocks\n"
-           "            inodes: %d blocks\n" 
-           "            blocks: %d\n"
-           "            root inode: %d\n\n", sb->magic, sb->inode_map_sz,
-           sb->block_map_sz, sb->inode_region_sz, sb->num_blocks, sb->root_inode);
-
-    printf("allocated inodes: ");
-    fd_set *inode_map = (void*)disk + FS_BLOCK_SIZE;
-    char *comma = "";
-    for (i = 0; i < sb->inode_map_sz * 8192; i++)
-        if (FD_ISSET(i, inode_map)) {
-            printf("%s %d", comma, i);
-            comma = ",";
-        }
-    printf("\n\n");
-
-    printf("allocated blocks: ");
-    fd_set *block_map = (void*)inode_map + sb->inode_map_sz * FS_BLOCK_SIZE;
-    for (comma = "", i = 0; i < sb->block_map_sz * 8192; i++)
-        if (FD_ISSET(i, block_map)) {
-            printf("%s %d", comma, i);
-            comma = ",";
-        }
-        printf("\n\n");
-
-    struct fs5600_inode *inodes = (void*)block_map + sb->block_map_sz * FS_BLOCK_SIZE;
-    
-    struct entry { int dir; int inum;} inode_list[100];
-    int head = 0, tail = 0;
-
-    inode_list[head++] = (struct entry){.dir=1, .inum=1};
-    while (head != tail) {
-        struct entry e = inode_list[tail++];
-        struct fs5600_inode *in = inodes + e.inum;
-        if (!e.dir) {
-            printf("file: inode %d\n"
-                   "      uid/gid %d/%d\n"
-                   "      mode %08o\n"
-                   "      size  %d\n",
-                   e.inum, in->uid, in->gid, in->mode, in->size);
-            printf("blocks: ");
-            for (i = 0; i < 6; i++)
-                if (in->direct[i]) {
-                    printf("%d ", in->direct[i]);
-                    FD_SET(in->direct[i], blkmap);
-                    if (!FD_ISSET(in->direct[i], block_map))
-                        printf("\n***ERROR*** block %d marked free\n", in->direct[i]);
-                }
-            if (in->indir_1) {
-                printf("\nindir_1 (%d): ", in->indir_1);
-                int *buf = disk + in->indir_1 * FS_BLOCK_SIZE;
-                for (i = 0; i < 256; i++)
-                    if (buf[i]) {
-                        printf("%d ", buf[i]);
-                        FD_SET(buf[i], blkmap);
-                        if (!FD_ISSET(buf[i], block_map))
-                            printf("\n***ERROR*** block %d marked free\n", buf[i]);
-                    }
-            }
-            if (in->indir_2) {
-                printf("\nindir_2 (%d): ", in->indir_2);
-                int *buf1 = disk + in->indir_2 * FS_BLOCK_SIZE;
-                for (i = 0; i < 256 && buf1[i]; i++) {
-                    printf("\nindir_2[%d] (%d): ", i, buf1[i]);
-                    int j, *buf = disk + buf1[i] * FS_BLOCK_SIZE;
-                    for (j = 0; j < 256; j++)
-                        if (buf[j]) {
-                            printf("%d ", buf[j]);
-                            FD_SET(buf[j], blkmap);
-                            if (!FD_ISSET(buf[j], block_map))
-                                printf("\n***ERROR*** block %d marked free\n", buf[j]);
-                        }
-                }
-            }
-            printf("\n\n");
+    uint8_t bit = 1 << (n % 8);
+    return (__atomic_fetch_or(&map[n / 8], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+static int test_bit(uint8_t *map, uint32_t n)
+{
+    return (map[n / 8] >> (n % 8)) & 1;
+}
+
+/* counters for the summary, updated with atomic adds
+ */
+struct {
+    long errors;
+    long dirs;
+    long files;
+    long data_blocks;
+    long indir_blocks;
+    long bytes;
+    long leaked_blocks;
+    long leaked_inodes;
+    long shared_blocks;         /* dedup: blocks with refcount > 1 */
+    long shared_refs;           /* ... and the references beyond the first */
+} stats;
+
+#define COUNT(field, n) __atomic_add_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+
+int verbose;
+int json;
+int layout;
+#define LAYOUT_TOP_N 10
+pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* error messages go to stdout in the normal listing, and to stderr
+ * when stdout is reserved for the JSON summary.
+ */
+static void error(const char *fmt, ...)
+{
+    va_list ap;
+    COUNT(errors, 1);
+    pthread_mutex_lock(&print_lock);
+    FILE *fp = json ? stderr : stdout;
+    fprintf(fp, "***ERROR*** ");
+    va_start(ap, fmt);
+    vfprintf(fp, fmt, ap);
+    va_end(ap);
+    fprintf(fp, "\n");
+    pthread_mutex_unlock(&print_lock);
+}
+
+/* Work queue - directories and files still to be checked. It grows
+ * as needed; 'pending' counts entries queued or in progress, and the
+ * walk is finished when it drops to zero.
+ */
+struct entry { int dir; uint32_t inum; };
+
+struct {
+    struct entry *e;
+    int head, tail, max;
+    int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+} q = {.lock = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER};
+
+static void q_push(int dir, uint32_t inum)
+{
+    pthread_mutex_lock(&q.lock);
+    if (q.tail == q.max) {
+        if (q.head > 0) {       /* slide down before growing */
+            memmove(q.e, q.e + q.head, (q.tail - q.head) * sizeof(*q.e));
+            q.tail -= q.head;
+            q.head = 0;
         }
+        if (q.tail == q.max) {
+            q.max = q.max ? q.max * 2 : 1024;
+            q.e = realloc(q.e, q.max * sizeof(*q.e));
+            if (q.e == NULL)
+                perror("realloc"), exit(2);
+        }
+    }
+    q.e[q.tail++] = (struct entry){.dir = dir, .inum = inum};
+    q.pending++;
+    pthread_cond_signal(&q.cv);
+    pthread_mutex_unlock(&q.lock);
+}
+
+/* returns 0 when the walk is complete
+ */
+static int q_pop(struct entry *e)
+{
+    pthread_mutex_lock(&q.lock);
+    while (q.head == q.tail && q.pending > 0)
+        pthread_cond_wait(&q.cv, &q.lock);
+    int found = (q.head != q.tail);
+    if (found)
+        *e = q.e[q.head++];
+    pthread_mutex_unlock(&q.lock);
+    return found;
+}
+
+static void q_done(void)
+{
+    pthread_mutex_lock(&q.lock);
+    if (--q.pending == 0)
+        pthread_cond_broadcast(&q.cv);
+    pthread_mutex_unlock(&q.lock);
+}
+
+/* device block 'a' of the image */
+static void *dev_ptr(int64_t a)
+{
+    if (n_members > 0)
+        return members[STRIPE_MEMBER(a, stripe_unit, n_members)] +
+            STRIPE_BLK(a, stripe_unit, n_members) * BLOCK_SIZE;
+    return disk + a * BLOCK_SIZE;
+}
+
+/* file system block 'blk', wherever it is */
+static void *blk_ptr(uint32_t blk)
+{
+    if (snap_data && SNAP_TEST(snap.saved_map, blk))
+        return snap_data + snap.data_off + (size_t)blk * snap.bs;
+    if (log_dev && blk != 0) {
+        int64_t phys = lfs_where(log_dev, blk);
+        if (phys < 0)
+            return zero_blk;
+        return dev_ptr(phys * (bs / BLOCK_SIZE));
+    }
+    return dev_ptr((int64_t)blk * (bs / BLOCK_SIZE));
+}
+
+/* bit 'n' of the bitmap starting at block 'start' */
+static int map_isset(uint32_t start, uint32_t n)
+{
+    return FD_ISSET(n % (8 * bs), (fd_set *)blk_ptr(start + n / (8 * bs)));
+}
+
+static struct fs5600_inode *inode_ptr(uint32_t inum)
+{
+    uint32_t per = INODES_PER_BLK(bs, isz);
+    return FS5600_INODE(blk_ptr(inode_start + inum / per), isz, inum % per);
+}
+
+static struct fs5600_dedup *dedup_ent(uint32_t blk)
+{
+    struct fs5600_dedup *d = blk_ptr(dedup_start + blk / DEDUP_PER_BLK(bs));
+    return d + blk % DEDUP_PER_BLK(bs);
+}
+
+/* check a block pointer found in inode 'inum': it must lie in the
+ * data area, be marked allocated, and not be referenced elsewhere -
+ * except for file data ('data' set) on a dedup image, where the
+ * references are counted, to be checked against the refcount later.
+ * Returns 0 if the pointer can't be followed.
+ */
+static int check_blk(uint32_t inum, uint32_t blk, int data)
+{
+    if (blk < data_start || blk >= sb->num_blocks) {
+        error("inode %u: block %u out of range", inum, blk);
+        return 0;
+    }
+    if (!map_isset(block_map_start, blk))
+        error("inode %u: block %u marked free", inum, blk);
+    if (data && dedup_start) {
+        __atomic_add_fetch(&blk_cnt[blk], 1, __ATOMIC_RELAXED);
+        test_and_set(blk_ref, blk);
+    } else if (test_and_set(blk_ref, blk))
+        error("inode %u: block %u referenced twice", inum, blk);
+    return 1;
+}
+
+/* per-thread state for the tree walk. 'blks' collects the verified
+ * data blocks of a file in logical order for the layout report.
+ */
+struct walker {
+    struct layout_stats ls;
+    int collect;                /* fill in 'blks' */
+    uint32_t *blks;
+    long nblks, max;
+};
+
+static void add_blk(struct walker *w, uint32_t blk)
+{
+    if (!w->collect)
+        return;
+    if (w->nblks == w->max) {
+        w->max = w->max ? w->max * 2 : 1024;
+        w->blks = realloc(w->blks, w->max * sizeof(uint32_t));
+    }
+    w->blks[w->nblks++] = blk;
+}
+
+/* check an indirect block and the tree under it, 'levels' deep (1 =
+ * pointers to data blocks), returning the number of data blocks
+ */
+static long check_indir(struct walker *w, uint32_t inum, uint32_t blk,
+                        int levels, long *n_indir)
+{
+    long n = 0;
+    int i;
+    uint32_t *ptrs = blk_ptr(blk);
+
+    (*n_indir)++;
+    for (i = 0; i < ptrs_per_blk; i++) {
+        if (!ptrs[i] || !check_blk(inum, ptrs[i], levels == 1))
+            continue;
+        if (levels > 1)
+            n += check_indir(w, inum, ptrs[i], levels - 1, n_indir);
         else {
-            if (!S_ISDIR(in->mode)) {
-                printf("***ERROR*** inode %d not a directory\n", e.inum);
-                continue;
+            add_blk(w, ptrs[i]);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void check_file(struct walker *w, uint32_t inum, struct fs5600_inode *in)
+{
+    long n = 0, n_indir = 0;
+    int i;
+
+    w->nblks = 0;
+    if (!S_ISREG(in->mode))
+        error("inode %u: mode %o is not a regular file", inum, in->mode);
+    if (!(sb->features & FS5600_FEAT_LARGE_FILE) && (in->size_hi || in->indir_3))
+        error("inode %u: large file fields set without the feature", inum);
+    if ((in->flags & ~(FS5600_INODE_COMPRESSED | FS5600_INODE_INLINE)) ||
+        ((in->flags & FS5600_INODE_COMPRESSED) &&
+         !(sb->features & FS5600_FEAT_COMPRESS)) ||
+        ((in->flags & FS5600_INODE_INLINE) &&
+         !(sb->features & FS5600_FEAT_INLINE)))
+        error("inode %u: bad flags %x", inum, in->flags);
+    for (i = 0; i < N_DIRECT; i++)
+        if (in->direct[i] && check_blk(inum, in->direct[i], 1)) {
+            add_blk(w, in->direct[i]);
+            n++;
+        }
+    uint32_t roots[] = {in->indir_1, in->indir_2, in->indir_3};
+    for (i = 0; i < 3; i++)
+        if (roots[i] && check_blk(inum, roots[i], 0))
+            n += check_indir(w, inum, roots[i], i + 1, &n_indir);
+
+    int64_t size = FS5600_SIZE(in);
+    long need = (size + bs - 1) / bs;
+    if (size < 0)
+        error("inode %u: negative size %lld", inum, (long long)size);
+    else if (in->flags & FS5600_INODE_INLINE) {
+        if (size > FS5600_INLINE_MAX(isz) || n || n_indir)
+            error("inode %u: inline file with size %lld and %ld blocks",
+                  inum, (long long)size, n + n_indir);
+    } else if (n < need && !(in->flags & FS5600_INODE_COMPRESSED))
+        error("inode %u: size %lld needs %ld blocks, found %ld",
+              inum, (long long)size, need, n);
+
+    COUNT(files, 1);
+    COUNT(data_blocks, n);
+    COUNT(indir_blocks, n_indir);
+    COUNT(bytes, size);
+
+    if (w->collect) {
+        uint32_t ino_blk = 1 + sb->inode_map_sz + sb->block_map_sz +
+            inum / INODES_PER_BLK(bs, isz);
+        layout_add_file(&w->ls, inum, ino_blk, w->blks, w->nblks);
+    }
+
+    if (verbose) {
+        pthread_mutex_lock(&print_lock);
+        printf("file: inode %u uid/gid %d/%d mode %08o size %lld "
+               "blocks %ld indirect %ld\n", inum, in->uid, in->gid,
+               in->mode, (long long)size, n, n_indir);
+        pthread_mutex_unlock(&print_lock);
+    }
+}
+
+static void check_dir(uint32_t inum, struct fs5600_inode *in)
+{
+    int i;
+
+    if (!S_ISDIR(in->mode)) {
+        error("inode %u not a directory", inum);
+        return;
+    }
+    COUNT(dirs, 1);
+    if (!check_blk(inum, in->direct[0], 0))
+        return;
+
+    struct fs5600_dirent *de = blk_ptr(in->direct[0]);
+    if (verbose) {
+        pthread_mutex_lock(&print_lock);
+        printf("directory: inode %u\n", inum);
+        for (i = 0; i < dirents_per_blk; i++)
+            if (de[i].valid)
+                printf("  %s %d %.28s\n", de[i].isDir ? "D" : "F",
+                       de[i].inode, de[i].name);
+        pthread_mutex_unlock(&print_lock);
+    }
+
+    for (i = 0; i < dirents_per_blk; i++) {
+        if (!de[i].valid)
+            continue;
+        uint32_t j = de[i].inode;
+        if (j < 1 || j >= n_inodes) {
+            error("directory %u: invalid inode %u", inum, j);
+            continue;
+        }
+        if (!map_isset(inode_map_start, j))
+            error("inode %u is marked free", j);
+        /* a second reference is either a hard link (which we don't
+         * support) or a directory cycle - don't walk it again.
+         */
+        if (test_and_set(ino_ref, j)) {
+            error("inode %u referenced twice", j);
+            continue;
+        }
+        q_push(de[i].isDir, j);
+    }
+}
+
+static void *walk_worker(void *arg)
+{
+    struct walker *w = arg;
+    struct entry e;
+
+    if (layout) {
+        layout_init(&w->ls, LAYOUT_TOP_N);
+        w->collect = 1;
+    }
+    while (q_pop(&e)) {
+        struct fs5600_inode *in = inode_ptr(e.inum);
+        if (e.dir)
+            check_dir(e.inum, in);
+        else
+            check_file(w, e.inum, in);
+        q_done();
+    }
+    free(w->blks);
+    return NULL;
+}
+
+/* Bitmap cross-check - anything marked allocated that the walk didn't
+ * reach is leaked, and on a dedup image the refcounts have to match
+ * the references found. Split into one range per thread.
+ */
+struct range { uint32_t lo, hi; };
+
+static void *bitmap_worker(void *arg)
+{
+    struct range *r = arg;
+    uint32_t i;
+    long leaked = 0;
+
+    for (i = r->lo; i < r->hi; i++) {
+        struct fs5600_dedup *d = dedup_start ? dedup_ent(i) : NULL;
+        if (d && (d->refs ? d->refs != blk_cnt[i] : blk_cnt[i] > 1))
+            error("block %u: refcount %u, %u references", i, d->refs,
+                  blk_cnt[i]);
+        if (d && d->refs > 1) {
+            COUNT(shared_blocks, 1);
+            COUNT(shared_refs, d->refs - 1);
+        }
+        if (map_isset(block_map_start, i) && !test_bit(blk_ref, i)) {
+            if (verbose) {
+                pthread_mutex_lock(&print_lock);
+                printf("leaked block: %u\n", i);
+                pthread_mutex_unlock(&print_lock);
             }
-            printf("directory: inode %d\n", e.inum);
-            struct fs5600_dirent *de = disk + in->direct[0] * FS_BLOCK_SIZE;
-            if (!FD_ISSET(in->direct[0], block_map))
-                printf("\n***ERROR*** block %d marked free\n", in->direct[0]);
-            FD_SET(in->direct[0], blkmap);
-            
-            for (i = 0; i < 32; i++)
-                if (de[i].valid) {
-                    printf("  %s %d %s\n", de[i].isDir ? "D" : "F", de[i].inode,
-                           de[i].name);
-                    int j = de[i].inode;
-                    if (j < 0 || j >= sb->inode_region_sz * 16) {
-                        printf("***ERROR*** invalid inode %d\n", j);
-                        continue;
-                    }
-                    FD_SET(j, imap);
-                    if (!FD_ISSET(j, inode_map))
-                        printf("***ERROR*** inode %d is marked free\n", j);
-                    inode_list[head++] = (struct entry) {.dir = de[i].isDir, j};
-                }
-            printf("\n");
+            leaked++;
+        }
+    }
+    COUNT(leaked_blocks, leaked);
+    return NULL;
+}
+
+static void run_threads(int n, void *(*f)(void *), void *args, size_t argsz)
+{
+    pthread_t *t = calloc(n, sizeof(*t));
+    int i;
+    for (i = 0; i < n; i++)
+        pthread_create(&t[i], NULL, f, args ? (char *)args + i * argsz : NULL);
+    for (i = 0; i < n; i++)
+        pthread_join(t[i], NULL);
+    free(t);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/* FS5600_FEAT_LOG: lfs.c reads the segment summaries through this,
+ * to rebuild the block map blk_ptr goes through
+ */
+static int64_t img_blocks;
+
+static int64_t img_num_blocks(struct blkdev *dev)
+{
+    return img_blocks;
+}
+
+static void img_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    int i;
+    for (i = 0; i < n; i++)     /* striped: not contiguous */
+        memcpy((char *)buf + (size_t)i * BLOCK_SIZE, dev_ptr(first + i),
+               BLOCK_SIZE);
+}
+
+static struct blkdev_ops img_ops = {
+    .num_blocks = img_num_blocks,
+    .read = img_read,
+};
+
+static struct blkdev img_dev = {.ops = &img_ops};
+
+/* map the members of the striped set 'paths', once stripe.c has
+ * checked their labels; returns the size of the array
+ */
+static off_t map_striped(char *paths)
+{
+    struct blkdev *dev = image_create(paths);
+    char *copy = strdup(paths), *p;
+    int i;
+
+    if (dev == NULL)
+        exit(2);
+    for (n_members = 1, p = copy; *p; p++)
+        n_members += (*p == ',');
+    members = calloc(n_members, sizeof(char *));
+    member_size = calloc(n_members, sizeof(off_t));
+    for (i = 0, p = strtok(copy, ","); p != NULL; i++, p = strtok(NULL, ",")) {
+        int fd = open(p, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0)
+            perror(p), exit(2);
+        member_size[i] = st.st_size;
+        members[i] = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (members[i] == MAP_FAILED)
+            perror("mmap"), exit(2);
+        close(fd);
+    }
+    stripe_unit = ((struct stripe_label *)members[0])->unit;
+    free(copy);
+    return dev->ops->num_blocks(dev) * BLOCK_SIZE;
+}
+
+/* -snapshot: map the file of snapshot 'snap', so that blk_ptr finds
+ * the blocks it saved there. Blocks free when it was taken are read
+ * from the image as they are now, since nothing reachable points at
+ * them.
+ */
+static void snap_map(void)
+{
+    struct stat st;
+    uint32_t b;
+
+    if (fstat(snap.fd, &st) < 0)
+        perror("fstat"), exit(2);
+    for (b = 0; b < snap.nblks; b++)
+        if (SNAP_TEST(snap.saved_map, b) &&
+            snap.data_off + (off_t)(b + 1) * snap.bs > st.st_size) {
+            error("snapshot %s: saved block %u missing", snap.name, b);
+            snap.saved_map[b / 8] &= ~(1 << (b % 8));
+        }
+    snap_data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, snap.fd, 0);
+    if (snap_data == MAP_FAILED)
+        perror("mmap"), exit(2);
+}
+
+/* the snapshots of the image, for the summary */
+struct snap_sum {
+    char *name;
+    long  saved, shared, free;
+};
+static struct snap_sum *snaps;
+static int n_snaps;
+
+/* Each snapshot has to fit the file system; the superblock, bitmaps,
+ * inode table and journal can't have been free when it was taken, and
+ * a block free then can't have been saved since. Counts its blocks.
+ */
+static void check_snapshots(const char *image)
+{
+    char **names;
+    int i;
+    uint32_t b;
+
+    if ((n_snaps = snap_list(image, &names)) < 0) {
+        error("can't list snapshots: %s", strerror(-n_snaps));
+        n_snaps = 0;
+        return;
+    }
+    snaps = calloc(n_snaps, sizeof(*snaps));
+    for (i = 0; i < n_snaps; i++) {
+        struct snap_info si;
+        struct snap_sum *ss = &snaps[i];
+        ss->name = names[i];
+        if (snap_load(image, names[i], &si) < 0) {
+            error("snapshot %s: can't read it", names[i]);
+            continue;
+        }
+        if (si.bs != bs || si.nblks != sb->num_blocks) {
+            error("snapshot %s: %u blocks of %u bytes, not %u of %u",
+                  names[i], si.nblks, si.bs, sb->num_blocks, bs);
+            snap_unload(&si);
+            continue;
+        }
+        for (b = 0; b < si.nblks; b++) {
+            int f = SNAP_TEST(si.free_map, b), s = SNAP_TEST(si.saved_map, b);
+            if (f && b < data_start)
+                error("snapshot %s: metadata block %u free", names[i], b);
+            if (f && s)
+                error("snapshot %s: free block %u saved", names[i], b);
+            ss->free += f;
+            ss->saved += s;
+        }
+        for (; b < si.map_bytes * 8; b++)
+            if (SNAP_TEST(si.free_map, b) || SNAP_TEST(si.saved_map, b))
+                error("snapshot %s: block %u out of range", names[i], b);
+        ss->shared = si.nblks - ss->free - ss->saved;
+        snap_unload(&si);
+    }
+    free(names);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t i;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *snap_name = NULL;
+
+    for (argc--, argv++; argc > 1 && argv[0][0] == '-'; argc--, argv++) {
+        if (!strcmp(argv[0], "-j") && argc > 2) {
+            nthreads = atoi(argv[1]);
+            argc--, argv++;
+        } else if (!strcmp(argv[0], "-json"))
+            json = 1;
+        else if (!strcmp(argv[0], "-v"))
+            verbose = 1;
+        else if (!strcmp(argv[0], "--layout"))
+            layout = 1;
+        else if (!strcmp(argv[0], "-snapshot") && argc > 2) {
+            snap_name = argv[1];
+            argc--, argv++;
+        } else
+            break;
+    }
+    if (argc != 1) {
+        fprintf(stderr, "usage: read-img [-j threads] [-json] [-v] "
+                "[--layout] [-snapshot name]\n"
+                "                file.img | a.img,b.img,...\n");
+        exit(2);
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+
+    double t0 = now();
+    int fd = -1;
+    off_t size;
+    if (strchr(argv[0], ',') != NULL)
+        size = map_striped(argv[0]);
+    else {
+        fd = open(argv[0], O_RDONLY);
+        if (fd < 0)
+            perror("can't open"), exit(2);
+        struct stat _sb;
+        if (fstat(fd, &_sb) < 0)
+            perror("fstat"), exit(2);
+        size = _sb.st_size;
+        disk = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    off_t map_size = size;
+    if (size < FS_BLOCK_SIZE)
+        fprintf(stderr, "%s: too small for a superblock\n", argv[0]), exit(2);
+    if (disk == MAP_FAILED)
+        perror("mmap"), exit(2);
+
+    sb = dev_ptr(0);
+    if (snap_name != NULL) {
+        int val = snap_load(argv[0], snap_name, &snap);
+        if (val < 0) {
+            fprintf(stderr, "snapshot %s: %s\n", snap_name,
+                    val == -EINVAL ? "bad header" : strerror(-val));
+            exit(2);
+        }
+        if (snap.bs != FS5600_BLOCK_SIZE(sb) ||
+            snap.nblks != sb->num_blocks) {
+            fprintf(stderr, "snapshot %s: not of this file system\n",
+                    snap_name);
+            exit(2);
+        }
+        snap_map();
+        sb = blk_ptr(0);
+    }
+    if (!json)
+        printf("superblock: magic:  %08x\n"
+               "            imap:   %d blocks\n"
+               "            bmap:   %d blocks\n"
+               "            inodes: %d blocks\n"
+               "            blocks: %u\n"
+               "            root inode: %d\n"
+               "            features: %08x\n"
+               "            block size: %u\n", sb->magic, sb->inode_map_sz,
+               sb->block_map_sz, sb->inode_region_sz, sb->num_blocks,
+               sb->root_inode, sb->features, FS5600_BLOCK_SIZE(sb));
+    if (!json && (sb->features & FS5600_FEAT_JOURNAL))
+        printf("            journal: %u blocks at %u\n", sb->journal_sz,
+               sb->journal_start);
+    if (!json && (sb->features & FS5600_FEAT_DEDUP))
+        printf("            dedup table: %u blocks at %u\n", sb->dedup_sz,
+               FS5600_DEDUP_START(sb));
+    if (!json)
+        printf("            state: %s\n",
+               (sb->state & FS5600_STATE_DIRTY) ? "dirty" : "clean");
+    if (!json && (sb->features & FS5600_FEAT_INLINE))
+        printf("            inode size: %u\n", sb->inode_size);
+    if (!json && (sb->features & FS5600_FEAT_LOG))
+        printf("            log: %u segments of %u blocks\n", sb->n_segs,
+               sb->seg_sz);
+    if (!json)
+        printf("\n");
+
+    bs = FS5600_BLOCK_SIZE(sb);
+    if ((sb->features & FS5600_FEAT_LOG) && FS5600_VALID_BLOCK_SIZE(bs)) {
+        img_blocks = size / BLOCK_SIZE;
+        if ((log_dev = lfs_create(&img_dev, sb)) == NULL) {
+            fprintf(stderr, "%s: bad superblock\n", argv[0]);
+            exit(2);
         }
+        zero_blk = calloc(1, bs);
+        size = (off_t)sb->num_blocks * bs;
     }
 
-    printf("unreachable inodes: ");
-    for (i = 1; i < sb->inode_region_sz * 16; i++)
-        if (FD_ISSET(i, imap) && !FD_ISSET(i, inode_map))
-            printf("%d ", i);
-    printf("\n");
+    isz = FS5600_INODE_SIZE(sb);
+    ptrs_per_blk = PTRS_PER_BLK(bs);
+    dirents_per_blk = DIRENTS_PER_BLK(bs);
+    data_start = FS5600_DATA_START(sb);
+    n_inodes = sb->inode_region_sz * INODES_PER_BLK(bs, isz);
+    if (sb->magic != FS5600_MAGIC || !FS5600_VALID_BLOCK_SIZE(bs) ||
+        data_start > sb->num_blocks ||
+        ((sb->features & FS5600_FEAT_JOURNAL) ? sb->journal_sz < 2 ||
+         sb->journal_start != data_start - sb->journal_sz :
+         sb->journal_sz || sb->journal_start) ||
+        ((sb->features & FS5600_FEAT_DEDUP) ?
+         (uint64_t)sb->dedup_sz * DEDUP_PER_BLK(bs) < sb->num_blocks :
+         sb->dedup_sz != 0) ||
+        ((sb->features & FS5600_FEAT_INLINE) ?
+         !FS5600_VALID_INODE_SIZE(isz, bs) ||
+         isz == sizeof(struct fs5600_inode) : sb->inode_size != 0) ||
+        (!(sb->features & FS5600_FEAT_LOG) && (sb->seg_sz || sb->n_segs)) ||
+        (off_t)sb->num_blocks * bs > size ||
+        (uint64_t)sb->block_map_sz * bs * 8 < sb->num_blocks ||
+        (uint64_t)sb->inode_map_sz * bs * 8 < n_inodes) {
+        fprintf(stderr, "%s: bad superblock\n", argv[0]);
+        exit(2);
+    }
+    if (sb->features & ~FS5600_FEATURES) {
+        fprintf(stderr, "%s: unknown features %08x\n", argv[0],
+                sb->features & ~FS5600_FEATURES);
+        exit(2);
+    }
+
+    if (sb->features & FS5600_FEAT_JOURNAL) {
+        int pending = layout_journal_pending(sb, blk_ptr);
+        if (pending < 0)
+            error("bad journal header");
+        else if (pending)
+            fprintf(json ? stderr : stdout, "journal holds transactions "
+                    "that haven't been replayed - mount the image first\n");
+    }
+
+    inode_map_start = 1;
+    block_map_start = 1 + sb->inode_map_sz;
+    inode_start = 1 + sb->inode_map_sz + sb->block_map_sz;
+
+    blk_ref = calloc(sb->num_blocks / 8 + 1, 1);
+    ino_ref = calloc(n_inodes / 8 + 1, 1);
+    if (blk_ref == NULL || ino_ref == NULL)
+        perror("calloc"), exit(2);
+    if (sb->features & FS5600_FEAT_DEDUP) {
+        dedup_start = FS5600_DEDUP_START(sb);
+        if ((blk_cnt = calloc(sb->num_blocks, sizeof(uint32_t))) == NULL)
+            perror("calloc"), exit(2);
+    }
+
+    /* the superblock, bitmaps, inode table and journal are always in use
+     */
+    for (i = 0; i < data_start; i++) {
+        test_and_set(blk_ref, i);
+        if (!map_isset(block_map_start, i))
+            error("metadata block %u marked free", i);
+    }
+
+    double t1 = now();
+    test_and_set(ino_ref, sb->root_inode);
+    q_push(1, sb->root_inode);
+    struct walker *w = calloc(nthreads, sizeof(*w));
+    run_threads(nthreads, walk_worker, w, sizeof(*w));
+
+    double t2 = now();
+    struct range *r = calloc(nthreads, sizeof(*r));
+    uint32_t chunk = (sb->num_blocks - data_start) / nthreads + 1;
+    for (i = 0; i < nthreads; i++) {
+        r[i].lo = data_start + i * chunk;
+        r[i].hi = r[i].lo + chunk;
+        if (r[i].lo > sb->num_blocks)
+            r[i].lo = sb->num_blocks;
+        if (r[i].hi > sb->num_blocks)
+            r[i].hi = sb->num_blocks;
+    }
+    run_threads(nthreads, bitmap_worker, r, sizeof(*r));
+    free(r);
+
+    /* inode 0 is reserved and always marked in use
+     */
+    for (i = 1; i < n_inodes; i++)
+        if (map_isset(inode_map_start, i) && !test_bit(ino_ref, i)) {
+            if (verbose)
+                printf("leaked inode: %u\n", i);
+            stats.leaked_inodes++;
+        }
+
+    struct layout_stats ls;
+    if (layout) {
+        layout_init(&ls, LAYOUT_TOP_N);
+        for (i = 0; i < nthreads; i++) {
+            layout_merge(&ls, &w[i].ls);
+            free(w[i].ls.worst);
+        }
+        layout_free_space(&ls, sb, blk_ptr, data_start, sb->num_blocks);
+    }
+    free(w);
+    check_snapshots(argv[0]);
+    double t3 = now();
+
+    if (json) {
+        printf("{\"image\": ");
+        json_string(argv[0]);
+        printf(", \"blocks\": %u, \"inodes\": %u, \"threads\": %d,\n"
+               " \"dirs\": %ld, \"files\": %ld, \"bytes\": %ld,"
+               " \"data_blocks\": %ld, \"indirect_blocks\": %ld,\n"
+               " \"leaked_blocks\": %ld, \"leaked_inodes\": %ld,"
+               " \"errors\": %ld,\n"
+               " \"timings_ms\": {\"open\": %.3f, \"walk\": %.3f,"
+               " \"bitmaps\": %.3f, \"total\": %.3f}",
+               sb->num_blocks, n_inodes, nthreads, stats.dirs, stats.files,
+               stats.bytes, stats.data_blocks, stats.indir_blocks,
+               stats.leaked_blocks, stats.leaked_inodes, stats.errors,
+               (t1-t0)*1e3, (t2-t1)*1e3, (t3-t2)*1e3, (t3-t0)*1e3);
+        if (dedup_start)
+            printf(",\n \"shared_blocks\": %ld, \"shared_refs\": %ld",
+                   stats.shared_blocks, stats.shared_refs);
+        if (n_snaps > 0) {
+            printf(",\n \"snapshots\": [");
+            for (i = 0; i < n_snaps; i++) {
+                printf("%s{\"name\": ", i ? ", " : "");
+                json_string(snaps[i].name);
+                printf(", \"saved\": %ld, \"shared\": %ld, \"free\": %ld}",
+                       snaps[i].saved, snaps[i].shared, snaps[i].free);
+            }
+            printf("]");
+        }
+        if (layout) {
+            printf(",\n \"layout\": ");
+            layout_print_json(stdout, &ls);
+        }
+        printf("}\n");
+    } else {
+        printf("\n%ld directories, %ld files, %ld bytes in %ld data + "
+               "%ld indirect blocks\n", stats.dirs, stats.files, stats.bytes,
+               stats.data_blocks, stats.indir_blocks);
+        if (dedup_start)
+            printf("shared: %ld blocks, with %ld more references\n",
+                   stats.shared_blocks, stats.shared_refs);
+        printf("leaked (allocated but unreachable): %ld blocks, %ld inodes\n",
+               stats.leaked_blocks, stats.leaked_inodes);
+        for (i = 0; i < n_snaps; i++)
+            printf("snapshot %s: %ld blocks saved, %ld shared, %ld free\n",
+                   snaps[i].name, snaps[i].saved, snaps[i].shared,
+                   snaps[i].free);
+        printf("%ld errors, checked in %.3f s with %d threads\n",
+               stats.errors, t3 - t0, nthreads);
+        if (layout) {
+            printf("\n");
+            layout_print(stdout, &ls);
+        }
+    }
 
-    printf("unreachable blocks: ");
-    for (i = 1 + sb->inode_map_sz + sb->block_map_sz + sb->inode_region_sz;
-         i < sb->num_blocks; i++)
-        if (FD_ISSET(i, blkmap) && !FD_ISSET(i, block_map))
-            printf("%d ", i);
-    printf("\n");
-    
-    return 0;
+    if (snap_name != NULL)
+        snap_unload(&snap);
+    if (disk != NULL)
+        munmap(disk, map_size);
+    for (i = 0; i < n_members; i++)
+        munmap(members[i], member_size[i]);
+    if (fd >= 0)
+        close(fd);
+    return stats.errors ? 1 : 0;
 }
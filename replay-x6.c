@@ -0,0 +1,310 @@
+/*
+ * file:        replay-x6.c
+ * description: replay an fs_ops trace (recorded with 'homework -trace')
+ *              in-process against a copy of a CS 5600 hw3 image, and
+ *              report throughput and per-op latency percentiles.
+ *
+ * usage: replay-x6 [-threads N] [-timed] [-speed X] [-keep] [-csv]
+ *                  trace file.img | a.img,b.img,...
+ *     -threads N  - issue calls from N threads (default 1)
+ *     -timed      - keep the recorded inter-arrival times, instead of
+ *                   replaying as fast as possible
+ *     -speed X    - with -timed, scale time by X (2 = twice as fast)
+ *     -keep       - keep the working copy of the image
+ *     -csv        - print results as CSV
+ *
+ * The trace is replayed against file.img.replay, a fresh copy of the
+ * image (or of each member of a striped set), so the original is left
+ * alone. Calls are issued in the order they started, as recorded. The
+ * file system serializes them itself (on its own lock, see LOCKED_OP
+ * in homework.c); with several threads the reported latency includes
+ * waiting for it, the way requests queue in a FUSE daemon.
+ */
+#define FUSE_USE_VERSION 27
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fuse.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fs5600.h"
+#include "blkdev.h"
+#include "stats.h"
+#include "trace.h"
+
+extern struct fuse_operations fs_ops;
+struct blkdev *disk;
+
+struct call {
+    struct trace_rec r;
+    char *path, *path2;
+};
+
+struct call *calls;
+long n_calls;
+long next_call;                 /* shared index into 'calls' */
+int timed;
+double speed = 1;
+uint64_t replay_t0;
+
+struct worker {
+    struct lat_stats st[TR_NOPS];
+    long diverged;              /* result differs from the recording */
+    char *buf;
+    uint32_t buflen;
+};
+
+/* records are written as calls finish; replay them as they started */
+static int by_start(const void *a, const void *b)
+{
+    const struct call *x = a, *y = b;
+    return x->r.ts_ns < y->r.ts_ns ? -1 : x->r.ts_ns > y->r.ts_ns;
+}
+
+static void load_trace(const char *file)
+{
+    FILE *fp = fopen(file, "r");
+    struct trace_hdr h;
+    long max = 0;
+
+    if (fp == NULL)
+        perror(file), exit(1);
+    if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != TRACE_MAGIC ||
+        h.version != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a trace file\n", file);
+        exit(1);
+    }
+    while (1) {
+        struct call c;
+        if (fread(&c.r, sizeof(c.r), 1, fp) != 1)
+            break;
+        c.path = calloc(c.r.path_len + 1, 1);
+        c.path2 = calloc(c.r.path2_len + 1, 1);
+        if ((c.r.path_len && fread(c.path, c.r.path_len, 1, fp) != 1) ||
+            (c.r.path2_len && fread(c.path2, c.r.path2_len, 1, fp) != 1) ||
+            c.r.op >= TR_NOPS) {
+            fprintf(stderr, "%s: truncated or corrupt record %ld\n", file,
+                    n_calls);
+            break;
+        }
+        if (n_calls == max) {
+            max = max ? max * 2 : 4096;
+            calls = realloc(calls, max * sizeof(*calls));
+        }
+        calls[n_calls++] = c;
+    }
+    fclose(fp);
+    qsort(calls, n_calls, sizeof(*calls), by_start);
+}
+
+static void copy_image(const char *from, const char *to)
+{
+    int in = open(from, O_RDONLY), out;
+    char buf[65536];
+    ssize_t n;
+
+    if (in < 0)
+        perror(from), exit(1);
+    if ((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        perror(to), exit(1);
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+        if (write(out, buf, n) != n)
+            perror(to), exit(1);
+    close(in);
+    close(out);
+}
+
+/* copy each image of 'paths' (one, or a striped set) to <name>.replay;
+ * returns the copies' names, the same way
+ */
+static char *copy_set(const char *paths)
+{
+    char *names = strdup(paths), *p, *work;
+    int n = 1;
+
+    for (p = names; *p; p++)
+        n += (*p == ',');
+    work = malloc(strlen(paths) + n * 8 + 1);
+    *work = 0;
+    for (p = strtok(names, ","); p != NULL; p = strtok(NULL, ",")) {
+        char *to = work + strlen(work) + (*work != 0);
+        if (*work)
+            strcat(work, ",");
+        sprintf(to, "%s.replay", p);
+        copy_image(p, to);
+    }
+    free(names);
+    return work;
+}
+
+static int null_filler(void *buf, const char *name, const struct stat *sb,
+                       off_t off)
+{
+    return 0;
+}
+
+static int issue(struct worker *w, struct call *c)
+{
+    struct trace_rec *r = &c->r;
+    struct stat sb;
+    struct statvfs sv;
+    struct utimbuf ut = {.actime = r->arg, .modtime = r->arg};
+
+    if ((r->op == TR_READ || r->op == TR_WRITE) && r->len > w->buflen) {
+        w->buf = realloc(w->buf, r->len);
+        memset(w->buf, 'r', r->len);
+        w->buflen = r->len;
+    }
+    switch (r->op) {
+    case TR_GETATTR:  return fs_ops.getattr(c->path, &sb);
+    case TR_READDIR:  return fs_ops.readdir(c->path, NULL, null_filler, 0, NULL);
+    case TR_MKNOD:    return fs_ops.mknod(c->path, r->arg, 0);
+    case TR_MKDIR:    return fs_ops.mkdir(c->path, r->arg);
+    case TR_UNLINK:   return fs_ops.unlink(c->path);
+    case TR_RMDIR:    return fs_ops.rmdir(c->path);
+    case TR_RENAME:   return fs_ops.rename(c->path, c->path2);
+    case TR_CHMOD:    return fs_ops.chmod(c->path, r->arg);
+    case TR_UTIME:    return fs_ops.utime(c->path, &ut);
+    case TR_TRUNCATE: return fs_ops.truncate(c->path, r->arg);
+    case TR_READ:     return fs_ops.read(c->path, w->buf, r->len, r->arg, NULL);
+    case TR_WRITE:    return fs_ops.write(c->path, w->buf, r->len, r->arg, NULL);
+    case TR_STATFS:   return fs_ops.statfs(c->path, &sv);
+    case TR_FLUSH:    return fs_ops.flush(c->path, NULL);
+    case TR_FSYNC:    return fs_ops.fsync(c->path, r->arg, NULL);
+    case TR_FALLOCATE:
+        return fs_ops.fallocate(c->path, r->mode, r->arg, r->len, NULL);
+    }
+    return -ENOSYS;
+}
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts = {.tv_sec = t / 1000000000, .tv_nsec = t % 1000000000};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void *worker(void *arg)
+{
+    struct worker *w = arg;
+    long i;
+
+    while ((i = __atomic_fetch_add(&next_call, 1, __ATOMIC_RELAXED)) < n_calls) {
+        struct call *c = &calls[i];
+        uint64_t t = now_ns();
+        if (timed) {
+            uint64_t due = replay_t0 + c->r.ts_ns / speed;
+            if (due > t) {
+                sleep_until(due);
+                t = due;
+            }
+        }
+        int val = issue(w, c);
+        uint64_t dt = now_ns() - t;
+
+        lat_add(&w->st[c->r.op], dt, (c->r.op == TR_READ ||
+                                      c->r.op == TR_WRITE) && val > 0 ? val : 0);
+        if (val < 0)
+            w->st[c->r.op].errors++;
+        if (val != c->r.result)
+            w->diverged++;
+    }
+    return NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: replay-x6 [-threads N] [-timed] [-speed X] "
+            "[-keep] [-csv] trace\n"
+            "                 file.img | a.img,b.img,...\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = 1, keep = 0, csv = 0, i, op;
+
+    for (argc--, argv++; argc > 2; argc--, argv++) {
+        if (!strcmp(argv[0], "-threads") && argc > 3) {
+            nthreads = atoi(argv[1]);
+            argc--, argv++;
+        } else if (!strcmp(argv[0], "-speed") && argc > 3) {
+            speed = atof(argv[1]);
+            argc--, argv++;
+        } else if (!strcmp(argv[0], "-timed"))
+            timed = 1;
+        else if (!strcmp(argv[0], "-keep"))
+            keep = 1;
+        else if (!strcmp(argv[0], "-csv"))
+            csv = 1;
+        else
+            usage();
+    }
+    if (argc != 2 || nthreads < 1 || speed <= 0)
+        usage();
+
+    load_trace(argv[0]);
+    char *work = copy_set(argv[1]), *p;
+    if ((disk = image_create(work)) == NULL)
+        exit(1);
+    fs_ops.init(NULL);
+
+    struct worker *w = calloc(nthreads, sizeof(*w));
+    pthread_t *t = calloc(nthreads, sizeof(*t));
+    for (i = 0; i < nthreads; i++)
+        for (op = 0; op < TR_NOPS; op++)
+            lat_init(&w[i].st[op], trace_op_names[op]);
+
+    replay_t0 = now_ns();
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&t[i], NULL, worker, &w[i]);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(t[i], NULL);
+    uint64_t elapsed = now_ns() - replay_t0;
+
+    struct lat_stats st[TR_NOPS];
+    long diverged = 0, total = 0;
+    uint64_t bytes = 0;
+    for (op = 0; op < TR_NOPS; op++) {
+        lat_init(&st[op], trace_op_names[op]);
+        for (i = 0; i < nthreads; i++)
+            lat_merge(&st[op], &w[i].st[op]);
+        total += st[op].n;
+        bytes += st[op].bytes;
+    }
+    for (i = 0; i < nthreads; i++)
+        diverged += w[i].diverged;
+
+    if (csv) {
+        char s[32];
+        sprintf(s, "%d", nthreads);
+        lat_print_header(stdout, "threads");
+        for (op = 0; op < TR_NOPS; op++)
+            if (st[op].n)
+                lat_print_csv(stdout, &st[op], s, 0);
+    } else {
+        double secs = elapsed / 1e9;
+        printf("replayed %ld calls in %.3f s with %d threads%s: %.1f ops/s, "
+               "%.3f MB/s\n", total, secs, nthreads, timed ? " (timed)" : "",
+               total / secs, bytes / 1e6 / secs);
+        if (n_calls)
+            printf("trace covered %.3f s; %ld results differed from the "
+                   "recording\n", calls[n_calls-1].r.ts_ns / 1e9, diverged);
+        for (op = 0; op < TR_NOPS; op++)
+            if (st[op].n)
+                lat_print(stdout, &st[op], 0);
+    }
+
+    fs_ops.destroy(NULL);
+    if (!keep)
+        for (p = strtok(work, ","); p != NULL; p = strtok(NULL, ","))
+            unlink(p);
+    return 0;
+}
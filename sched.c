@@ -0,0 +1,219 @@
+/*
+ * file:        sched.c
+ * description: I/O scheduler for CS 5600 hw3.
+ *
+ * Queued blocks live in a fixed pool, one BLOCK_SIZE slot each, and a
+ * hash table maps a block number to its newest queued copy. Each
+ * barrier starts a new epoch; a block written again in the same epoch
+ * just has its slot overwritten, while a write in a later epoch gets a
+ * new slot so that the earlier version still goes out first.
+ *
+ * At flush time the queue is sorted by (epoch, block number) and each
+ * run of consecutive blocks in an epoch is handed to the lower device
+ * as a single write.
+ *
+ * A discard gets an epoch of its own, so it is issued after the writes
+ * queued before it and before those queued after it.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sched.h"
+
+#define SCHED_MAX   4096        /* queued blocks before a forced flush */
+#define HASH_SIZE   (2 * SCHED_MAX)     /* power of 2 */
+#define MAX_MERGE   256         /* blocks per merged write */
+
+struct sched_ent {
+    int64_t blk;
+    int     epoch;
+    char   *data;
+};
+
+struct sched_discard {
+    int64_t first;
+    int     n;
+    int     epoch;
+};
+
+struct sched_dev {
+    struct blkdev    *lower;
+    struct sched_ent *q;
+    int               n;        /* entries in 'q' */
+    int               epoch;
+    int               dirty;    /* writes queued in this epoch */
+    int              *hash;     /* index+1 of newest entry, 0 = empty */
+    char             *pool;     /* SCHED_MAX data slots */
+    char             *buf;      /* staging for merged writes */
+    struct sched_discard *disc; /* in epoch order */
+    int               n_disc, max_disc;
+};
+
+static int *hash_slot(struct sched_dev *s, int64_t blk)
+{
+    unsigned h = (unsigned)(blk * 0x9E3779B1u) & (HASH_SIZE - 1);
+    while (s->hash[h] && s->q[s->hash[h] - 1].blk != blk)
+        h = (h + 1) & (HASH_SIZE - 1);
+    return &s->hash[h];
+}
+
+static int cmp_ent(const void *_a, const void *_b)
+{
+    const struct sched_ent *a = _a, *b = _b;
+    if (a->epoch != b->epoch)
+        return a->epoch - b->epoch;
+    return a->blk < b->blk ? -1 : a->blk > b->blk;
+}
+
+static void sched_flush(struct blkdev *dev)
+{
+    struct sched_dev *s = dev->private;
+    struct blkdev *lower = s->lower;
+    int i, j, d = 0;
+
+    if (s->n == 0 && s->n_disc == 0)
+        return;
+    qsort(s->q, s->n, sizeof(*s->q), cmp_ent);
+    for (i = 0; i < s->n; i = j) {
+        if (i > 0 && s->q[i].epoch != s->q[i-1].epoch && lower->ops->barrier)
+            lower->ops->barrier(lower);
+        if (d < s->n_disc && s->disc[d].epoch < s->q[i].epoch) {
+            for (; d < s->n_disc && s->disc[d].epoch < s->q[i].epoch; d++)
+                lower->ops->discard(lower, s->disc[d].first, s->disc[d].n);
+            if (lower->ops->barrier)
+                lower->ops->barrier(lower);
+        }
+        for (j = i + 1; j < s->n && j - i < MAX_MERGE &&
+                 s->q[j].epoch == s->q[i].epoch &&
+                 s->q[j].blk == s->q[j-1].blk + 1; j++)
+            ;
+        if (j - i == 1) {
+            lower->ops->write(lower, s->q[i].blk, 1, s->q[i].data);
+            continue;
+        }
+        int k;
+        for (k = i; k < j; k++)
+            memcpy(s->buf + (size_t)(k - i) * BLOCK_SIZE, s->q[k].data,
+                   BLOCK_SIZE);
+        lower->ops->write(lower, s->q[i].blk, j - i, s->buf);
+    }
+    for (; d < s->n_disc; d++)
+        lower->ops->discard(lower, s->disc[d].first, s->disc[d].n);
+    s->n = 0;
+    s->n_disc = 0;
+    s->epoch = 0;
+    s->dirty = 0;
+    memset(s->hash, 0, HASH_SIZE * sizeof(int));
+    if (lower->ops->flush)
+        lower->ops->flush(lower);
+}
+
+static void sched_barrier(struct blkdev *dev)
+{
+    struct sched_dev *s = dev->private;
+    if (s->dirty) {
+        s->epoch++;
+        s->dirty = 0;
+    }
+}
+
+static void sched_discard(struct blkdev *dev, int64_t first, int n)
+{
+    struct sched_dev *s = dev->private;
+
+    if (s->lower->ops->discard == NULL)
+        return;
+    sched_barrier(dev);
+    if (s->n_disc == s->max_disc) {
+        s->max_disc = s->max_disc ? 2 * s->max_disc : 64;
+        s->disc = realloc(s->disc, s->max_disc * sizeof(*s->disc));
+    }
+    s->disc[s->n_disc++] = (struct sched_discard){first, n, s->epoch};
+    s->dirty = 1;
+    sched_barrier(dev);
+}
+
+static int64_t sched_num_blocks(struct blkdev *dev)
+{
+    struct sched_dev *s = dev->private;
+    return s->lower->ops->num_blocks(s->lower);
+}
+
+static void sched_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct sched_dev *s = dev->private;
+    int i;
+
+    s->lower->ops->read(s->lower, first, n, buf);
+    for (i = 0; s->n > 0 && i < n; i++) {
+        int idx = *hash_slot(s, first + i);
+        if (idx)
+            memcpy((char*)buf + (size_t)i * BLOCK_SIZE, s->q[idx - 1].data,
+                   BLOCK_SIZE);
+    }
+}
+
+static void sched_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct sched_dev *s = dev->private;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        char *data = (char*)buf + (size_t)i * BLOCK_SIZE;
+        int *slot = hash_slot(s, first + i);
+
+        if (*slot && s->q[*slot - 1].epoch == s->epoch) {
+            memcpy(s->q[*slot - 1].data, data, BLOCK_SIZE);
+            continue;
+        }
+        if (s->n == SCHED_MAX) {
+            sched_flush(dev);
+            slot = hash_slot(s, first + i);
+        }
+        struct sched_ent *e = &s->q[s->n];
+        e->blk = first + i;
+        e->epoch = s->epoch;
+        memcpy(e->data, data, BLOCK_SIZE);
+        *slot = ++s->n;
+        s->dirty = 1;
+    }
+}
+
+static int sched_sync(struct blkdev *dev)
+{
+    struct sched_dev *s = dev->private;
+    sched_flush(dev);
+    return s->lower->ops->sync ? s->lower->ops->sync(s->lower) : 0;
+}
+
+struct blkdev_ops sched_ops = {
+    .num_blocks = sched_num_blocks,
+    .read = sched_read,
+    .write = sched_write,
+    .flush = sched_flush,
+    .barrier = sched_barrier,
+    .sync = sched_sync,
+    .discard = sched_discard,
+};
+
+struct blkdev *sched_create(struct blkdev *lower)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct sched_dev *s = calloc(1, sizeof(*s));
+    int i;
+
+    assert(dev != NULL && s != NULL);
+    s->lower = lower;
+    s->q = calloc(SCHED_MAX, sizeof(*s->q));
+    s->hash = calloc(HASH_SIZE, sizeof(int));
+    s->pool = malloc((size_t)SCHED_MAX * BLOCK_SIZE);
+    s->buf = malloc((size_t)MAX_MERGE * BLOCK_SIZE);
+    assert(s->q && s->hash && s->pool && s->buf);
+    for (i = 0; i < SCHED_MAX; i++)
+        s->q[i].data = s->pool + (size_t)i * BLOCK_SIZE;
+
+    dev->private = s;
+    dev->ops = &sched_ops;
+    return dev;
+}
@@ -0,0 +1,21 @@
+/*
+ * file:        sched.h
+ * description: I/O scheduler for CS 5600 hw3 - a blkdev stacked on top
+ *              of another one, which queues writes until flushed and
+ *              then issues them sorted by block number and merged into
+ *              multi-block writes.
+ */
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include "blkdev.h"
+
+/* Writes to the returned device are held in memory until its 'flush'
+ * op is called (or the queue fills up); reads see queued data. Writes
+ * of the same block between two barriers are merged into one, and all
+ * writes queued before a 'barrier' reach 'lower' before any queued
+ * after it.
+ */
+struct blkdev *sched_create(struct blkdev *lower);
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * file:        snap-x6.c
+ * description: snapshot tool for CS 5600 / 7600 hw3 images. Snapshots
+ *              live next to the image (see snap.h); 'homework
+ *              -snapshot name' mounts one read-only, and read-img
+ *              -snapshot name checks it.
+ *
+ * usage: snap-x6 list file.img
+ *        snap-x6 create file.img name
+ *        snap-x6 delete file.img name
+ *
+ * 'create' mounts the image in-process (recovering it if it wasn't
+ * unmounted cleanly) and takes the snapshot as the 'snapshot' command
+ * does on a mounted file system; the image mustn't be mounted at the
+ * time. 'list' shows, for each snapshot, the blocks copied out of the
+ * image since it was taken and those it still shares with it.
+ */
+#define FUSE_USE_VERSION 27
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <fuse.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "blkdev.h"
+#include "snap.h"
+
+extern struct fuse_operations fs_ops;
+extern int fs_snapshot(const char *name);
+extern char *fs_snap_image;
+struct blkdev *disk;
+
+static int64_t count_bits(uint8_t *map, uint32_t n)
+{
+    int64_t count = 0;
+    uint32_t i;
+    for (i = 0; i < n; i++)
+        count += SNAP_TEST(map, i);
+    return count;
+}
+
+static int list(char *image)
+{
+    char **names;
+    int i, n = snap_list(image, &names);
+
+    if (n < 0) {
+        fprintf(stderr, "%s: %s\n", image, strerror(-n));
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        struct snap_info si;
+        int val = snap_load(image, names[i], &si);
+        if (val < 0) {
+            printf("%-16s %s\n", names[i],
+                   val == -EINVAL ? "bad header" : strerror(-val));
+            continue;
+        }
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S",
+                 localtime(&si.taken));
+        int64_t saved = count_bits(si.saved_map, si.nblks);
+        int64_t unused = count_bits(si.free_map, si.nblks);
+        printf("%-16s %s  %lld saved, %lld shared, %lld free\n", names[i],
+               when, (long long)saved,
+               (long long)(si.nblks - saved - unused), (long long)unused);
+        snap_unload(&si);
+        free(names[i]);
+    }
+    free(names);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && !strcmp(argv[1], "list"))
+        return list(argv[2]);
+    if (argc != 4 || (strcmp(argv[1], "create") && strcmp(argv[1], "delete"))) {
+        fprintf(stderr, "usage: snap-x6 list file.img\n"
+                "       snap-x6 create file.img name\n"
+                "       snap-x6 delete file.img name\n");
+        exit(1);
+    }
+
+    int val;
+    if (!strcmp(argv[1], "delete"))
+        val = snap_delete(argv[2], argv[3]);
+    else {
+        if ((disk = image_create(argv[2])) == NULL)
+            exit(1);
+        fs_snap_image = argv[2];
+        fs_ops.init(NULL);
+        val = fs_snapshot(argv[3]);
+        fs_ops.destroy(NULL);
+    }
+    if (val < 0) {
+        fprintf(stderr, "%s %s: %s\n", argv[1], argv[3], strerror(-val));
+        return 1;
+    }
+    return 0;
+}
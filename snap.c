@@ -0,0 +1,526 @@
+/*
+ * file:        snap.c
+ * description: snapshots for CS 5600 hw3.
+ *
+ * Taking a snapshot writes only its header and free map (a copy of the
+ * block bitmap): the caller has just written everything out, so the
+ * image itself is the snapshot, and from then on the live device copies
+ * each block into the snapshot file before the first write to it -
+ * unless it was free at the time, as then the snapshot doesn't need
+ * it. Inode table, bitmaps and root directory are copied like any
+ * other block, so what a snapshot costs is the blocks changed after
+ * it, mostly metadata, rather than the size of the volume. A block
+ * still shared by several snapshots is read once and written to each.
+ * The copies and the saved map are synced before the write they make
+ * way for is passed down, so after a crash a snapshot never points at
+ * the image for a block that has been overwritten.
+ *
+ * The device sits on top of the log on a log-structured image, so that
+ * it sees the file system's block numbers; the cleaner's moves are
+ * below it and never copied.
+ */
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+
+#include "snap.h"
+
+#define SNAP_RUN 64             /* blocks copied per read */
+
+struct snap_dev {
+    struct blkdev    *lower;
+    int               bs;       /* file system block size */
+    int               sect;     /* device blocks per file system block */
+    uint32_t          nblks;    /* file system blocks */
+    char             *image;
+    struct snap_info *snaps;    /* a read-only device has just the one */
+    int               n_snaps;
+    size_t           *lo, *hi;  /* per snapshot: saved map bytes changed */
+    char             *buf;      /* SNAP_RUN blocks */
+    pthread_mutex_t   lock;
+};
+
+static struct blkdev_ops snap_ops, view_ops;
+
+static char *snap_path(const char *image, const char *name)
+{
+    char *path = malloc(strlen(image) + strlen(name) + 7);
+    assert(path != NULL);
+    if (name[0])
+        sprintf(path, "%s.snap/%s", image, name);
+    else
+        sprintf(path, "%s.snap", image);
+    return path;
+}
+
+static int valid_name(const char *name)
+{
+    return name[0] != 0 && name[0] != '.' && strchr(name, '/') == NULL &&
+        strlen(name) < 64;
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+int snap_list(const char *image, char ***names)
+{
+    char *dir = snap_path(image, "");
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    int n = 0, max = 0;
+
+    free(dir);
+    *names = NULL;
+    if (d == NULL)
+        return errno == ENOENT ? 0 : -errno;
+    while ((de = readdir(d)) != NULL) {
+        if (!valid_name(de->d_name))
+            continue;
+        if (n == max) {
+            max = max ? 2 * max : 8;
+            *names = realloc(*names, max * sizeof(char *));
+        }
+        (*names)[n++] = strdup(de->d_name);
+    }
+    closedir(d);
+    qsort(*names, n, sizeof(char *), cmp_name);
+    return n;
+}
+
+static void read_all(int fd, void *buf, size_t len, off_t pos)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t result = pread(fd, (char *)buf + done, len - done,
+                               pos + done);
+        if (result < 0) {
+            perror("snapshot read");
+            assert(0);
+        }
+        if (result == 0) {      /* a hole at the end */
+            memset((char *)buf + done, 0, len - done);
+            return;
+        }
+        done += result;
+    }
+}
+
+static void write_all(int fd, void *buf, size_t len, off_t pos)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t result = pwrite(fd, (char *)buf + done, len - done,
+                                pos + done);
+        if (result <= 0) {      /* out of space on the host, say */
+            perror("snapshot write");
+            assert(0);
+        }
+        done += result;
+    }
+}
+
+static void set_geometry(struct snap_info *si)
+{
+    si->map_bytes = ((si->nblks + 7) / 8 + BLOCK_SIZE - 1) /
+        BLOCK_SIZE * BLOCK_SIZE;
+    si->data_off = (BLOCK_SIZE + 2 * si->map_bytes + si->bs - 1) /
+        si->bs * si->bs;
+}
+
+int snap_load(const char *image, const char *name, struct snap_info *si)
+{
+    struct snap_hdr h;
+    char *path;
+
+    memset(si, 0, sizeof(*si));
+    if (!valid_name(name))
+        return -EINVAL;
+    path = snap_path(image, name);
+    if ((si->fd = open(path, O_RDWR)) < 0)
+        si->fd = open(path, O_RDONLY);
+    free(path);
+    if (si->fd < 0)
+        return -errno;
+    if (pread(si->fd, &h, sizeof(h), 0) != sizeof(h) ||
+        h.magic != SNAP_MAGIC || !FS5600_VALID_BLOCK_SIZE(h.block_size) ||
+        h.num_blocks == 0) {
+        close(si->fd);
+        return -EINVAL;
+    }
+    si->name = strdup(name);
+    si->bs = h.block_size;
+    si->nblks = h.num_blocks;
+    si->taken = h.taken;
+    set_geometry(si);
+    si->free_map = malloc(si->map_bytes);
+    si->saved_map = malloc(si->map_bytes);
+    assert(si->name && si->free_map && si->saved_map);
+    read_all(si->fd, si->free_map, si->map_bytes, BLOCK_SIZE);
+    read_all(si->fd, si->saved_map, si->map_bytes,
+             BLOCK_SIZE + si->map_bytes);
+    return 0;
+}
+
+void snap_unload(struct snap_info *si)
+{
+    close(si->fd);
+    free(si->name);
+    free(si->free_map);
+    free(si->saved_map);
+}
+
+int snap_delete(const char *image, const char *name)
+{
+    if (!valid_name(name))
+        return -EINVAL;
+    char *path = snap_path(image, name);
+    int val = unlink(path) < 0 ? -errno : 0;
+    free(path);
+    if (val == 0) {             /* the last one takes the directory along */
+        path = snap_path(image, "");
+        rmdir(path);
+        free(path);
+    }
+    return val;
+}
+
+/* does snapshot 'si' still share block 'b' with the image? */
+static int shares(struct snap_info *si, int64_t b)
+{
+    return !SNAP_TEST(si->free_map, b) && !SNAP_TEST(si->saved_map, b);
+}
+
+static int any_shares(struct snap_dev *s, int64_t b)
+{
+    int i;
+    for (i = 0; i < s->n_snaps; i++)
+        if (shares(&s->snaps[i], b))
+            return 1;
+    return 0;
+}
+
+int snap_shared(struct blkdev *dev, int64_t blk)
+{
+    struct snap_dev *s = dev->private;
+    return dev->ops == &snap_ops && s->n_snaps > 0 && any_shares(s, blk);
+}
+
+/* copy file system blocks b0..b1-1 into each snapshot still sharing
+ * them, and sync the copies and the saved maps, before they are
+ * overwritten
+ */
+static void save(struct snap_dev *s, int64_t b0, int64_t b1)
+{
+    int64_t b, e, x, y;
+    int i;
+
+    for (i = 0; i < s->n_snaps; i++) {
+        s->lo[i] = s->snaps[i].map_bytes;
+        s->hi[i] = 0;
+    }
+    for (b = b0; b < b1; b = e) {
+        if (!any_shares(s, b)) {
+            e = b + 1;
+            continue;
+        }
+        for (e = b + 1; e < b1 && e - b < SNAP_RUN && any_shares(s, e); e++)
+            ;
+        s->lower->ops->read(s->lower, b * s->sect, (e - b) * s->sect, s->buf);
+        for (i = 0; i < s->n_snaps; i++) {
+            struct snap_info *si = &s->snaps[i];
+            for (x = b; x < e; x = y) {
+                if (!shares(si, x)) {
+                    y = x + 1;
+                    continue;
+                }
+                for (y = x + 1; y < e && shares(si, y); y++)
+                    ;
+                write_all(si->fd, s->buf + (x - b) * s->bs,
+                          (y - x) * s->bs, si->data_off + x * s->bs);
+                if ((size_t)(x / 8) < s->lo[i])
+                    s->lo[i] = x / 8;
+                if ((size_t)((y - 1) / 8 + 1) > s->hi[i])
+                    s->hi[i] = (y - 1) / 8 + 1;
+                for (; x < y; x++)
+                    si->saved_map[x / 8] |= 1 << (x % 8);
+            }
+        }
+    }
+    for (i = 0; i < s->n_snaps; i++) {
+        struct snap_info *si = &s->snaps[i];
+        if (s->hi[i] == 0)
+            continue;
+        size_t lo = s->lo[i] / BLOCK_SIZE * BLOCK_SIZE;
+        size_t hi = (s->hi[i] + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        write_all(si->fd, si->saved_map + lo, hi - lo,
+                  BLOCK_SIZE + si->map_bytes + lo);
+        if (fdatasync(si->fd) < 0)
+            perror("snapshot sync");
+    }
+}
+
+static int64_t snap_num_blocks(struct blkdev *dev)
+{
+    struct snap_dev *s = dev->private;
+    return s->lower->ops->num_blocks(s->lower);
+}
+
+static void snap_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct snap_dev *s = dev->private;
+    s->lower->ops->read(s->lower, first, n, buf);
+}
+
+static void snap_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct snap_dev *s = dev->private;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->n_snaps > 0)
+        save(s, first / s->sect, (first + n + s->sect - 1) / s->sect);
+    s->lower->ops->write(s->lower, first, n, buf);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void snap_write_super(struct blkdev *dev, void *buf)
+{
+    struct snap_dev *s = dev->private;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->n_snaps > 0)
+        save(s, 0, 1);
+    s->lower->ops->write_super(s->lower, buf);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void snap_flush(struct blkdev *dev)
+{
+    struct snap_dev *s = dev->private;
+    if (s->lower->ops->flush)
+        s->lower->ops->flush(s->lower);
+}
+
+static void snap_barrier(struct blkdev *dev)
+{
+    struct snap_dev *s = dev->private;
+    if (s->lower->ops->barrier)
+        s->lower->ops->barrier(s->lower);
+}
+
+static int snap_sync(struct blkdev *dev)
+{
+    struct snap_dev *s = dev->private;
+    return s->lower->ops->sync ? s->lower->ops->sync(s->lower) : 0;
+}
+
+/* a block a snapshot still shares has to keep its contents, so only
+ * the rest of the range is passed down
+ */
+static void snap_discard(struct blkdev *dev, int64_t first, int n)
+{
+    struct snap_dev *s = dev->private;
+    int64_t b, e, b1 = (first + n) / s->sect;
+
+    if (s->lower->ops->discard == NULL)
+        return;
+    pthread_mutex_lock(&s->lock);
+    for (b = first / s->sect; b < b1; b = e + 1) {
+        for (e = b; e < b1 && !any_shares(s, e); e++)
+            ;
+        if (e > b)
+            s->lower->ops->discard(s->lower, b * s->sect, (e - b) * s->sect);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static struct blkdev_ops snap_ops = {
+    .num_blocks = snap_num_blocks,
+    .read = snap_read,
+    .write = snap_write,
+    .write_super = snap_write_super,
+    .flush = snap_flush,
+    .barrier = snap_barrier,
+    .sync = snap_sync,
+    .discard = snap_discard,
+};
+
+/* the read-only device: blocks free when the snapshot was taken read
+ * as zeros, saved ones come from the snapshot file
+ */
+static void view_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct snap_dev *s = dev->private;
+    struct snap_info *si = &s->snaps[0];
+    int64_t d, e;
+
+    s->lower->ops->read(s->lower, first, n, buf);
+    for (d = first; d < first + n; d = e) {
+        int64_t b = d / s->sect;
+        for (e = d + 1; e < first + n && e / s->sect == b; e++)
+            ;
+        char *p = (char *)buf + (d - first) * BLOCK_SIZE;
+        if (SNAP_TEST(si->free_map, b))
+            memset(p, 0, (e - d) * BLOCK_SIZE);
+        else if (SNAP_TEST(si->saved_map, b))
+            read_all(si->fd, p, (e - d) * BLOCK_SIZE,
+                     si->data_off + d * BLOCK_SIZE);
+    }
+}
+
+static void view_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    fprintf(stderr, "write to a snapshot\n");
+    assert(0);
+}
+
+static void view_write_super(struct blkdev *dev, void *buf)
+{
+    view_write(dev, 0, 1, buf);
+}
+
+static struct blkdev_ops view_ops = {
+    .num_blocks = snap_num_blocks,
+    .read = view_read,
+    .write = view_write,
+    .write_super = view_write_super,
+};
+
+static int load_checked(struct snap_dev *s, const char *name,
+                        struct snap_info *si)
+{
+    int val = snap_load(s->image, name, si);
+    if (val == 0 && (si->bs != s->bs || si->nblks != s->nblks)) {
+        snap_unload(si);
+        val = -EINVAL;
+    }
+    if (val < 0)
+        fprintf(stderr, "snapshot %s: %s\n", name,
+                val == -EINVAL ? "bad header" : strerror(-val));
+    return val;
+}
+
+struct blkdev *snap_create(struct blkdev *lower, struct fs5600_super *sb,
+                           const char *image, const char *name)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct snap_dev *s = calloc(1, sizeof(*s));
+    char **names;
+    int i, n = 1;
+
+    assert(dev != NULL && s != NULL);
+    s->lower = lower;
+    s->bs = FS5600_BLOCK_SIZE(sb);
+    s->sect = s->bs / BLOCK_SIZE;
+    s->nblks = sb->num_blocks;
+    s->image = strdup(image);
+    if (name == NULL && (n = snap_list(image, &names)) < 0) {
+        fprintf(stderr, "can't list snapshots: %s\n", strerror(-n));
+        return NULL;
+    }
+    s->snaps = calloc(n + 1, sizeof(*s->snaps));
+    s->lo = calloc(n + 1, sizeof(size_t));
+    s->hi = calloc(n + 1, sizeof(size_t));
+    s->buf = malloc((size_t)SNAP_RUN * s->bs);
+    assert(s->snaps && s->lo && s->hi && s->buf);
+    pthread_mutex_init(&s->lock, NULL);
+
+    if (name != NULL) {
+        if (load_checked(s, name, &s->snaps[0]) < 0)
+            return NULL;
+        s->n_snaps = 1;
+        dev->ops = &view_ops;
+    } else {
+        for (i = 0; i < n; i++) {
+            if (load_checked(s, names[i], &s->snaps[s->n_snaps]) < 0)
+                return NULL;
+            s->n_snaps++;
+            free(names[i]);
+        }
+        free(names);
+        dev->ops = &snap_ops;
+    }
+    dev->private = s;
+    return dev;
+}
+
+int snap_take(struct blkdev *dev, const char *name, void *block_map)
+{
+    struct snap_dev *s = dev->private;
+    struct snap_info si = {.bs = s->bs, .nblks = s->nblks};
+    struct snap_hdr h = {.magic = SNAP_MAGIC, .block_size = s->bs,
+                         .num_blocks = s->nblks, .taken = time(NULL)};
+    char *path;
+    int64_t b;
+    int val = 0;
+
+    if (dev->ops != &snap_ops)
+        return -EROFS;
+    if (!valid_name(name))
+        return -EINVAL;
+    path = snap_path(s->image, "");
+    if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+        free(path);
+        return -errno;
+    }
+    free(path);
+    path = snap_path(s->image, name);
+    if ((si.fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666)) < 0) {
+        free(path);
+        return -errno;
+    }
+
+    set_geometry(&si);
+    si.name = strdup(name);
+    si.free_map = calloc(si.map_bytes, 1);
+    si.saved_map = calloc(si.map_bytes, 1);
+    assert(si.name && si.free_map && si.saved_map);
+    for (b = 0; b < s->nblks; b++)
+        if (!FD_ISSET(b, (fd_set *)block_map))
+            si.free_map[b / 8] |= 1 << (b % 8);
+
+    char *hdr = calloc(BLOCK_SIZE, 1);
+    memcpy(hdr, &h, sizeof(h));
+    if (ftruncate(si.fd, si.data_off) < 0 ||
+        pwrite(si.fd, hdr, BLOCK_SIZE, 0) != BLOCK_SIZE ||
+        pwrite(si.fd, si.free_map, si.map_bytes, BLOCK_SIZE) !=
+        (ssize_t)si.map_bytes || fdatasync(si.fd) < 0)
+        val = -errno;
+    free(hdr);
+    if (val < 0) {
+        unlink(path);
+        free(path);
+        snap_unload(&si);
+        return val;
+    }
+    free(path);
+
+    /* the new file's directory entry has to be durable, too */
+    path = snap_path(s->image, "");
+    int dfd = open(path, O_RDONLY);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+    free(path);
+
+    pthread_mutex_lock(&s->lock);
+    s->snaps = realloc(s->snaps, (s->n_snaps + 1) * sizeof(*s->snaps));
+    s->lo = realloc(s->lo, (s->n_snaps + 1) * sizeof(size_t));
+    s->hi = realloc(s->hi, (s->n_snaps + 1) * sizeof(size_t));
+    s->snaps[s->n_snaps++] = si;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * file:        snap.h
+ * description: snapshots for CS 5600 hw3 - a blkdev stacked on top of
+ *              another one, which copies a block into each snapshot
+ *              that still shares it before the block is first
+ *              overwritten, or presents one snapshot as a read-only
+ *              device.
+ *
+ * The snapshots of image 'x.img' live in the directory 'x.img.snap',
+ * one file per snapshot, named after it:
+ *
+ *   header | free map | saved map | saved blocks
+ *
+ * Both maps have a bit per file system block. A block free when the
+ * snapshot was taken is never copied, and reads back as zeros; a saved
+ * block is at data_off + blk * block_size, so the file is sparse and
+ * holds only what was saved; every other block is still shared with
+ * the image.
+ */
+#ifndef __SNAP_H__
+#define __SNAP_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "blkdev.h"
+#include "fs5600.h"
+
+#define SNAP_MAGIC 0x736e6170   /* "snap" */
+
+struct snap_hdr {
+    uint32_t magic;
+    uint32_t block_size;        /* of the file system */
+    uint32_t num_blocks;        /* ditto */
+    uint32_t pad;
+    int64_t  taken;             /* time(2) */
+};
+
+/* a snapshot file opened with snap_load
+ */
+struct snap_info {
+    char    *name;
+    int      fd;
+    uint32_t bs, nblks;
+    time_t   taken;
+    size_t   map_bytes;         /* each map, rounded up to BLOCK_SIZE */
+    off_t    data_off;
+    uint8_t *free_map;
+    uint8_t *saved_map;
+};
+
+#define SNAP_TEST(map, blk) (((map)[(blk) / 8] >> ((blk) % 8)) & 1)
+
+/* With 'name' NULL, returns a device for the live file system on
+ * 'lower', which saves the blocks the snapshots of 'image' still share
+ * before passing a write down; else a read-only device showing
+ * snapshot 'name' of it. 'sb' describes the file system. Prints why
+ * and returns NULL on error.
+ */
+struct blkdev *snap_create(struct blkdev *lower, struct fs5600_super *sb,
+                           const char *image, const char *name);
+
+/* take snapshot 'name' of the live device 'dev' now, which the caller
+ * has made hold a cleanly unmounted file system; 'block_map' is its
+ * block bitmap. Returns 0 or -errno.
+ */
+int snap_take(struct blkdev *dev, const char *name, void *block_map);
+
+/* does a snapshot still share file system block 'blk' with the live
+ * device 'dev', so that writing it means copying it first?
+ */
+int snap_shared(struct blkdev *dev, int64_t blk);
+
+/* the names of the snapshots of 'image', sorted, in '*names' (free
+ * each one and the array); returns how many, or -errno
+ */
+int snap_list(const char *image, char ***names);
+
+/* open snapshot 'name' of 'image' and read its maps into 'si'; returns
+ * 0 or -errno (-EINVAL for a bad header)
+ */
+int snap_load(const char *image, const char *name, struct snap_info *si);
+void snap_unload(struct snap_info *si);
+
+/* delete snapshot 'name' of 'image'; 0 or -errno */
+int snap_delete(const char *image, const char *name);
+
+#endif
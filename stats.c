@@ -0,0 +1,107 @@
+/*
+ * file:        stats.c
+ * description: latency recording and percentiles for the CS 5600 hw3
+ *              benchmark and workload tools
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void lat_init(struct lat_stats *ls, const char *name)
+{
+    memset(ls, 0, sizeof(*ls));
+    ls->name = name;
+}
+
+void lat_add(struct lat_stats *ls, uint64_t ns, uint64_t bytes)
+{
+    if (ls->n == ls->max) {
+        ls->max = ls->max ? ls->max * 2 : 1024;
+        ls->ns = realloc(ls->ns, ls->max * sizeof(*ls->ns));
+        if (ls->ns == NULL)
+            perror("realloc"), exit(1);
+    }
+    ls->ns[ls->n++] = ns;
+    ls->total_ns += ns;
+    ls->bytes += bytes;
+    ls->sorted = 0;
+}
+
+void lat_merge(struct lat_stats *dst, struct lat_stats *src)
+{
+    long i;
+    for (i = 0; i < src->n; i++)
+        lat_add(dst, src->ns[i], 0);
+    dst->bytes += src->bytes;
+    dst->errors += src->errors;
+}
+
+void lat_free(struct lat_stats *ls)
+{
+    free(ls->ns);
+    ls->ns = NULL;
+    ls->n = ls->max = 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+uint64_t lat_pct(struct lat_stats *ls, double p)
+{
+    if (ls->n == 0)
+        return 0;
+    if (!ls->sorted) {
+        qsort(ls->ns, ls->n, sizeof(*ls->ns), cmp_u64);
+        ls->sorted = 1;
+    }
+    long i = (long)(p / 100 * ls->n);
+    if (i >= ls->n)
+        i = ls->n - 1;
+    return ls->ns[i];
+}
+
+void lat_print_header(FILE *fp, const char *extra)
+{
+    fprintf(fp, "op,%s%scount,errors,ops_per_s,mb_per_s,mean_us,p50_us,"
+            "p90_us,p99_us,p999_us,max_us\n", extra ? extra : "",
+            extra ? "," : "");
+}
+
+void lat_print_csv(FILE *fp, struct lat_stats *ls, const char *extra,
+                   uint64_t elapsed_ns)
+{
+    double secs = (elapsed_ns ? elapsed_ns : ls->total_ns) / 1e9;
+    fprintf(fp, "%s,%s%s%ld,%ld,%.1f,%.3f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+            ls->name, extra ? extra : "", extra ? "," : "", ls->n, ls->errors,
+            secs > 0 ? ls->n / secs : 0, secs > 0 ? ls->bytes / 1e6 / secs : 0,
+            ls->n ? ls->total_ns / 1e3 / ls->n : 0,
+            lat_pct(ls, 50) / 1e3, lat_pct(ls, 90) / 1e3,
+            lat_pct(ls, 99) / 1e3, lat_pct(ls, 99.9) / 1e3,
+            lat_pct(ls, 100) / 1e3);
+}
+
+void lat_print(FILE *fp, struct lat_stats *ls, uint64_t elapsed_ns)
+{
+    double secs = (elapsed_ns ? elapsed_ns : ls->total_ns) / 1e9;
+    fprintf(fp, "%-9s %8ld ops %10.1f ops/s %8.3f MB/s   "
+            "us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+            ls->name, ls->n, secs > 0 ? ls->n / secs : 0,
+            secs > 0 ? ls->bytes / 1e6 / secs : 0,
+            lat_pct(ls, 50) / 1e3, lat_pct(ls, 90) / 1e3,
+            lat_pct(ls, 99) / 1e3, lat_pct(ls, 99.9) / 1e3,
+            lat_pct(ls, 100) / 1e3);
+    if (ls->errors)
+        fprintf(fp, "%-9s %8ld errors\n", "", ls->errors);
+}
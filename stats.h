@@ -0,0 +1,45 @@
+/*
+ * file:        stats.h
+ * description: latency recording and percentiles for the CS 5600 hw3
+ *              benchmark and workload tools
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* every sample is kept, so percentiles are exact; the array grows as
+ * needed.
+ */
+struct lat_stats {
+    const char *name;
+    uint64_t *ns;
+    long n, max;
+    uint64_t total_ns;
+    uint64_t bytes;
+    long errors;
+    int sorted;
+};
+
+uint64_t now_ns(void);
+
+void lat_init(struct lat_stats *ls, const char *name);
+void lat_add(struct lat_stats *ls, uint64_t ns, uint64_t bytes);
+void lat_merge(struct lat_stats *dst, struct lat_stats *src);
+void lat_free(struct lat_stats *ls);
+
+/* p in [0,100]
+ */
+uint64_t lat_pct(struct lat_stats *ls, double p);
+
+/* one line per op: name,count,ops/s,MB/s,mean,p50,p90,p99,p99.9,max
+ * (times in microseconds). 'elapsed_ns' is the wall-clock time the
+ * rates are computed over; pass 0 to use the sum of the samples.
+ */
+void lat_print_header(FILE *fp, const char *extra);
+void lat_print_csv(FILE *fp, struct lat_stats *ls, const char *extra,
+                   uint64_t elapsed_ns);
+void lat_print(FILE *fp, struct lat_stats *ls, uint64_t elapsed_ns);
+
+#endif
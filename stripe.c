@@ -0,0 +1,348 @@
+/*
+ * file:        stripe.c
+ * description: striping over several image files for CS 5600 hw3.
+ *
+ * A transfer is cut at stripe unit boundaries into pieces, each of
+ * which is a single transfer on one member. Every member has a thread
+ * of its own; the pieces for all but one member are handed to theirs,
+ * and the caller does the remaining member's itself and then waits, so
+ * a transfer spanning k members takes about as long as a k'th of it on
+ * one. One that falls on a single member - any transfer no larger than
+ * the unit - is done by the caller alone, without the handoff. A sync
+ * syncs all the members at once the same way.
+ *
+ * Requests are taken one at a time; the parallelism is within each.
+ */
+#define _XOPEN_SOURCE 500
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "stripe.h"
+
+enum { OP_READ, OP_WRITE, OP_DISCARD, OP_SYNC };
+
+struct piece {
+    int64_t first;              /* on the member */
+    int     n;
+    char   *buf;
+};
+
+struct member {
+    struct blkdev     *dev;
+    struct stripe_dev *s;
+    struct piece      *pieces;  /* of the current request */
+    int                n_pieces, max_pieces;
+    int                posted;  /* handed to the thread, not done yet */
+    int                err;     /* of its last sync */
+    pthread_cond_t     cv;
+};
+
+struct stripe_dev {
+    int              n;         /* members */
+    int64_t          unit;      /* in BLOCK_SIZE blocks */
+    int64_t          nblks;     /* of the array */
+    struct member   *m;
+    int              op;        /* of the current request */
+    pthread_mutex_t  io_lock;   /* one request at a time */
+    pthread_mutex_t  lock;      /* posted, pending */
+    pthread_cond_t   done;
+    int              pending;   /* members still working */
+};
+
+static void do_pieces(struct member *m)
+{
+    struct blkdev *dev = m->dev;
+    int i;
+
+    for (i = 0; i < m->n_pieces; i++) {
+        struct piece *p = &m->pieces[i];
+        switch (m->s->op) {
+        case OP_READ:
+            dev->ops->read(dev, p->first, p->n, p->buf);
+            break;
+        case OP_WRITE:
+            dev->ops->write(dev, p->first, p->n, p->buf);
+            break;
+        case OP_DISCARD:
+            if (dev->ops->discard)
+                dev->ops->discard(dev, p->first, p->n);
+            break;
+        }
+    }
+    if (m->s->op == OP_SYNC)
+        m->err = dev->ops->sync ? dev->ops->sync(dev) : 0;
+}
+
+static void *member_thread(void *arg)
+{
+    struct member *m = arg;
+    struct stripe_dev *s = m->s;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!m->posted)
+            pthread_cond_wait(&m->cv, &s->lock);
+        pthread_mutex_unlock(&s->lock);
+        do_pieces(m);
+        pthread_mutex_lock(&s->lock);
+        m->posted = 0;
+        if (--s->pending == 0)
+            pthread_cond_signal(&s->done);
+    }
+    return NULL;
+}
+
+static void add_piece(struct member *m, int64_t first, int n, char *buf)
+{
+    if (m->n_pieces == m->max_pieces) {
+        m->max_pieces = m->max_pieces ? 2 * m->max_pieces : 16;
+        m->pieces = realloc(m->pieces, m->max_pieces * sizeof(*m->pieces));
+        assert(m->pieces != NULL);
+    }
+    m->pieces[m->n_pieces++] = (struct piece){first, n, buf};
+}
+
+/* run the current request: the members with pieces (every one, for a
+ * sync) in parallel, the first of them in this thread
+ */
+static void run(struct stripe_dev *s)
+{
+    int i, self = -1;
+
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; i < s->n; i++) {
+        if (s->m[i].n_pieces == 0 && s->op != OP_SYNC)
+            continue;
+        if (self < 0) {
+            self = i;
+            continue;
+        }
+        s->m[i].posted = 1;
+        s->pending++;
+        pthread_cond_signal(&s->m[i].cv);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (self >= 0)
+        do_pieces(&s->m[self]);
+
+    pthread_mutex_lock(&s->lock);
+    while (s->pending > 0)
+        pthread_cond_wait(&s->done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->n; i++)
+        s->m[i].n_pieces = 0;
+}
+
+/* cut array blocks first..first+n-1 into pieces for the members */
+static void split(struct stripe_dev *s, int64_t first, int n, char *buf)
+{
+    int64_t a = first, end = first + n;
+
+    while (a < end) {
+        int64_t off = a % s->unit;
+        int64_t len = s->unit - off < end - a ? s->unit - off : end - a;
+        add_piece(&s->m[STRIPE_MEMBER(a, s->unit, s->n)],
+                  STRIPE_BLK(a, s->unit, s->n), len,
+                  buf ? buf + (a - first) * BLOCK_SIZE : NULL);
+        a += len;
+    }
+}
+
+static void request(struct blkdev *dev, int op, int64_t first, int n,
+                    void *buf)
+{
+    struct stripe_dev *s = dev->private;
+
+    pthread_mutex_lock(&s->io_lock);
+    s->op = op;
+    split(s, first, n, buf);
+    run(s);
+    pthread_mutex_unlock(&s->io_lock);
+}
+
+static int64_t stripe_num_blocks(struct blkdev *dev)
+{
+    struct stripe_dev *s = dev->private;
+    return s->nblks;
+}
+
+static void stripe_read(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct stripe_dev *s = dev->private;
+    assert(first >= 0 && n >= 0 && first + n <= s->nblks);
+    request(dev, OP_READ, first, n, buf);
+}
+
+static void stripe_write(struct blkdev *dev, int64_t first, int n, void *buf)
+{
+    struct stripe_dev *s = dev->private;
+    assert(first != 0);         /* over-writing the superblock is an error */
+    assert(first >= 0 && n >= 0 && first + n <= s->nblks);
+    request(dev, OP_WRITE, first, n, buf);
+}
+
+/* array block 0 is the first data block of member 0 */
+static void stripe_write_super(struct blkdev *dev, void *buf)
+{
+    struct stripe_dev *s = dev->private;
+    struct blkdev *m0 = s->m[0].dev;
+
+    pthread_mutex_lock(&s->io_lock);
+    m0->ops->write(m0, STRIPE_LABEL_BLKS, 1, buf);
+    pthread_mutex_unlock(&s->io_lock);
+}
+
+/* fails if any member's sync does */
+static int stripe_sync(struct blkdev *dev)
+{
+    struct stripe_dev *s = dev->private;
+    int i, val = 0;
+
+    pthread_mutex_lock(&s->io_lock);
+    s->op = OP_SYNC;
+    run(s);
+    for (i = 0; i < s->n; i++)
+        if (s->m[i].err < 0)
+            val = s->m[i].err;
+    pthread_mutex_unlock(&s->io_lock);
+    return val;
+}
+
+static void stripe_discard(struct blkdev *dev, int64_t first, int n)
+{
+    struct stripe_dev *s = dev->private;
+    assert(first > 0 && n >= 0 && first + n <= s->nblks);
+    request(dev, OP_DISCARD, first, n, NULL);
+}
+
+static struct blkdev_ops stripe_ops = {
+    .num_blocks = stripe_num_blocks,
+    .read = stripe_read,
+    .write = stripe_write,
+    .write_super = stripe_write_super,
+    .sync = stripe_sync,
+    .discard = stripe_discard,
+};
+
+/* the member names in 'paths', in '*copy' (to be freed along with
+ * '*names')
+ */
+static int split_paths(char *paths, char **copy, char ***names)
+{
+    char *p;
+    int n = 1;
+
+    *copy = strdup(paths);
+    for (p = *copy; *p; p++)
+        n += (*p == ',');
+    *names = malloc(n * sizeof(char *));
+    assert(*copy != NULL && *names != NULL);
+    for (n = 0, p = strtok(*copy, ","); p != NULL; p = strtok(NULL, ","))
+        (*names)[n++] = p;
+    return n;
+}
+
+struct blkdev *stripe_create(char *paths)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct stripe_dev *s = calloc(1, sizeof(*s));
+    struct stripe_label first, *l;
+    char **names, *copy, *buf = malloc(BLOCK_SIZE);
+    int i;
+
+    assert(dev != NULL && s != NULL && buf != NULL);
+    if ((s->n = split_paths(paths, &copy, &names)) < 2) {
+        fprintf(stderr, "%s: a striped set needs two images or more\n",
+                paths);
+        return NULL;
+    }
+    s->m = calloc(s->n, sizeof(*s->m));
+    assert(s->m != NULL);
+    for (i = 0; i < s->n; i++) {
+        struct member *m = &s->m[i];
+        if ((m->dev = image_create(names[i])) == NULL)
+            return NULL;
+        m->s = s;
+        pthread_cond_init(&m->cv, NULL);
+
+        int64_t size = m->dev->ops->num_blocks(m->dev);
+        if (size > STRIPE_LABEL_BLKS)
+            m->dev->ops->read(m->dev, 0, 1, buf);
+        else
+            memset(buf, 0, BLOCK_SIZE);
+        l = (void *)buf;
+        if (i == 0)
+            first = *l;
+        if (l->magic != STRIPE_MAGIC || l->n_members != s->n ||
+            l->unit == 0 || l->set_id != first.set_id ||
+            l->unit != first.unit || l->member_blks != first.member_blks ||
+            size < STRIPE_LABEL_BLKS + (int64_t)l->member_blks) {
+            fprintf(stderr, "%s: not member %d of this striped set\n",
+                    names[i], i);
+            return NULL;
+        }
+        if (l->index != i) {
+            fprintf(stderr, "%s: member %d of the set, not %d\n",
+                    names[i], l->index, i);
+            return NULL;
+        }
+    }
+    s->unit = first.unit;
+    s->nblks = (int64_t)s->n * first.member_blks;
+    pthread_mutex_init(&s->io_lock, NULL);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->done, NULL);
+    for (i = 1; i < s->n; i++) {   /* member 0's share is the caller's */
+        pthread_t t;
+        pthread_create(&t, NULL, member_thread, &s->m[i]);
+        pthread_detach(t);
+    }
+    free(copy);
+    free(names);
+    free(buf);
+
+    dev->private = s;
+    dev->ops = &stripe_ops;
+    return dev;
+}
+
+int64_t stripe_format(char *paths, int64_t size, int unit)
+{
+    char **names, *copy;
+    int i, n = split_paths(paths, &copy, &names);
+    int64_t unit_blks = unit / BLOCK_SIZE;
+    int64_t rows = unit_blks > 0 ? size / BLOCK_SIZE / (n * unit_blks) : 0;
+    struct stripe_label l = {.magic = STRIPE_MAGIC, .n_members = n,
+                             .unit = unit_blks,
+                             .set_id = (uint64_t)time(NULL) << 20 ^ getpid(),
+                             .member_blks = rows * unit_blks};
+    char *buf = calloc(BLOCK_SIZE, 1);
+    int64_t val = (int64_t)n * rows * unit_blks * BLOCK_SIZE;
+
+    if (n < 2 || unit % BLOCK_SIZE != 0 || rows < 1)
+        val = -EINVAL;
+    for (i = 0; i < n && val > 0; i++) {
+        int fd = open(names[i], O_WRONLY | O_CREAT, 0666);
+        l.index = i;
+        memcpy(buf, &l, sizeof(l));
+        if (fd < 0 || ftruncate(fd, 0) < 0 ||
+            ftruncate(fd, (STRIPE_LABEL_BLKS + l.member_blks) * BLOCK_SIZE) < 0 ||
+            pwrite(fd, buf, BLOCK_SIZE, 0) != BLOCK_SIZE)
+            val = -errno;
+        if (fd >= 0)
+            close(fd);
+    }
+    free(copy);
+    free(names);
+    free(buf);
+    return val;
+}
@@ -0,0 +1,50 @@
+/*
+ * file:        stripe.h
+ * description: striping for CS 5600 hw3 - a blkdev spread over several
+ *              image files ("members"), a stripe unit at a time in
+ *              turn, so that large transfers go to all of them at once.
+ *
+ * Each member starts with STRIPE_LABEL_BLKS blocks holding its label in
+ * the first one; array block 'a' is block a % unit of stripe unit
+ * a / unit, which goes to member (a / unit) % n, at row (a / unit) / n
+ * of its data.
+ */
+#ifndef __STRIPE_H__
+#define __STRIPE_H__
+
+#include <stdint.h>
+
+#include "blkdev.h"
+
+#define STRIPE_MAGIC      0x73747270    /* "strp" */
+#define STRIPE_LABEL_BLKS 64            /* so data stays 64K-aligned */
+
+/* where array block 'a' is, with 'n' members and a unit of 'unit' */
+#define STRIPE_MEMBER(a, unit, n) ((a) / (unit) % (n))
+#define STRIPE_BLK(a, unit, n) \
+    (STRIPE_LABEL_BLKS + (a) / (unit) / (n) * (unit) + (a) % (unit))
+
+struct stripe_label {
+    uint32_t magic;
+    uint32_t index;             /* of this member, from 0 */
+    uint32_t n_members;
+    uint32_t unit;              /* stripe unit, in BLOCK_SIZE blocks */
+    uint64_t set_id;            /* the same on every member of a set */
+    uint64_t member_blks;       /* data blocks on each member */
+};
+
+/* 'paths' is the members' file names separated by commas, in order.
+ * Checks their labels and returns the array, whose transfers are
+ * split by member and done by a thread per member in parallel; prints
+ * why and returns NULL if the labels don't make up a set.
+ */
+struct blkdev *stripe_create(char *paths);
+
+/* create (or truncate) the members named in 'paths' for an array of
+ * at most 'size' bytes with a stripe unit of 'unit' bytes (a multiple
+ * of BLOCK_SIZE), and label them. Returns the size of the array - a
+ * whole number of stripes - or -errno.
+ */
+int64_t stripe_format(char *paths, int64_t size, int unit);
+
+#endif
@@ -35,6 +35,11 @@ fail(){
 	echo FAILED: $*
 	exit 1
 }
+# the image checks clean, with nothing allocated but unreachable
+noleak(){
+	./read-img test.img > /tmp/read-img.out &&
+		grep -q "unreachable): 0 blocks, 0 inodes$" /tmp/read-img.out
+}
 ######################prepare and run#############
 echo "preparing for the running environment"
 echo "ckecing mount"
@@ -284,7 +289,7 @@ do
 	cp $file ./testdir$file
 	rm ./testdir$file
 	test ! -e ./testdir$file || fail rm ./testdir$file 1 failed
-	test "$(./read-img test.img | tail -2 | wc --words)" = 4 || fail rm ./testdir$file  2 failed
+	noleak || fail rm ./testdir$file  2 failed
 done
 echo "unlink test passed"
 echo "testing truncate"
@@ -300,8 +305,7 @@ do
 	test -e ./testdir$file || fail truncate ./testdir$file failed
 	test "$(stat -c%s ./testdir$file)" = "0" || fail truncate .testdir$file 2 failed, no zeroify size
 	# ./read-img test.img
-	test "$(./read-img test.img | tail -2 | wc --words)" = 4 || \
-		fail truncate ./testdir$file failed lost block
+	noleak || fail truncate ./testdir$file failed lost block
 	rm ./testdir$file
 done
 echo "truncate test passed"
@@ -414,7 +418,7 @@ do
 done
 echo "stress test 3 for write passed"
 echo "all tests passed"
-rm /tmp/*test*
+rm /tmp/*test* /tmp/read-img.out
 echo "finializing"
 sleep 1
 test `fusermount -u testdir` 0
@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+#
+# run the same workload on images with different block sizes: the
+# mktest image, put/get round trips through every level of the block
+# tree, and a directory with more than 32 entries.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/bs.$$.img
+TMP=/tmp/bs.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 5000 /dev/urandom > $TMP/r5k
+head -c 300000 /dev/urandom > $TMP/r300k
+head -c 5000000 /dev/urandom > $TMP/r5m
+head -c 276177 /dev/zero | tr '\0' K > $TMP/k270
+
+for bs in 1024 4096 16384; do
+    ./mktest -bs $bs $IMG || fail mktest -bs $bs
+    ./read-img $IMG > /dev/null || fail $bs: mktest image inconsistent
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+get dir1/file.270 $TMP/f270
+quit
+EOF
+    cmp $TMP/f270 $TMP/k270 || fail $bs: file.270
+
+    rm -f $IMG
+    ./mkfs-x6 -size 16m -bs $bs $IMG || fail mkfs-x6 -bs $bs
+    n=$((bs / 32 < 40 ? bs / 32 : 40))     # dirents per block
+    (echo mkdir d
+     for i in $(seq $n); do echo put $TMP/r5k d/f$i; done
+     echo put $TMP/r300k b
+     echo put $TMP/r5m c
+     echo get d/f$n $TMP/f40
+     echo get b $TMP/b
+     echo get c $TMP/c
+     echo quit) | ./homework -cmdline -image $IMG > $TMP/out
+    grep -q error $TMP/out && fail $bs: $(grep error $TMP/out | head -1)
+    cmp $TMP/f40 $TMP/r5k || fail $bs: d/f$n
+    cmp $TMP/b $TMP/r300k || fail $bs: b
+    cmp $TMP/c $TMP/r5m || fail $bs: c
+    ./read-img $IMG > /dev/null || fail $bs: image inconsistent
+    rm -f $IMG $TMP/f270 $TMP/f40 $TMP/b $TMP/c
+done
+
+echo SUCCESS
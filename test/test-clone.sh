@@ -0,0 +1,86 @@
+#!/usr/bin/env bash
+#
+# copying within the image: a clone, and ranges copied into a file at
+# aligned and unaligned offsets, read back the same before and after a
+# remount, on every kind of image; with dedup the clone shares all the
+# whole blocks of the original, and writes to either copy leave the
+# other alone. Paths too long for the command line are refused.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/clone.$$.img
+TMP=/tmp/clone.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 5000 /dev/urandom > $TMP/r5k
+head -c 3000000 /dev/urandom > $TMP/r3m
+# b: a clone of r3m, with 4096 bytes at 8192 and 1000 bytes at 100
+# copied over from r5k, and 50000 bytes of r3m from 1000 appended
+(head -c 100 $TMP/r3m; head -c 1000 $TMP/r5k; head -c 8192 $TMP/r3m |
+     tail -c +1101; head -c 4096 $TMP/r5k; tail -c +12289 $TMP/r3m;
+ head -c 51000 $TMP/r3m | tail -c 50000) > $TMP/b.want
+
+for opt in "" "-bs 4096" "-journal 256" "-inline" "-compress" "-dedup" \
+           "-dedup -journal 256"; do
+    rm -f $IMG
+    ./mkfs-x6 -size 16m $opt $IMG > /dev/null || fail mkfs-x6 $opt
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+put $TMP/r3m a
+put $TMP/r5k s
+clone a b
+copy s 0 b 8192 4096
+copy s 0 b 100 1000
+copy a 1000 b 3000000 50000
+get a $TMP/a
+get b $TMP/b
+copy a 0 a 1000 5000
+copy a 0 b 4000000 10
+copy a 0 d 0 10
+quit
+EOF
+    [ $(grep -c error $TMP/out) = 3 ] ||
+        fail "$opt: $(grep error $TMP/out | head -1)"
+    cmp $TMP/a $TMP/r3m || fail "$opt: a before remount"
+    cmp $TMP/b $TMP/b.want || fail "$opt: b before remount"
+    ./read-img $IMG > $TMP/out || fail "$opt: image inconsistent"
+    if [[ "$opt" == -dedup* ]]; then
+        n=$(sed -n 's/^shared: \([0-9]*\) blocks.*/\1/p' $TMP/out)
+        [ "$n" -ge 2900 ] || fail "$opt: only $n blocks shared"
+    fi
+
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+get a $TMP/a
+get b $TMP/b
+rm a
+quit
+EOF
+    cmp $TMP/a $TMP/r3m || fail "$opt: a"
+    cmp $TMP/b $TMP/b.want || fail "$opt: b"
+    ./read-img $IMG > /dev/null || fail "$opt: image inconsistent after rm"
+done
+
+# deep enough that the full paths don't fit
+./mkfs-x6 -size 4m $IMG > /dev/null
+N=aaaaaaaaaaaaaaaaaaaaaaaaa
+./homework -cmdline -image $IMG << EOF > $TMP/out
+mkdir $N
+cd $N
+mkdir $N
+cd $N
+mkdir $N
+cd $N
+mkdir $N
+cd $N
+put $TMP/r5k a
+clone a bbbbbbbbbbbbbbbbbbbbbbbbbb
+copy a 0 bbbbbbbbbbbbbbbbbbbbbbbbbb 0 10
+quit
+EOF
+[ $(grep -c "File name too long" $TMP/out) = 2 ] || fail long paths accepted
+./read-img $IMG > /dev/null || fail "long paths: image inconsistent"
+
+echo SUCCESS
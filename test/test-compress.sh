@@ -0,0 +1,60 @@
+#!/usr/bin/env bash
+#
+# compression: on an image made with -compress, text files take a
+# fraction of the blocks their size needs and read back intact - after
+# unaligned writes that rewrite clusters, and at several block sizes -
+# while incompressible files still work; rm frees all of it, and the
+# image checks clean.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/comp.$$.img
+TMP=/tmp/comp.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+for i in $(seq 20000); do
+    echo "2024-01-01 12:00:$((i % 60)) host$((i % 7)) request $i served in $((i % 13)) ms"
+done > $TMP/log
+head -c 300000 /dev/urandom > $TMP/r300k
+head -c 5000 /dev/urandom > $TMP/r5k
+size=$(stat -c %s $TMP/log)
+
+for bs in 1024 4096 16384; do
+    ./mkfs-x6 -size 16m -bs $bs -compress $IMG || fail mkfs-x6 -bs $bs
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+blksiz 1000
+put $TMP/log log
+put $TMP/r300k rand
+blksiz 4096
+put $TMP/r5k small
+put $TMP/log log2
+quit
+EOF
+    ./read-img -v $IMG > $TMP/out || fail "bs $bs: image inconsistent"
+    blocks=$(awk '$2 == "inode" && $3 == "2" {print $11}' $TMP/out)
+    [ -n "$blocks" ] && [ $((blocks * bs * 2)) -lt $size ] ||
+        fail "bs $bs: log takes $blocks blocks"
+
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+get log $TMP/log.out
+get log2 $TMP/log2.out
+get rand $TMP/rand.out
+get small $TMP/small.out
+rm log
+rm log2
+rm rand
+quit
+EOF
+    cmp $TMP/log $TMP/log.out || fail "bs $bs: log"
+    cmp $TMP/log $TMP/log2.out || fail "bs $bs: log2"
+    cmp $TMP/r300k $TMP/rand.out || fail "bs $bs: rand"
+    cmp $TMP/r5k $TMP/small.out || fail "bs $bs: small"
+    ./read-img $IMG > $TMP/out || fail "bs $bs: image inconsistent after rm"
+    grep -q "unreachable): 0 blocks, 0 inodes" $TMP/out || fail "bs $bs: leaked"
+done
+
+echo SUCCESS
@@ -0,0 +1,67 @@
+#!/usr/bin/env bash
+#
+# dedup: copies of a file share their blocks, also when written in
+# unaligned pieces; a write to a shared block goes to a copy of it; the
+# refcounts check out with read-img, and removing the files one at a
+# time frees the blocks only with the last reference.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/dedup.$$.img
+TMP=/tmp/dedup.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 300000 /dev/urandom > $TMP/r300k
+head -c 8192 /dev/zero > $TMP/zeros
+(head -c 1000 /dev/zero; head -c 5000 /dev/urandom) > $TMP/mix
+
+for opt in "" "-journal 256" "-bs 4096"; do
+    ./mkfs-x6 -size 16m -dedup $opt $IMG || fail mkfs-x6 $opt
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+put $TMP/r300k a
+put $TMP/r300k b
+put $TMP/zeros z
+blksiz 1000
+put $TMP/r300k c
+put $TMP/mix m
+quit
+EOF
+    ./read-img $IMG > $TMP/out || fail "$opt: image inconsistent"
+    refs=$(sed -n 's/^shared: \([0-9]*\) blocks, with \([0-9]*\) more.*/\2/p' $TMP/out)
+    bs=$(sed -n 's/.*block size: //p' $TMP/out)
+    [ -n "$refs" ] && [ $refs -ge $((2 * 300000 / bs)) ] ||
+        fail "$opt: only $refs shared references"
+
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+get a $TMP/a
+get c $TMP/c
+get z $TMP/z
+get m $TMP/m
+rm a
+rm b
+quit
+EOF
+    cmp $TMP/a $TMP/r300k || fail "$opt: a"
+    cmp $TMP/c $TMP/r300k || fail "$opt: c"
+    cmp $TMP/z $TMP/zeros || fail "$opt: z"
+    cmp $TMP/m $TMP/mix || fail "$opt: m"
+    ./read-img $IMG > /dev/null || fail "$opt: image inconsistent after rm"
+
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+get c $TMP/c
+rm c
+rm z
+rm m
+quit
+EOF
+    cmp $TMP/c $TMP/r300k || fail "$opt: c after rm"
+    ./read-img $IMG > $TMP/out || fail "$opt: image inconsistent at the end"
+    grep -q "unreachable): 0 blocks, 0 inodes" $TMP/out || fail "$opt: leaked"
+    grep -q "in 0 data" $TMP/out || fail "$opt: blocks left"
+done
+
+echo SUCCESS
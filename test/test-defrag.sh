@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+#
+# fragment an image by interleaving puts and deletes, defragment it,
+# and check that the data survived and the layout improved.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/defrag.$$.img
+TMP=/tmp/defrag.$$
+trap "rm -rf $IMG $IMG.defrag $TMP" 0
+mkdir $TMP
+
+head -c 20000 /dev/urandom > $TMP/r20k
+head -c 5000 /dev/urandom > $TMP/r5k
+head -c 300000 /dev/urandom > $TMP/r300k
+
+./mktest $IMG
+./homework -cmdline -image $IMG << EOF > /dev/null
+put $TMP/r20k a
+put $TMP/r5k b
+put $TMP/r20k c
+put $TMP/r5k d
+rm b
+rm d
+put $TMP/r300k e
+rm a
+put $TMP/r20k g
+quit
+EOF
+
+./read-img $IMG > /dev/null || fail image inconsistent before defrag
+./defrag-x6 $IMG > $TMP/out || fail defrag-x6
+tail -1 $TMP/out
+grep -q 'score .* -> 0.00%' $TMP/out || fail layout not improved
+./read-img $IMG > /dev/null || fail image inconsistent after defrag
+
+./homework -cmdline -image $IMG << EOF > /dev/null
+get c $TMP/c
+get e $TMP/e
+get g $TMP/g
+quit
+EOF
+cmp $TMP/c $TMP/r20k || fail c
+cmp $TMP/e $TMP/r300k || fail e
+cmp $TMP/g $TMP/r20k || fail g
+
+echo SUCCESS
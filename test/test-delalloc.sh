@@ -0,0 +1,94 @@
+#!/usr/bin/env bash
+#
+# delayed allocation: data still in memory reads back before and after
+# the unmount writes it out; a file deleted before write-back leaves no
+# hole in the free space; and an aging run interleaving appends to many
+# files leaves the same files as with delayed allocation off, in fewer
+# extents. mkdir on a full disk, with the last few blocks held back
+# for delayed data, fails cleanly.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/delalloc.$$.img
+TMP=/tmp/delalloc.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 5000 /dev/urandom > $TMP/r5k
+head -c 100000 /dev/urandom > $TMP/r100k
+head -c 300000 /dev/urandom > $TMP/r300k
+head -c 3000 /dev/urandom > $TMP/r3k
+head -c 1000 /dev/urandom > $TMP/r1k
+
+for opt in "" "-bs 4096" "-journal 256" "-inline"; do
+    rm -f $IMG
+    ./mkfs-x6 -size 4m $opt $IMG > /dev/null || fail mkfs-x6 $opt
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+put $TMP/r300k big
+put $TMP/r5k small
+get big $TMP/big
+get small $TMP/small
+ls-l
+quit
+EOF
+    grep -q error $TMP/out && fail "$opt: $(grep error $TMP/out | head -1)"
+    grep -q "^big .* 300000 " $TMP/out || fail "$opt: size before write-back"
+    cmp $TMP/big $TMP/r300k || fail "$opt: big before write-back"
+    cmp $TMP/small $TMP/r5k || fail "$opt: small before write-back"
+    ./read-img $IMG > /dev/null || fail "$opt: image inconsistent"
+
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+get big $TMP/big
+get small $TMP/small
+quit
+EOF
+    cmp $TMP/big $TMP/r300k || fail "$opt: big"
+    cmp $TMP/small $TMP/r5k || fail "$opt: small"
+done
+
+# the temporary file never gets blocks, so the other two are side by
+# side and the free space is in one piece
+rm -f $IMG
+./mkfs-x6 -size 4m $IMG > /dev/null
+./homework -cmdline -image $IMG << EOF > /dev/null
+put $TMP/r100k keep1
+put $TMP/r300k tmp
+put $TMP/r100k keep2
+rm tmp
+quit
+EOF
+./read-img --layout $IMG > $TMP/out || fail "temp file: image inconsistent"
+grep -q "extents per file: *1.00" $TMP/out || fail "temp file: fragmented"
+grep -q "free space: .* in 1 runs" $TMP/out || fail "temp file: left a hole"
+
+# interleaved appends
+for kb in 0 512; do
+    rm -f $IMG
+    ./mkfs-x6 -size 32m $IMG > /dev/null
+    ./age-x6 -ops 5000 -mix 4:6:1 -delalloc $kb $IMG > /dev/null ||
+        fail "age-x6 -delalloc $kb"
+    ./read-img -v --layout $IMG > $TMP/out || fail "$kb: image inconsistent"
+    grep "^file:" $TMP/out | sort > $TMP/files.$kb
+    sed -n 's/^layout: .* \([0-9]*\) extents/\1/p' $TMP/out > $TMP/ext.$kb
+done
+cmp $TMP/files.0 $TMP/files.512 || fail "files differ"
+[ $(cat $TMP/ext.512) -lt $(cat $TMP/ext.0) ] ||
+    fail "$(cat $TMP/ext.512) extents, $(cat $TMP/ext.0) without"
+
+# a full disk with a few blocks free again, held back for delayed data
+rm -f $IMG
+./mkfs-x6 -size 1m $IMG > /dev/null
+(for i in 1 2 3 4; do echo "put $TMP/r300k b$i"; done
+ echo "put $TMP/r3k small"
+ for i in $(seq 60); do echo "put $TMP/r1k s$i"; done
+ echo "rm small"
+ for i in 1 2 3 4; do echo "mkdir d$i"; done
+ echo quit) | ./homework -cmdline -image $IMG > /dev/null 2>&1 ||
+    fail "mkdir on a full disk"
+./read-img $IMG > $TMP/out || fail "full: image inconsistent"
+grep -q "unreachable): 0 blocks, 0 inodes" $TMP/out || fail "full: leaked"
+
+echo SUCCESS
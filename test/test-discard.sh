@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+#
+# discard: removing a file punches its blocks out of the image file, so
+# the image's disk usage drops, with and without the journal; fstrim
+# then finds the rest of the free space, and the image still checks
+# clean.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/disc.$$.img
+TMP=/tmp/disc.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 2000000 /dev/urandom > $TMP/r2m
+head -c 5000 /dev/urandom > $TMP/r5k
+
+usage(){
+    du -k $IMG | cut -f1
+}
+
+for opt in "" "-journal 256"; do
+    ./mkfs-x6 -size 16m $opt $IMG || fail mkfs-x6 $opt
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+mkdir d
+put $TMP/r2m d/big
+put $TMP/r5k d/small
+quit
+EOF
+    before=$(usage)
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+rm d/big
+quit
+EOF
+    after=$(usage)
+    [ $after -lt $((before - 1500)) ] || fail "$opt: rm freed only $((before - after))K"
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+fstrim
+rm d/small
+rmdir d
+quit
+EOF
+    grep -q "trimmed [1-9][0-9]* blocks" $TMP/out || fail "$opt: fstrim"
+    ./read-img $IMG > /dev/null || fail "$opt: image inconsistent"
+done
+
+echo SUCCESS
@@ -0,0 +1,104 @@
+#!/usr/bin/env bash
+#
+# preallocation: fallocate gives a file one run of zeroed blocks, or
+# keeps them past its end with FALLOC_FL_KEEP_SIZE, across a remount;
+# what is left of a file's reservation window is freed at close; and
+# an aging run appending to a few files at a time leaves the same
+# files with and without windows, in fewer extents.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/falloc.$$.img
+TMP=/tmp/falloc.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 5000 /dev/urandom > $TMP/r5k
+head -c 300000 /dev/urandom > $TMP/r300k
+head -c 1200000 /dev/urandom > $TMP/r1200k
+(cat $TMP/r5k; head -c 95000 /dev/zero) > $TMP/r5k.z
+
+for opt in "" "-bs 4096" "-journal 256" "-inline"; do
+    rm -f $IMG
+    ./mkfs-x6 -size 4m $opt $IMG > /dev/null || fail mkfs-x6 $opt
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+put $TMP/r5k pad
+put $TMP/r5k z
+falloc z 0 300000
+put $TMP/r5k grown
+falloc grown 50000 50000
+put $TMP/r5k kept
+falloc-k kept 0 300000
+get z $TMP/z
+ls-l
+quit
+EOF
+    grep -q error $TMP/out && fail "$opt: $(grep error $TMP/out | head -1)"
+    grep -q "^z .* 300000 " $TMP/out || fail "$opt: z size"
+    grep -q "^kept .* 5000 " $TMP/out || fail "$opt: kept size"
+    head -c 5000 $TMP/z | cmp - $TMP/r5k || fail "$opt: z data"
+    tail -c 295000 $TMP/z | cmp - <(head -c 295000 /dev/zero) ||
+        fail "$opt: z not zeroed"
+    ./read-img $IMG > /dev/null || fail "$opt: image inconsistent"
+
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+get grown $TMP/grown
+get kept $TMP/kept
+ls-l kept
+falloc d 0 1000
+falloc kept 0 0
+quit
+EOF
+    cmp $TMP/grown $TMP/r5k.z || fail "$opt: grown"
+    cmp $TMP/kept $TMP/r5k || fail "$opt: kept"
+    [ $(grep -c error $TMP/out) = 2 ] || fail "$opt: bad arguments accepted"
+    ./read-img -v $IMG > $TMP/out || fail "$opt: image inconsistent"
+    bs=$(sed -n 's/.*block size: //p' $TMP/out)
+    grep -q "size 5000 blocks $(( (300000 + bs - 1) / bs )) " $TMP/out ||
+        fail "$opt: kept blocks lost"
+done
+
+# fallocated space is in one piece
+rm -f $IMG
+./mkfs-x6 -size 4m $IMG > /dev/null
+./homework -cmdline -image $IMG << EOF > /dev/null
+put $TMP/r300k big
+put $TMP/r5k z
+falloc z 0 300000
+rm big
+quit
+EOF
+./read-img --layout $IMG > $TMP/out || fail "layout: image inconsistent"
+grep -q "extents per file: *1.00" $TMP/out || fail "fallocated space fragmented"
+
+# a file written past the delayed allocation buffer gets a window,
+# which doesn't outlive close
+rm -f $IMG
+./mkfs-x6 -size 4m $IMG > /dev/null
+./homework -cmdline -image $IMG << EOF > /dev/null
+put $TMP/r1200k big
+get big $TMP/big
+quit
+EOF
+cmp $TMP/big $TMP/r1200k || fail "big"
+./read-img -v $IMG > $TMP/out || fail "window: image inconsistent"
+grep -q "size 1200000 blocks 1172 " $TMP/out || fail "window left behind"
+
+# interleaved appends
+for kb in 0 256; do
+    rm -f $IMG
+    ./mkfs-x6 -size 32m $IMG > /dev/null
+    ./age-x6 -ops 3000 -mix 1:10:1 -delalloc 0 -window $kb $IMG > /dev/null ||
+        fail "age-x6 -window $kb"
+    ./read-img -v --layout $IMG > $TMP/out || fail "$kb: image inconsistent"
+    grep "^file:" $TMP/out | sort > $TMP/files.$kb
+    sed -n 's/^layout: .* \([0-9]*\) extents/\1/p' $TMP/out > $TMP/ext.$kb
+done
+cmp $TMP/files.0 $TMP/files.256 || fail "files differ"
+[ $(cat $TMP/ext.256) -lt $(cat $TMP/ext.0) ] ||
+    fail "$(cat $TMP/ext.256) extents, $(cat $TMP/ext.0) without"
+
+echo SUCCESS
@@ -0,0 +1,43 @@
+#!/usr/bin/env bash
+#
+# free space index: fill images whose size isn't a multiple of 64
+# blocks until they run out of space, then free a file in the middle
+# and a new one must fit in its place, and come back intact; the image
+# checks clean throughout.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/freemap.$$.img
+TMP=/tmp/freemap.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 100000 /dev/urandom > $TMP/r100k
+head -c 90000 /dev/urandom > $TMP/r90k
+
+for bs in 1024 4096; do
+    rm -f $IMG
+    ./mkfs-x6 -size $((2053 * 1024)) -bs $bs $IMG > /dev/null ||
+        fail mkfs-x6 -bs $bs
+    (for i in $(seq 25); do echo put $TMP/r100k f$i; done
+     echo quit) | ./homework -cmdline -image $IMG > $TMP/out
+    grep -q "No space left" $TMP/out || fail "$bs: didn't fill up"
+    ./read-img $IMG > /dev/null || fail "$bs: image inconsistent when full"
+
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+rm f5
+put $TMP/r90k new
+get new $TMP/new
+get f4 $TMP/f4
+quit
+EOF
+    grep -q error $TMP/out && fail "$bs: $(grep error $TMP/out | head -1)"
+    cmp $TMP/new $TMP/r90k || fail "$bs: new"
+    cmp $TMP/f4 $TMP/r100k || fail "$bs: f4"
+    ./read-img $IMG > /dev/null || fail "$bs: image inconsistent"
+done
+
+echo SUCCESS
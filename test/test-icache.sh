@@ -0,0 +1,31 @@
+#!/usr/bin/env bash
+#
+# inode cache: the same aging workload, run with an inode cache of a
+# few blocks - so that table blocks are replaced all the time - and
+# with the default one, leaves the same files in the image, with and
+# without the journal, and the image checks clean.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/icache.$$.img
+TMP=/tmp/icache.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+for opt in "" "-journal 256" "-inline"; do
+    for kb in 4 1024; do
+        ./mkfs-x6 -size 16m $opt $IMG || fail mkfs-x6 $opt
+        ./age-x6 -ops 3000 -dirs 40 -size exp:2k -mix 6:3:2:1 -icache $kb \
+            $IMG > /dev/null || fail "$opt: age-x6 -icache $kb"
+        ./read-img -v $IMG > $TMP/out || fail "$opt: $kb: image inconsistent"
+        grep -v "checked in" $TMP/out | sort > $TMP/out.$kb
+    done
+    n=$(grep -c "^file:" $TMP/out.4)
+    [ $n -gt 500 ] || fail "$opt: only $n files"
+    cmp $TMP/out.4 $TMP/out.1024 || fail "$opt: images differ"
+done
+
+echo SUCCESS
@@ -0,0 +1,60 @@
+#!/usr/bin/env bash
+#
+# inline data: on an image made with -inline, files up to 192 bytes live
+# in their inodes and take no blocks; a file that grows past that moves
+# out to blocks intact, also with compression, dedup and the journal;
+# rm leaves nothing behind, and the image checks clean.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/inline.$$.img
+TMP=/tmp/inline.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 40 /dev/urandom > $TMP/r40
+head -c 192 /dev/urandom > $TMP/r192
+head -c 193 /dev/urandom > $TMP/r193
+head -c 5000 /dev/urandom > $TMP/r5k
+
+for opt in "" "-journal 256" "-compress" "-dedup"; do
+    ./mkfs-x6 -size 16m -inline $opt $IMG || fail mkfs-x6 $opt
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+mkdir d
+put $TMP/r40 d/a
+put $TMP/r192 d/b
+put $TMP/r193 d/c
+blksiz 100
+put $TMP/r5k d/grow
+quit
+EOF
+    ./read-img -v $IMG > $TMP/out || fail "$opt: image inconsistent"
+    for sz in 40 192; do
+        grep -q "size $sz blocks 0 " $TMP/out || fail "$opt: $sz bytes not inline"
+    done
+    grep -q "size 193 blocks 0 " $TMP/out && fail "$opt: 193 bytes inline"
+
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+get d/a $TMP/a
+get d/b $TMP/b
+get d/c $TMP/c
+get d/grow $TMP/grow
+rm d/a
+rm d/b
+rm d/c
+rm d/grow
+rmdir d
+quit
+EOF
+    cmp $TMP/a $TMP/r40 || fail "$opt: a"
+    cmp $TMP/b $TMP/r192 || fail "$opt: b"
+    cmp $TMP/c $TMP/r193 || fail "$opt: c"
+    cmp $TMP/grow $TMP/r5k || fail "$opt: grow"
+    ./read-img $IMG > $TMP/out || fail "$opt: image inconsistent after rm"
+    grep -q "unreachable): 0 blocks, 0 inodes" $TMP/out || fail "$opt: leaked"
+done
+
+echo SUCCESS
@@ -0,0 +1,113 @@
+#!/usr/bin/env bash
+#
+# metadata journal: a clean unmount leaves a consistent image with an
+# empty journal, and after a crash (kill -9 of the file system) the
+# next mount replays the committed transactions and the image checks
+# clean again.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/jnl.$$.img
+TMP=/tmp/jnl.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 5000 /dev/urandom > $TMP/r5k
+head -c 300000 /dev/urandom > $TMP/r300k
+
+# clean unmount
+./mkfs-x6 -size 16m -journal 256 $IMG || fail mkfs-x6
+./homework -cmdline -image $IMG << EOF > /dev/null
+mkdir d
+put $TMP/r300k d/big
+put $TMP/r5k d/small
+put $TMP/r5k gone
+rm gone
+rename d/small d/small2
+quit
+EOF
+./read-img $IMG > $TMP/out || fail image inconsistent after unmount
+grep -q "haven't been replayed" $TMP/out && fail journal not empty after unmount
+./homework -cmdline -image $IMG << EOF > /dev/null
+get d/big $TMP/big
+get d/small2 $TMP/small2
+quit
+EOF
+cmp $TMP/big $TMP/r300k || fail d/big
+cmp $TMP/small2 $TMP/r5k || fail d/small2
+
+# crash: enough operations for several group commits, then kill -9
+./mkfs-x6 -size 16m -journal 256 $IMG || fail mkfs-x6
+mkfifo $TMP/fifo
+./homework -cmdline -image $IMG < $TMP/fifo > $TMP/log 2>&1 &
+pid=$!
+exec 3> $TMP/fifo
+for d in $(seq 0 19); do
+    echo "mkdir d$d"
+    for f in $(seq 0 9); do
+        echo "put $TMP/r5k d$d/f$f"
+    done
+    echo "rm d$d/f9"
+done >&3
+# the last of it waits in memory for delayed allocation, and in the
+# running transaction, until an operation finds them old enough
+sleep 6
+echo "mkdir late" >&3
+echo pwd >&3
+for i in $(seq 100); do
+    grep -qx / $TMP/log && break
+    sleep 0.1
+done
+grep -qx / $TMP/log || fail file system did not finish
+kill -9 $pid
+wait $pid 2> /dev/null
+exec 3>&-
+
+./homework -cmdline -image $IMG << EOF > /dev/null 2> $TMP/err
+get d0/f0 $TMP/f0
+quit
+EOF
+grep -q "journal: replayed" $TMP/err || fail nothing replayed
+cmp $TMP/f0 $TMP/r5k || fail d0/f0 after replay
+./read-img $IMG > /dev/null || fail image inconsistent after replay
+
+# killed in the middle of a checkpoint: part way through writing the
+# blocks home, once they all are, and once the header empties the log
+for step in partial home header; do
+    ./mkfs-x6 -size 16m -journal 16 $IMG > /dev/null || fail mkfs-x6
+    for d in $(seq 0 9); do
+        echo "mkdir d$d"
+        for f in $(seq 0 9); do
+            echo "put $TMP/r5k d$d/f$f"
+        done
+    done > $TMP/cmds
+    { JNL_KILL_AT=$step ./homework -cmdline -image $IMG < $TMP/cmds \
+          > /dev/null; } 2> /dev/null
+    [ $? = 137 ] || fail "$step: not killed"
+
+    (echo "ls d0"
+     for d in $(seq 0 9); do
+         for f in $(seq 0 9); do
+             echo "get d$d/f$f $TMP/d$d.f$f"
+         done
+     done) | ./homework -cmdline -image $IMG > $TMP/out 2> $TMP/err
+    case $step in
+        header) grep -q "journal: replayed" $TMP/err &&
+                    fail "$step: replayed an empty log" ;;
+        *)      grep -q "journal: replayed" $TMP/err ||
+                    fail "$step: nothing replayed" ;;
+    esac
+    ./read-img $IMG > /dev/null || fail "$step: image inconsistent"
+    grep -A1 -x "cmd> ls d0" $TMP/out | grep -q "^error" &&
+        fail "$step: d0 lost"
+    # the data goes ahead of the metadata, so a file is whole or empty
+    for f in $TMP/d*.f*; do
+        [ -s $f ] && { cmp -s $f $TMP/r5k || fail "$step: $f"; }
+    done
+    rm -f $TMP/d*.f*
+done
+
+echo SUCCESS
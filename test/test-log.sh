@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+#
+# log-structured images: files come back intact after a remount; an
+# aging run writing many times the size of the image, so that the
+# cleaner has to free segments all along, leaves an image that checks
+# clean, with the same files as the same run on a normal image; and a
+# file system killed while writing comes back consistent.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/log.$$.img
+TMP=/tmp/log.$$
+trap "exec 3>&-; rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 5000 /dev/urandom > $TMP/r5k
+head -c 300000 /dev/urandom > $TMP/r300k
+
+for opt in "" "-bs 4096" "-journal 256" "-dedup"; do
+    rm -f $IMG
+    ./mkfs-x6 -size 4m -log $opt $IMG > /dev/null || fail mkfs-x6 $opt
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+mkdir d
+put $TMP/r300k d/big
+put $TMP/r5k d/small
+put $TMP/r300k d/gone
+rm d/gone
+quit
+EOF
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+get d/big $TMP/big
+get d/small $TMP/small
+quit
+EOF
+    grep -q error $TMP/out && fail "$opt: $(grep error $TMP/out | head -1)"
+    cmp $TMP/big $TMP/r300k || fail "$opt: big"
+    cmp $TMP/small $TMP/r5k || fail "$opt: small"
+    ./read-img $IMG > /dev/null || fail "$opt: image inconsistent"
+
+    # the normal image gets the same (logical) size
+    rm -f $IMG
+    ./mkfs-x6 -size 4m -log $opt $IMG > /dev/null
+    ./read-img $IMG > $TMP/out
+    size=$(( $(sed -n 's/.*blocks: //p' $TMP/out) *
+             $(sed -n 's/.*block size: //p' $TMP/out) ))
+    for log in -log ""; do
+        rm -f $IMG
+        ./mkfs-x6 -size $([ "$log" ] && echo 4m || echo $size) $log $opt \
+            $IMG > /dev/null
+        ./age-x6 -ops 20000 -dirs 10 -size exp:8k -mix 6:3:4:1 $IMG \
+            > /dev/null || fail "$opt: age-x6 $log"
+        ./read-img -v $IMG > $TMP/out || fail "$opt: $log: image inconsistent"
+        grep "^file:" $TMP/out | sort > $TMP/files$log
+    done
+    n=$(wc -l < $TMP/files-log)
+    [ $n -gt 100 ] || fail "$opt: only $n files"
+    cmp $TMP/files-log $TMP/files || fail "$opt: files differ"
+done
+
+# killed in the middle of writing
+rm -f $IMG $TMP/fifo
+./mkfs-x6 -size 16m -log $IMG > /dev/null
+mkfifo $TMP/fifo
+./homework -cmdline -image $IMG < $TMP/fifo > /dev/null &
+pid=$!
+exec 3> $TMP/fifo
+echo "put $TMP/r300k big" >&3
+for i in $(seq 5); do
+    echo "put $TMP/r300k f$i" >&3
+done
+sleep 1
+kill -9 $pid
+wait $pid 2> /dev/null
+exec 3>&-
+./homework -cmdline -image $IMG << EOF > /dev/null
+get big $TMP/big
+quit
+EOF
+cmp $TMP/big $TMP/r300k || fail "killed: big"
+./read-img $IMG > /dev/null || fail "killed: image inconsistent"
+
+echo SUCCESS
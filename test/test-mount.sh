@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+#
+# clean/dirty state: an image is marked dirty while it is mounted and
+# clean after 'quit'; killing the file system leaves it dirty, and the
+# next mount rebuilds the block bitmap from the inodes, reclaiming
+# blocks marked in use that no file points to (here, set by hand).
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/mount.$$.img
+TMP=/tmp/mount.$$
+trap "exec 3>&-; rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 5000 /dev/urandom > $TMP/r5k
+head -c 300000 /dev/urandom > $TMP/r300k
+
+state(){
+    ./read-img $IMG | sed -n 's/.*state: //p'
+}
+
+for opt in "" "-journal 256" "-dedup"; do
+    rm -f $IMG
+    ./mkfs-x6 -size 16m $opt $IMG > /dev/null || fail mkfs-x6 $opt
+    ./homework -cmdline -image $IMG << EOF > /dev/null
+mkdir d
+put $TMP/r300k d/big
+quit
+EOF
+    [ "$(state)" = clean ] || fail "$opt: not clean after quit"
+
+    # mounted: dirty, and still dirty when killed
+    rm -f $TMP/fifo
+    mkfifo $TMP/fifo
+    ./homework -cmdline -image $IMG < $TMP/fifo > /dev/null &
+    pid=$!
+    exec 3> $TMP/fifo
+    echo "put $TMP/r5k d/small" >&3
+    for i in $(seq 50); do
+        [ "$(state)" = dirty ] && break
+        sleep 0.1
+    done
+    [ "$(state)" = dirty ] || fail "$opt: not dirty while mounted"
+    sleep 0.5
+    kill -9 $pid
+    wait $pid 2> /dev/null
+    exec 3>&-
+    [ "$(state)" = dirty ] || fail "$opt: not dirty after kill"
+
+    # leak 8 free blocks by hand
+    imap=$(./read-img $IMG | sed -n 's/.*imap: *\([0-9]*\) blocks/\1/p')
+    printf '\377' | dd of=$IMG bs=1 seek=$(((1 + imap) * 1024 + 1500)) \
+        conv=notrunc 2> /dev/null
+    ./read-img $IMG > $TMP/out
+    grep -q "unreachable): 8 blocks" $TMP/out || fail "$opt: leak not set up"
+
+    ./homework -cmdline -image $IMG << EOF > /dev/null 2> $TMP/err
+get d/big $TMP/big
+quit
+EOF
+    grep -q "8 blocks reclaimed" $TMP/err || fail "$opt: $(cat $TMP/err)"
+    cmp $TMP/big $TMP/r300k || fail "$opt: big"
+    ./read-img $IMG > $TMP/out || fail "$opt: image inconsistent"
+    grep -q "unreachable): 0 blocks, 0 inodes" $TMP/out || fail "$opt: leaked"
+    [ "$(state)" = clean ] || fail "$opt: not clean after recovery"
+done
+
+echo SUCCESS
@@ -0,0 +1,104 @@
+#!/usr/bin/env bash
+#
+# snapshots: taken on a mounted file system and with snap-x6, they
+# mount read-only with the files as they were, while the image goes
+# on changing; saving the blocks rewritten since costs a fraction of
+# the data written; an aging run after a snapshot leaves it exactly as
+# it was; and read-img checks both the image and its snapshots.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/snapshot.$$.img
+TMP=/tmp/snapshot.$$
+trap "rm -rf $IMG $IMG.snap $TMP" 0
+mkdir $TMP
+
+head -c 5000 /dev/urandom > $TMP/r5k
+head -c 100000 /dev/urandom > $TMP/r100k
+head -c 300000 /dev/urandom > $TMP/r300k
+
+for opt in "" "-bs 4096" "-journal 256" "-inline" "-dedup" "-log"; do
+    rm -rf $IMG $IMG.snap
+    ./mkfs-x6 -size 8m $opt $IMG > /dev/null || fail mkfs-x6 $opt
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+mkdir d
+put $TMP/r300k d/a
+put $TMP/r5k b
+snapshot s1
+put $TMP/r300k c
+rm d/a
+rm b
+put $TMP/r100k b
+snapshot s2
+rm c
+snapshot s1
+quit
+EOF
+    [ $(grep -c error $TMP/out) = 1 ] ||
+        fail "$opt: $(grep error $TMP/out | head -1)"
+    [ "$(./snap-x6 list $IMG | cut -d' ' -f1 | tr '\n' ' ')" = "s1 s2 " ] ||
+        fail "$opt: snapshots not listed"
+    ./read-img $IMG > $TMP/out || fail "$opt: image inconsistent"
+    bs=$(sed -n 's/.*block size: //p' $TMP/out)
+    n=$(sed -n 's/^snapshot s1: \([0-9]*\) blocks saved.*/\1/p' $TMP/out)
+    [ $(( n * bs )) -lt 40000 ] || fail "$opt: $n blocks saved"
+
+    ./homework -cmdline -snapshot s1 -image $IMG << EOF > $TMP/out
+get d/a $TMP/a
+get b $TMP/b
+ls
+put $TMP/r5k x
+quit
+EOF
+    cmp $TMP/a $TMP/r300k || fail "$opt: s1: a"
+    cmp $TMP/b $TMP/r5k || fail "$opt: s1: b"
+    grep -qx c $TMP/out && fail "$opt: s1: c"
+    [ $(grep -c "error: Read-only" $TMP/out) = 1 ] ||
+        fail "$opt: s1 not read-only"
+    ./homework -cmdline -snapshot s2 -image $IMG << EOF > /dev/null
+get c $TMP/c
+get b $TMP/b
+quit
+EOF
+    cmp $TMP/c $TMP/r300k || fail "$opt: s2: c"
+    cmp $TMP/b $TMP/r100k || fail "$opt: s2: b"
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+get b $TMP/b
+ls
+quit
+EOF
+    cmp $TMP/b $TMP/r100k || fail "$opt: b"
+    grep -qx c $TMP/out && fail "$opt: c still there"
+
+    for s in s1 s2; do
+        ./read-img -snapshot $s $IMG > /dev/null ||
+            fail "$opt: $s inconsistent"
+    done
+    ./mkfs-x6 -size 8m $IMG > /dev/null && fail "$opt: mkfs-x6 over snapshots"
+    ./snap-x6 delete $IMG s1 || fail "$opt: delete"
+    [ "$(./snap-x6 list $IMG | cut -d' ' -f1)" = s2 ] ||
+        fail "$opt: s1 not deleted"
+    ./read-img $IMG > /dev/null || fail "$opt: inconsistent after delete"
+done
+
+# an aging run after a snapshot leaves it as it was
+for opt in "" "-journal 256" "-log"; do
+    rm -rf $IMG $IMG.snap
+    ./mkfs-x6 -size 16m $opt $IMG > /dev/null
+    ./age-x6 -ops 2000 $IMG > /dev/null || fail "$opt: age-x6"
+    ./snap-x6 create $IMG before || fail "$opt: snap-x6 create"
+    ./read-img -v $IMG | grep "^file:" | sort > $TMP/files.before
+    ./age-x6 -ops 3000 -seed 2 -mix 2:3:4:1 $IMG > /dev/null ||
+        fail "$opt: age-x6 after"
+    ./read-img -v $IMG | grep "^file:" | sort > $TMP/files.after
+    ./read-img -v -snapshot before $IMG > $TMP/out ||
+        fail "$opt: snapshot inconsistent"
+    grep "^file:" $TMP/out | sort | cmp - $TMP/files.before ||
+        fail "$opt: snapshot changed"
+    cmp -s $TMP/files.before $TMP/files.after && fail "$opt: nothing changed"
+done
+
+echo SUCCESS
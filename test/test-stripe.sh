@@ -0,0 +1,93 @@
+#!/usr/bin/env bash
+#
+# striping: mkfs-x6 makes a set of three images that mounts (and is
+# checked by read-img) as one, with the data spread over all three; the
+# members only go together in order; a trace replays onto a set; and an
+# aging run on the set ends up with the same files as on a single image
+# of the same size.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/stripe.$$
+TMP=/tmp/stripe-tmp.$$
+trap "rm -rf $IMG.* $TMP" 0
+mkdir $TMP
+SET=$IMG.a.img,$IMG.b.img,$IMG.c.img
+
+head -c 5000 /dev/urandom > $TMP/r5k
+head -c 300000 /dev/urandom > $TMP/r300k
+
+for opt in "" "-bs 4096" "-journal 256" "-log"; do
+    rm -f $IMG.*
+    ./mkfs-x6 -size 8m -stripe 16k $opt $SET > /dev/null ||
+        fail "$opt: mkfs-x6"
+    for m in a b c; do
+        [ $(stat -c %s $IMG.$m.img) = $(( (64 + 170 * 16) * 1024 )) ] ||
+            fail "$opt: $m is $(stat -c %s $IMG.$m.img) bytes"
+    done
+    ./homework -cmdline -image $SET << EOF > $TMP/out
+mkdir d
+put $TMP/r300k d/a
+put $TMP/r5k b
+quit
+EOF
+    grep -q error $TMP/out && fail "$opt: $(grep error $TMP/out | head -1)"
+    ./homework -cmdline -image $SET << EOF > /dev/null
+get d/a $TMP/a
+get b $TMP/b
+quit
+EOF
+    cmp $TMP/a $TMP/r300k || fail "$opt: a"
+    cmp $TMP/b $TMP/r5k || fail "$opt: b"
+    ./read-img $SET > $TMP/out || fail "$opt: inconsistent"
+    for m in a b c; do
+        [ $(du -k $IMG.$m.img | cut -f1) -gt 80 ] ||
+            fail "$opt: no data on $m"
+    done
+
+    ./read-img $IMG.b.img,$IMG.a.img,$IMG.c.img > /dev/null 2>&1 &&
+        fail "$opt: members out of order"
+    ./homework -cmdline -image $IMG.a.img,$IMG.b.img < /dev/null \
+        > /dev/null 2>&1 && fail "$opt: member missing"
+done
+
+# a trace replays onto a copy of each member; defrag-x6 won't take a set
+rm -f $IMG.*
+./mkfs-x6 -size 8m -stripe 16k $SET > /dev/null
+./homework -cmdline -image $SET -trace $TMP/trace << EOF > /dev/null
+mkdir d
+put $TMP/r300k d/a
+put $TMP/r5k d/b
+falloc d/b 0 100000
+quit
+EOF
+./mkfs-x6 -size 8m -stripe 16k $SET > /dev/null
+./replay-x6 -keep $TMP/trace $SET > $TMP/out || fail replay-x6
+grep -q " 0 results differed" $TMP/out || fail "replay: $(grep differed $TMP/out)"
+./read-img -v $IMG.a.img.replay,$IMG.b.img.replay,$IMG.c.img.replay \
+    > $TMP/out || fail replayed set inconsistent
+[ $(grep -c "^file:" $TMP/out) = 2 ] || fail replay: files missing
+./defrag-x6 $SET > /dev/null 2>&1 && fail defrag-x6 on a set
+
+# -stripe has to be a whole number of blocks
+./mkfs-x6 -size 8m -bs 4096 -stripe 2k $SET > /dev/null &&
+    fail "2K stripe of 4K blocks"
+
+# aging a striped set and a single image the same way
+for opt in "" "-journal 256" "-log"; do
+    rm -f $IMG.*
+    ./mkfs-x6 -size 24m -stripe 32k $opt $SET > /dev/null
+    ./age-x6 -ops 2000 $SET > /dev/null || fail "$opt: age-x6"
+    ./read-img -v $SET | grep "^file:" > $TMP/files.striped ||
+        fail "$opt: striped set inconsistent"
+    size=$(( 3 * ($(stat -c %s $IMG.a.img) / 1024 - 64) ))
+    ./mkfs-x6 -size ${size}k $opt $IMG.img > /dev/null
+    ./age-x6 -ops 2000 $IMG.img > /dev/null || fail "$opt: age-x6 image"
+    ./read-img -v $IMG.img | grep "^file:" | cmp - $TMP/files.striped ||
+        fail "$opt: different files"
+done
+
+echo SUCCESS
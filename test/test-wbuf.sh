@@ -0,0 +1,76 @@
+#!/usr/bin/env bash
+#
+# write-behind: files written 1000 bytes at a time read back in the
+# same session (served from the buffer) and after a remount; an aging
+# run making unaligned writes leaves the same files with and without
+# the buffer, with and without delayed allocation and the journal, and
+# the image checks clean; and filling the disk fails writes as they are
+# made, never losing buffered data when it is written out later.
+
+fail(){
+    echo FAILED: $*
+    exit 1
+}
+
+IMG=/tmp/wbuf.$$.img
+TMP=/tmp/wbuf.$$
+trap "rm -rf $IMG $TMP" 0
+mkdir $TMP
+
+head -c 5000 /dev/urandom > $TMP/r5k
+head -c 300000 /dev/urandom > $TMP/r300k
+
+for opt in "" "-bs 4096" "-inline" "-compress"; do
+    rm -f $IMG
+    ./mkfs-x6 -size 4m $opt $IMG > /dev/null || fail mkfs-x6 $opt
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+put $TMP/r300k big
+put $TMP/r5k small
+get big $TMP/big
+get small $TMP/small
+quit
+EOF
+    grep -q error $TMP/out && fail "$opt: $(grep error $TMP/out | head -1)"
+    cmp $TMP/big $TMP/r300k || fail "$opt: big before remount"
+    cmp $TMP/small $TMP/r5k || fail "$opt: small before remount"
+    ./read-img $IMG > /dev/null || fail "$opt: image inconsistent"
+
+    ./homework -cmdline -image $IMG << EOF > $TMP/out
+get big $TMP/big
+get small $TMP/small
+quit
+EOF
+    cmp $TMP/big $TMP/r300k || fail "$opt: big"
+    cmp $TMP/small $TMP/r5k || fail "$opt: small"
+done
+
+for opt in "" "-journal 256"; do
+    for da in 0 512; do
+        for kb in 0 64; do
+            rm -f $IMG
+            ./mkfs-x6 -size 16m $opt $IMG > /dev/null
+            ./age-x6 -ops 3000 -io 1000 -delalloc $da -wbuf $kb $IMG \
+                > /dev/null || fail "$opt: age-x6 -delalloc $da -wbuf $kb"
+            ./read-img -v $IMG > $TMP/out ||
+                fail "$opt: $da/$kb: image inconsistent"
+            grep "^file:" $TMP/out | sort > $TMP/files.$da.$kb
+        done
+    done
+    n=$(wc -l < $TMP/files.0.0)
+    [ $n -gt 100 ] || fail "$opt: only $n files"
+    for f in 0.64 512.0 512.64; do
+        cmp $TMP/files.0.0 $TMP/files.$f || fail "$opt: files differ ($f)"
+    done
+done
+
+# a full disk: the space for buffered data is held back
+for da in 0 512; do
+    rm -f $IMG
+    ./mkfs-x6 -size 1m $IMG > /dev/null
+    ./age-x6 -ops 2000 -io 1000 -mix 4:4:0 -delalloc $da -wbuf 64 $IMG \
+        > /dev/null 2> $TMP/err || fail "full, -delalloc $da: age-x6"
+    [ -s $TMP/err ] && fail "full, -delalloc $da: $(head -1 $TMP/err)"
+    ./read-img $IMG > /dev/null || fail "full, -delalloc $da: inconsistent"
+done
+
+echo SUCCESS
@@ -0,0 +1,53 @@
+/*
+ * file:        trace.h
+ * description: fs_ops call recorder for CS 5600 hw3, and the binary
+ *              trace format shared with replay-x6
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+#define TRACE_MAGIC   0x52543658        /* "X6TR" */
+#define TRACE_VERSION 1
+
+enum trace_op {
+    TR_GETATTR, TR_READDIR, TR_MKNOD, TR_MKDIR, TR_UNLINK, TR_RMDIR,
+    TR_RENAME, TR_CHMOD, TR_UTIME, TR_TRUNCATE, TR_READ, TR_WRITE,
+    TR_STATFS, TR_FLUSH, TR_FSYNC, TR_FALLOCATE, TR_NOPS
+};
+
+extern const char *trace_op_names[TR_NOPS];
+
+struct trace_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_sec;         /* wall clock when recording started */
+};
+
+/* each record is followed by 'path_len' bytes of path and, for
+ * rename, 'path2_len' bytes of destination path (no NULs).
+ * 'arg' is the offset for read/write/fallocate, the length for
+ * truncate, the mode for mknod/mkdir/chmod, the modification time for
+ * utime and the 'datasync' flag for fsync.
+ */
+struct trace_rec {
+    uint64_t ts_ns;             /* start time, relative to trace start */
+    uint32_t dur_ns;            /* time the call took (saturating) */
+    int32_t  result;
+    uint64_t arg;
+    uint32_t len;               /* read/write/fallocate length (saturating) */
+    uint8_t  op;
+    uint8_t  mode;              /* fallocate mode, 0 for the rest */
+    uint8_t  path_len;
+    uint8_t  path2_len;
+};
+
+/* start recording to 'path', and point the entries of 'ops' at
+ * recording wrappers around the original functions.
+ */
+struct fuse_operations;
+int trace_start(const char *path, struct fuse_operations *ops);
+void trace_stop(void);
+
+#endif